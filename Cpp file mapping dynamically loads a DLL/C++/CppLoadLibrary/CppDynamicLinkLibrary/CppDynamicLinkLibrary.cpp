@@ -15,15 +15,13 @@ WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
 \***************************************************************************/
 
 #include "CppDynamicLinkLibrary.h"
+#include "LibraryPin.h"
+#include "LibraryTrace.h"
+#include "IpcChannel.h"
 #include <strsafe.h>
 #include <Windows.h>
-
-// I/O declarification
-#include <string>
-#include <iostream>
-#include <conio.h>
-#include <cstdlib>
-using namespace std;
+#include <stdio.h>
+#include <string.h>
 // In terminal services: The name can have a "Global\" or "Local\" prefix 
 // to explicitly create the object in the global or session namespace. The 
 // remainder of the name can contain any character except the backslash 
@@ -48,8 +46,31 @@ using namespace std;
 // must be less than the view size (VIEW_SIZE).
 #define MESSAGE             L"Message from the client process."
 
+// The channel to the service: the file mapping it created and, with 
+// FILE_MAPPING_KERNELDRIVER, the section of the kernel driver. It is opened 
+// on the first call to an exported function, never in DllMain: DllMain runs 
+// under the loader lock, so blocking there would stall the LoadLibrary call 
+// of the host and every other thread that loads or unloads a module. Once 
+// open, it pins the DLL in the process, so a host that loads and frees the 
+// DLL again and again maps the views once.
+struct MAPPED_CHANNEL
+{
+    HANDLE hMapFile;
+    PVOID pInOutView;
+#if defined(FILE_MAPPING_KERNELDRIVER)
+    HANDLE hKernelMap;
+    PVOID pKernelView;
+#endif
+};
+
+static MAPPED_CHANNEL g_channel;
+static INIT_ONCE g_channelOnce = INIT_ONCE_STATIC_INIT;
+
 // Local Function
-static int SharedMappedFileClient();
+static BOOL CALLBACK OpenChannel(PINIT_ONCE pInitOnce, PVOID pParameter, 
+    PVOID *ppContext);
+static DWORD EnsureChannel(void);
+static void CloseChannel(void);
 
 #pragma region DLLMain
 BOOL APIENTRY DllMain(HMODULE hModule,
@@ -57,11 +78,16 @@ BOOL APIENTRY DllMain(HMODULE hModule,
                       LPVOID lpReserved
                       )
 {
+    // The start of the initialization for the trace (see ipc_set_trace).
+    uint64_t start = IpcTimestamp();
+
 	switch (ul_reason_for_call)
 	{
 	case DLL_PROCESS_ATTACH:
          wprintf(L"DLLMain - DLL_PROCESS_ATTACH\n");
-		 SharedMappedFileClient();
+         // Nothing but bookkeeping here; the channel is opened lazily.
+         DisableThreadLibraryCalls(hModule);
+         RecordInitialization(start, IpcTimestamp());
 	break;
 	case DLL_THREAD_ATTACH:
     break;
@@ -69,6 +95,13 @@ BOOL APIENTRY DllMain(HMODULE hModule,
     break;
 	case DLL_PROCESS_DETACH:
 		 wprintf(L"DLLMain - DLL_PROCESS_DETACH\n");
+         // On FreeLibrary, release the channel; a DLL that pinned itself 
+         // only gets here when the process exits (lpReserved != NULL), and 
+         // the system releases it then anyway.
+         if (lpReserved == NULL)
+         {
+             CloseChannel();
+         }
 	break;
 	}
 	return TRUE;
@@ -90,118 +123,187 @@ BOOL APIENTRY DllMain(HMODULE hModule,
 #pragma endregion
 
 
-#pragma region Ordinary Functions
+#pragma region Shared Mapped File Client
 
-static int SharedMappedFileClient()
+//
+//   FUNCTION: OpenChannel(PINIT_ONCE, PVOID, PVOID *)
+//
+//   PURPOSE: The one-time initialization of the channel, run by 
+//   InitOnceExecuteOnce on the first thread that needs the channel while 
+//   the others wait. It opens and maps the file mapping of the service and, 
+//   with FILE_MAPPING_KERNELDRIVER, the section of the kernel driver. On 
+//   failure it releases what it opened, stores the error code in 
+//   *pParameter and returns FALSE, so the next call tries again: the 
+//   service may not be up yet.
+//
+static BOOL CALLBACK OpenChannel(PINIT_ONCE pInitOnce, PVOID pParameter, 
+                                 PVOID *ppContext)
 {
-	HANDLE hMapFile = NULL;
-    PVOID pInOutView = NULL;
-    CHAR Text1[256];
-    WCHAR* Text2;
-    string s1;
+    DWORD *pdwError = static_cast<DWORD *>(pParameter);
+    uint64_t start;
+
 #if defined(FILE_MAPPING_KERNELDRIVER)
-	PVOID  pKSObj = NULL;
-	HANDLE hMap = NULL;
-	TCHAR szKSObjName[] = TEXT("Global\\SharedMemory");
-
-	hMap = OpenFileMapping(FILE_MAP_READ, FALSE, szKSObjName);
-	if (hMap == NULL) {
-		printf("failed to OpenFileMapping() err code %d\n", GetLastError());
-		goto Cleanup;
-	}
-	wprintf(L"The kernel file mapping (%s) is opened\n", szKSObjName);
+    start = IpcTimestamp();
+    g_channel.hKernelMap = OpenFileMapping(FILE_MAP_READ, FALSE, 
+        L"Global\\SharedMemory");
+    TracePhase("OpenFileMapping", start);
+    if (g_channel.hKernelMap == NULL)
+    {
+        goto Cleanup;
+    }
 
-	pKSObj = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 1024);
-	if (pKSObj == NULL) {
-		printf("failed to MapViewOfFile() err code %d\n", GetLastError());
-		goto Cleanup;
-	}
-	printf("Read from kernel driver: %s\n", pKSObj);
+    start = IpcTimestamp();
+    g_channel.pKernelView = MapViewOfFile(g_channel.hKernelMap, 
+        FILE_MAP_READ, 0, 0, VIEW_SIZE);
+    TracePhase("MapViewOfFile", start);
+    if (g_channel.pKernelView == NULL)
+    {
+        goto Cleanup;
+    }
 #endif
+
     // Try to open the named file mapping identified by the map name.
-    hMapFile = OpenFileMapping(
+    start = IpcTimestamp();
+    g_channel.hMapFile = OpenFileMapping(
         FILE_MAP_ALL_ACCESS,    // Read Write access
         FALSE,                  // Do not inherit the name
         FULL_MAP_NAME           // File mapping name 
         );
-    if (hMapFile == NULL) 
+    TracePhase("OpenFileMapping", start);
+    if (g_channel.hMapFile == NULL) 
     {
-        wprintf(L"OpenFileMapping failed w/err 0x%08lx\n", GetLastError());
         goto Cleanup;
     }
-    wprintf(L"The file mapping (%s) is opened\n", FULL_MAP_NAME);
 
-    // Map a input view of the file mapping into the address space of the current 
-    // process.
-    pInOutView = MapViewOfFile(
-        hMapFile,               // Handle of the map object
+    // Map a input view of the file mapping into the address space of the 
+    // current process.
+    start = IpcTimestamp();
+    g_channel.pInOutView = MapViewOfFile(
+        g_channel.hMapFile,     // Handle of the map object
         FILE_MAP_ALL_ACCESS,    // Read Write access
         0,                      // High-order DWORD of the file offset 
         IN_VIEW_OFFSET,         // Low-order DWORD of the file offset
         VIEW_SIZE               // The number of bytes to map to view
         );
-    if (pInOutView == NULL)
+    TracePhase("MapViewOfFile", start);
+    if (g_channel.pInOutView == NULL)
     {
-        wprintf(L"MapViewOfFile failed w/err 0x%08lx\n", GetLastError()); 
         goto Cleanup;
     }
 
-    wprintf(L"The file view is mapped\n");
+    PinLibrary();
+    return TRUE;
+
+Cleanup:
+
+    *pdwError = GetLastError();
+    CloseChannel();
+    return FALSE;
+}
+
+
+// Open the channel unless it is open. Returns ERROR_SUCCESS or the error 
+// code of the failed attempt.
+static DWORD EnsureChannel(void)
+{
+    DWORD dwError = ERROR_SUCCESS;
+    if (!InitOnceExecuteOnce(&g_channelOnce, OpenChannel, &dwError, NULL) && 
+        dwError == ERROR_SUCCESS)
+    {
+        dwError = GetLastError();
+    }
+    return dwError;
+}
 
-    // Read and display the content in view.
-    wprintf(L"Read from the file mapping:\n\"%s\"\n", (PWSTR)pInOutView);
 
-    // Prepare a message to be written to the server view.
-	PWSTR pszMessage;
-    DWORD cbMessage;
-	DWORD ssize = 0;
+// Unmap the views and close the file mappings that are open.
+static void CloseChannel(void)
+{
+    if (g_channel.pInOutView)
+    {
+        UnmapViewOfFile(g_channel.pInOutView);
+        g_channel.pInOutView = NULL;
+    }
+    if (g_channel.hMapFile)
+    {
+        CloseHandle(g_channel.hMapFile);
+        g_channel.hMapFile = NULL;
+    }
 #if defined(FILE_MAPPING_KERNELDRIVER)
-	char *p = (char *)pKSObj;
-	s1 = p;
-#else
-	cout << "Enter a string that stored in share mapping object :";
-	getline(cin, s1);
-	// cout << "You entered: " << s1;
+    if (g_channel.pKernelView)
+    {
+        UnmapViewOfFile(g_channel.pKernelView);
+        g_channel.pKernelView = NULL;
+    }
+    if (g_channel.hKernelMap)
+    {
+        CloseHandle(g_channel.hKernelMap);
+        g_channel.hKernelMap = NULL;
+    }
 #endif
-	while (s1[ssize] != '\0') {
-	  Text1[ssize] = s1[ssize];
-		ssize++;
-	}
-	Text1[ssize] = '\0';
-	//wprintf(L"number of size is %d\n", ssize);
+}
 
-	Text2 = new WCHAR[ssize];
-	// Convert char* string to a wchar_t* string.
-    mbstowcs(Text2, Text1, ssize+1);
-    pszMessage = Text2;
-    cbMessage = cbMessage = (wcslen(pszMessage) + 1) * sizeof(*pszMessage);
 
-	// Write the message to the server view.
-    memcpy_s((pInOutView), VIEW_SIZE, pszMessage, cbMessage);
+// Copy the message the service left in the file mapping into the buffer.
+DWORD __stdcall ReadMappedMessage(PWSTR pszBuffer, DWORD cchBuffer)
+{
+    DWORD dwError = EnsureChannel();
+    if (dwError != ERROR_SUCCESS)
+    {
+        return dwError;
+    }
 
-    // Wait to clean up resources and stop the process.
-    wprintf(L"Press ENTER to clean up resources and quit");
-    getchar();
+    HRESULT hr = StringCchCopyN(pszBuffer, cchBuffer, 
+        (PCWSTR)g_channel.pInOutView, VIEW_SIZE / sizeof(WCHAR));
+    return SUCCEEDED(hr) ? ERROR_SUCCESS : ERROR_INSUFFICIENT_BUFFER;
+}
 
-Cleanup:
 
-    if (hMapFile)
+// Write a message for the service into the file mapping. With 
+// FILE_MAPPING_KERNELDRIVER, a NULL message forwards the one the kernel 
+// driver left in its section.
+DWORD __stdcall WriteMappedMessage(PCWSTR pszMessage)
+{
+    DWORD dwError = EnsureChannel();
+    if (dwError != ERROR_SUCCESS)
+    {
+        return dwError;
+    }
+
+    WCHAR szMessage[VIEW_SIZE / sizeof(WCHAR)];
+    if (pszMessage == NULL)
     {
-        if (pInOutView)
+#if defined(FILE_MAPPING_KERNELDRIVER)
+        // Convert the char string of the driver to a wchar_t string.
+        if (MultiByteToWideChar(CP_ACP, 0, (LPCSTR)g_channel.pKernelView, 
+            (int)strnlen((LPCSTR)g_channel.pKernelView, VIEW_SIZE - 1) + 1, 
+            szMessage, ARRAYSIZE(szMessage)) == 0)
         {
-            // Unmap the file view.
-            UnmapViewOfFile(pInOutView);
-            pInOutView = NULL;
+            return GetLastError();
         }
-		
-        // Close the file mapping object.
-        CloseHandle(hMapFile);
-        hMapFile = NULL;
+        pszMessage = szMessage;
+#else
+        return ERROR_INVALID_PARAMETER;
+#endif
+    }
+
+    size_t cchMessage = wcsnlen(pszMessage, VIEW_SIZE / sizeof(WCHAR));
+    if (cchMessage >= VIEW_SIZE / sizeof(WCHAR))
+    {
+        return ERROR_INSUFFICIENT_BUFFER;
     }
 
-	return 0;
+	// Write the message to the server view.
+    memcpy_s(g_channel.pInOutView, VIEW_SIZE, pszMessage, 
+        (cchMessage + 1) * sizeof(WCHAR));
+    return ERROR_SUCCESS;
 }
 
+#pragma endregion
+
+
+#pragma region Ordinary Functions
+
 // An exported/imported cdecl(default) function using a DEF file
 //int /*__cdecl*/ GetStringLength1(PCWSTR pszString)
 //{
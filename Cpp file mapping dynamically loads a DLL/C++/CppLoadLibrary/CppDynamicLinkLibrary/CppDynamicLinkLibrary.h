@@ -21,6 +21,38 @@ The sample DLL exports these data, functions and classes:
     // Callback Function
     int __stdcall Max(int a, int b, PFN_COMPARE cmpFunc)
 
+    // Shared Mapped File Client
+    DWORD __stdcall ReadMappedMessage(PWSTR pszBuffer, DWORD cchBuffer);
+    DWORD __stdcall WriteMappedMessage(PCWSTR pszMessage);
+
+    // C Interface of the Service Channel (see IpcApi.h)
+    int ipc_open(const char *pszName, ipc_channel **ppChannel);
+    int ipc_send(ipc_channel *pChannel, const void *pData, size_t cbData);
+    int ipc_send_batch(ipc_channel *pChannel, const ipc_iovec *pMessages,
+        size_t cMessages, size_t *pcSent);
+    int ipc_recv(ipc_channel *pChannel, void *pBuffer, size_t cbBuffer,
+        size_t *pcbData, uint32_t dwTimeout);
+    int ipc_recv_batch(ipc_channel *pChannel, ipc_buffer *pBuffers,
+        size_t cBuffers, size_t *pcReceived, uint32_t dwTimeout);
+    void ipc_close(ipc_channel *pChannel);
+    int ipc_listen(const char *pszName, PFN_IPC_HANDLER pfnHandler,
+        void *pContext, ipc_listener **ppListener);
+    void ipc_unlisten(ipc_listener *pListener);
+    void ipc_set_trace(PFN_IPC_TRACE pfnTrace, void *pContext);
+
+    // Client Objects of the Service Channel (see IpcClientObject.h)
+    int ipc_create_client(const char *pszName, IIpcClient **ppClient);
+    struct IIpcClient
+    {
+        int Send(...); int SendBatch(...);
+        int Receive(...); int ReceiveBatch(...);
+        int Call(...); void *GetScratch(size_t cb);
+        void Release(void);
+    };
+
+    // Message-Handler Plugin of the Service (see IpcPlugin.h)
+    const IPC_PLUGIN_TABLE *IpcGetPlugin(uint32_t abiVersion);
+
     // Class
     class CSimpleObject
     {
@@ -125,6 +157,24 @@ EXTERN_C SYMBOL_DECLSPEC int g_nVal2;
 #pragma endregion
 
 
+#pragma region Shared Mapped File Client
+
+// Exported/imported stdcall functions using a DEF file that read and write 
+// the file mapping of the service. The mapping is opened on the first call 
+// from any thread, once, and not in DllMain, so loading the DLL never 
+// waits for the service. Both return ERROR_SUCCESS or a Win32 error code; 
+// a call made while the service is not up fails and the next one tries 
+// again.
+// Sym: ReadMappedMessage, WriteMappedMessage
+// See: CppDynamicLinkLibrary.def
+//      CppDynamicLinkLibrary.cpp
+SYMBOL_DEF DWORD __stdcall ReadMappedMessage(PWSTR pszBuffer, 
+    DWORD cchBuffer);
+SYMBOL_DEF DWORD __stdcall WriteMappedMessage(PCWSTR pszMessage);
+
+#pragma endregion
+
+
 #pragma region Callback Function
 
 // Type-definition: 'PFN_COMPARE' now can be used as type
@@ -0,0 +1,1697 @@
+/****************************** Module Header ******************************\
+Module Name:  IpcApi.cpp
+Project:      CppDynamicLinkLibrary
+Copyright (c) Microsoft Corporation.
+
+Implements the C interface of the channel (see IpcApi.h) in four layers:
+
+    transport   opens, writes, wakes, reads and closes one session: over
+                CIpcClient on Windows, and over a POSIX shared memory object
+                of the same layout elsewhere.
+    registry    keeps one session per section for the whole process. The
+                channels opened on a section hold references to its
+                session, and the session outlives its last channel, so the
+                next ipc_open finds it mapped and accepted. The library pins
+                itself in the process when it opens its first session (see
+                LibraryPin.h), which keeps the registry across FreeLibrary
+                and dlclose.
+    listeners   servers in the process (see ipc_listen). A channel opened on
+                the section of one is local: it has no session, and the
+                handler of the listener answers each request on the thread
+                of the caller, straight into a reply ring of the channel.
+    channels    the exported functions. A channel sends on the rings of its
+                session and records itself as the owner of each request.
+                The server answers the requests of a session in order, so
+                the owner of the next reply is always the oldest one
+                recorded. Whoever takes a reply off the ring hands it to its
+                owner: straight into the buffer of the caller, or into the
+                stash of another channel, which that channel empties on its
+                next receive.
+
+The rings are single-producer single-consumer, so the channels of a session
+touch them under the lock of the session. One thread at a time waits for
+replies, outside the lock; the others wait on a condition variable until it
+has taken a reply off the ring or given up waiting. The only channel of a
+session skips the lock until a second one is opened on the section (see
+CSessionLock).
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#include "IpcApi.h"
+#include "IpcChannel.h"
+#include "LibraryPin.h"
+#include "LibraryTrace.h"
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#ifdef _WIN32
+#include "IpcClient.h"
+#else
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#define IPC_DEFAULT_NAME        "Global\\SampleMap"
+#else
+#define IPC_DEFAULT_NAME        "/SampleMap"
+
+// Time, in milliseconds, the server has to accept a new session, and the
+// number of times a waiting caller polls the reply ring before it gives
+// up its processor. For the first IPC_YIELD_TIME milliseconds it only
+// yields, so a server on the same processor answers at once; after that
+// it naps for IPC_POLL_INTERVAL microseconds at a time.
+#define IPC_ACCEPT_TIMEOUT      1000
+#define IPC_CLIENT_SPIN_COUNT   64
+#define IPC_YIELD_TIME          1
+#define IPC_POLL_INTERVAL       50
+#endif
+
+// Sessions the registry keeps open after their last channel is closed.
+#define IPC_IDLE_SESSIONS       4
+
+// Shape of the reply ring of a local channel: that of a ring of a section
+// of the default geometry, so requests fit the same way.
+static const IPC_GEOMETRY g_localGeometry =
+    { 1, IPC_DEFAULT_SLOTS, IPC_DEFAULT_SLOT_SIZE, 1 };
+
+
+static uint64_t GetMilliseconds(void)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+#pragma region Startup Trace
+
+// The hook of ipc_set_trace, and the initialization of the library, which
+// ends before a host can set one.
+static std::mutex g_traceLock;
+static PFN_IPC_TRACE g_pfnTrace = NULL;
+static void *g_pTraceContext = NULL;
+static uint64_t g_initializationStart = 0;
+static uint64_t g_initializationEnd = 0;
+
+
+void TracePhase(const char *pszPhase, uint64_t start)
+{
+    uint64_t end = IpcTimestamp();
+    PFN_IPC_TRACE pfnTrace;
+    void *pContext;
+    {
+        std::lock_guard<std::mutex> lock(g_traceLock);
+        pfnTrace = g_pfnTrace;
+        pContext = g_pTraceContext;
+    }
+    if (pfnTrace != NULL)
+    {
+        pfnTrace(pContext, pszPhase, start, end);
+    }
+}
+
+
+// Called once, from DllMain or from the constructors below, before any
+// exported function can run.
+void RecordInitialization(uint64_t start, uint64_t end)
+{
+    g_initializationStart = start;
+    g_initializationEnd = end;
+}
+
+#ifndef _WIN32
+
+// The static constructors of the shared object run between these two: the
+// first has the highest priority there is, the second the lowest.
+static uint64_t g_constructorsStart = 0;
+
+__attribute__((constructor(101))) static void BeginInitialization(void)
+{
+    g_constructorsStart = IpcTimestamp();
+}
+
+__attribute__((constructor)) static void EndInitialization(void)
+{
+    RecordInitialization(g_constructorsStart, IpcTimestamp());
+}
+
+#ifdef IPC_EAGER_OPEN
+
+// Built with -DIPC_EAGER_OPEN, the library opens a channel from its
+// constructors, the way DllMain opened the mapping before the channel was
+// opened on first use: on the section IPC_EAGER_SECTION names, or on the
+// default one. Only "make compare-startup" builds it, to measure what the
+// lazy open takes off the load of the library. Every global the open uses
+// is constant-initialized, so it may run before the others.
+static ipc_channel *g_pEagerChannel = NULL;
+
+__attribute__((constructor(102))) static void OpenEagerChannel(void)
+{
+    ipc_open(getenv("IPC_EAGER_SECTION"), &g_pEagerChannel);
+}
+
+__attribute__((destructor(102))) static void CloseEagerChannel(void)
+{
+    ipc_close(g_pEagerChannel);
+}
+
+#endif
+
+#endif
+
+#pragma endregion
+
+
+#pragma region Transport
+
+#ifdef _WIN32
+
+struct SESSION_TRANSPORT
+{
+    SESSION_TRANSPORT(void) : client(szMapName)
+    {
+        szMapName[0] = L'\0';
+    }
+
+    // Declared before the client, which keeps a pointer to it.
+    wchar_t szMapName[MAX_PATH];
+    CIpcClient client;
+};
+
+
+bool PinLibrary(void)
+{
+    HMODULE hModule;
+    return GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS |
+        GET_MODULE_HANDLE_EX_FLAG_PIN, (LPCWSTR)&PinLibrary, &hModule) != FALSE;
+}
+
+
+static int ChannelOpen(SESSION_TRANSPORT *pTransport, const char *pszName)
+{
+    if (MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, pszName, -1,
+        pTransport->szMapName, ARRAYSIZE(pTransport->szMapName)) == 0)
+    {
+        return IPC_E_INVALIDARG;
+    }
+
+    // The client maps the section and connects the session in one step.
+    uint64_t start = IpcTimestamp();
+    bool fConnected = pTransport->client.EnsureConnected();
+    TracePhase("OpenSession", start);
+    return fConnected ? IPC_OK : IPC_E_NOTCONNECTED;
+}
+
+
+// Make sure the session is usable. A client that lost the server tries to
+// connect again first, at most as often as its back-off allows.
+static int ChannelCheck(SESSION_TRANSPORT *pTransport)
+{
+    return pTransport->client.EnsureConnected() ? IPC_OK : IPC_E_NOTCONNECTED;
+}
+
+
+// Check, after a wait that brought no reply, whether the server is gone.
+// The client disconnects if it is, and connects again on the next check.
+static bool ChannelLost(SESSION_TRANSPORT *pTransport)
+{
+    return !pTransport->client.CheckServer();
+}
+
+
+// Number of times the session was opened. It changes when the client
+// reconnects, which loses the requests in flight.
+static uint64_t ChannelEpoch(SESSION_TRANSPORT *pTransport)
+{
+    return pTransport->client.GetConnectCount();
+}
+
+
+static IPC_RING_HEADER *ChannelRing(SESSION_TRANSPORT *pTransport,
+    uint32_t ring, const IPC_GEOMETRY **ppGeometry)
+{
+    CIpcClient &client = pTransport->client;
+    *ppGeometry = &client.GetHeader()->Geometry;
+    return IpcGetRing(client.GetHeader(), client.GetSession(), ring);
+}
+
+
+static bool ChannelDurable(SESSION_TRANSPORT *pTransport)
+{
+    return IpcIsDurable(pTransport->client.GetHeader());
+}
+
+
+// Wake the shard that serves the session: when it waits for requests (see
+// CIpcClient::RingDoorbell), or always when it waits for reply credits.
+static void ChannelWake(SESSION_TRANSPORT *pTransport, bool fAlways)
+{
+    CIpcClient &client = pTransport->client;
+    IPC_SECTION_HEADER *pHeader = client.GetHeader();
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (fAlways || IpcGetShard(pHeader, IpcShardOfSession(pHeader->Geometry,
+        client.GetSession()))->ServerSleeping.load(std::memory_order_relaxed))
+    {
+        SetEvent(client.GetDoorbell());
+    }
+}
+
+
+//
+//   FUNCTION: ChannelWait(SESSION_TRANSPORT *, uint32_t)
+//
+//   PURPOSE: Wait up to dwTimeout milliseconds for a reply to be queued,
+//   the way CIpcClient::Receive does, but without taking it and without
+//   changing the client, so that it can run outside the lock of the
+//   session: poll the ring for a short while, then advertise that the
+//   client sleeps and wait for the session event or the exit of the server.
+//
+static void ChannelWait(SESSION_TRANSPORT *pTransport, uint32_t dwTimeout)
+{
+    CIpcClient &client = pTransport->client;
+    IPC_SESSION *pSession = IpcGetSession(client.GetHeader(),
+        client.GetSession());
+    IPC_RING_HEADER *pReplies = IpcGetRing(client.GetHeader(),
+        client.GetSession(), IPC_RING_REPLY);
+
+    for (unsigned int i = 0; i < IPC_CLIENT_SPIN_COUNT; i++)
+    {
+        if (IpcRingCount(pReplies) != 0)
+        {
+            return;
+        }
+        YieldProcessor();
+    }
+
+    HANDLE handles[2] = { client.GetReplyEvent(), client.GetServerProcess() };
+    DWORD cHandles = 2;
+    if (handles[1] == NULL)
+    {
+        cHandles = 1;
+        if (dwTimeout > IPC_SERVER_CHECK_INTERVAL)
+        {
+            dwTimeout = IPC_SERVER_CHECK_INTERVAL;
+        }
+    }
+
+    pSession->ClientSleeping.store(1, std::memory_order_seq_cst);
+    if (IpcRingCount(pReplies) == 0)
+    {
+        WaitForMultipleObjects(cHandles, handles, FALSE, dwTimeout);
+    }
+    pSession->ClientSleeping.store(0, std::memory_order_relaxed);
+}
+
+
+static void ChannelClose(SESSION_TRANSPORT *pTransport)
+{
+    pTransport->client.Disconnect();
+}
+
+#else
+
+struct SESSION_TRANSPORT
+{
+    int fd;
+    void *pView;
+    size_t cbView;
+    IPC_SECTION_HEADER *pHeader;
+    uint32_t generation;
+    int iSession;
+};
+
+// Number of sessions the process has opened, mixed into the hash that
+// picks the shard of the next one.
+static std::atomic<uint32_t> g_cSessionsOpened(0);
+
+
+// Load the library once more with RTLD_NODELETE, which keeps it mapped
+// after the host closes its own handle.
+bool PinLibrary(void)
+{
+    Dl_info info;
+    return dladdr((void *)&PinLibrary, &info) != 0 &&
+        dlopen(info.dli_fname, RTLD_NOW | RTLD_NOLOAD | RTLD_NODELETE) != NULL;
+}
+
+
+static void Nap(void)
+{
+    struct timespec interval = { 0, IPC_POLL_INTERVAL * 1000 };
+    nanosleep(&interval, NULL);
+}
+
+
+// The server that accepted the session has exited, been replaced or
+// closed the session.
+static bool IsServerLost(SESSION_TRANSPORT *pTransport)
+{
+    IPC_SESSION *pSession = IpcGetSession(pTransport->pHeader,
+        (uint32_t)pTransport->iSession);
+    return pTransport->pHeader->Generation.load(std::memory_order_acquire) !=
+        pTransport->generation ||
+        pSession->State.load(std::memory_order_acquire) != IPC_SESSION_ACTIVE;
+}
+
+
+// Map the section and wait for the server to accept a session in it. On
+// failure the caller closes whatever was opened.
+static int ConnectSession(SESSION_TRANSPORT *pTransport, const char *pszName)
+{
+    pTransport->fd = -1;
+    pTransport->pView = NULL;
+    pTransport->iSession = -1;
+
+    uint64_t phaseStart = IpcTimestamp();
+    pTransport->fd = shm_open(pszName, O_RDWR, 0);
+    TracePhase("shm_open", phaseStart);
+    if (pTransport->fd < 0)
+    {
+        return IPC_E_NOTCONNECTED;
+    }
+
+    struct stat info;
+    if (fstat(pTransport->fd, &info) != 0)
+    {
+        return IPC_E_NOTCONNECTED;
+    }
+    pTransport->cbView = (size_t)info.st_size;
+    phaseStart = IpcTimestamp();
+    void *pView = mmap(NULL, pTransport->cbView, PROT_READ | PROT_WRITE,
+        MAP_SHARED, pTransport->fd, 0);
+    TracePhase("mmap", phaseStart);
+    if (pView == MAP_FAILED)
+    {
+        return IPC_E_NOTCONNECTED;
+    }
+    pTransport->pView = pView;
+    if (!IpcValidateSection(pView, pTransport->cbView))
+    {
+        return IPC_E_NOTCONNECTED;
+    }
+
+    pTransport->pHeader = IpcGetHeader(pView);
+    pTransport->generation = pTransport->pHeader->Generation.load(
+        std::memory_order_acquire);
+    pTransport->iSession = IpcOpenSession(pTransport->pHeader,
+        (uint32_t)getpid(), IpcHashClient((uint32_t)getpid(),
+        g_cSessionsOpened.fetch_add(1, std::memory_order_relaxed)));
+    if (pTransport->iSession < 0)
+    {
+        return IPC_E_NOTCONNECTED;
+    }
+
+    IPC_SESSION *pSession = IpcGetSession(pTransport->pHeader,
+        (uint32_t)pTransport->iSession);
+    uint64_t start = GetMilliseconds();
+    while (pSession->State.load(std::memory_order_acquire) !=
+        IPC_SESSION_ACTIVE)
+    {
+        if (GetMilliseconds() - start >= IPC_ACCEPT_TIMEOUT)
+        {
+            return IPC_E_NOTCONNECTED;
+        }
+        Nap();
+    }
+    return IPC_OK;
+}
+
+
+static int ChannelOpen(SESSION_TRANSPORT *pTransport, const char *pszName)
+{
+    uint64_t start = IpcTimestamp();
+    int result = ConnectSession(pTransport, pszName);
+    TracePhase("OpenSession", start);
+    return result;
+}
+
+
+// A lost server is not looked for again: the channel has to be reopened.
+static int ChannelCheck(SESSION_TRANSPORT *pTransport)
+{
+    return IsServerLost(pTransport) ? IPC_E_NOTCONNECTED : IPC_OK;
+}
+
+
+static bool ChannelLost(SESSION_TRANSPORT *pTransport)
+{
+    return IsServerLost(pTransport);
+}
+
+
+// The session is never reopened in place.
+static uint64_t ChannelEpoch(SESSION_TRANSPORT *)
+{
+    return 0;
+}
+
+
+static IPC_RING_HEADER *ChannelRing(SESSION_TRANSPORT *pTransport,
+    uint32_t ring, const IPC_GEOMETRY **ppGeometry)
+{
+    *ppGeometry = &pTransport->pHeader->Geometry;
+    return IpcGetRing(pTransport->pHeader, (uint32_t)pTransport->iSession,
+        ring);
+}
+
+
+static bool ChannelDurable(SESSION_TRANSPORT *pTransport)
+{
+    return IpcIsDurable(pTransport->pHeader);
+}
+
+
+// There are no doorbells here: the server polls the rings.
+static void ChannelWake(SESSION_TRANSPORT *, bool)
+{
+}
+
+
+// Poll the reply ring until a reply is queued, the server is lost or
+// dwTimeout milliseconds have passed.
+static void ChannelWait(SESSION_TRANSPORT *pTransport, uint32_t dwTimeout)
+{
+    IPC_RING_HEADER *pReplies = IpcGetRing(pTransport->pHeader,
+        (uint32_t)pTransport->iSession, IPC_RING_REPLY);
+    uint64_t start = GetMilliseconds();
+
+    for (unsigned int i = 0; IpcRingCount(pReplies) == 0; i++)
+    {
+        if (i % IPC_CLIENT_SPIN_COUNT == IPC_CLIENT_SPIN_COUNT - 1)
+        {
+            uint64_t elapsed = GetMilliseconds() - start;
+            if (elapsed >= dwTimeout || IsServerLost(pTransport))
+            {
+                return;
+            }
+            if (elapsed < IPC_YIELD_TIME)
+            {
+                sched_yield();
+            }
+            else
+            {
+                Nap();
+            }
+        }
+    }
+}
+
+
+static void ChannelClose(SESSION_TRANSPORT *pTransport)
+{
+    if (pTransport->iSession >= 0)
+    {
+        IpcCloseSession(pTransport->pHeader, (uint32_t)pTransport->iSession);
+        pTransport->iSession = -1;
+    }
+    if (pTransport->pView != NULL)
+    {
+        munmap(pTransport->pView, pTransport->cbView);
+        pTransport->pView = NULL;
+    }
+    if (pTransport->fd >= 0)
+    {
+        close(pTransport->fd);
+        pTransport->fd = -1;
+    }
+}
+
+#endif
+
+#pragma endregion
+
+
+#pragma region Registry
+
+// A session with the server, shared by the channels the process opened on
+// the same section.
+struct SHARED_SESSION
+{
+    SHARED_SESSION *pNext;
+    char szName[IPC_MAX_NAME];
+
+    // Channels that hold the session; guarded by g_registryLock.
+    unsigned int cChannels;
+
+    // Guards the rest, the rings and the stashes of the channels.
+    std::mutex lock;
+
+    // The channel that opened the session while it had no other, which
+    // uses it without the lock, and is set while that channel does; see
+    // CSessionLock.
+    std::atomic<ipc_channel *> pSole;
+    std::atomic<bool> fSoleBusy;
+
+    // Notified when replies are handed over to other channels and when the
+    // waiting thread stops waiting.
+    std::condition_variable replied;
+
+    // A thread waits on the reply ring outside the lock.
+    bool fWaiting;
+
+    // ChannelEpoch of the requests in flight.
+    uint64_t epoch;
+
+    // Owner of every request whose reply is not off the ring yet, oldest
+    // first; NULL for a channel closed since.
+    std::unique_ptr<ipc_channel *[]> ppOwners;
+    uint32_t cMaxOwners;
+    uint64_t ownersHead;
+    uint64_t ownersTail;
+
+    SESSION_TRANSPORT transport;
+};
+
+static std::mutex g_registryLock;
+static SHARED_SESSION *g_pSessions = NULL;
+static unsigned int g_cIdleSessions = 0;
+
+// The library stays loaded until the process exits, so idle sessions may
+// be kept for the next ipc_open.
+static bool g_fPinned = false;
+
+
+//
+//   CLASS: CSessionLock
+//
+//   PURPOSE: The lock of a session, which the only channel of the session
+//   skips: it marks itself busy instead, and takes the lock after all once
+//   RevokeSole has taken the session from it. The mark and the check of
+//   the owner, like those of RevokeSole, are sequentially consistent, so
+//   either the channel sees that it lost the session or RevokeSole sees it
+//   busy and waits for it. A session shared once stays locked for good.
+//
+class CSessionLock
+{
+public:
+
+    CSessionLock(SHARED_SESSION *pSession, ipc_channel *pChannel) :
+        m_pSession(pSession), m_pChannel(pChannel), m_fSole(false),
+        m_lock(pSession->lock, std::defer_lock)
+    {
+        lock();
+    }
+
+    ~CSessionLock(void)
+    {
+        if (m_fSole)
+        {
+            m_pSession->fSoleBusy.store(false, std::memory_order_release);
+        }
+    }
+
+    void lock(void)
+    {
+        if (m_pSession->pSole.load(std::memory_order_relaxed) == m_pChannel)
+        {
+            m_pSession->fSoleBusy.store(true);
+            if (m_pSession->pSole.load() == m_pChannel)
+            {
+                m_fSole = true;
+                return;
+            }
+            m_pSession->fSoleBusy.store(false, std::memory_order_release);
+        }
+        m_lock.lock();
+    }
+
+    void unlock(void)
+    {
+        if (m_fSole)
+        {
+            m_fSole = false;
+            m_pSession->fSoleBusy.store(false, std::memory_order_release);
+            return;
+        }
+        m_lock.unlock();
+    }
+
+    // Nobody else uses the session, so nobody waits or is waited for.
+    void wait_for(uint32_t dwTimeout)
+    {
+        if (!m_fSole)
+        {
+            m_pSession->replied.wait_for(m_lock,
+                std::chrono::milliseconds(dwTimeout));
+        }
+    }
+
+    void notify_all(void)
+    {
+        if (!m_fSole)
+        {
+            m_pSession->replied.notify_all();
+        }
+    }
+
+private:
+
+    SHARED_SESSION *m_pSession;
+    ipc_channel *m_pChannel;
+    bool m_fSole;
+    std::unique_lock<std::mutex> m_lock;
+};
+
+
+// Make the channel that had the session to itself take the lock like the
+// others from its next call on, and wait for the call it is in. Called
+// before a second channel joins the session or another thread checks it.
+static void RevokeSole(SHARED_SESSION *pSession)
+{
+    pSession->pSole.store(NULL);
+    while (pSession->fSoleBusy.load())
+    {
+        std::this_thread::yield();
+    }
+}
+
+
+static void DestroySession(SHARED_SESSION *pSession)
+{
+    ChannelClose(&pSession->transport);
+    delete pSession;
+}
+
+
+static void UnlinkSession(SHARED_SESSION *pSession)
+{
+    SHARED_SESSION **ppLink = &g_pSessions;
+    while (*ppLink != pSession)
+    {
+        ppLink = &(*ppLink)->pNext;
+    }
+    *ppLink = pSession->pNext;
+}
+
+
+// Map the section and open a new session in it.
+static int CreateSession(const char *pszName, SHARED_SESSION **ppSession)
+{
+    SHARED_SESSION *pSession = new (std::nothrow) SHARED_SESSION;
+    if (pSession == NULL)
+    {
+        return IPC_E_NOMEMORY;
+    }
+    strcpy(pSession->szName, pszName);
+    pSession->cChannels = 0;
+    pSession->pSole.store(NULL, std::memory_order_relaxed);
+    pSession->fSoleBusy.store(false, std::memory_order_relaxed);
+    pSession->fWaiting = false;
+    pSession->ownersHead = 0;
+    pSession->ownersTail = 0;
+
+    int result = ChannelOpen(&pSession->transport, pszName);
+    if (result == IPC_OK)
+    {
+        // A request in flight is in a request slot, with the server or in
+        // a reply slot.
+        const IPC_GEOMETRY *pGeometry;
+        ChannelRing(&pSession->transport, IPC_RING_REPLY, &pGeometry);
+        pSession->cMaxOwners = 2 * pGeometry->cSlots;
+        pSession->ppOwners.reset(
+            new (std::nothrow) ipc_channel *[pSession->cMaxOwners]);
+        if (!pSession->ppOwners)
+        {
+            result = IPC_E_NOMEMORY;
+        }
+    }
+    if (result != IPC_OK)
+    {
+        DestroySession(pSession);
+        return result;
+    }
+
+    pSession->epoch = ChannelEpoch(&pSession->transport);
+    *ppSession = pSession;
+    return IPC_OK;
+}
+
+
+//
+//   FUNCTION: FindSession(const char *, SHARED_SESSION **)
+//
+//   PURPOSE: Find the session of the process on the section. An idle
+//   session whose server is gone is destroyed, so that a new one replaces
+//   it; a session other channels use is kept as it is, and fails for the
+//   new channel as it does for them. Called under g_registryLock.
+//
+static int FindSession(const char *pszName, SHARED_SESSION **ppSession)
+{
+    SHARED_SESSION *pSession = g_pSessions;
+    while (pSession != NULL && strcmp(pSession->szName, pszName) != 0)
+    {
+        pSession = pSession->pNext;
+    }
+    *ppSession = NULL;
+    if (pSession == NULL)
+    {
+        return IPC_OK;
+    }
+
+    RevokeSole(pSession);
+    int result;
+    {
+        std::lock_guard<std::mutex> lock(pSession->lock);
+        result = ChannelCheck(&pSession->transport);
+    }
+    if (result != IPC_OK && pSession->cChannels != 0)
+    {
+        return result;
+    }
+    if (pSession->cChannels == 0)
+    {
+        g_cIdleSessions--;
+    }
+    if (result != IPC_OK)
+    {
+        UnlinkSession(pSession);
+        DestroySession(pSession);
+        return IPC_OK;
+    }
+    *ppSession = pSession;
+    return IPC_OK;
+}
+
+
+//
+//   FUNCTION: AcquireSession(const char *, ipc_channel *, SHARED_SESSION **)
+//
+//   PURPOSE: Find the session of the process on the section, or open one,
+//   and count the channel on it. The session is opened outside
+//   g_registryLock, so that connecting to one server does not hold up the
+//   channels of the others; if another thread has registered one for the
+//   section meanwhile, that one is used and the new one closed.
+//
+static int AcquireSession(const char *pszName, ipc_channel *pChannel,
+    SHARED_SESSION **ppSession)
+{
+    SHARED_SESSION *pCreated = NULL;
+    SHARED_SESSION *pSession;
+    int result;
+
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> registry(g_registryLock);
+            result = FindSession(pszName, &pSession);
+            if (result == IPC_OK && pSession == NULL && pCreated != NULL)
+            {
+                pSession = pCreated;
+                pCreated = NULL;
+                pSession->pNext = g_pSessions;
+                g_pSessions = pSession;
+                if (!g_fPinned)
+                {
+                    g_fPinned = PinLibrary();
+                }
+            }
+            if (result == IPC_OK && pSession != NULL)
+            {
+                pSession->pSole.store(
+                    (pSession->cChannels == 0) ? pChannel : NULL);
+                pSession->cChannels++;
+            }
+        }
+        if (result != IPC_OK || pSession != NULL)
+        {
+            break;
+        }
+        result = CreateSession(pszName, &pCreated);
+        if (result != IPC_OK)
+        {
+            return result;
+        }
+    }
+
+    if (pCreated != NULL)
+    {
+        DestroySession(pCreated);
+    }
+    if (result == IPC_OK)
+    {
+        *ppSession = pSession;
+    }
+    return result;
+}
+
+
+// Count one channel less on the session. The last one leaves the session
+// open for the next ipc_open, as long as there is room among the idle
+// sessions and the library cannot be unloaded under it.
+static void ReleaseSession(SHARED_SESSION *pSession)
+{
+    std::lock_guard<std::mutex> registry(g_registryLock);
+
+    if (--pSession->cChannels != 0)
+    {
+        return;
+    }
+    if (g_fPinned && g_cIdleSessions < IPC_IDLE_SESSIONS)
+    {
+        g_cIdleSessions++;
+        return;
+    }
+    UnlinkSession(pSession);
+    DestroySession(pSession);
+}
+
+#pragma endregion
+
+
+#pragma region Listeners
+
+struct ipc_listener
+{
+    ipc_listener *pNext;
+    char szName[IPC_MAX_NAME];
+    PFN_IPC_HANDLER pfnHandler;
+    void *pContext;
+
+    // The registration and the channels opened on the listener; guarded by
+    // g_registryLock, like the numbering of the channels.
+    unsigned int cRefs;
+    uint32_t cChannelsOpened;
+
+    // Set by ipc_unlisten, which then waits for the calls of the handler
+    // in progress to return.
+    std::atomic<bool> fClosed;
+    std::atomic<uint32_t> cCalls;
+};
+
+static ipc_listener *g_pListeners = NULL;
+
+
+// Find the listener registered for the section. Called under
+// g_registryLock.
+static ipc_listener *FindListener(const char *pszName)
+{
+    ipc_listener *pListener = g_pListeners;
+    while (pListener != NULL && strcmp(pListener->szName, pszName) != 0)
+    {
+        pListener = pListener->pNext;
+    }
+    return pListener;
+}
+
+
+static void ReleaseListener(ipc_listener *pListener)
+{
+    std::lock_guard<std::mutex> registry(g_registryLock);
+    if (--pListener->cRefs == 0)
+    {
+        delete pListener;
+    }
+}
+
+#pragma endregion
+
+
+#pragma region Channels
+
+struct ipc_channel
+{
+    SHARED_SESSION *pSession;
+
+    // SHARED_SESSION::epoch the requests in flight were sent in.
+    uint64_t epoch;
+
+    // Requests sent whose replies the caller has not taken yet, and the
+    // most there may be: as many as the stash holds.
+    uint32_t cInFlight;
+    uint32_t cWindow;
+
+    // Replies other channels took off the ring for this one, in order.
+    // Sized when the channel is opened: a reply larger than a stash slot,
+    // which only a section resized since can produce, is truncated.
+    std::unique_ptr<unsigned char[]> pStash;
+    std::unique_ptr<size_t[]> pcbStashed;
+    size_t cbStashSlot;
+    uint64_t stashHead;
+    uint64_t stashTail;
+
+    // Set instead of pSession for a local channel: the listener, the number
+    // of the channel for its handler and the reply ring, in pLocalMemory.
+    ipc_listener *pListener;
+    uint32_t iLocal;
+    IPC_RING_HEADER *pLocalReplies;
+    std::unique_ptr<unsigned char[]> pLocalMemory;
+};
+
+
+//
+//   FUNCTION: CheckChannel(ipc_channel *)
+//
+//   PURPOSE: Make sure the session is usable, and forget the requests a
+//   reconnection has lost: the owners of the session and the requests in
+//   flight of the channel. The stash holds replies that did come, and is
+//   kept. Called under the lock of the session.
+//
+static int CheckChannel(ipc_channel *pChannel)
+{
+    SHARED_SESSION *pSession = pChannel->pSession;
+    int result = ChannelCheck(&pSession->transport);
+    if (result != IPC_OK)
+    {
+        return result;
+    }
+
+    uint64_t epoch = ChannelEpoch(&pSession->transport);
+    if (pSession->epoch != epoch)
+    {
+        pSession->ownersHead = pSession->ownersTail;
+        pSession->epoch = epoch;
+    }
+    if (pChannel->epoch != pSession->epoch)
+    {
+        pChannel->cInFlight = (uint32_t)(pChannel->stashTail -
+            pChannel->stashHead);
+        pChannel->epoch = pSession->epoch;
+    }
+    return IPC_OK;
+}
+
+
+// Number of requests the channel may send before it takes replies.
+static uint32_t GetSendWindow(ipc_channel *pChannel)
+{
+    SHARED_SESSION *pSession = pChannel->pSession;
+    uint64_t cOwnersFree = pSession->cMaxOwners -
+        (pSession->ownersTail - pSession->ownersHead);
+    uint32_t cWindow = pChannel->cWindow - pChannel->cInFlight;
+    return (cOwnersFree < cWindow) ? (uint32_t)cOwnersFree : cWindow;
+}
+
+
+static void AddOwner(ipc_channel *pChannel)
+{
+    SHARED_SESSION *pSession = pChannel->pSession;
+    pSession->ppOwners[pSession->ownersTail++ % pSession->cMaxOwners] =
+        pChannel;
+    pChannel->cInFlight++;
+}
+
+
+// Copy the replies stashed for the channel into the buffers, oldest first.
+static size_t TakeStashed(ipc_channel *pChannel, ipc_buffer *pBuffers,
+    size_t cBuffers)
+{
+    size_t cTaken = 0;
+    for (; cTaken < cBuffers && pChannel->stashHead != pChannel->stashTail;
+        cTaken++, pChannel->stashHead++)
+    {
+        size_t iSlot = (size_t)(pChannel->stashHead % pChannel->cWindow);
+        ipc_buffer &buffer = pBuffers[cTaken];
+        buffer.len = pChannel->pcbStashed[iSlot];
+        if (buffer.len > buffer.size)
+        {
+            buffer.len = buffer.size;
+        }
+        memcpy(buffer.base, &pChannel->pStash[iSlot * pChannel->cbStashSlot],
+            buffer.len);
+        pChannel->cInFlight--;
+    }
+    return cTaken;
+}
+
+
+//
+//   FUNCTION: TakeQueued(ipc_channel *, ipc_buffer *, size_t, bool *)
+//
+//   PURPOSE: Take replies off the ring of the session until the buffers
+//   are full or the ring is empty. The replies of the channel go into the
+//   buffers, those of other channels into their stashes and those of
+//   closed channels nowhere. All the slots are freed with a single store
+//   of the tail, granting the server the credits for them at once. Called
+//   under the lock of the session while no thread waits outside it.
+//
+static size_t TakeQueued(ipc_channel *pChannel, ipc_buffer *pBuffers,
+    size_t cBuffers, bool *pfHandedOver)
+{
+    SHARED_SESSION *pSession = pChannel->pSession;
+    const IPC_GEOMETRY *pGeometry;
+    IPC_RING_HEADER *pReplies = ChannelRing(&pSession->transport,
+        IPC_RING_REPLY, &pGeometry);
+    uint64_t tail = pReplies->Tail.load(std::memory_order_relaxed);
+    uint64_t head = pReplies->Head.load(std::memory_order_acquire);
+
+    size_t cTaken = 0;
+    uint64_t position = tail;
+    for (; position != head && cTaken < cBuffers; position++)
+    {
+        ipc_channel *pOwner = NULL;
+        if (pSession->ownersHead != pSession->ownersTail)
+        {
+            pOwner = pSession->ppOwners[pSession->ownersHead++ %
+                pSession->cMaxOwners];
+        }
+
+        if (pOwner == pChannel)
+        {
+            ipc_buffer &buffer = pBuffers[cTaken++];
+            buffer.len = IpcRingPeek(*pGeometry, pReplies, position,
+                buffer.base, buffer.size);
+            pChannel->cInFlight--;
+        }
+        else if (pOwner != NULL)
+        {
+            size_t iSlot = (size_t)(pOwner->stashTail++ % pOwner->cWindow);
+            pOwner->pcbStashed[iSlot] = IpcRingPeek(*pGeometry, pReplies,
+                position, &pOwner->pStash[iSlot * pOwner->cbStashSlot],
+                pOwner->cbStashSlot);
+            *pfHandedOver = true;
+        }
+    }
+
+    if (position != tail)
+    {
+        IpcRingRelease(pReplies, position);
+        if (IpcRingGrant(*pGeometry, pReplies, pGeometry->cSlots))
+        {
+            ChannelWake(&pSession->transport, true);
+        }
+    }
+    return cTaken;
+}
+
+
+//
+//   FUNCTION: ReceiveReplies(ipc_channel *, ipc_buffer *, size_t, size_t *,
+//   uint32_t)
+//
+//   PURPOSE: Wait up to dwTimeout milliseconds for the next reply of the
+//   channel, then take the ones ready behind it, up to cBuffers in all.
+//   If no other thread waits for the session, this one waits on the ring
+//   itself, outside the lock, and hands over whatever comes; otherwise it
+//   waits for the thread that does.
+//
+static int ReceiveReplies(ipc_channel *pChannel, ipc_buffer *pBuffers,
+    size_t cBuffers, size_t *pcReceived, uint32_t dwTimeout)
+{
+    SHARED_SESSION *pSession = pChannel->pSession;
+    uint64_t start = 0;
+    CSessionLock lock(pSession, pChannel);
+
+    for (;;)
+    {
+        int result = CheckChannel(pChannel);
+        if (result != IPC_OK)
+        {
+            return result;
+        }
+
+        bool fHandedOver = false;
+        size_t cTaken = TakeStashed(pChannel, pBuffers, cBuffers);
+        if (!pSession->fWaiting && cTaken < cBuffers)
+        {
+            cTaken += TakeQueued(pChannel, pBuffers + cTaken,
+                cBuffers - cTaken, &fHandedOver);
+        }
+        if (fHandedOver)
+        {
+            lock.notify_all();
+        }
+        if (cTaken != 0)
+        {
+            *pcReceived = cTaken;
+            return IPC_OK;
+        }
+
+        // The clock is read once the reply is not there at once.
+        if (start == 0)
+        {
+            start = GetMilliseconds();
+        }
+        uint64_t elapsed = GetMilliseconds() - start;
+        if (elapsed >= dwTimeout)
+        {
+            return IPC_E_TIMEOUT;
+        }
+        uint32_t dwRemaining = (uint32_t)(dwTimeout - elapsed);
+
+        if (pSession->fWaiting)
+        {
+            lock.wait_for(dwRemaining);
+            continue;
+        }
+
+        // Nothing changes the client while fWaiting is set: the other
+        // threads only check that it is connected, which it is.
+        pSession->fWaiting = true;
+        lock.unlock();
+        ChannelWait(&pSession->transport, dwRemaining);
+        lock.lock();
+        pSession->fWaiting = false;
+        lock.notify_all();
+
+        const IPC_GEOMETRY *pGeometry;
+        if (IpcRingCount(ChannelRing(&pSession->transport, IPC_RING_REPLY,
+            &pGeometry)) == 0 && ChannelLost(&pSession->transport))
+        {
+            return IPC_E_NOTCONNECTED;
+        }
+    }
+}
+
+
+// Publish a request without waking the server. Called under the lock of
+// the session.
+static int ChannelWrite(ipc_channel *pChannel, const void *pData,
+    size_t cbData)
+{
+    const IPC_GEOMETRY *pGeometry;
+    IPC_RING_HEADER *pRequests = ChannelRing(&pChannel->pSession->transport,
+        IPC_RING_REQUEST, &pGeometry);
+    if (cbData > IpcMaxMessageSize(*pGeometry))
+    {
+        return IPC_E_TOOBIG;
+    }
+    if (GetSendWindow(pChannel) == 0 ||
+        !IpcRingWrite(*pGeometry, pRequests, pData, cbData,
+        ChannelDurable(&pChannel->pSession->transport)))
+    {
+        return IPC_E_BUSY;
+    }
+    AddOwner(pChannel);
+    return IPC_OK;
+}
+
+#pragma endregion
+
+
+#pragma region Local Channels
+
+//
+//   FUNCTION: OpenLocalChannel(const char *, ipc_channel *)
+//
+//   PURPOSE: Make the channel local if a listener in the process serves
+//   the section.
+//
+//   RETURN VALUE: IPC_OK if it did, IPC_E_NOTCONNECTED if the section has
+//   no listener, so the channel has to go through the section.
+//
+static int OpenLocalChannel(const char *pszName, ipc_channel *pChannel)
+{
+    ipc_listener *pListener;
+    {
+        std::lock_guard<std::mutex> registry(g_registryLock);
+        pListener = FindListener(pszName);
+        if (pListener == NULL)
+        {
+            return IPC_E_NOTCONNECTED;
+        }
+        pListener->cRefs++;
+        pChannel->iLocal = pListener->cChannelsOpened++;
+    }
+
+    // The ring header is aligned on a cache line, the slots on their size.
+    size_t cbRing = IpcRingSize(g_localGeometry);
+    pChannel->pLocalMemory.reset(new (std::nothrow) unsigned char[
+        cbRing + g_localGeometry.cbSlot]);
+    if (!pChannel->pLocalMemory)
+    {
+        ReleaseListener(pListener);
+        return IPC_E_NOMEMORY;
+    }
+    void *pRing = pChannel->pLocalMemory.get() +
+        (IpcAlignUp((size_t)pChannel->pLocalMemory.get(),
+        g_localGeometry.cbSlot) - (size_t)pChannel->pLocalMemory.get());
+
+    pChannel->pSession = NULL;
+    pChannel->pListener = pListener;
+    pChannel->pLocalReplies = new (pRing) IPC_RING_HEADER;
+    IpcRingReset(g_localGeometry, pChannel->pLocalReplies);
+    return IPC_OK;
+}
+
+
+//
+//   FUNCTION: LocalSend(ipc_channel *, const void *, size_t)
+//
+//   PURPOSE: Hand a request of a local channel to the handler of its
+//   listener, which writes the reply straight into the next slot of the
+//   reply ring of the channel. The request is never copied, and the reply
+//   only when the caller takes it.
+//
+static int LocalSend(ipc_channel *pChannel, const void *pData, size_t cbData)
+{
+    ipc_listener *pListener = pChannel->pListener;
+    IPC_RING_HEADER *pReplies = pChannel->pLocalReplies;
+    size_t cbMax = IpcMaxMessageSize(g_localGeometry);
+    if (cbData > cbMax)
+    {
+        return IPC_E_TOOBIG;
+    }
+    if (IpcRingCredits(g_localGeometry, pReplies) == 0)
+    {
+        return IPC_E_BUSY;
+    }
+
+    // Pairs with ipc_unlisten: either it sees the call, or the call sees
+    // that the listener is closed.
+    pListener->cCalls.fetch_add(1, std::memory_order_seq_cst);
+    if (pListener->fClosed.load(std::memory_order_seq_cst))
+    {
+        pListener->cCalls.fetch_sub(1, std::memory_order_release);
+        return IPC_E_NOTCONNECTED;
+    }
+
+    uint64_t head = pReplies->Head.load(std::memory_order_relaxed);
+    IPC_SLOT_HEADER *pSlot = IpcGetSlot(g_localGeometry, pReplies, head);
+    size_t cbReply = pListener->pfnHandler(pListener->pContext,
+        pChannel->iLocal, pData, cbData, pSlot + 1, cbMax);
+    pListener->cCalls.fetch_sub(1, std::memory_order_release);
+
+    IpcSealSlot(pSlot, head, (cbReply < cbMax) ? cbReply : cbMax, false);
+    IpcRingPublish(pReplies, head + 1);
+    return IPC_OK;
+}
+
+
+// Take the replies of a local channel, up to cBuffers. They are all there
+// once their requests are sent, so there is nothing to wait for.
+static int LocalReceive(ipc_channel *pChannel, ipc_buffer *pBuffers,
+    size_t cBuffers, size_t *pcReceived)
+{
+    IPC_RING_HEADER *pReplies = pChannel->pLocalReplies;
+    uint64_t tail = pReplies->Tail.load(std::memory_order_relaxed);
+    uint64_t head = pReplies->Head.load(std::memory_order_relaxed);
+    if (tail == head)
+    {
+        return IPC_E_TIMEOUT;
+    }
+
+    size_t cTaken = 0;
+    for (; cTaken < cBuffers && tail != head; cTaken++, tail++)
+    {
+        ipc_buffer &buffer = pBuffers[cTaken];
+        buffer.len = IpcRingPeek(g_localGeometry, pReplies, tail, buffer.base,
+            buffer.size);
+    }
+    IpcRingRelease(pReplies, tail);
+    IpcRingGrant(g_localGeometry, pReplies, g_localGeometry.cSlots);
+    *pcReceived = cTaken;
+    return IPC_OK;
+}
+
+#pragma endregion
+
+
+#pragma region Exported Functions
+
+IPC_API int IPC_CALL ipc_open(const char *pszName, ipc_channel **ppChannel)
+{
+    if (ppChannel == NULL)
+    {
+        return IPC_E_INVALIDARG;
+    }
+    *ppChannel = NULL;
+    if (pszName == NULL)
+    {
+        pszName = IPC_DEFAULT_NAME;
+    }
+    if (strlen(pszName) >= IPC_MAX_NAME)
+    {
+        return IPC_E_INVALIDARG;
+    }
+
+    std::unique_ptr<ipc_channel> pChannel(new (std::nothrow) ipc_channel);
+    if (!pChannel)
+    {
+        return IPC_E_NOMEMORY;
+    }
+
+    // A server in the process answers without the section.
+    int result = OpenLocalChannel(pszName, pChannel.get());
+    if (result != IPC_E_NOTCONNECTED)
+    {
+        if (result == IPC_OK)
+        {
+            *ppChannel = pChannel.release();
+        }
+        return result;
+    }
+    pChannel->pListener = NULL;
+
+    SHARED_SESSION *pSession;
+    result = AcquireSession(pszName, pChannel.get(), &pSession);
+    if (result != IPC_OK)
+    {
+        return result;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pSession->lock);
+        result = ChannelCheck(&pSession->transport);
+        if (result == IPC_OK)
+        {
+            const IPC_GEOMETRY *pGeometry;
+            ChannelRing(&pSession->transport, IPC_RING_REPLY, &pGeometry);
+            pChannel->pSession = pSession;
+            pChannel->epoch = pSession->epoch;
+            pChannel->cInFlight = 0;
+            pChannel->cWindow = pSession->cMaxOwners;
+            pChannel->cbStashSlot = IpcMaxMessageSize(*pGeometry);
+            pChannel->stashHead = 0;
+            pChannel->stashTail = 0;
+        }
+    }
+    if (result != IPC_OK)
+    {
+        ReleaseSession(pSession);
+        return result;
+    }
+    pChannel->pStash.reset(new (std::nothrow) unsigned char[
+        (size_t)pChannel->cWindow * pChannel->cbStashSlot]);
+    pChannel->pcbStashed.reset(new (std::nothrow) size_t[pChannel->cWindow]);
+    if (!pChannel->pStash || !pChannel->pcbStashed)
+    {
+        ReleaseSession(pSession);
+        return IPC_E_NOMEMORY;
+    }
+
+    *ppChannel = pChannel.release();
+    return IPC_OK;
+}
+
+
+IPC_API int IPC_CALL ipc_send(ipc_channel *pChannel, const void *pData,
+    size_t cbData)
+{
+    if (pChannel == NULL || (pData == NULL && cbData != 0))
+    {
+        return IPC_E_INVALIDARG;
+    }
+    if (pChannel->pListener != NULL)
+    {
+        return LocalSend(pChannel, pData, cbData);
+    }
+
+    CSessionLock lock(pChannel->pSession, pChannel);
+    int result = CheckChannel(pChannel);
+    if (result == IPC_OK)
+    {
+        result = ChannelWrite(pChannel, pData, cbData);
+    }
+    if (result == IPC_OK)
+    {
+        ChannelWake(&pChannel->pSession->transport, false);
+    }
+    return result;
+}
+
+
+//
+//   FUNCTION: ipc_send_batch(ipc_channel *, const ipc_iovec *, size_t,
+//   size_t *)
+//
+//   PURPOSE: Stage as many of the messages as the server has granted
+//   credits for in consecutive slots, then publish them with a single store
+//   of the head of the ring and ring the doorbell once, so the server sees
+//   the whole batch at once and the caller pays for one call.
+//
+IPC_API int IPC_CALL ipc_send_batch(ipc_channel *pChannel,
+    const ipc_iovec *pMessages, size_t cMessages, size_t *pcSent)
+{
+    if (pcSent != NULL)
+    {
+        *pcSent = 0;
+    }
+    if (pChannel == NULL || pcSent == NULL ||
+        (pMessages == NULL && cMessages != 0))
+    {
+        return IPC_E_INVALIDARG;
+    }
+
+    // A local channel answers each request as it is sent anyway.
+    if (pChannel->pListener != NULL)
+    {
+        for (; *pcSent < cMessages; (*pcSent)++)
+        {
+            const ipc_iovec &message = pMessages[*pcSent];
+            if (message.base == NULL && message.len != 0)
+            {
+                return IPC_E_INVALIDARG;
+            }
+            int result = LocalSend(pChannel, message.base, message.len);
+            if (result != IPC_OK)
+            {
+                return result;
+            }
+        }
+        return IPC_OK;
+    }
+
+    SHARED_SESSION *pSession = pChannel->pSession;
+    CSessionLock lock(pSession, pChannel);
+    int result = CheckChannel(pChannel);
+    if (result != IPC_OK)
+    {
+        return result;
+    }
+
+    const IPC_GEOMETRY *pGeometry;
+    IPC_RING_HEADER *pRequests = ChannelRing(&pSession->transport,
+        IPC_RING_REQUEST, &pGeometry);
+    uint64_t head = pRequests->Head.load(std::memory_order_relaxed);
+    uint64_t cCredits = IpcRingCredits(*pGeometry, pRequests);
+    uint32_t cWindow = GetSendWindow(pChannel);
+    if (cCredits > cWindow)
+    {
+        cCredits = cWindow;
+    }
+    size_t cbMax = IpcMaxMessageSize(*pGeometry);
+    bool fDurable = ChannelDurable(&pSession->transport);
+
+    size_t cStaged = 0;
+    for (; cStaged < cMessages; cStaged++)
+    {
+        const ipc_iovec &message = pMessages[cStaged];
+        if (message.base == NULL && message.len != 0)
+        {
+            result = IPC_E_INVALIDARG;
+            break;
+        }
+        if (message.len > cbMax)
+        {
+            result = IPC_E_TOOBIG;
+            break;
+        }
+        if (cStaged == cCredits)
+        {
+            result = IPC_E_BUSY;
+            break;
+        }
+        IpcRingStage(*pGeometry, pRequests, head + cStaged, message.base,
+            message.len, fDurable);
+        AddOwner(pChannel);
+    }
+
+    if (cStaged != 0)
+    {
+        IpcRingPublish(pRequests, head + cStaged);
+        ChannelWake(&pSession->transport, false);
+    }
+    *pcSent = cStaged;
+    return result;
+}
+
+
+IPC_API int IPC_CALL ipc_recv(ipc_channel *pChannel, void *pBuffer,
+    size_t cbBuffer, size_t *pcbData, uint32_t dwTimeout)
+{
+    if (pcbData != NULL)
+    {
+        *pcbData = 0;
+    }
+    if (pChannel == NULL || pcbData == NULL ||
+        (pBuffer == NULL && cbBuffer != 0))
+    {
+        return IPC_E_INVALIDARG;
+    }
+
+    ipc_buffer buffer = { pBuffer, cbBuffer, 0 };
+    size_t cReceived;
+    int result = (pChannel->pListener != NULL) ?
+        LocalReceive(pChannel, &buffer, 1, &cReceived) :
+        ReceiveReplies(pChannel, &buffer, 1, &cReceived, dwTimeout);
+    *pcbData = buffer.len;
+    return result;
+}
+
+
+//
+//   FUNCTION: ipc_recv_batch(ipc_channel *, ipc_buffer *, size_t, size_t *,
+//   uint32_t)
+//
+//   PURPOSE: Wait for the first reply like ipc_recv, then copy out the ones
+//   queued behind it and free all their slots with a single store of the
+//   tail of the ring (see TakeQueued).
+//
+IPC_API int IPC_CALL ipc_recv_batch(ipc_channel *pChannel,
+    ipc_buffer *pBuffers, size_t cBuffers, size_t *pcReceived,
+    uint32_t dwTimeout)
+{
+    if (pcReceived != NULL)
+    {
+        *pcReceived = 0;
+    }
+    if (pChannel == NULL || pcReceived == NULL || pBuffers == NULL ||
+        cBuffers == 0)
+    {
+        return IPC_E_INVALIDARG;
+    }
+    for (size_t i = 0; i < cBuffers; i++)
+    {
+        pBuffers[i].len = 0;
+        if (pBuffers[i].base == NULL && pBuffers[i].size != 0)
+        {
+            return IPC_E_INVALIDARG;
+        }
+    }
+    if (pChannel->pListener != NULL)
+    {
+        return LocalReceive(pChannel, pBuffers, cBuffers, pcReceived);
+    }
+    return ReceiveReplies(pChannel, pBuffers, cBuffers, pcReceived,
+        dwTimeout);
+}
+
+
+// Close the channel. Its requests still in flight keep their places among
+// the owners, as NULL, so that the other channels still find the owners of
+// the replies behind them.
+IPC_API void IPC_CALL ipc_close(ipc_channel *pChannel)
+{
+    if (pChannel == NULL)
+    {
+        return;
+    }
+    if (pChannel->pListener != NULL)
+    {
+        ReleaseListener(pChannel->pListener);
+        delete pChannel;
+        return;
+    }
+
+    SHARED_SESSION *pSession = pChannel->pSession;
+    {
+        std::lock_guard<std::mutex> lock(pSession->lock);
+        for (uint64_t i = pSession->ownersHead; i != pSession->ownersTail; i++)
+        {
+            ipc_channel *&pOwner = pSession->ppOwners[i % pSession->cMaxOwners];
+            if (pOwner == pChannel)
+            {
+                pOwner = NULL;
+            }
+        }
+    }
+    ReleaseSession(pSession);
+    delete pChannel;
+}
+
+
+
+IPC_API int IPC_CALL ipc_listen(const char *pszName,
+    PFN_IPC_HANDLER pfnHandler, void *pContext, ipc_listener **ppListener)
+{
+    if (ppListener == NULL)
+    {
+        return IPC_E_INVALIDARG;
+    }
+    *ppListener = NULL;
+    if (pszName == NULL)
+    {
+        pszName = IPC_DEFAULT_NAME;
+    }
+    if (pfnHandler == NULL || strlen(pszName) >= IPC_MAX_NAME)
+    {
+        return IPC_E_INVALIDARG;
+    }
+
+    std::lock_guard<std::mutex> registry(g_registryLock);
+    if (FindListener(pszName) != NULL)
+    {
+        return IPC_E_EXISTS;
+    }
+    ipc_listener *pListener = new (std::nothrow) ipc_listener;
+    if (pListener == NULL)
+    {
+        return IPC_E_NOMEMORY;
+    }
+    strcpy(pListener->szName, pszName);
+    pListener->pfnHandler = pfnHandler;
+    pListener->pContext = pContext;
+    pListener->cRefs = 1;
+    pListener->cChannelsOpened = 0;
+    pListener->fClosed.store(false, std::memory_order_relaxed);
+    pListener->cCalls.store(0, std::memory_order_relaxed);
+
+    pListener->pNext = g_pListeners;
+    g_pListeners = pListener;
+    *ppListener = pListener;
+    return IPC_OK;
+}
+
+
+// Close the listener to new calls and to new channels, then wait for the
+// calls in progress, so that the caller may free the context of the
+// handler once the function returns.
+IPC_API void IPC_CALL ipc_unlisten(ipc_listener *pListener)
+{
+    if (pListener == NULL)
+    {
+        return;
+    }
+
+    pListener->fClosed.store(true, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> registry(g_registryLock);
+        ipc_listener **ppLink = &g_pListeners;
+        while (*ppLink != pListener)
+        {
+            ppLink = &(*ppLink)->pNext;
+        }
+        *ppLink = pListener->pNext;
+    }
+    while (pListener->cCalls.load(std::memory_order_acquire) != 0)
+    {
+        std::this_thread::yield();
+    }
+    ReleaseListener(pListener);
+}
+
+
+
+IPC_API void IPC_CALL ipc_set_trace(PFN_IPC_TRACE pfnTrace, void *pContext)
+{
+    {
+        std::lock_guard<std::mutex> lock(g_traceLock);
+        g_pfnTrace = pfnTrace;
+        g_pTraceContext = pContext;
+    }
+    if (pfnTrace != NULL)
+    {
+        pfnTrace(pContext, "Initialization", g_initializationStart,
+            g_initializationEnd);
+    }
+}
+
+#pragma endregion
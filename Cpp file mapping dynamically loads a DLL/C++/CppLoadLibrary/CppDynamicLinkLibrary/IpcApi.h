@@ -0,0 +1,229 @@
+/****************************** Module Header ******************************\
+Module Name:  IpcApi.h
+Project:      CppDynamicLinkLibrary
+Copyright (c) Microsoft Corporation.
+
+The C interface of the shared-memory channel of the service (see
+IpcChannel.h). Any host process, whatever language or runtime it is
+written in, can load the library and talk to the server through it:
+
+    ipc_channel *pChannel;
+    if (ipc_open(NULL, &pChannel) == IPC_OK)
+    {
+        char reply[256];
+        size_t cbReply;
+        ipc_send(pChannel, "ping", 4);
+        ipc_recv(pChannel, reply, sizeof(reply), &cbReply, 1000);
+        ipc_close(pChannel);
+    }
+
+The interface is plain C, with fixed-width types and no structure whose
+layout depends on the compiler, so it stays the same from one build of the
+library to the next. Every message is copied straight between the buffer of
+the caller and a slot of the session rings, except a reply another channel
+took off the ring, which waits in a buffer of its own channel; only
+ipc_open allocates, so the other functions never touch the heap. Crossing into a dynamically
+loaded library costs an indirect call per function, so a caller that moves
+many messages hands them over in arrays with ipc_send_batch and
+ipc_recv_batch: one call, and one store to the ring, per batch.
+
+The library keeps one session with the server per section for the whole
+process. Every channel opened on a section shares it: the modules of a
+process that each open a channel send on the same rings, and each channel
+still receives exactly the replies to its own requests. The session stays
+open when the last channel is closed, and the library stays loaded once it
+has opened one, so a host that loads the library, opens a channel and
+frees everything again and again maps the section only the first time.
+
+A server that runs in the same process as the library can register itself
+with ipc_listen. From then on ipc_open on that section gives a channel that
+never touches the section: ipc_send calls the handler of the server on the
+thread of the caller, which writes its reply straight into a reply ring of
+the channel, and ipc_recv takes it from there. The functions behave as
+they do across processes, except that a reply is ready as soon as the
+request is sent.
+
+A host that wants to know where its startup goes sets a trace hook with
+ipc_set_trace right after loading the library. The library reports its own
+initialization to it at once, then the phases of each session it brings up
+as they end, on the clock of the host's own timestamps.
+
+A channel must be used by one thread at a time; different channels may be
+used by different threads. On Windows the session reconnects by itself
+when the server restarts; the POSIX build, which exists to test the
+library with dlopen on Linux, polls the rings instead of ringing doorbells
+and reports a lost server as IPC_E_NOTCONNECTED until every channel of the
+section is closed and one is opened again.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The functions are exported by name through the DEF file on Windows, and
+// are the only symbols the shared object exports elsewhere.
+#ifdef _WIN32
+#define IPC_CALL __stdcall
+#ifdef CPPDYNAMICLINKLIBRARY_EXPORTS
+#define IPC_API
+#else
+#define IPC_API __declspec(dllimport)
+#endif
+#else
+#define IPC_CALL
+#define IPC_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#pragma region Types
+
+// A session with the server. Opaque to the caller.
+typedef struct ipc_channel ipc_channel;
+
+// A server registered in the process. Opaque to the caller.
+typedef struct ipc_listener ipc_listener;
+
+// One message of a batch, in a buffer owned by the caller.
+typedef struct ipc_iovec
+{
+    const void *base;
+    size_t len;
+} ipc_iovec;
+
+// A buffer owned by the caller that receives one message: size is its
+// capacity, len receives the number of bytes copied into it.
+typedef struct ipc_buffer
+{
+    void *base;
+    size_t size;
+    size_t len;
+} ipc_buffer;
+
+// Results of the functions.
+#define IPC_OK                  0
+#define IPC_E_INVALIDARG        (-1)    // A NULL or malformed argument
+#define IPC_E_NOTCONNECTED      (-2)    // No server, or the server is gone
+#define IPC_E_TOOBIG            (-3)    // The message does not fit a slot
+#define IPC_E_BUSY              (-4)    // No credits; receive replies first
+#define IPC_E_TIMEOUT           (-5)    // No reply within the timeout
+#define IPC_E_NOMEMORY          (-6)
+#define IPC_E_EXISTS            (-7)    // The section already has a listener
+
+// Longest section name, in bytes of UTF-8 with the terminating null.
+#define IPC_MAX_NAME            260
+
+#pragma endregion
+
+
+#pragma region Functions
+
+// Map the section of the server and open a session in it. pszName is the
+// name of the section in UTF-8: a file mapping name on Windows, a POSIX
+// shared memory object name elsewhere; NULL selects the section of the
+// service. On success *ppChannel receives the channel, which the caller
+// closes with ipc_close.
+IPC_API int IPC_CALL ipc_open(const char *pszName, ipc_channel **ppChannel);
+
+// Queue one request for the server. Fails with IPC_E_BUSY rather than
+// waiting when the server has granted no credits for it.
+IPC_API int IPC_CALL ipc_send(ipc_channel *pChannel, const void *pData,
+    size_t cbData);
+
+// Queue several requests, publish them to the server together and wake it
+// once for all of them. The requests are queued in order up to the first
+// that cannot be: *pcSent receives the number queued, and the result tells
+// why the next one was not (IPC_E_BUSY when the credits ran out), or is
+// IPC_OK if all were.
+IPC_API int IPC_CALL ipc_send_batch(ipc_channel *pChannel,
+    const ipc_iovec *pMessages, size_t cMessages, size_t *pcSent);
+
+// Wait up to dwTimeout milliseconds for the next reply and copy it into
+// the buffer; a reply larger than the buffer is truncated. *pcbData
+// receives the number of bytes copied.
+IPC_API int IPC_CALL ipc_recv(ipc_channel *pChannel, void *pBuffer,
+    size_t cbBuffer, size_t *pcbData, uint32_t dwTimeout);
+
+// Wait up to dwTimeout milliseconds for the next reply, then take the
+// replies already queued behind it, up to cBuffers in all, and free their
+// slots together. *pcReceived receives the number of buffers filled, in
+// the order the replies came.
+IPC_API int IPC_CALL ipc_recv_batch(ipc_channel *pChannel,
+    ipc_buffer *pBuffers, size_t cBuffers, size_t *pcReceived,
+    uint32_t dwTimeout);
+
+// Close the session and free the channel. NULL is ignored.
+IPC_API void IPC_CALL ipc_close(ipc_channel *pChannel);
+
+// Produce the reply to one request of a channel, at most cbReply bytes,
+// and return its size. iChannel numbers the channels of the listener.
+// Called on the threads of the clients, so by several threads at once, but
+// for one channel by one thread at a time. The same as the pfnHandle of a
+// plugin of the service (see IpcPlugin.h).
+typedef size_t (IPC_CALL *PFN_IPC_HANDLER)(void *pContext, uint32_t iChannel,
+    const void *pRequest, size_t cbRequest, void *pReply, size_t cbReply);
+
+// Register a server in the process for the section pszName (NULL for the
+// one of the service): channels opened on it afterwards call pfnHandler
+// directly instead of going through the section. Channels already open
+// are not affected. Fails with IPC_E_EXISTS if the section has a listener.
+IPC_API int IPC_CALL ipc_listen(const char *pszName,
+    PFN_IPC_HANDLER pfnHandler, void *pContext, ipc_listener **ppListener);
+
+// Remove the listener once no call of its handler is running. The channels
+// opened on it fail with IPC_E_NOTCONNECTED from then on. NULL is ignored.
+IPC_API void IPC_CALL ipc_unlisten(ipc_listener *pListener);
+
+// Receives one phase of the startup of the library once the phase has
+// ended. start and end are ticks of QueryPerformanceCounter on Windows and
+// nanoseconds of CLOCK_MONOTONIC elsewhere, the clock of IpcTimestamp in
+// IpcChannel.h. pszPhase is valid during the call only.
+typedef void (IPC_CALL *PFN_IPC_TRACE)(void *pContext, const char *pszPhase,
+    uint64_t start, uint64_t end);
+
+// Set the trace hook, or remove it with NULL. The hook receives at once
+// "Initialization", the run of DllMain on Windows and of the static
+// constructors of the shared object elsewhere. After that it receives
+// "OpenSession" for every session the library opens, from mapping the
+// section to the server accepting the session; elsewhere "shm_open" and
+// "mmap" come first, the phases within it. On Windows the first
+// ReadMappedMessage or WriteMappedMessage reports "OpenFileMapping" and
+// "MapViewOfFile" for the views it maps. The hook is called on the thread
+// that opens the session; set and remove it while no other thread opens
+// one.
+IPC_API void IPC_CALL ipc_set_trace(PFN_IPC_TRACE pfnTrace, void *pContext);
+
+// Types of the functions, for hosts that look them up at run time with
+// GetProcAddress or dlsym.
+typedef int (IPC_CALL *PFN_IPC_OPEN)(const char *, ipc_channel **);
+typedef int (IPC_CALL *PFN_IPC_SEND)(ipc_channel *, const void *, size_t);
+typedef int (IPC_CALL *PFN_IPC_SEND_BATCH)(ipc_channel *, const ipc_iovec *,
+    size_t, size_t *);
+typedef int (IPC_CALL *PFN_IPC_RECV)(ipc_channel *, void *, size_t, size_t *,
+    uint32_t);
+typedef int (IPC_CALL *PFN_IPC_RECV_BATCH)(ipc_channel *, ipc_buffer *,
+    size_t, size_t *, uint32_t);
+typedef void (IPC_CALL *PFN_IPC_CLOSE)(ipc_channel *);
+typedef int (IPC_CALL *PFN_IPC_LISTEN)(const char *, PFN_IPC_HANDLER, void *,
+    ipc_listener **);
+typedef void (IPC_CALL *PFN_IPC_UNLISTEN)(ipc_listener *);
+typedef void (IPC_CALL *PFN_IPC_SET_TRACE)(PFN_IPC_TRACE, void *);
+
+#pragma endregion
+
+
+#ifdef __cplusplus
+}
+#endif
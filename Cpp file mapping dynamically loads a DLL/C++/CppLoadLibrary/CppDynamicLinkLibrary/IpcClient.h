@@ -0,0 +1,155 @@
+/****************************** Module Header ******************************\
+* Module Name:  IpcClient.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares CIpcClient, which holds one session with the server over the
+* shared section (see IpcChannel.h) and keeps it across restarts of the
+* server. The client moves between two states:
+* 
+*     disconnected  no view of the section is mapped. EnsureConnected opens
+*                   the section, opens a session and waits for the server
+*                   to accept it; if any step fails, the next attempt is
+*                   made after a delay that doubles from
+*                   IPC_RECONNECT_MIN_DELAY up to IPC_RECONNECT_MAX_DELAY.
+*     connected     requests and replies flow through the session rings.
+*                   The client watches the process of the server and the
+*                   generation of the section; when the server exits or a
+*                   new one takes the section over, the client unmaps its
+*                   stale view and is disconnected again. The same happens
+*                   when the server closes a session that stayed idle, or
+*                   moves its clients to a resized section.
+* 
+* The first attempt after a lost connection is made at once, so a server
+* that is restarted quickly is found again within milliseconds.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include "IpcChannel.h"
+
+// Bounds, in milliseconds, of the delay between two connection attempts.
+#define IPC_RECONNECT_MIN_DELAY 1
+#define IPC_RECONNECT_MAX_DELAY 1000
+
+// Time, in milliseconds, the server has to accept a new session.
+#define IPC_ACCEPT_TIMEOUT      1000
+
+// Number of times a waiting client polls the reply ring before it sleeps.
+#define IPC_CLIENT_SPIN_COUNT   64
+
+// Interval, in milliseconds, at which a waiting client that cannot watch
+// the server process checks the generation of the section.
+#define IPC_SERVER_CHECK_INTERVAL 100
+
+
+class CIpcClient
+{
+public:
+
+    // The client starts disconnected; nothing is opened until the first
+    // call to EnsureConnected.
+    explicit CIpcClient(PCWSTR pszMapName);
+
+    // Close the session and unmap the section.
+    ~CIpcClient(void);
+
+    // Connect to the server if the client is disconnected and the delay
+    // since the last failed attempt has elapsed. Returns true if the client
+    // is connected when the function returns.
+    bool EnsureConnected(void);
+
+    // Close the session and unmap the section. The next attempt to connect
+    // is made at once.
+    void Disconnect(void);
+
+    bool IsConnected(void) const { return m_iSession >= 0; }
+
+    // Check that the server which accepted the session still serves the
+    // section and the session. Disconnects and returns false if it has
+    // exited, has been replaced or has closed the session.
+    bool CheckServer(void);
+
+    // Queue a request for the server. Returns false if the client is not
+    // connected (ERROR_NOT_CONNECTED), the message does not fit into a slot
+    // (ERROR_INSUFFICIENT_BUFFER) or the server has granted no credits for
+    // it (ERROR_BUSY).
+    bool Send(const void *pData, size_t cbData);
+
+    // Wait up to dwTimeout milliseconds for a reply and copy it into the
+    // buffer. Returns false on timeout, or if the server is lost while
+    // waiting, in which case the client is disconnected.
+    bool Receive(void *pBuffer, size_t cbBuffer, size_t *pcbData,
+        DWORD dwTimeout);
+
+    // Milliseconds until the next connection attempt is due; 0 if the
+    // client is connected or the attempt is due now.
+    DWORD GetRetryDelay(void) const;
+
+    // Handle of the server process, signaled when the server exits; NULL
+    // if the client is disconnected or may not open the server process.
+    HANDLE GetServerProcess(void) const { return m_hServerProcess; }
+
+    // The greeting the server left at the start of the section, or NULL if
+    // the client is disconnected.
+    PCWSTR GetGreeting(void) const { return (PCWSTR)m_pView; }
+
+    // Generation of the section when the session was opened.
+    uint32_t GetGeneration(void) const { return m_generation; }
+
+    // Number of times the client has connected.
+    unsigned long GetConnectCount(void) const { return m_cConnects; }
+
+    // Replies the client lets the server queue: it reads them as they come,
+    // so the whole ring.
+    uint32_t GetReplyWindow(void) const { return m_geometry.cSlots; }
+
+    // The section, the session, the doorbell of its shard and the event
+    // the server sets for the replies of the session, for callers that
+    // drive the session rings themselves (see CAsyncChannel). Only valid
+    // while the client is connected.
+    IPC_SECTION_HEADER *GetHeader(void) const { return m_pHeader; }
+    int GetSession(void) const { return m_iSession; }
+    HANDLE GetDoorbell(void) const { return m_hDoorbell; }
+    HANDLE GetReplyEvent(void) const { return m_hReplyEvent; }
+
+private:
+
+    CIpcClient(const CIpcClient &);
+    CIpcClient &operator=(const CIpcClient &);
+
+    DWORD Connect(void);
+    DWORD OpenSection(PCWSTR pszMapName);
+    bool WaitForAccept(void);
+    bool IsServerLost(void) const;
+    bool IsSessionClosed(void) const;
+    void RingDoorbell(void);
+    void Close(void);
+
+    PCWSTR m_pszMapName;
+
+    HANDLE m_hMapFile;
+    PVOID m_pView;
+    IPC_SECTION_HEADER *m_pHeader;
+    IPC_GEOMETRY m_geometry;
+    uint32_t m_generation;
+    int m_iSession;
+    uint32_t m_iShard;
+
+    HANDLE m_hServerProcess;
+    HANDLE m_hDoorbell;
+    HANDLE m_hReplyEvent;
+
+    DWORD m_dwBackoff;
+    ULONGLONG m_ullNextAttempt;
+    unsigned long m_cConnects;
+};
@@ -0,0 +1,299 @@
+/****************************** Module Header ******************************\
+Module Name:  IpcClientObject.cpp
+Project:      CppDynamicLinkLibrary
+Copyright (c) Microsoft Corporation.
+
+Implements the client objects of IpcClientObject.h over the channels of the
+C interface, and the pool that keeps the released ones for reuse.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#include "IpcClientObject.h"
+#include <string.h>
+#include <memory>
+#include <mutex>
+#include <new>
+
+// Released clients the pool keeps, over all sections.
+#define IPC_CLIENT_POOL         16
+
+// Size the scratch arena of a new client starts at, enough for any reply
+// of a section of the default geometry.
+#define IPC_CLIENT_SCRATCH      4096
+
+
+class CPooledClient final : public IIpcClient
+{
+public:
+
+    CPooledClient(void);
+
+    // Close the channel, dropping the replies still on their way.
+    ~CPooledClient(void);
+
+    // Open the channel and allocate the arena. Returns an IPC_ result.
+    int Open(const char *pszName);
+
+    // Whether the client may go back to the pool: its channel works and
+    // no reply of it is still due, which would otherwise reach the next
+    // owner of the client.
+    bool IsReusable(void) const;
+
+    const char *GetName(void) const
+    {
+        return m_szName;
+    }
+
+    // IIpcClient
+    int IPC_CALL Send(const void *pData, size_t cbData);
+    int IPC_CALL SendBatch(const ipc_iovec *pMessages, size_t cMessages,
+        size_t *pcSent);
+    int IPC_CALL Receive(void *pBuffer, size_t cbBuffer, size_t *pcbData,
+        uint32_t dwTimeout);
+    int IPC_CALL ReceiveBatch(ipc_buffer *pBuffers, size_t cBuffers,
+        size_t *pcReceived, uint32_t dwTimeout);
+    int IPC_CALL Call(const void *pRequest, size_t cbRequest,
+        const void **ppReply, size_t *pcbReply, uint32_t dwTimeout);
+    void *IPC_CALL GetScratch(size_t cb);
+    void IPC_CALL Release(void);
+
+    // Link of the pool; guarded by g_poolLock.
+    CPooledClient *m_pNext;
+
+private:
+
+    CPooledClient(const CPooledClient &);
+    CPooledClient &operator=(const CPooledClient &);
+
+    // Count the requests whose replies are due, and remember a channel
+    // that stopped working.
+    int Account(int result, size_t cSent, size_t cReceived);
+
+    char m_szName[IPC_MAX_NAME];    // "" for the section of the service
+    ipc_channel *m_pChannel;
+    std::unique_ptr<unsigned char[]> m_pScratch;
+    size_t m_cbScratch;
+    size_t m_cDue;
+    bool m_fBroken;
+};
+
+
+// The released clients, most recently released first.
+static std::mutex g_poolLock;
+static CPooledClient *g_pPool = NULL;
+static unsigned int g_cPooled = 0;
+
+
+CPooledClient::CPooledClient(void) :
+    m_pNext(NULL),
+    m_pChannel(NULL),
+    m_cbScratch(0),
+    m_cDue(0),
+    m_fBroken(false)
+{
+    m_szName[0] = '\0';
+}
+
+
+CPooledClient::~CPooledClient(void)
+{
+    ipc_close(m_pChannel);
+}
+
+
+int CPooledClient::Open(const char *pszName)
+{
+    if (pszName != NULL)
+    {
+        if (strlen(pszName) >= IPC_MAX_NAME)
+        {
+            return IPC_E_INVALIDARG;
+        }
+        strcpy(m_szName, pszName);
+    }
+
+    m_pScratch.reset(new (std::nothrow) unsigned char[IPC_CLIENT_SCRATCH]);
+    if (!m_pScratch)
+    {
+        return IPC_E_NOMEMORY;
+    }
+    m_cbScratch = IPC_CLIENT_SCRATCH;
+    return ipc_open(pszName, &m_pChannel);
+}
+
+
+bool CPooledClient::IsReusable(void) const
+{
+    return m_cDue == 0 && !m_fBroken;
+}
+
+
+int CPooledClient::Account(int result, size_t cSent, size_t cReceived)
+{
+    m_cDue += cSent;
+    m_cDue -= (cReceived < m_cDue) ? cReceived : m_cDue;
+    if (result == IPC_E_NOTCONNECTED)
+    {
+        m_fBroken = true;
+    }
+    return result;
+}
+
+
+int IPC_CALL CPooledClient::Send(const void *pData, size_t cbData)
+{
+    int result = ipc_send(m_pChannel, pData, cbData);
+    return Account(result, (result == IPC_OK) ? 1 : 0, 0);
+}
+
+
+int IPC_CALL CPooledClient::SendBatch(const ipc_iovec *pMessages,
+                                      size_t cMessages, size_t *pcSent)
+{
+    size_t cSent = 0;
+    int result = ipc_send_batch(m_pChannel, pMessages, cMessages, &cSent);
+    if (pcSent != NULL)
+    {
+        *pcSent = cSent;
+    }
+    return Account(result, cSent, 0);
+}
+
+
+int IPC_CALL CPooledClient::Receive(void *pBuffer, size_t cbBuffer,
+                                    size_t *pcbData, uint32_t dwTimeout)
+{
+    int result = ipc_recv(m_pChannel, pBuffer, cbBuffer, pcbData, dwTimeout);
+    return Account(result, 0, (result == IPC_OK) ? 1 : 0);
+}
+
+
+int IPC_CALL CPooledClient::ReceiveBatch(ipc_buffer *pBuffers,
+                                         size_t cBuffers, size_t *pcReceived,
+                                         uint32_t dwTimeout)
+{
+    size_t cReceived = 0;
+    int result = ipc_recv_batch(m_pChannel, pBuffers, cBuffers, &cReceived,
+        dwTimeout);
+    if (pcReceived != NULL)
+    {
+        *pcReceived = cReceived;
+    }
+    return Account(result, 0, cReceived);
+}
+
+
+int IPC_CALL CPooledClient::Call(const void *pRequest, size_t cbRequest,
+                                 const void **ppReply, size_t *pcbReply,
+                                 uint32_t dwTimeout)
+{
+    if (ppReply == NULL || pcbReply == NULL)
+    {
+        return IPC_E_INVALIDARG;
+    }
+    *ppReply = NULL;
+    *pcbReply = 0;
+
+    int result = Send(pRequest, cbRequest);
+    if (result == IPC_OK)
+    {
+        result = Receive(m_pScratch.get(), m_cbScratch, pcbReply, dwTimeout);
+    }
+    if (result == IPC_OK)
+    {
+        *ppReply = m_pScratch.get();
+    }
+    return result;
+}
+
+
+void *IPC_CALL CPooledClient::GetScratch(size_t cb)
+{
+    if (cb > m_cbScratch)
+    {
+        size_t cbNew = (cb > 2 * m_cbScratch) ? cb : 2 * m_cbScratch;
+        unsigned char *pScratch = new (std::nothrow) unsigned char[cbNew];
+        if (pScratch == NULL)
+        {
+            return NULL;
+        }
+        m_pScratch.reset(pScratch);
+        m_cbScratch = cbNew;
+    }
+    return m_pScratch.get();
+}
+
+
+// Put the client in the pool if it is reusable and the pool has room, and
+// destroy it otherwise.
+void IPC_CALL CPooledClient::Release(void)
+{
+    if (IsReusable())
+    {
+        std::lock_guard<std::mutex> lock(g_poolLock);
+        if (g_cPooled < IPC_CLIENT_POOL)
+        {
+            m_pNext = g_pPool;
+            g_pPool = this;
+            g_cPooled++;
+            return;
+        }
+    }
+    delete this;
+}
+
+
+// Take the most recently released client of the section from the pool.
+static CPooledClient *TakePooledClient(const char *pszName)
+{
+    std::lock_guard<std::mutex> lock(g_poolLock);
+    for (CPooledClient **ppLink = &g_pPool; *ppLink != NULL;
+        ppLink = &(*ppLink)->m_pNext)
+    {
+        CPooledClient *pClient = *ppLink;
+        if (strcmp(pClient->GetName(), pszName) == 0)
+        {
+            *ppLink = pClient->m_pNext;
+            g_cPooled--;
+            return pClient;
+        }
+    }
+    return NULL;
+}
+
+
+IPC_API int IPC_CALL ipc_create_client(const char *pszName,
+                                       IIpcClient **ppClient)
+{
+    if (ppClient == NULL)
+    {
+        return IPC_E_INVALIDARG;
+    }
+
+    *ppClient = TakePooledClient((pszName != NULL) ? pszName : "");
+    if (*ppClient != NULL)
+    {
+        return IPC_OK;
+    }
+
+    CPooledClient *pClient = new (std::nothrow) CPooledClient;
+    if (pClient == NULL)
+    {
+        return IPC_E_NOMEMORY;
+    }
+    int result = pClient->Open(pszName);
+    if (result != IPC_OK)
+    {
+        delete pClient;
+        return result;
+    }
+    *ppClient = pClient;
+    return IPC_OK;
+}
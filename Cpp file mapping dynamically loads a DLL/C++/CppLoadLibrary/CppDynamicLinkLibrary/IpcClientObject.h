@@ -0,0 +1,167 @@
+/****************************** Module Header ******************************\
+Module Name:  IpcClientObject.h
+Project:      CppDynamicLinkLibrary
+Copyright (c) Microsoft Corporation.
+
+The C++ face of the channel of the service (see IpcApi.h): IIpcClient, a
+client object that owns a channel, and so a reference to the mapped
+section and its session, together with a scratch arena that holds its
+replies, and CIpcClientHandle, the move-only owner a host keeps it in:
+
+    IIpcClient *pClient;
+    if (ipc_create_client(NULL, &pClient) == IPC_OK)
+    {
+        CIpcClientHandle client(pClient);
+        const void *pReply;
+        size_t cbReply;
+        client->Call("ping", 4, &pReply, &cbReply, 1000);
+    }                                   // Back to the pool of the library
+
+Exporting a class with __declspec(dllexport), as CSimpleObject would have
+been, ties the host to the compiler, the runtime and the layout of the
+class the library was built with. IIpcClient is an abstract interface
+instead, with the calling convention spelled out and C types only, whose
+virtual table is laid out the same way by every compiler of the platform.
+The library creates the object in ipc_create_client and the host gives it
+back with Release, never with delete, so the object is allocated and freed
+by the same heap.
+
+A released client goes back to a pool in the library with its channel and
+its arena, provided no request of it is still waiting for a reply, and the
+next ipc_create_client on the same section takes it from there. A host
+that creates a client, sends and destroys it in a loop therefore opens the
+channel and allocates the arena once; after that a cycle makes no system
+call and no allocation.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include "IpcApi.h"
+
+
+// A client of the section. Used by one thread at a time, like a channel.
+struct IIpcClient
+{
+    // ipc_send, ipc_send_batch, ipc_recv and ipc_recv_batch on the channel
+    // of the client.
+    virtual int IPC_CALL Send(const void *pData, size_t cbData) = 0;
+    virtual int IPC_CALL SendBatch(const ipc_iovec *pMessages,
+        size_t cMessages, size_t *pcSent) = 0;
+    virtual int IPC_CALL Receive(void *pBuffer, size_t cbBuffer,
+        size_t *pcbData, uint32_t dwTimeout) = 0;
+    virtual int IPC_CALL ReceiveBatch(ipc_buffer *pBuffers, size_t cBuffers,
+        size_t *pcReceived, uint32_t dwTimeout) = 0;
+
+    // Send one request and wait up to dwTimeout milliseconds for the next
+    // reply, which lands in the scratch arena: *ppReply stays valid until
+    // the next call of Call or GetScratch, or Release.
+    virtual int IPC_CALL Call(const void *pRequest, size_t cbRequest,
+        const void **ppReply, size_t *pcbReply, uint32_t dwTimeout) = 0;
+
+    // The scratch arena, grown to at least cb bytes; its content is lost
+    // when it grows. Returns NULL if it cannot grow.
+    virtual void *IPC_CALL GetScratch(size_t cb) = 0;
+
+    // Give the client back to the library. The object must not be used
+    // afterwards.
+    virtual void IPC_CALL Release(void) = 0;
+
+protected:
+
+    // Only Release destroys a client.
+    ~IIpcClient(void) {}
+};
+
+
+// Create a client of the section pszName (NULL for the one of the
+// service), from the pool if it holds one of the section, and open its
+// channel otherwise. On success *ppClient receives the client, which the
+// caller releases with Release.
+extern "C" IPC_API int IPC_CALL ipc_create_client(const char *pszName,
+    IIpcClient **ppClient);
+
+typedef int (IPC_CALL *PFN_IPC_CREATE_CLIENT)(const char *, IIpcClient **);
+
+
+// Owns a client and releases it when it goes out of scope. It can be moved
+// but not copied, so exactly one handle owns a client at a time.
+class CIpcClientHandle
+{
+public:
+
+    CIpcClientHandle(void) : m_pClient(NULL)
+    {
+    }
+
+    explicit CIpcClientHandle(IIpcClient *pClient) : m_pClient(pClient)
+    {
+    }
+
+    CIpcClientHandle(CIpcClientHandle &&other) : m_pClient(other.m_pClient)
+    {
+        other.m_pClient = NULL;
+    }
+
+    CIpcClientHandle &operator=(CIpcClientHandle &&other)
+    {
+        if (this != &other)
+        {
+            Reset(other.m_pClient);
+            other.m_pClient = NULL;
+        }
+        return *this;
+    }
+
+    ~CIpcClientHandle(void)
+    {
+        Reset(NULL);
+    }
+
+    // Release the client owned, if any, and own pClient instead.
+    void Reset(IIpcClient *pClient)
+    {
+        if (m_pClient != NULL)
+        {
+            m_pClient->Release();
+        }
+        m_pClient = pClient;
+    }
+
+    // Stop owning the client and return it.
+    IIpcClient *Detach(void)
+    {
+        IIpcClient *pClient = m_pClient;
+        m_pClient = NULL;
+        return pClient;
+    }
+
+    IIpcClient *Get(void) const
+    {
+        return m_pClient;
+    }
+
+    IIpcClient *operator->(void) const
+    {
+        return m_pClient;
+    }
+
+    explicit operator bool(void) const
+    {
+        return m_pClient != NULL;
+    }
+
+private:
+
+    CIpcClientHandle(const CIpcClientHandle &);
+    CIpcClientHandle &operator=(const CIpcClientHandle &);
+
+    IIpcClient *m_pClient;
+};
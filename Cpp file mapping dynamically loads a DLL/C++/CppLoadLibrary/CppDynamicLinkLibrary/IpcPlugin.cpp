@@ -0,0 +1,81 @@
+/****************************** Module Header ******************************\
+Module Name:  IpcPlugin.cpp
+Project:      CppDynamicLinkLibrary
+Copyright (c) Microsoft Corporation.
+
+Makes the library a message-handler plugin of the service (see
+IpcPlugin.h) as well: when the Plugin value of the configuration of the
+service names this DLL, the service answers every request with its
+upper-cased copy instead of echoing it. The handler keeps no state, so it
+needs neither Attach nor Detach.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#include "IpcPlugin.h"
+
+#ifdef _WIN32
+#define IPC_PLUGIN_EXPORT
+#else
+#define IPC_PLUGIN_EXPORT       __attribute__((visibility("default")))
+#endif
+
+// Version of the handler, reported in the event log of the service.
+#define PLUGIN_VERSION          1
+
+
+//
+//   FUNCTION: HandleRequest(void *, uint32_t, const void *, size_t, void *,
+//   size_t)
+//
+//   PURPOSE: Copy the request into the reply, upper-casing ASCII letters.
+//   Every byte of the request is read once, as the interface requires.
+//
+static size_t IPC_PLUGIN_CALL HandleRequest(void *pContext, uint32_t iSession,
+    const void *pRequest, size_t cbRequest, void *pReply, size_t cbReply)
+{
+    (void)pContext;
+    (void)iSession;
+
+    const unsigned char *pIn = static_cast<const unsigned char *>(pRequest);
+    unsigned char *pOut = static_cast<unsigned char *>(pReply);
+    size_t cb = (cbRequest < cbReply) ? cbRequest : cbReply;
+    for (size_t i = 0; i < cb; i++)
+    {
+        unsigned char ch = pIn[i];
+        pOut[i] = (ch >= 'a' && ch <= 'z') ?
+            (unsigned char)(ch - 'a' + 'A') : ch;
+    }
+    return cb;
+}
+
+
+static const IPC_PLUGIN_TABLE g_table =
+{
+    sizeof(IPC_PLUGIN_TABLE),
+    IPC_PLUGIN_ABI_VERSION,
+    "CppDynamicLinkLibrary",
+    PLUGIN_VERSION,
+    NULL,
+    NULL,
+    HandleRequest
+};
+
+
+//
+//   FUNCTION: IpcGetPlugin(uint32_t)
+//
+//   PURPOSE: The factory of the plugin (PFN_IPC_GET_PLUGIN). Exported by 
+//   name through the DEF file on Windows.
+//
+extern "C" IPC_PLUGIN_EXPORT const IPC_PLUGIN_TABLE *IPC_PLUGIN_CALL
+IpcGetPlugin(uint32_t abiVersion)
+{
+    return (abiVersion >= IPC_PLUGIN_ABI_VERSION) ? &g_table : NULL;
+}
@@ -0,0 +1,98 @@
+/****************************** Module Header ******************************\
+* Module Name:  IpcPlugin.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* The interface between the service and a message-handler plugin: a DLL
+* that answers the requests of the sessions in place of the built-in echo.
+* The plugin exports a single function, IpcGetPlugin, which returns a
+* table of everything else the service calls:
+* 
+*     static size_t IPC_PLUGIN_CALL Handle(void *pContext, uint32_t iSession,
+*         const void *pRequest, size_t cbRequest, void *pReply,
+*         size_t cbReply);
+* 
+*     static const IPC_PLUGIN_TABLE g_table =
+*     {
+*         sizeof(IPC_PLUGIN_TABLE), IPC_PLUGIN_ABI_VERSION,
+*         "Sample", 1, NULL, NULL, Handle
+*     };
+* 
+*     extern "C" const IPC_PLUGIN_TABLE *IPC_PLUGIN_CALL IpcGetPlugin(
+*         uint32_t abiVersion)
+*     {
+*         return (abiVersion >= IPC_PLUGIN_ABI_VERSION) ? &g_table : NULL;
+*     }
+* 
+* The service looks the factory up once, when it loads the plugin, and
+* calls through the table from then on. The table is versioned: AbiVersion
+* changes when the meaning of a member does, and later versions of the
+* same AbiVersion only append members, which the service uses when cbSize
+* says the plugin has them. The interface is plain C, so a plugin does not
+* have to be built with the compiler of the service.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define IPC_PLUGIN_CALL __stdcall
+#else
+#define IPC_PLUGIN_CALL
+#endif
+
+// Version of the table the service understands.
+#define IPC_PLUGIN_ABI_VERSION  1
+
+// Name under which a plugin exports its factory (PFN_IPC_GET_PLUGIN).
+#define IPC_PLUGIN_FACTORY      "IpcGetPlugin"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+typedef struct IPC_PLUGIN_TABLE
+{
+    uint32_t cbSize;                // sizeof(IPC_PLUGIN_TABLE) of the plugin
+    uint32_t AbiVersion;            // IPC_PLUGIN_ABI_VERSION of the plugin
+    const char *pszName;            // For the event log
+    uint32_t PluginVersion;         // For the event log
+
+    // Optional. Attach is called once when the plugin is loaded and
+    // returns the context passed to every other call; Detach is called
+    // once no call of the plugin is running any more, before the DLL is
+    // unloaded.
+    void *(IPC_PLUGIN_CALL *pfnAttach)(void);
+    void (IPC_PLUGIN_CALL *pfnDetach)(void *pContext);
+
+    // Produce the reply to one request of a session, at most cbReply
+    // bytes, and return its size. Called by many threads at once, but for
+    // one session by one thread at a time and in the order of its
+    // requests. The request lies in memory the client may rewrite, so the
+    // plugin must read every field of it once.
+    size_t (IPC_PLUGIN_CALL *pfnHandle)(void *pContext, uint32_t iSession,
+        const void *pRequest, size_t cbRequest, void *pReply,
+        size_t cbReply);
+} IPC_PLUGIN_TABLE;
+
+// The factory. Returns the table of the plugin for a service that
+// understands versions up to abiVersion, or NULL if the plugin cannot
+// serve it. The table must stay valid until the DLL is unloaded.
+typedef const IPC_PLUGIN_TABLE *(IPC_PLUGIN_CALL *PFN_IPC_GET_PLUGIN)(
+    uint32_t abiVersion);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,31 @@
+/****************************** Module Header ******************************\
+Module Name:  LibraryPin.h
+Project:      CppDynamicLinkLibrary
+Copyright (c) Microsoft Corporation.
+
+Declares PinLibrary, which keeps the library loaded until the process
+exits. The channels of the library are process-wide state that is costly
+to build: the views of the sections, the sessions the server accepted. A
+host that loads the library, talks to the service and frees it again and
+again would build them on every load. Pinned, the library stays in the
+process after the host frees it, LoadLibrary or dlopen of it again only
+counts one more reference, and the channels are found open.
+
+The library pins itself once it has opened a channel, never in DllMain.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+// Pin the library in the process: GetModuleHandleEx with
+// GET_MODULE_HANDLE_EX_FLAG_PIN on Windows, dlopen with RTLD_NODELETE
+// elsewhere. Returns false if it could not; the library is then unloaded
+// as usual and must release its channels when it is.
+bool PinLibrary(void);
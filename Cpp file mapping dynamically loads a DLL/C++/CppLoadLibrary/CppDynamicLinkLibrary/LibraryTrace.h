@@ -0,0 +1,32 @@
+/****************************** Module Header ******************************\
+Module Name:  LibraryTrace.h
+Project:      CppDynamicLinkLibrary
+Copyright (c) Microsoft Corporation.
+
+Declares the points at which the library reports the phases of its
+startup to the trace hook of the host (see ipc_set_trace in IpcApi.h): its
+own initialization, and the system calls that bring a channel up. A phase
+costs a call of IpcTimestamp and a look at the hook, so the points stay in
+release builds.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+// Report the phase pszPhase, which began at start, an IpcTimestamp(), and
+// ends now, to the trace hook if the host has set one.
+void TracePhase(const char *pszPhase, uint64_t start);
+
+// Remember the initialization of the library: DllMain on Windows, the
+// static constructors of the shared object elsewhere. It ends before the
+// host can set a hook, so ipc_set_trace reports it when it is called.
+void RecordInitialization(uint64_t start, uint64_t end);
@@ -0,0 +1,392 @@
+/****************************** Module Header ******************************\
+Module Name:  ApiBenchmark.cpp
+Project:      CppLoadLibrary
+Copyright (c) Microsoft Corporation.
+
+Implements the benchmarks of single against batched calls into the DLL, of
+loading and freeing it over and over, of the latency of a round trip
+across processes against one within the process, and of creating and
+releasing client objects.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "ApiBenchmark.h"
+#include "../CppDynamicLinkLibrary/IpcChannel.h"
+#pragma endregion
+
+
+//
+//   FUNCTION: RunPass(const IPC_FUNCTIONS &, ipc_channel *, unsigned int,
+//   unsigned int, double *)
+//
+//   PURPOSE: Echo cMessages requests, keeping up to BENCHMARK_WINDOW of
+//   them in flight. With a batch of 1 every request and every reply takes
+//   a call of its own; otherwise the requests go out cBatch per call and
+//   the replies come back as many per call as are waiting, up to cBatch.
+//
+//   RETURN VALUE: IPC_OK and the elapsed seconds in *pSeconds, or the
+//   result of the call that failed.
+//
+static int RunPass(const IPC_FUNCTIONS &functions, ipc_channel *pChannel,
+    unsigned int cMessages, unsigned int cBatch, double *pSeconds)
+{
+    static unsigned char requests[BENCHMARK_BATCH][BENCHMARK_MESSAGE_SIZE];
+    static unsigned char replies[BENCHMARK_BATCH][BENCHMARK_MESSAGE_SIZE];
+    ipc_iovec messages[BENCHMARK_BATCH];
+    ipc_buffer buffers[BENCHMARK_BATCH];
+    for (unsigned int i = 0; i < cBatch; i++)
+    {
+        memset(requests[i], 'a' + i % 26, sizeof(requests[i]));
+        messages[i].base = requests[i];
+        messages[i].len = sizeof(requests[i]);
+        buffers[i].base = replies[i];
+        buffers[i].size = sizeof(replies[i]);
+    }
+
+    unsigned int cSent = 0;
+    unsigned int cReceived = 0;
+    uint64_t start = IpcTimestamp();
+
+    while (cReceived < cMessages)
+    {
+        // Fill the window.
+        int result = IPC_OK;
+        while (result == IPC_OK && cSent < cMessages &&
+            cSent - cReceived < BENCHMARK_WINDOW)
+        {
+            unsigned int cWanted = cMessages - cSent;
+            if (cWanted > BENCHMARK_WINDOW - (cSent - cReceived))
+            {
+                cWanted = BENCHMARK_WINDOW - (cSent - cReceived);
+            }
+            if (cBatch == 1)
+            {
+                result = functions.pfnSend(pChannel, requests[0],
+                    sizeof(requests[0]));
+                cSent += (result == IPC_OK) ? 1 : 0;
+            }
+            else
+            {
+                size_t cQueued = 0;
+                result = functions.pfnSendBatch(pChannel, messages,
+                    (cWanted < cBatch) ? cWanted : cBatch, &cQueued);
+                cSent += (unsigned int)cQueued;
+            }
+        }
+        if (result != IPC_OK && result != IPC_E_BUSY)
+        {
+            return result;
+        }
+
+        // Take the replies that have come, at least one.
+        if (cBatch == 1)
+        {
+            size_t cbReply;
+            result = functions.pfnRecv(pChannel, replies[0],
+                sizeof(replies[0]), &cbReply, BENCHMARK_TIMEOUT);
+            cReceived += (result == IPC_OK) ? 1 : 0;
+        }
+        else
+        {
+            size_t cTaken = 0;
+            result = functions.pfnRecvBatch(pChannel, buffers, cBatch,
+                &cTaken, BENCHMARK_TIMEOUT);
+            cReceived += (unsigned int)cTaken;
+        }
+        if (result != IPC_OK)
+        {
+            return result;
+        }
+    }
+
+    *pSeconds = (double)(IpcTimestamp() - start) / IpcTimestampFrequency();
+    return IPC_OK;
+}
+
+
+bool RunApiBenchmark(const IPC_FUNCTIONS &functions, const char *pszName,
+                     unsigned int cMessages, unsigned int cBatch)
+{
+    if (cBatch < 1 || cBatch > BENCHMARK_BATCH)
+    {
+        cBatch = BENCHMARK_BATCH;
+    }
+
+    ipc_channel *pChannel = NULL;
+    int result = functions.pfnOpen(pszName, &pChannel);
+    if (result != IPC_OK)
+    {
+        printf("ipc_open failed w/err %d\n", result);
+        return false;
+    }
+
+    printf("Echo %u messages of %u bytes through the C interface\n",
+        cMessages, (unsigned int)BENCHMARK_MESSAGE_SIZE);
+
+    double seconds[2] = { 0, 0 };
+    unsigned int batches[2] = { 1, cBatch };
+    for (int i = 0; i < 2 && result == IPC_OK; i++)
+    {
+        result = RunPass(functions, pChannel, cMessages, batches[i],
+            &seconds[i]);
+        if (result == IPC_OK)
+        {
+            printf("%2u message(s) per call: %10.0f messages/s, "
+                "%7.3f us/message\n", batches[i], cMessages / seconds[i],
+                seconds[i] * 1e6 / cMessages);
+        }
+    }
+    functions.pfnClose(pChannel);
+
+    if (result != IPC_OK)
+    {
+        printf("The benchmark failed w/err %d\n", result);
+        return false;
+    }
+    printf("Batching is %.2fx as fast\n", seconds[0] / seconds[1]);
+    return true;
+}
+
+
+//
+//   FUNCTION: RunCycle(PFN_LOAD_IPC_LIBRARY, PFN_FREE_IPC_LIBRARY,
+//   const char *)
+//
+//   PURPOSE: Load the library, echo one request through a channel of its
+//   own and free the library again.
+//
+//   RETURN VALUE: IPC_OK, or the result of the call that failed.
+//
+static int RunCycle(PFN_LOAD_IPC_LIBRARY pfnLoad, PFN_FREE_IPC_LIBRARY pfnFree,
+    const char *pszName)
+{
+    IPC_FUNCTIONS functions;
+    void *hModule = pfnLoad(&functions);
+    if (hModule == NULL)
+    {
+        return IPC_E_NOTCONNECTED;
+    }
+
+    ipc_channel *pChannel = NULL;
+    int result = functions.pfnOpen(pszName, &pChannel);
+    if (result == IPC_OK)
+    {
+        unsigned char request[BENCHMARK_MESSAGE_SIZE] = { 0 };
+        unsigned char reply[BENCHMARK_MESSAGE_SIZE];
+        size_t cbReply;
+        result = functions.pfnSend(pChannel, request, sizeof(request));
+        if (result == IPC_OK)
+        {
+            result = functions.pfnRecv(pChannel, reply, sizeof(reply),
+                &cbReply, BENCHMARK_TIMEOUT);
+        }
+        functions.pfnClose(pChannel);
+    }
+
+    pfnFree(hModule);
+    return result;
+}
+
+
+bool RunChurnBenchmark(PFN_LOAD_IPC_LIBRARY pfnLoad,
+                       PFN_FREE_IPC_LIBRARY pfnFree, const char *pszName,
+                       unsigned int cCycles)
+{
+    if (cCycles < 2)
+    {
+        cCycles = 2;
+    }
+    printf("Load, open, echo, close and free the library %u times\n",
+        cCycles);
+
+    double first = 0;
+    double others = 0;
+    for (unsigned int i = 0; i < cCycles; i++)
+    {
+        uint64_t start = IpcTimestamp();
+        int result = RunCycle(pfnLoad, pfnFree, pszName);
+        double seconds = (double)(IpcTimestamp() - start) /
+            IpcTimestampFrequency();
+        if (result != IPC_OK)
+        {
+            printf("Cycle %u failed w/err %d\n", i, result);
+            return false;
+        }
+        if (i == 0)
+        {
+            first = seconds;
+        }
+        else
+        {
+            others += seconds;
+        }
+    }
+
+    others /= cCycles - 1;
+    printf("First cycle: %9.1f us, later cycles: %9.1f us on average, "
+        "%.0fx cheaper\n", first * 1e6, others * 1e6, first / others);
+    return true;
+}
+
+
+// The server of the local pass: echoes the request.
+static size_t IPC_CALL EchoHandler(void *, uint32_t,
+    const void *pRequest, size_t cbRequest, void *pReply, size_t cbReply)
+{
+    size_t cbCopy = (cbRequest < cbReply) ? cbRequest : cbReply;
+    memcpy(pReply, pRequest, cbCopy);
+    return cbCopy;
+}
+
+
+//
+//   FUNCTION: RunLatencyPass(const IPC_FUNCTIONS &, const char *,
+//   const char *, std::vector<uint64_t> &, double *)
+//
+//   PURPOSE: Open a channel on the section, time each round trip of a
+//   request with nothing else in flight and print the mean, median and
+//   99th percentile of the round trips.
+//
+//   RETURN VALUE: IPC_OK and the mean in seconds in *pMean, or the result
+//   of the call that failed.
+//
+static int RunLatencyPass(const IPC_FUNCTIONS &functions, const char *pszName,
+    const char *pszPass, std::vector<uint64_t> &times, double *pMean)
+{
+    ipc_channel *pChannel = NULL;
+    int result = functions.pfnOpen(pszName, &pChannel);
+    if (result != IPC_OK)
+    {
+        return result;
+    }
+
+    unsigned char request[BENCHMARK_MESSAGE_SIZE];
+    unsigned char reply[BENCHMARK_MESSAGE_SIZE];
+    memset(request, 'l', sizeof(request));
+    uint64_t total = 0;
+    for (size_t i = 0; i < times.size() && result == IPC_OK; i++)
+    {
+        size_t cbReply;
+        uint64_t start = IpcTimestamp();
+        result = functions.pfnSend(pChannel, request, sizeof(request));
+        if (result == IPC_OK)
+        {
+            result = functions.pfnRecv(pChannel, reply, sizeof(reply),
+                &cbReply, BENCHMARK_TIMEOUT);
+        }
+        times[i] = IpcTimestamp() - start;
+        total += times[i];
+    }
+    functions.pfnClose(pChannel);
+    if (result != IPC_OK)
+    {
+        return result;
+    }
+
+    std::sort(times.begin(), times.end());
+    double usPerTick = 1e6 / IpcTimestampFrequency();
+    *pMean = (double)total / times.size() / IpcTimestampFrequency();
+    printf("%-14s mean %8.3f us, median %8.3f us, p99 %8.3f us\n", pszPass,
+        *pMean * 1e6, times[times.size() / 2] * usPerTick,
+        times[times.size() * 99 / 100] * usPerTick);
+    return IPC_OK;
+}
+
+
+bool RunLatencyBenchmark(const IPC_FUNCTIONS &functions, const char *pszName,
+                         unsigned int cRoundTrips)
+{
+    if (cRoundTrips < 1)
+    {
+        cRoundTrips = 1;
+    }
+    printf("Time %u round trips of %u bytes, one at a time\n", cRoundTrips,
+        (unsigned int)BENCHMARK_MESSAGE_SIZE);
+
+    std::vector<uint64_t> times(cRoundTrips);
+    double seconds[2] = { 0, 0 };
+    int result = RunLatencyPass(functions, pszName, "Cross-process:",
+        times, &seconds[0]);
+    if (result == IPC_OK)
+    {
+        ipc_listener *pListener = NULL;
+        result = functions.pfnListen(pszName, EchoHandler, NULL, &pListener);
+        if (result == IPC_OK)
+        {
+            result = RunLatencyPass(functions, pszName, "In-process:",
+                times, &seconds[1]);
+            functions.pfnUnlisten(pListener);
+        }
+    }
+
+    if (result != IPC_OK)
+    {
+        printf("The benchmark failed w/err %d\n", result);
+        return false;
+    }
+    printf("The in-process channel is %.1fx as fast\n",
+        seconds[0] / seconds[1]);
+    return true;
+}
+
+
+bool RunClientBenchmark(const IPC_FUNCTIONS &functions, const char *pszName,
+                        unsigned int cCycles)
+{
+    if (cCycles < 2)
+    {
+        cCycles = 2;
+    }
+    printf("Create a client, call it and release it %u times\n", cCycles);
+
+    unsigned char request[BENCHMARK_MESSAGE_SIZE];
+    memset(request, 'c', sizeof(request));
+    double first = 0;
+    double others = 0;
+    for (unsigned int i = 0; i < cCycles; i++)
+    {
+        uint64_t start = IpcTimestamp();
+        IIpcClient *pClient = NULL;
+        int result = functions.pfnCreateClient(pszName, &pClient);
+        if (result == IPC_OK)
+        {
+            CIpcClientHandle client(pClient);
+            const void *pReply;
+            size_t cbReply;
+            result = client->Call(request, sizeof(request), &pReply, &cbReply,
+                BENCHMARK_TIMEOUT);
+        }
+        double seconds = (double)(IpcTimestamp() - start) /
+            IpcTimestampFrequency();
+        if (result != IPC_OK)
+        {
+            printf("Cycle %u failed w/err %d\n", i, result);
+            return false;
+        }
+        if (i == 0)
+        {
+            first = seconds;
+        }
+        else
+        {
+            others += seconds;
+        }
+    }
+
+    others /= cCycles - 1;
+    printf("First cycle: %9.1f us, later cycles: %9.3f us on average, "
+        "%.0fx cheaper\n", first * 1e6, others * 1e6, first / others);
+    return true;
+}
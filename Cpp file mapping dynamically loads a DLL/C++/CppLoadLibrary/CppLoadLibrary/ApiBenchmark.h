@@ -0,0 +1,108 @@
+/****************************** Module Header ******************************\
+Module Name:  ApiBenchmark.h
+Project:      CppLoadLibrary
+Copyright (c) Microsoft Corporation.
+
+Declares the benchmarks of the C interface of the DLL (see IpcApi.h), as
+a host sees it through the function pointers it looked up. Both hosts,
+CppLoadLibrary.cpp and CppLoadLibraryPosix.cpp, run them:
+
+    RunApiBenchmark     echoes the same requests once with one message per
+                        call (ipc_send, ipc_recv) and once with a batch of
+                        messages per call (ipc_send_batch, ipc_recv_batch),
+                        and prints the throughput of both.
+    RunChurnBenchmark   loads the library, opens a channel, echoes a
+                        request, closes the channel and frees the library,
+                        over and over, and prints what the first cycle
+                        cost against the others, which find the section
+                        mapped and the session open in the process.
+    RunLatencyBenchmark times single round trips through the section, then
+                        registers an echo server in the process with
+                        ipc_listen and times them again on the local
+                        channel ipc_open gives from then on.
+    RunClientBenchmark  creates a client object, makes one call and
+                        releases it, over and over, and prints what the
+                        first cycle cost against the others, which take
+                        the client from the pool of the library.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include "../CppDynamicLinkLibrary/IpcClientObject.h"
+
+// Requests echoed by each pass, and their size in bytes.
+#define BENCHMARK_MESSAGES      200000
+#define BENCHMARK_MESSAGE_SIZE  64
+
+// Messages per call of the batched pass, and the most requests either pass
+// leaves waiting for their replies; the window stays below the slots of a
+// ring so that the server never runs out of credits for the replies.
+#define BENCHMARK_BATCH         32
+#define BENCHMARK_WINDOW        32
+
+// Time, in milliseconds, a reply may take before the pass gives up.
+#define BENCHMARK_TIMEOUT       1000
+
+// Load, open, echo, close and free cycles of the churn benchmark.
+#define BENCHMARK_CYCLES        1000
+
+// Round trips each pass of the latency benchmark times.
+#define BENCHMARK_ROUND_TRIPS   100000
+
+
+// The functions of the C interface, as looked up by the host.
+struct IPC_FUNCTIONS
+{
+    PFN_IPC_OPEN pfnOpen;
+    PFN_IPC_SEND pfnSend;
+    PFN_IPC_SEND_BATCH pfnSendBatch;
+    PFN_IPC_RECV pfnRecv;
+    PFN_IPC_RECV_BATCH pfnRecvBatch;
+    PFN_IPC_CLOSE pfnClose;
+    PFN_IPC_LISTEN pfnListen;
+    PFN_IPC_UNLISTEN pfnUnlisten;
+    PFN_IPC_CREATE_CLIENT pfnCreateClient;
+};
+
+// Echo cMessages requests through a session of its own on the section
+// pszName (NULL for the one of the service), one message per call and then
+// cBatch per call, and print the messages per second of each pass. Returns
+// false if the session cannot be opened or a pass fails.
+bool RunApiBenchmark(const IPC_FUNCTIONS &functions, const char *pszName,
+    unsigned int cMessages = BENCHMARK_MESSAGES,
+    unsigned int cBatch = BENCHMARK_BATCH);
+
+// Load the library and look up its functions into *pFunctions, returning
+// the handle of the module or NULL; free the library again. Supplied by
+// the host, which knows where the library is.
+typedef void *(*PFN_LOAD_IPC_LIBRARY)(IPC_FUNCTIONS *pFunctions);
+typedef void (*PFN_FREE_IPC_LIBRARY)(void *hModule);
+
+// Run cCycles cycles of loading the library, opening a channel on the
+// section pszName, echoing one request, closing the channel and freeing
+// the library, and print the time of the first cycle and the mean time of
+// the others. Returns false if a cycle fails.
+bool RunChurnBenchmark(PFN_LOAD_IPC_LIBRARY pfnLoad,
+    PFN_FREE_IPC_LIBRARY pfnFree, const char *pszName,
+    unsigned int cCycles = BENCHMARK_CYCLES);
+
+// Time cRoundTrips requests sent and answered one at a time on the section
+// pszName, first through the server of the section and then through an
+// echo server registered in the process, and print the mean, median and
+// 99th percentile of both. Returns false if either pass fails.
+bool RunLatencyBenchmark(const IPC_FUNCTIONS &functions, const char *pszName,
+    unsigned int cRoundTrips = BENCHMARK_ROUND_TRIPS);
+
+// Run cCycles cycles of creating a client of the section pszName, calling
+// it once and releasing it, and print the time of the first cycle and the
+// mean time of the others. Returns false if a cycle fails.
+bool RunClientBenchmark(const IPC_FUNCTIONS &functions, const char *pszName,
+    unsigned int cCycles = BENCHMARK_CYCLES);
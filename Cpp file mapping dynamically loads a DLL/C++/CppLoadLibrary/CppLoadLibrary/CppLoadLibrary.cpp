@@ -12,6 +12,16 @@ and then retrieve the address of a function in the export table. Because
 we explicitly invoke these APIs, this kind of loading is also referred to 
 as explicit linking. 
 
+Once the DLL has opened a channel to the service it pins itself in the 
+process (see LibraryPin.h), so FreeLibrary no longer unloads it: the 
+program first loads and frees it over and over to show what that saves 
+(see RunChurnBenchmark), and the module is still loaded at the end.
+
+Run as "CppLoadLibrary /profile trace.json", the program instead brings the 
+client up once with every step timed (see StartupProfiler.h), from 
+IsModuleLoaded to the first reply, prints the breakdown and writes the 
+Chrome trace to the given file.
+
 This source is subject to the Microsoft Public License.
 See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
 All other rights reserved.
@@ -24,6 +34,9 @@ WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
 #pragma region Includes
 #include <stdio.h>
 #include <windows.h>
+#include "ApiBenchmark.h"
+#include "StartupProfiler.h"
+#include "../CppDynamicLinkLibrary/IpcChannel.h"
 #pragma endregion
 
 
@@ -43,6 +56,31 @@ typedef int     (CALLBACK* LPFNGETSTRINGLENGTH2)    (PCWSTR);
 typedef int     (CALLBACK* PFN_COMPARE)             (int, int);
 typedef int     (CALLBACK* LPFNMAX)                 (int, int, PFN_COMPARE);
 
+// The functions that read and write the file mapping of the service.
+typedef DWORD   (CALLBACK* LPFNREADMAPPEDMESSAGE)   (PWSTR, DWORD);
+typedef DWORD   (CALLBACK* LPFNWRITEMAPPEDMESSAGE)  (PCWSTR);
+
+// Unicode string message to be written to the mapped view.
+#define MESSAGE             L"Message from the client process."
+
+// The name of the module to be dynamically-loaded.
+#define MODULE_NAME         L"CppDynamicLinkLibrary"
+
+
+//
+//   FUNCTION: ElapsedMilliseconds(const LARGE_INTEGER &)
+//
+//   PURPOSE: The time elapsed since a QueryPerformanceCounter reading, in 
+//   milliseconds.
+//
+double ElapsedMilliseconds(const LARGE_INTEGER &start)
+{
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (now.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+}
+
 
 //
 //   FUNCTION: IsModuleLoaded(PCWSTR)
@@ -65,6 +103,174 @@ BOOL IsModuleLoaded(PCWSTR pszModuleName)
 }
 
 
+//
+//   FUNCTION: GetIpcFunctions(HMODULE, IPC_FUNCTIONS *)
+//
+//   PURPOSE: Look up the functions of the C interface of the DLL. Returns 
+//   FALSE if one of them cannot be found.
+//
+BOOL GetIpcFunctions(HMODULE hModule, IPC_FUNCTIONS *pFunctions)
+{
+    pFunctions->pfnOpen = (PFN_IPC_OPEN)GetProcAddress(hModule, "ipc_open");
+    pFunctions->pfnSend = (PFN_IPC_SEND)GetProcAddress(hModule, "ipc_send");
+    pFunctions->pfnSendBatch = (PFN_IPC_SEND_BATCH)
+        GetProcAddress(hModule, "ipc_send_batch");
+    pFunctions->pfnRecv = (PFN_IPC_RECV)GetProcAddress(hModule, "ipc_recv");
+    pFunctions->pfnRecvBatch = (PFN_IPC_RECV_BATCH)
+        GetProcAddress(hModule, "ipc_recv_batch");
+    pFunctions->pfnClose = (PFN_IPC_CLOSE)
+        GetProcAddress(hModule, "ipc_close");
+    pFunctions->pfnListen = (PFN_IPC_LISTEN)
+        GetProcAddress(hModule, "ipc_listen");
+    pFunctions->pfnUnlisten = (PFN_IPC_UNLISTEN)
+        GetProcAddress(hModule, "ipc_unlisten");
+    pFunctions->pfnCreateClient = (PFN_IPC_CREATE_CLIENT)
+        GetProcAddress(hModule, "ipc_create_client");
+    return pFunctions->pfnOpen != NULL && pFunctions->pfnSend != NULL && 
+        pFunctions->pfnSendBatch != NULL && pFunctions->pfnRecv != NULL && 
+        pFunctions->pfnRecvBatch != NULL && pFunctions->pfnClose != NULL && 
+        pFunctions->pfnListen != NULL && pFunctions->pfnUnlisten != NULL && 
+        pFunctions->pfnCreateClient != NULL;
+}
+
+
+// Load and free the DLL for RunChurnBenchmark.
+void *LoadIpcLibrary(IPC_FUNCTIONS *pFunctions)
+{
+    HMODULE hModule = LoadLibrary(MODULE_NAME);
+    if (hModule != NULL && !GetIpcFunctions(hModule, pFunctions))
+    {
+        FreeLibrary(hModule);
+        hModule = NULL;
+    }
+    return hModule;
+}
+
+
+void FreeIpcLibrary(void *hModule)
+{
+    FreeLibrary((HMODULE)hModule);
+}
+
+
+//
+//   FUNCTION: ProfileStartup(PCWSTR)
+//
+//   PURPOSE: Bring the client up the way the program does, timing every 
+//   step: IsModuleLoaded, LoadLibrary, the lookup of the functions, the 
+//   first message written to and read from the file mapping, and the first 
+//   request and reply through the C interface. The DLL reports its 
+//   initialization and the OpenFileMapping and MapViewOfFile calls within 
+//   those steps through ipc_set_trace. Prints the breakdown and writes the 
+//   Chrome trace to pszTracePath.
+//
+//   RETURN VALUE: TRUE if every step succeeded.
+//
+BOOL ProfileStartup(PCWSTR pszTracePath)
+{
+    CStartupProfiler profiler;
+    IPC_FUNCTIONS functions;
+    PFN_IPC_SET_TRACE pfnSetTrace = NULL;
+    LPFNREADMAPPEDMESSAGE lpfnReadMappedMessage = NULL;
+    LPFNWRITEMAPPEDMESSAGE lpfnWriteMappedMessage = NULL;
+    ipc_channel *pChannel = NULL;
+    WCHAR szMessage[512];
+    DWORD dwError = ERROR_SUCCESS;
+    int result = IPC_OK;
+    BOOL fSucceeded = FALSE;
+    FILE *pFile = NULL;
+
+    uint64_t start = IpcTimestamp();
+    if (IsModuleLoaded(MODULE_NAME))
+    {
+        wprintf(L"The module is loaded already; the profile is not cold\n");
+    }
+    start = profiler.EndPhase("IsModuleLoaded", start);
+
+    HMODULE hModule = LoadLibrary(MODULE_NAME);
+    start = profiler.EndPhase("LoadLibrary", start);
+    if (hModule == NULL)
+    {
+        wprintf(L"LoadLibrary failed w/err 0x%08lx\n", GetLastError());
+        return FALSE;
+    }
+
+    pfnSetTrace = (PFN_IPC_SET_TRACE)GetProcAddress(hModule, "ipc_set_trace");
+    lpfnReadMappedMessage = (LPFNREADMAPPEDMESSAGE) 
+        GetProcAddress(hModule, "ReadMappedMessage");
+    lpfnWriteMappedMessage = (LPFNWRITEMAPPEDMESSAGE) 
+        GetProcAddress(hModule, "WriteMappedMessage");
+    BOOL fFound = GetIpcFunctions(hModule, &functions) && 
+        pfnSetTrace != NULL && lpfnReadMappedMessage != NULL && 
+        lpfnWriteMappedMessage != NULL;
+    start = profiler.EndPhase("GetProcAddress", start);
+    if (!fFound)
+    {
+        wprintf(L"The functions cannot be found (Error: 0x%08lx)\n", 
+            GetLastError());
+        goto Cleanup;
+    }
+
+    // From here on the DLL reports its phases too, starting with DllMain.
+    pfnSetTrace(CStartupProfiler::TraceHook, &profiler);
+
+    start = IpcTimestamp();
+    dwError = lpfnWriteMappedMessage(MESSAGE);
+    start = profiler.EndPhase("First WriteMappedMessage", start);
+    if (dwError == ERROR_SUCCESS)
+    {
+        dwError = lpfnReadMappedMessage(szMessage, ARRAYSIZE(szMessage));
+        start = profiler.EndPhase("First ReadMappedMessage", start);
+    }
+
+    if (dwError == ERROR_SUCCESS)
+    {
+        result = functions.pfnOpen(NULL, &pChannel);
+        start = profiler.EndPhase("ipc_open", start);
+    }
+    if (dwError == ERROR_SUCCESS && result == IPC_OK)
+    {
+        char reply[256];
+        size_t cbReply;
+        result = functions.pfnSend(pChannel, "ping", 4);
+        start = profiler.EndPhase("First ipc_send", start);
+        if (result == IPC_OK)
+        {
+            result = functions.pfnRecv(pChannel, reply, sizeof(reply), 
+                &cbReply, BENCHMARK_TIMEOUT);
+            profiler.EndPhase("First ipc_recv", start);
+        }
+        functions.pfnClose(pChannel);
+    }
+    pfnSetTrace(NULL, NULL);
+    if (dwError != ERROR_SUCCESS || result != IPC_OK)
+    {
+        wprintf(L"The first exchange failed w/err 0x%08lx, %d\n", dwError, 
+            result);
+        goto Cleanup;
+    }
+
+    profiler.PrintReport();
+    if (_wfopen_s(&pFile, pszTracePath, L"w") == 0)
+    {
+        fSucceeded = profiler.WriteChromeTrace(pFile);
+        fSucceeded = (fclose(pFile) == 0) && fSucceeded;
+    }
+    if (fSucceeded)
+    {
+        wprintf(L"The Chrome trace is in %s\n", pszTracePath);
+    }
+    else
+    {
+        wprintf(L"The trace cannot be written to %s\n", pszTracePath);
+    }
+
+Cleanup:
+    FreeLibrary(hModule);
+    return fSucceeded;
+}
+
+
 //
 //   FUNCTION: Max(int, int)
 //
@@ -88,22 +294,38 @@ int wmain(int argc, wchar_t *argv[])
 {
     BOOL fLoaded = FALSE;
     HINSTANCE hModule = NULL;
+    LARGE_INTEGER start;
+    DWORD dwError;
+    LPFNREADMAPPEDMESSAGE lpfnReadMappedMessage = NULL;
+    LPFNWRITEMAPPEDMESSAGE lpfnWriteMappedMessage = NULL;
 
 	// The name of the module to be dynamically-loaded.
-	PCWSTR pszModuleName = L"CppDynamicLinkLibrary";
+	PCWSTR pszModuleName = MODULE_NAME;
+
+    // Only profile the startup, while the module is not loaded yet.
+    if (argc > 2 && _wcsicmp(argv[1], L"/profile") == 0)
+    {
+        return ProfileStartup(argv[2]) ? 0 : 1;
+    }
 
 	// Check whether or not the module is loaded.
 	fLoaded = IsModuleLoaded(pszModuleName);
     wprintf(L"Module \"%s\" is %sloaded\n", pszModuleName, fLoaded ? L"" : L"not ");
 
+    // Load and free the library over and over, starting while no channel 
+    // of the DLL is open in the process.
+    RunChurnBenchmark(LoadIpcLibrary, FreeIpcLibrary, NULL);
+
 	// Dynamically load the library.
     wprintf(L"Load the library\n");
+    QueryPerformanceCounter(&start);
 	hModule = LoadLibrary(pszModuleName);
 	if (hModule == NULL)
 	{
         wprintf(L"LoadLibrary failed w/err 0x%08lx\n", GetLastError());
         goto Cleanup;
     }
+    wprintf(L"LoadLibrary took %.3f ms\n", ElapsedMilliseconds(start));
 
     // Check whether or not the module is loaded.
 	fLoaded = IsModuleLoaded(pszModuleName);
@@ -116,6 +338,68 @@ int wmain(int argc, wchar_t *argv[])
     // Dynamically-loaded DLL does not allow you to access the global data 
     // exported from the DLL.
 
+    // 
+    // Exchange messages with the service through the DLL. The first call 
+    // opens the file mapping; later calls find it open.
+    // 
+
+    lpfnReadMappedMessage = (LPFNREADMAPPEDMESSAGE) 
+        GetProcAddress(hModule, "ReadMappedMessage");
+    lpfnWriteMappedMessage = (LPFNWRITEMAPPEDMESSAGE) 
+        GetProcAddress(hModule, "WriteMappedMessage");
+    if (lpfnReadMappedMessage == NULL || lpfnWriteMappedMessage == NULL)
+    {
+        wprintf(L"ReadMappedMessage or WriteMappedMessage cannot be found "
+            L"(Error: 0x%08lx)\n", GetLastError());
+        goto Cleanup;
+    }
+
+    {
+        WCHAR szMessage[512];
+        QueryPerformanceCounter(&start);
+        dwError = lpfnReadMappedMessage(szMessage, ARRAYSIZE(szMessage));
+        double msFirst = ElapsedMilliseconds(start);
+        if (dwError != ERROR_SUCCESS)
+        {
+            wprintf(L"ReadMappedMessage failed w/err 0x%08lx\n", dwError);
+            goto Cleanup;
+        }
+        wprintf(L"Read from the file mapping:\n\"%s\"\n", szMessage);
+
+        QueryPerformanceCounter(&start);
+        dwError = lpfnWriteMappedMessage(MESSAGE);
+        double msNext = ElapsedMilliseconds(start);
+        if (dwError != ERROR_SUCCESS)
+        {
+            wprintf(L"WriteMappedMessage failed w/err 0x%08lx\n", dwError);
+            goto Cleanup;
+        }
+        wprintf(L"The first message took %.3f ms, the next one %.3f ms\n", 
+            msFirst, msNext);
+
+        // Compare one message per call with a batch per call through the C 
+        // interface of the DLL.
+        IPC_FUNCTIONS functions;
+        if (!GetIpcFunctions(hModule, &functions))
+        {
+            wprintf(L"The ipc_* functions cannot be found (Error: 0x%08lx)\n", 
+                GetLastError());
+            goto Cleanup;
+        }
+        RunApiBenchmark(functions, NULL);
+
+        // Compare a round trip through the service with one through a 
+        // server registered in this process.
+        RunLatencyBenchmark(functions, NULL);
+
+        // Create, call and release client objects, which the DLL pools.
+        RunClientBenchmark(functions, NULL);
+
+        // Wait to clean up resources and stop the process.
+        wprintf(L"Press ENTER to clean up resources and quit");
+        getchar();
+    }
+
     // 
     // Call the functions exported from a module.
     // 
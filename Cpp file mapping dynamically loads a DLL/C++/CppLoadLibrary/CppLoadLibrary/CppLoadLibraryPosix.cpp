@@ -0,0 +1,835 @@
+/****************************** Module Header ******************************\
+Module Name:  CppLoadLibraryPosix.cpp
+Project:      CppLoadLibrary
+Copyright (c) Microsoft Corporation.
+
+The POSIX counterpart of CppLoadLibrary.cpp, which tests the C interface of
+the library (see IpcApi.h) without Windows. The program plays the server
+itself: it lays out a section in a POSIX shared memory object and echoes
+every request of every session from a thread of its own. It first checks
+that recovering a section cuts a ring at a slot whose payload was only
+partly written back (see IpcRecoverSection), then loads
+and frees the library over and over (see RunChurnBenchmark), while the
+process has not opened the section yet. It then loads the library with
+dlopen, looks the functions up with dlsym and checks that single and
+batched requests come back intact and in order, that channels sharing the
+session of the process each get their own replies, from one thread and
+from several, that a server registered in the process answers a channel
+directly, that client objects come back from the pool of the library
+without the replies of their last owner, and that the plugin table the library exports for the service
+answers a request. Last, it runs the benchmarks of single against batched
+calls and of the latency across processes against within the process (see
+ApiBenchmark.h) and of creating and releasing client objects.
+
+With --profile, it instead brings the client up once, cold, with every step
+timed (see StartupProfiler.h), prints the breakdown and writes the Chrome
+trace to the given file.
+
+    CppLoadLibraryPosix [--profile trace.json]
+                        [path of libCppDynamicLinkLibrary.so]
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <thread>
+#include "ApiBenchmark.h"
+#include "StartupProfiler.h"
+#include "../CppDynamicLinkLibrary/IpcChannel.h"
+#include "../CppDynamicLinkLibrary/IpcPlugin.h"
+#pragma endregion
+
+
+#define LIBRARY_PATH        "./libCppDynamicLinkLibrary.so"
+
+// Message sent as the first request.
+#define MESSAGE             "Message from the client process."
+
+// Shape of the test section: a few sessions are enough.
+#define TEST_SESSIONS       4
+#define TEST_SLOTS          64
+#define TEST_SLOT_SIZE      256
+
+// Requests sent in one batch, and the time, in milliseconds, a reply may
+// take.
+#define TEST_BATCH          16
+#define TEST_TIMEOUT        1000
+
+// Threads that echo through channels of their own on the shared session,
+// and the requests each of them sends.
+#define TEST_THREADS        4
+#define TEST_THREAD_MESSAGES 20000
+
+
+static std::atomic<bool> g_fStopping(false);
+static const char *g_pszLibrary = LIBRARY_PATH;
+
+
+//
+//   FUNCTION: GetIpcFunctions(void *, IPC_FUNCTIONS *)
+//
+//   PURPOSE: Look up the functions of the C interface of the library.
+//   Returns false if one of them cannot be found.
+//
+static bool GetIpcFunctions(void *hModule, IPC_FUNCTIONS *pFunctions)
+{
+    pFunctions->pfnOpen = (PFN_IPC_OPEN)dlsym(hModule, "ipc_open");
+    pFunctions->pfnSend = (PFN_IPC_SEND)dlsym(hModule, "ipc_send");
+    pFunctions->pfnSendBatch =
+        (PFN_IPC_SEND_BATCH)dlsym(hModule, "ipc_send_batch");
+    pFunctions->pfnRecv = (PFN_IPC_RECV)dlsym(hModule, "ipc_recv");
+    pFunctions->pfnRecvBatch =
+        (PFN_IPC_RECV_BATCH)dlsym(hModule, "ipc_recv_batch");
+    pFunctions->pfnClose = (PFN_IPC_CLOSE)dlsym(hModule, "ipc_close");
+    pFunctions->pfnListen = (PFN_IPC_LISTEN)dlsym(hModule, "ipc_listen");
+    pFunctions->pfnUnlisten =
+        (PFN_IPC_UNLISTEN)dlsym(hModule, "ipc_unlisten");
+    pFunctions->pfnCreateClient =
+        (PFN_IPC_CREATE_CLIENT)dlsym(hModule, "ipc_create_client");
+    if (!pFunctions->pfnOpen || !pFunctions->pfnSend ||
+        !pFunctions->pfnSendBatch || !pFunctions->pfnRecv ||
+        !pFunctions->pfnRecvBatch || !pFunctions->pfnClose ||
+        !pFunctions->pfnListen || !pFunctions->pfnUnlisten ||
+        !pFunctions->pfnCreateClient)
+    {
+        printf("dlsym failed w/err %s\n", dlerror());
+        return false;
+    }
+    return true;
+}
+
+
+//
+//   FUNCTION: LoadIpcLibrary(IPC_FUNCTIONS *)
+//
+//   PURPOSE: Load the library with dlopen and look up the functions of its
+//   C interface. Returns the handle of the library, or NULL.
+//
+static void *LoadIpcLibrary(IPC_FUNCTIONS *pFunctions)
+{
+    void *hModule = dlopen(g_pszLibrary, RTLD_NOW | RTLD_LOCAL);
+    if (hModule == NULL)
+    {
+        printf("dlopen failed w/err %s\n", dlerror());
+        return NULL;
+    }
+    if (!GetIpcFunctions(hModule, pFunctions))
+    {
+        dlclose(hModule);
+        return NULL;
+    }
+    return hModule;
+}
+
+
+static void FreeIpcLibrary(void *hModule)
+{
+    dlclose(hModule);
+}
+
+
+//
+//   FUNCTION: EchoThread(const IPC_FUNCTIONS *, const char *, int,
+//   std::atomic<int> *)
+//
+//   PURPOSE: Open a channel, which shares the session of the process, and
+//   echo numbered requests through it, a few in flight at a time. Counts a
+//   failure if a reply is lost or does not match its request.
+//
+static void EchoThread(const IPC_FUNCTIONS *pFunctions, const char *pszName,
+    int iThread, std::atomic<int> *pcFailures)
+{
+    ipc_channel *pChannel = NULL;
+    if (pFunctions->pfnOpen(pszName, &pChannel) != IPC_OK)
+    {
+        (*pcFailures)++;
+        return;
+    }
+
+    char request[32];
+    char reply[32];
+    int cSent = 0;
+    int cReceived = 0;
+    while (cReceived < TEST_THREAD_MESSAGES)
+    {
+        while (cSent < TEST_THREAD_MESSAGES && cSent - cReceived < 4)
+        {
+            int cb = snprintf(request, sizeof(request), "%d:%d", iThread,
+                cSent);
+            if (pFunctions->pfnSend(pChannel, request, (size_t)cb) != IPC_OK)
+            {
+                break;
+            }
+            cSent++;
+        }
+
+        size_t cbReply = 0;
+        int cb = snprintf(request, sizeof(request), "%d:%d", iThread,
+            cReceived);
+        if (pFunctions->pfnRecv(pChannel, reply, sizeof(reply), &cbReply,
+            TEST_TIMEOUT) != IPC_OK || cbReply != (size_t)cb ||
+            memcmp(reply, request, cbReply) != 0)
+        {
+            printf("Thread %d: reply %d is wrong\n", iThread, cReceived);
+            (*pcFailures)++;
+            break;
+        }
+        cReceived++;
+    }
+    pFunctions->pfnClose(pChannel);
+}
+
+
+//
+//   FUNCTION: EchoSessions(IPC_SECTION_HEADER *)
+//
+//   PURPOSE: Serve the section the way the service does, without doorbells:
+//   accept new sessions, send every request back as its reply and free the
+//   sessions the clients close.
+//
+static void EchoSessions(IPC_SECTION_HEADER *pHeader)
+{
+    const IPC_GEOMETRY &geometry = pHeader->Geometry;
+    unsigned char message[TEST_SLOT_SIZE];
+
+    while (!g_fStopping.load(std::memory_order_relaxed))
+    {
+        for (uint32_t i = 0; i < geometry.cSessions; i++)
+        {
+            IPC_SESSION *pSession = IpcGetSession(pHeader, i);
+            uint32_t state = pSession->State.load(std::memory_order_acquire);
+            if (state == IPC_SESSION_CONNECTING)
+            {
+                pHeader->cActiveSessions.fetch_add(1);
+                pSession->State.store(IPC_SESSION_ACTIVE,
+                    std::memory_order_release);
+            }
+            else if (state == IPC_SESSION_CLOSING)
+            {
+                pHeader->cActiveSessions.fetch_sub(1);
+                pSession->State.store(IPC_SESSION_FREE,
+                    std::memory_order_release);
+            }
+            else if (state == IPC_SESSION_ACTIVE)
+            {
+                IPC_RING_HEADER *pRequests = IpcGetRing(pHeader, i,
+                    IPC_RING_REQUEST);
+                IPC_RING_HEADER *pReplies = IpcGetRing(pHeader, i,
+                    IPC_RING_REPLY);
+                size_t cbMessage;
+                while (IpcRingCredits(geometry, pReplies) != 0 &&
+                    IpcRingRead(geometry, pRequests, message, sizeof(message),
+                    &cbMessage))
+                {
+                    IpcRingWrite(geometry, pReplies, message, cbMessage);
+                }
+                IpcRingGrant(geometry, pRequests, geometry.cSlots);
+            }
+        }
+        std::this_thread::yield();
+    }
+}
+
+
+// The server in the process of the local channel test: replies with the
+// request reversed, so the reply cannot have come from EchoSessions.
+static size_t IPC_CALL ReverseHandler(void *, uint32_t,
+    const void *pRequest, size_t cbRequest, void *pReply, size_t cbReply)
+{
+    size_t cbCopy = (cbRequest < cbReply) ? cbRequest : cbReply;
+    for (size_t i = 0; i < cbCopy; i++)
+    {
+        ((char *)pReply)[i] = ((const char *)pRequest)[cbRequest - 1 - i];
+    }
+    return cbCopy;
+}
+
+
+//
+//   FUNCTION: TestRingRecovery(void)
+//
+//   PURPOSE: Recover a section the way a backing file hands it back after a
+//   crash whose last write-back caught a producer copying its second
+//   message: the slot carries the sequence number of its position, but
+//   only the first half of its payload. Recovery must keep the first
+//   message and cut the ring before the torn one.
+//
+//   RETURN VALUE: true if the ring was cut at the torn slot.
+//
+static bool TestRingRecovery(void)
+{
+    IPC_GEOMETRY geometry = { TEST_SESSIONS, TEST_SLOTS, TEST_SLOT_SIZE, 1 };
+    size_t cbSection = IpcSectionSize(geometry);
+    void *pView = mmap(NULL, cbSection, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pView == MAP_FAILED)
+    {
+        perror("mmap");
+        return false;
+    }
+
+    IpcInitializeSection(pView, cbSection, geometry, (uint32_t)getpid(),
+        IPC_SECTION_DURABLE);
+    IPC_SECTION_HEADER *pHeader = IpcGetHeader(pView);
+    int iSession = IpcOpenSession(pHeader, (uint32_t)getpid());
+    IPC_RING_HEADER *pRing = IpcGetRing(pHeader, (uint32_t)iSession,
+        IPC_RING_REQUEST);
+
+    char message[64];
+    for (size_t i = 0; i < sizeof(message); i++)
+    {
+        message[i] = (char)('a' + i % 26);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        IpcRingWrite(geometry, pRing, message, sizeof(message), true);
+    }
+
+    IPC_SLOT_HEADER *pTorn = IpcGetSlot(geometry, pRing, 1);
+    memset((char *)(pTorn + 1) + sizeof(message) / 2, 0, sizeof(message) / 2);
+
+    IPC_RECOVERY recovery;
+    bool fCut = IpcRecoverSection(pView, cbSection, geometry,
+        (uint32_t)getpid(), &recovery) &&
+        recovery.cMessages == 1 && recovery.cDiscarded == 2 &&
+        pRing->Head.load() == 1;
+    if (fCut)
+    {
+        printf("Recovery kept 1 message and dropped the torn one after it\n");
+    }
+    else
+    {
+        printf("Recovery kept %llu and dropped %llu messages of a torn ring\n",
+            (unsigned long long)recovery.cMessages,
+            (unsigned long long)recovery.cDiscarded);
+    }
+
+    munmap(pView, cbSection);
+    return fCut;
+}
+
+
+//
+//   FUNCTION: ProfileStartup(const char *, const char *)
+//
+//   PURPOSE: Bring the client up the way a host does the first time, timing
+//   every step: look for the library among the loaded ones, load it, look
+//   up its functions, open a channel on the section pszName and exchange
+//   the first request and reply. The library reports its initialization
+//   and the mapping of the section through ipc_set_trace. Prints the
+//   breakdown and writes the Chrome trace to pszTracePath.
+//
+//   RETURN VALUE: true if every step succeeded.
+//
+static bool ProfileStartup(const char *pszName, const char *pszTracePath)
+{
+    CStartupProfiler profiler;
+    IPC_FUNCTIONS functions;
+    PFN_IPC_SET_TRACE pfnSetTrace = NULL;
+    ipc_channel *pChannel = NULL;
+    int result = IPC_E_NOTCONNECTED;
+    bool fSucceeded = false;
+
+    // A library built to open its channel eagerly (see IPC_EAGER_OPEN in
+    // IpcApi.cpp) opens it on this section inside dlopen.
+    setenv("IPC_EAGER_SECTION", pszName, 1);
+
+    // The counterpart of IsModuleLoaded: dlopen finds the library without
+    // loading it.
+    uint64_t start = IpcTimestamp();
+    void *hModule = dlopen(g_pszLibrary, RTLD_NOW | RTLD_NOLOAD);
+    start = profiler.EndPhase("IsModuleLoaded", start);
+    if (hModule != NULL)
+    {
+        printf("The library is loaded already; the profile is not cold\n");
+        dlclose(hModule);
+        start = IpcTimestamp();
+    }
+
+    hModule = dlopen(g_pszLibrary, RTLD_NOW | RTLD_LOCAL);
+    start = profiler.EndPhase("dlopen", start);
+    if (hModule == NULL)
+    {
+        printf("dlopen failed w/err %s\n", dlerror());
+        return false;
+    }
+
+    pfnSetTrace = (PFN_IPC_SET_TRACE)dlsym(hModule, "ipc_set_trace");
+    bool fFound = GetIpcFunctions(hModule, &functions) && pfnSetTrace != NULL;
+    start = profiler.EndPhase("dlsym", start);
+    if (!fFound)
+    {
+        goto Cleanup;
+    }
+
+    // From here on the library reports its phases too.
+    pfnSetTrace(CStartupProfiler::TraceHook, &profiler);
+    start = IpcTimestamp();
+    result = functions.pfnOpen(pszName, &pChannel);
+    start = profiler.EndPhase("ipc_open", start);
+    if (result == IPC_OK)
+    {
+        char reply[TEST_SLOT_SIZE];
+        size_t cbReply;
+        result = functions.pfnSend(pChannel, MESSAGE, sizeof(MESSAGE) - 1);
+        start = profiler.EndPhase("First ipc_send", start);
+        if (result == IPC_OK)
+        {
+            result = functions.pfnRecv(pChannel, reply, sizeof(reply),
+                &cbReply, TEST_TIMEOUT);
+            profiler.EndPhase("First ipc_recv", start);
+        }
+        functions.pfnClose(pChannel);
+    }
+    pfnSetTrace(NULL, NULL);
+    if (result != IPC_OK)
+    {
+        printf("The first exchange failed w/err %d\n", result);
+        goto Cleanup;
+    }
+
+    profiler.PrintReport();
+    {
+        FILE *pFile = fopen(pszTracePath, "w");
+        fSucceeded = pFile != NULL && profiler.WriteChromeTrace(pFile);
+        if (pFile != NULL && fclose(pFile) != 0)
+        {
+            fSucceeded = false;
+        }
+    }
+    if (!fSucceeded)
+    {
+        perror(pszTracePath);
+    }
+    else
+    {
+        printf("The Chrome trace is in %s\n", pszTracePath);
+    }
+
+Cleanup:
+    dlclose(hModule);
+    return fSucceeded;
+}
+
+
+int main(int argc, char *argv[])
+{
+    const char *pszTracePath = NULL;
+    int iArgument = 1;
+    if (argc > 2 && strcmp(argv[1], "--profile") == 0)
+    {
+        pszTracePath = argv[2];
+        iArgument = 3;
+    }
+    if (argc > iArgument)
+    {
+        g_pszLibrary = argv[iArgument];
+    }
+    char szName[64];
+    snprintf(szName, sizeof(szName), "/SampleMapTest.%u", (unsigned)getpid());
+
+    IPC_GEOMETRY geometry = { TEST_SESSIONS, TEST_SLOTS, TEST_SLOT_SIZE, 1 };
+    size_t cbSection = IpcSectionSize(geometry);
+
+    void *hModule = NULL;
+    ipc_channel *pChannel = NULL;
+    void *pView = MAP_FAILED;
+    std::thread server;
+    int cFailures = 0;
+
+    // Lay the section out and start serving it.
+    int fd = shm_open(szName, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)cbSection) != 0)
+    {
+        perror("shm_open");
+        cFailures++;
+        goto Cleanup;
+    }
+    pView = mmap(NULL, cbSection, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (pView == MAP_FAILED)
+    {
+        perror("mmap");
+        cFailures++;
+        goto Cleanup;
+    }
+    IpcInitializeSection(pView, cbSection, geometry, (uint32_t)getpid());
+    server = std::thread(EchoSessions, IpcGetHeader(pView));
+
+    // Profile the startup instead of testing, while the library is cold.
+    if (pszTracePath != NULL)
+    {
+        if (!ProfileStartup(szName, pszTracePath))
+        {
+            cFailures++;
+        }
+        goto Cleanup;
+    }
+
+    if (!TestRingRecovery())
+    {
+        cFailures++;
+    }
+
+    // Loading and freeing the library over and over, starting cold.
+    if (!RunChurnBenchmark(LoadIpcLibrary, FreeIpcLibrary, szName))
+    {
+        cFailures++;
+    }
+
+    {
+        // Load the library and look up the functions.
+        IPC_FUNCTIONS functions;
+        hModule = LoadIpcLibrary(&functions);
+        if (hModule == NULL)
+        {
+            cFailures++;
+            goto Cleanup;
+        }
+        printf("The module %s is loaded\n", g_pszLibrary);
+
+        int result = functions.pfnOpen(szName, &pChannel);
+        if (result != IPC_OK)
+        {
+            printf("ipc_open failed w/err %d\n", result);
+            cFailures++;
+            goto Cleanup;
+        }
+
+        // One request, one reply.
+        char reply[TEST_SLOT_SIZE];
+        size_t cbReply = 0;
+        result = functions.pfnSend(pChannel, MESSAGE, sizeof(MESSAGE) - 1);
+        if (result == IPC_OK)
+        {
+            result = functions.pfnRecv(pChannel, reply, sizeof(reply), &cbReply,
+                TEST_TIMEOUT);
+        }
+        if (result != IPC_OK || cbReply != sizeof(MESSAGE) - 1 ||
+            memcmp(reply, MESSAGE, cbReply) != 0)
+        {
+            printf("ipc_send/ipc_recv failed w/err %d\n", result);
+            cFailures++;
+        }
+        else
+        {
+            printf("The reply is \"%.*s\"\n", (int)cbReply, reply);
+        }
+
+        // A batch, whose replies must come back in order.
+        char messages[TEST_BATCH][32];
+        ipc_iovec batch[TEST_BATCH];
+        for (int i = 0; i < TEST_BATCH; i++)
+        {
+            batch[i].base = messages[i];
+            batch[i].len = (size_t)snprintf(messages[i], sizeof(messages[i]),
+                "Request %d", i);
+        }
+        size_t cSent = 0;
+        result = functions.pfnSendBatch(pChannel, batch, TEST_BATCH, &cSent);
+        if (result != IPC_OK || cSent != TEST_BATCH)
+        {
+            printf("ipc_send_batch failed w/err %d after %zu\n", result,
+                cSent);
+            cFailures++;
+        }
+        char replies[TEST_BATCH][32];
+        ipc_buffer buffers[TEST_BATCH];
+        for (int i = 0; i < TEST_BATCH; i++)
+        {
+            buffers[i].base = replies[i];
+            buffers[i].size = sizeof(replies[i]);
+        }
+        size_t cReceived = 0;
+        while (cReceived < cSent)
+        {
+            size_t cTaken = 0;
+            result = functions.pfnRecvBatch(pChannel, buffers,
+                cSent - cReceived, &cTaken, TEST_TIMEOUT);
+            for (size_t i = 0; i < cTaken; i++, cReceived++)
+            {
+                if (buffers[i].len != batch[cReceived].len ||
+                    memcmp(replies[i], batch[cReceived].base,
+                    buffers[i].len) != 0)
+                {
+                    result = IPC_E_INVALIDARG;
+                }
+            }
+            if (result != IPC_OK)
+            {
+                printf("Reply %zu of the batch is wrong (%d)\n", cReceived,
+                    result);
+                cFailures++;
+                break;
+            }
+        }
+        printf("%zu batched requests came back in order\n", cReceived);
+
+        // A request that does not fit into a slot.
+        static char oversized[TEST_SLOT_SIZE];
+        result = functions.pfnSend(pChannel, oversized, sizeof(oversized));
+        if (result != IPC_E_TOOBIG)
+        {
+            printf("An oversized request returned %d\n", result);
+            cFailures++;
+        }
+
+        // A second channel on the section shares the session: the replies
+        // of both come off the same ring, and each channel gets its own.
+        ipc_channel *pOther = NULL;
+        result = functions.pfnOpen(szName, &pOther);
+        if (result == IPC_OK)
+        {
+            functions.pfnSend(pChannel, "first", 5);
+            functions.pfnSend(pOther, "second", 6);
+            functions.pfnSend(pChannel, "third", 5);
+            result = functions.pfnRecv(pOther, reply, sizeof(reply), &cbReply,
+                TEST_TIMEOUT);
+            bool fIntact = result == IPC_OK && cbReply == 6 &&
+                memcmp(reply, "second", 6) == 0;
+            result = functions.pfnRecvBatch(pChannel, buffers, 2, &cReceived,
+                TEST_TIMEOUT);
+            fIntact = fIntact && result == IPC_OK && cReceived == 2 &&
+                buffers[0].len == 5 && memcmp(replies[0], "first", 5) == 0 &&
+                buffers[1].len == 5 && memcmp(replies[1], "third", 5) == 0;
+            functions.pfnClose(pOther);
+            if (!fIntact)
+            {
+                result = IPC_E_INVALIDARG;
+            }
+        }
+        if (result != IPC_OK)
+        {
+            printf("The channels sharing the session mixed up their replies "
+                "(%d)\n", result);
+            cFailures++;
+        }
+        else
+        {
+            printf("Two channels on the shared session got their own "
+                "replies\n");
+        }
+
+        functions.pfnClose(pChannel);
+        pChannel = NULL;
+
+        // Channels of several threads on the shared session.
+        std::atomic<int> cThreadFailures(0);
+        std::thread threads[TEST_THREADS];
+        for (int i = 0; i < TEST_THREADS; i++)
+        {
+            threads[i] = std::thread(EchoThread, &functions, szName, i,
+                &cThreadFailures);
+        }
+        for (int i = 0; i < TEST_THREADS; i++)
+        {
+            threads[i].join();
+        }
+        if (cThreadFailures != 0)
+        {
+            cFailures++;
+        }
+        else
+        {
+            printf("%d threads echoed %d requests each through the shared "
+                "session\n", TEST_THREADS, TEST_THREAD_MESSAGES);
+        }
+
+        // A server in the process: a channel opened once it listens goes
+        // to it instead of the section, and fails once it stops.
+        ipc_listener *pListener = NULL;
+        ipc_listener *pSecond = NULL;
+        result = functions.pfnListen(szName, ReverseHandler, NULL, &pListener);
+        if (result == IPC_OK &&
+            functions.pfnListen(szName, ReverseHandler, NULL, &pSecond) !=
+            IPC_E_EXISTS)
+        {
+            result = IPC_E_INVALIDARG;
+        }
+        if (result == IPC_OK)
+        {
+            result = functions.pfnOpen(szName, &pChannel);
+        }
+        if (result == IPC_OK)
+        {
+            result = functions.pfnSendBatch(pChannel, batch, 2, &cSent);
+            if (result == IPC_OK)
+            {
+                result = functions.pfnRecvBatch(pChannel, buffers, 2,
+                    &cReceived, 0);
+            }
+            if (result == IPC_OK && (cReceived != 2 ||
+                buffers[1].len != batch[1].len ||
+                memcmp(replies[1], "1 tseuqeR", 9) != 0))
+            {
+                result = IPC_E_INVALIDARG;
+            }
+            if (result == IPC_OK && functions.pfnRecv(pChannel, reply,
+                sizeof(reply), &cbReply, 0) != IPC_E_TIMEOUT)
+            {
+                result = IPC_E_INVALIDARG;
+            }
+            functions.pfnUnlisten(pListener);
+            pListener = NULL;
+            if (result == IPC_OK && functions.pfnSend(pChannel, "x", 1) !=
+                IPC_E_NOTCONNECTED)
+            {
+                result = IPC_E_INVALIDARG;
+            }
+            functions.pfnClose(pChannel);
+            pChannel = NULL;
+        }
+        functions.pfnUnlisten(pListener);
+        if (result != IPC_OK)
+        {
+            printf("The channel to the server in the process failed (%d)\n",
+                result);
+            cFailures++;
+        }
+        else
+        {
+            printf("The server in the process answered the local channel\n");
+        }
+
+        // Client objects: a released client comes back from the pool, but
+        // not one whose reply is still due, which would reach the next
+        // owner.
+        IIpcClient *pFirst = NULL;
+        IIpcClient *pAgain = NULL;
+        result = functions.pfnCreateClient(szName, &pFirst);
+        if (result == IPC_OK)
+        {
+            CIpcClientHandle client(pFirst);
+            const void *pReply;
+            result = client->Call(MESSAGE, sizeof(MESSAGE) - 1, &pReply,
+                &cbReply, TEST_TIMEOUT);
+            if (result == IPC_OK && (cbReply != sizeof(MESSAGE) - 1 ||
+                memcmp(pReply, MESSAGE, cbReply) != 0))
+            {
+                result = IPC_E_INVALIDARG;
+            }
+            CIpcClientHandle moved(std::move(client));
+            if (client || moved.Get() != pFirst)
+            {
+                result = IPC_E_INVALIDARG;
+            }
+        }
+        if (result == IPC_OK)
+        {
+            result = functions.pfnCreateClient(szName, &pAgain);
+        }
+        if (result == IPC_OK)
+        {
+            CIpcClientHandle client(pAgain);
+            if (pAgain != pFirst)
+            {
+                result = IPC_E_INVALIDARG;
+            }
+            else
+            {
+                result = client->Send("stale", 5);
+            }
+        }
+        if (result == IPC_OK)
+        {
+            result = functions.pfnCreateClient(szName, &pAgain);
+        }
+        if (result == IPC_OK)
+        {
+            CIpcClientHandle client(pAgain);
+            if (client->Receive(reply, sizeof(reply), &cbReply, 100) !=
+                IPC_E_TIMEOUT)
+            {
+                result = IPC_E_INVALIDARG;
+            }
+        }
+        if (result != IPC_OK)
+        {
+            printf("The client objects failed (%d)\n", result);
+            cFailures++;
+        }
+        else
+        {
+            printf("A client came back from the pool without stale "
+                "replies\n");
+        }
+
+        // The plugin, called the way the service calls it.
+        PFN_IPC_GET_PLUGIN pfnGetPlugin =
+            (PFN_IPC_GET_PLUGIN)dlsym(hModule, IPC_PLUGIN_FACTORY);
+        const IPC_PLUGIN_TABLE *pPlugin = (pfnGetPlugin != NULL) ?
+            pfnGetPlugin(IPC_PLUGIN_ABI_VERSION) : NULL;
+        if (pPlugin == NULL || pPlugin->AbiVersion != IPC_PLUGIN_ABI_VERSION ||
+            pPlugin->pfnHandle == NULL)
+        {
+            printf("The plugin table is missing or malformed\n");
+            cFailures++;
+        }
+        else
+        {
+            cbReply = pPlugin->pfnHandle(NULL, 0, MESSAGE, sizeof(MESSAGE) - 1,
+                reply, sizeof(reply));
+            printf("The plugin %s v%u replies \"%.*s\"\n", pPlugin->pszName,
+                pPlugin->PluginVersion, (int)cbReply, reply);
+            if (cbReply != sizeof(MESSAGE) - 1 ||
+                memcmp(reply, "MESSAGE FROM THE CLIENT PROCESS.", cbReply) != 0)
+            {
+                cFailures++;
+            }
+        }
+
+        // Single against batched calls.
+        if (!RunApiBenchmark(functions, szName))
+        {
+            cFailures++;
+        }
+
+        // A round trip through the echo thread against one through a
+        // server in the process.
+        if (!RunLatencyBenchmark(functions, szName))
+        {
+            cFailures++;
+        }
+
+        // Client objects from the pool against the first one.
+        if (!RunClientBenchmark(functions, szName))
+        {
+            cFailures++;
+        }
+    }
+
+Cleanup:
+    if (hModule != NULL)
+    {
+        dlclose(hModule);
+    }
+    if (server.joinable())
+    {
+        g_fStopping = true;
+        server.join();
+    }
+    if (pView != MAP_FAILED)
+    {
+        munmap(pView, cbSection);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+        shm_unlink(szName);
+    }
+
+    printf(cFailures ? "FAILED\n" : "PASSED\n");
+    return cFailures ? 1 : 0;
+}
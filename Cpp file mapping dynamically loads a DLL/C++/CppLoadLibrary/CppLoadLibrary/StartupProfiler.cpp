@@ -0,0 +1,149 @@
+/****************************** Module Header ******************************\
+Module Name:  StartupProfiler.cpp
+Project:      CppLoadLibrary
+Copyright (c) Microsoft Corporation.
+
+Implements the profiler of the startup of the IPC client.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <string.h>
+#include <algorithm>
+#include "StartupProfiler.h"
+#include "../CppDynamicLinkLibrary/IpcChannel.h"
+#pragma endregion
+
+
+// Deepest nesting the report indents.
+#define PROFILER_MAX_DEPTH      8
+
+
+CStartupProfiler::CStartupProfiler(void) :
+    m_origin(IpcTimestamp()),
+    m_cPhases(0)
+{
+}
+
+
+uint64_t CStartupProfiler::EndPhase(const char *pszPhase, uint64_t start)
+{
+    uint64_t end = IpcTimestamp();
+    Record(pszPhase, false, start, end);
+    return end;
+}
+
+
+void IPC_CALL CStartupProfiler::TraceHook(void *pContext, const char *pszPhase,
+                                          uint64_t start, uint64_t end)
+{
+    static_cast<CStartupProfiler *>(pContext)->Record(pszPhase, true, start,
+        end);
+}
+
+
+void CStartupProfiler::Record(const char *pszPhase, bool fLibrary,
+                              uint64_t start, uint64_t end)
+{
+    if (m_cPhases == PROFILER_MAX_PHASES)
+    {
+        return;
+    }
+    PHASE &phase = m_phases[m_cPhases++];
+    strncpy(phase.szName, pszPhase, sizeof(phase.szName) - 1);
+    phase.szName[sizeof(phase.szName) - 1] = '\0';
+    phase.fLibrary = fLibrary;
+    phase.Start = start;
+    phase.End = end;
+}
+
+
+// Copy the phases into pSorted in the order they began; of two that began
+// together, the longer one, which holds the other, comes first. The hook
+// reports a phase of the library when it ends, so before the phase of the
+// host it ran within.
+void CStartupProfiler::Sort(PHASE *pSorted) const
+{
+    std::copy(m_phases, m_phases + m_cPhases, pSorted);
+    std::stable_sort(pSorted, pSorted + m_cPhases,
+        [](const PHASE &a, const PHASE &b)
+        {
+            return a.Start < b.Start || (a.Start == b.Start && a.End > b.End);
+        });
+}
+
+
+void CStartupProfiler::PrintReport(void) const
+{
+    PHASE sorted[PROFILER_MAX_PHASES];
+    Sort(sorted);
+
+    uint64_t end = m_origin;
+    for (unsigned int i = 0; i < m_cPhases; i++)
+    {
+        end = (std::max)(end, sorted[i].End);
+    }
+    double msPerTick = 1e3 / IpcTimestampFrequency();
+    double msTotal = (end - m_origin) * msPerTick;
+
+    printf("Startup profile: %.3f ms in %u phases\n", msTotal, m_cPhases);
+    printf("  %-34s %-8s %11s %11s %7s\n", "Phase", "Source", "Offset ms",
+        "Duration ms", "Share");
+
+    // The phases the current one may run within, outermost first.
+    const PHASE *pEnclosing[PROFILER_MAX_DEPTH];
+    unsigned int depth = 0;
+    for (unsigned int i = 0; i < m_cPhases; i++)
+    {
+        const PHASE &phase = sorted[i];
+        while (depth > 0 && (pEnclosing[depth - 1]->End < phase.End ||
+            pEnclosing[depth - 1]->End <= phase.Start))
+        {
+            depth--;
+        }
+
+        double msDuration = (phase.End - phase.Start) * msPerTick;
+        printf("  %*s%-*s %-8s %11.3f %11.3f %6.1f%%\n", (int)depth * 2, "",
+            34 - (int)depth * 2, phase.szName,
+            phase.fLibrary ? "library" : "host",
+            ((double)phase.Start - (double)m_origin) * msPerTick, msDuration,
+            (msTotal > 0) ? msDuration * 100 / msTotal : 0.0);
+
+        if (depth < PROFILER_MAX_DEPTH)
+        {
+            pEnclosing[depth++] = &phase;
+        }
+    }
+}
+
+
+bool CStartupProfiler::WriteChromeTrace(FILE *pFile) const
+{
+    PHASE sorted[PROFILER_MAX_PHASES];
+    Sort(sorted);
+
+    // Complete events ("ph": "X") in microseconds from the start of the
+    // profile, all on one thread, where the viewer stacks the phases that
+    // run within others. The names are ours and need no escaping.
+    double usPerTick = 1e6 / IpcTimestampFrequency();
+    fprintf(pFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (unsigned int i = 0; i < m_cPhases; i++)
+    {
+        const PHASE &phase = sorted[i];
+        fprintf(pFile, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1}%s\n", phase.szName,
+            phase.fLibrary ? "library" : "host",
+            ((double)phase.Start - (double)m_origin) * usPerTick,
+            (phase.End - phase.Start) * usPerTick,
+            (i + 1 < m_cPhases) ? "," : "");
+    }
+    fprintf(pFile, "]}\n");
+    return ferror(pFile) == 0;
+}
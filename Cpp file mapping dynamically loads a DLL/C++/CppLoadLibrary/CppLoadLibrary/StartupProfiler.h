@@ -0,0 +1,85 @@
+/****************************** Module Header ******************************\
+Module Name:  StartupProfiler.h
+Project:      CppLoadLibrary
+Copyright (c) Microsoft Corporation.
+
+Declares CStartupProfiler, which records where the time goes while a host
+brings the IPC client up, from looking for the module to the first reply.
+The host times its own steps, IsModuleLoaded, LoadLibrary or dlopen, the
+lookup of the functions and the first send and receive, and passes
+TraceHook to ipc_set_trace, through which the library reports its
+initialization and the mapping of the section inside those steps. All the
+timestamps come from IpcTimestamp, so the phases of both line up.
+
+PrintReport prints the phases in the order they began, each nested under
+the phase it ran within, with its offset from the start of the profile and
+its share of the whole. WriteChromeTrace writes them as complete events of
+the Chrome trace format, which chrome://tracing and Perfetto open as a
+timeline.
+
+This source is subject to the Microsoft Public License.
+See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+All other rights reserved.
+
+THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include "../CppDynamicLinkLibrary/IpcApi.h"
+
+// Most phases a profile records; later ones are dropped.
+#define PROFILER_MAX_PHASES     64
+
+// Longest phase name kept, with the terminating null.
+#define PROFILER_MAX_NAME       32
+
+
+class CStartupProfiler
+{
+public:
+
+    // Start the profile now.
+    CStartupProfiler(void);
+
+    // Record the phase pszPhase of the host, which began at start, an
+    // IpcTimestamp(), and ends now. Returns the end, which is the start of
+    // the next phase of a host that times its steps back to back.
+    uint64_t EndPhase(const char *pszPhase, uint64_t start);
+
+    // The hook to pass to ipc_set_trace, with the profiler as pContext.
+    static void IPC_CALL TraceHook(void *pContext, const char *pszPhase,
+        uint64_t start, uint64_t end);
+
+    // Print the breakdown of the phases to stdout.
+    void PrintReport(void) const;
+
+    // Write the phases to pFile as a Chrome trace. Returns false if the
+    // file could not be written.
+    bool WriteChromeTrace(FILE *pFile) const;
+
+private:
+
+    CStartupProfiler(const CStartupProfiler &);
+    CStartupProfiler &operator=(const CStartupProfiler &);
+
+    struct PHASE
+    {
+        char szName[PROFILER_MAX_NAME];
+        bool fLibrary;              // Reported by the library
+        uint64_t Start;
+        uint64_t End;
+    };
+
+    void Record(const char *pszPhase, bool fLibrary, uint64_t start,
+        uint64_t end);
+    void Sort(PHASE *pSorted) const;
+
+    uint64_t m_origin;
+    unsigned int m_cPhases;
+    PHASE m_phases[PROFILER_MAX_PHASES];
+};
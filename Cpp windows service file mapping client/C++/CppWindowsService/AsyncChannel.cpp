@@ -0,0 +1,651 @@
+/****************************** Module Header ******************************\
+* Module Name:  AsyncChannel.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the coroutine loop and the awaitable session channel.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include "AsyncChannel.h"
+#pragma endregion
+
+
+// Converts a delay in microseconds to a deadline in IpcTimestamp ticks.
+static uint64_t AsyncDeadline(uint64_t cMicroseconds)
+{
+    return IpcTimestamp() + cMicroseconds * IpcTimestampFrequency() / 1000000;
+}
+
+// The same for a timeout in milliseconds; 0 means no deadline.
+static uint64_t AsyncTimeout(DWORD dwMilliseconds)
+{
+    if (dwMilliseconds == INFINITE)
+    {
+        return 0;
+    }
+    return AsyncDeadline((uint64_t)dwMilliseconds * 1000);
+}
+
+
+#pragma region Frame Pool
+
+CFramePool::CACHE::CACHE(void)
+{
+    memset(pHead, 0, sizeof(pHead));
+    memset(cFrames, 0, sizeof(cFrames));
+}
+
+
+CFramePool::CACHE::~CACHE(void)
+{
+    for (size_t i = 0; i < ClassCount; i++)
+    {
+        while (pHead[i])
+        {
+            FREE_FRAME *pFrame = pHead[i];
+            pHead[i] = pFrame->pNext;
+            ::operator delete(pFrame);
+        }
+    }
+}
+
+
+CFramePool::CACHE &CFramePool::GetCache(void)
+{
+    static thread_local CACHE cache;
+    return cache;
+}
+
+
+void *CFramePool::Allocate(size_t cbFrame)
+{
+    if (cbFrame > ASYNC_MAX_POOLED_FRAME)
+    {
+        return ::operator new(cbFrame);
+    }
+
+    size_t iClass = (cbFrame - 1) / ASYNC_FRAME_GRANULARITY;
+    CACHE &cache = GetCache();
+    FREE_FRAME *pFrame = cache.pHead[iClass];
+    if (pFrame)
+    {
+        cache.pHead[iClass] = pFrame->pNext;
+        cache.cFrames[iClass]--;
+        return pFrame;
+    }
+    return ::operator new((iClass + 1) * ASYNC_FRAME_GRANULARITY);
+}
+
+
+void CFramePool::Free(void *pFrame, size_t cbFrame)
+{
+    if (cbFrame > ASYNC_MAX_POOLED_FRAME)
+    {
+        ::operator delete(pFrame);
+        return;
+    }
+
+    size_t iClass = (cbFrame - 1) / ASYNC_FRAME_GRANULARITY;
+    CACHE &cache = GetCache();
+    if (cache.cFrames[iClass] >= ASYNC_FRAME_CACHE)
+    {
+        ::operator delete(pFrame);
+        return;
+    }
+
+    FREE_FRAME *pFree = static_cast<FREE_FRAME *>(pFrame);
+    pFree->pNext = cache.pHead[iClass];
+    cache.pHead[iClass] = pFree;
+    cache.cFrames[iClass]++;
+}
+
+#pragma endregion
+
+
+#pragma region Task
+
+// The frame is freed before the loop learns that the coroutine returned,
+// so that Stop never returns while a frame is still being torn down.
+void CAsyncTask::promise_type::FinalAwaiter::await_suspend(
+    std::coroutine_handle<promise_type> h) noexcept
+{
+    CAsyncLoop *pLoop = h.promise().pLoop;
+    h.destroy();
+    pLoop->OnCoroutineDone();
+}
+
+#pragma endregion
+
+
+#pragma region Loop
+
+CAsyncLoop::CAsyncLoop(CThreadPool &pool)
+: m_pool(pool),
+  m_hWake(NULL),
+  m_pRegistered(NULL),
+  m_fStopping(false),
+  m_fSleeping(false),
+  m_cCoroutines(0)
+{
+    m_hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hWake == NULL)
+    {
+        throw GetLastError();
+    }
+}
+
+
+CAsyncLoop::~CAsyncLoop(void)
+{
+    Stop();
+    CloseHandle(m_hWake);
+}
+
+
+void CAsyncLoop::Start(void)
+{
+    if (!m_thread.joinable())
+    {
+        m_fStopping.store(false, std::memory_order_relaxed);
+        m_thread = std::thread(&CAsyncLoop::LoopThread, this);
+    }
+}
+
+
+void CAsyncLoop::Stop(void)
+{
+    if (m_thread.joinable())
+    {
+        m_fStopping.store(true, std::memory_order_seq_cst);
+        SetEvent(m_hWake);
+        m_thread.join();
+    }
+}
+
+
+void CAsyncLoop::Spawn(CAsyncTask task)
+{
+    std::coroutine_handle<CAsyncTask::promise_type> hCoroutine =
+        task.m_hCoroutine;
+    task.m_hCoroutine = NULL;
+
+    hCoroutine.promise().pLoop = this;
+    m_cCoroutines.fetch_add(1, std::memory_order_relaxed);
+    Resume(hCoroutine);
+}
+
+
+void CAsyncLoop::Resume(std::coroutine_handle<> hCoroutine)
+{
+    m_pool.Post([hCoroutine] { hCoroutine.resume(); });
+}
+
+
+// The loop may be destroyed as soon as the last coroutine is counted out,
+// so nothing touches it afterwards; a stopping loop polls the count
+// instead of waiting to be woken.
+void CAsyncLoop::OnCoroutineDone(void)
+{
+    m_cCoroutines.fetch_sub(1, std::memory_order_release);
+}
+
+
+//
+//   FUNCTION: CAsyncLoop::Register(ASYNC_WAITER *)
+//
+//   PURPOSE: Hand a suspended coroutine over to the loop thread. The waiter
+//   is pushed onto a lock-free list that the loop takes as a whole, so
+//   there is no ABA problem. The coroutine may be resumed before Register
+//   returns, so the caller must not touch the waiter afterwards.
+//
+void CAsyncLoop::Register(ASYNC_WAITER *pWaiter)
+{
+    ASYNC_WAITER *pHead = m_pRegistered.load(std::memory_order_relaxed);
+    do
+    {
+        pWaiter->pNext = pHead;
+    } while (!m_pRegistered.compare_exchange_weak(pHead, pWaiter,
+        std::memory_order_release, std::memory_order_relaxed));
+
+    Wake();
+}
+
+
+// Wake the loop if it sleeps. Pairs with the fence in LoopThread: either
+// the loop sees the new waiter before it sleeps, or this sees it sleeping.
+void CAsyncLoop::Wake(void)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_fSleeping.load(std::memory_order_relaxed))
+    {
+        SetEvent(m_hWake);
+    }
+}
+
+
+//
+//   FUNCTION: CAsyncLoop::LoopThread(void)
+//
+//   PURPOSE: Watch what the suspended coroutines wait for and resume each
+//   one on the pool as soon as it can make progress or its deadline has
+//   passed. Deadlines are armed in the timing wheel when a waiter comes in
+//   and disarmed when it is resumed early. The loop spins briefly while
+//   there is nothing to do, then sleeps until a coroutine registers, an
+//   object it waits for is signaled or the next deadline, polling the
+//   rings every ASYNC_POLL_INTERVAL milliseconds while any coroutine waits
+//   for one. When the next deadline is less than a millisecond away, the
+//   loop keeps spinning instead.
+//
+void CAsyncLoop::LoopThread(void)
+{
+    std::vector<ASYNC_WAITER *> waiting;
+    uint64_t frequency = IpcTimestampFrequency();
+    unsigned int cIdle = 0;
+
+    for (;;)
+    {
+        bool fResumed = false;
+
+        ASYNC_WAITER *pWaiter = m_pRegistered.exchange(NULL,
+            std::memory_order_acquire);
+        while (pWaiter)
+        {
+            ASYNC_WAITER *pNext = pWaiter->pNext;
+            CTimerWheel::Initialize(&pWaiter->Timeout, OnTimeout, this);
+            if (pWaiter->Deadline)
+            {
+                m_timers.Schedule(&pWaiter->Timeout, pWaiter->Deadline);
+            }
+            if (pWaiter->Kind != ASYNC_WAITER::Timer)
+            {
+                waiting.push_back(pWaiter);
+            }
+            pWaiter = pNext;
+        }
+
+        // Resumes the expired delays and marks the expired channel waiters.
+        fResumed = m_timers.Advance(IpcTimestamp()) != 0;
+
+        bool fStopping = m_fStopping.load(std::memory_order_acquire);
+        bool fPolling = false;
+        for (size_t i = 0; i < waiting.size(); )
+        {
+            ASYNC_WAITER *p = waiting[i];
+            bool fReady = (p->Kind == ASYNC_WAITER::Object) ?
+                p->fSignaled.load(std::memory_order_acquire) :
+                p->pChannel->IsReady(p->Kind);
+            if (!fReady && !p->fTimedOut && !fStopping)
+            {
+                fPolling = fPolling || p->Kind != ASYNC_WAITER::Object;
+                i++;
+                continue;
+            }
+
+            // Once the wait is unregistered its callback has returned, so
+            // it no longer touches the waiter and the flag is final.
+            if (p->Kind == ASYNC_WAITER::Object)
+            {
+                UnregisterWaitEx(p->hWait, INVALID_HANDLE_VALUE);
+                fReady = p->fSignaled.load(std::memory_order_acquire);
+            }
+
+            m_timers.Cancel(&p->Timeout);
+            waiting[i] = waiting.back();
+            waiting.pop_back();
+            p->fTimedOut = !fReady;
+            Resume(p->hCoroutine);
+            fResumed = true;
+        }
+
+        if (fStopping)
+        {
+            fResumed = m_timers.ExpireAll() != 0 || fResumed;
+            if (waiting.empty() &&
+                m_cCoroutines.load(std::memory_order_acquire) == 0)
+            {
+                break;
+            }
+        }
+
+        if (fResumed)
+        {
+            cIdle = 0;
+            continue;
+        }
+        if (++cIdle < ASYNC_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        DWORD dwWait = (fStopping || fPolling) ?
+            ASYNC_POLL_INTERVAL : INFINITE;
+        uint64_t nextExpiry = m_timers.GetNextExpiry();
+        if (nextExpiry != TIMER_WHEEL_NEVER)
+        {
+            uint64_t now = IpcTimestamp();
+            uint64_t ms = (nextExpiry > now) ?
+                (nextExpiry - now) * 1000 / frequency : 0;
+            if (ms < dwWait)
+            {
+                dwWait = (DWORD)ms;
+            }
+        }
+        if (dwWait == 0)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        m_fSleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_pRegistered.load(std::memory_order_relaxed) == NULL)
+        {
+            WaitForSingleObject(m_hWake, dwWait);
+        }
+        m_fSleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+
+// A delay is resumed at once; a channel or object waiter is resumed by the
+// next scan of the loop, which also takes it off the list of waiters.
+void CAsyncLoop::OnTimeout(TIMER_ENTRY *pTimer, PVOID pContext)
+{
+    CAsyncLoop *pLoop = static_cast<CAsyncLoop *>(pContext);
+    ASYNC_WAITER *pWaiter = CONTAINING_RECORD(pTimer, ASYNC_WAITER, Timeout);
+
+    pWaiter->fTimedOut = true;
+    if (pWaiter->Kind == ASYNC_WAITER::Timer)
+    {
+        pLoop->Resume(pWaiter->hCoroutine);
+    }
+}
+
+
+CAsyncLoop::DelayAwaiter::DelayAwaiter(CAsyncLoop &loop, uint64_t cMicroseconds)
+: m_loop(loop),
+  m_cMicroseconds(cMicroseconds)
+{
+    pNext = NULL;
+    pChannel = NULL;
+    Kind = Timer;
+    Deadline = 0;
+    fTimedOut = false;
+}
+
+
+// The delay starts when the coroutine suspends.
+void CAsyncLoop::DelayAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    hCoroutine = h;
+    Deadline = AsyncDeadline(m_cMicroseconds);
+    m_loop.Register(this);
+}
+
+
+CAsyncLoop::ObjectAwaiter::ObjectAwaiter(CAsyncLoop &loop, HANDLE hObject,
+                                         DWORD dwMilliseconds)
+: m_loop(loop),
+  m_hObject(hObject),
+  m_dwMilliseconds(dwMilliseconds),
+  m_fSignaled(false)
+{
+    pNext = NULL;
+    pChannel = NULL;
+    Kind = Object;
+    Deadline = 0;
+    fTimedOut = false;
+    hWait = NULL;
+    fSignaled.store(false, std::memory_order_relaxed);
+}
+
+
+bool CAsyncLoop::ObjectAwaiter::await_ready(void)
+{
+    m_fSignaled = WaitForSingleObject(m_hObject, 0) == WAIT_OBJECT_0;
+    return m_fSignaled || m_dwMilliseconds == 0;
+}
+
+
+//
+//   FUNCTION: CAsyncLoop::ObjectAwaiter::await_suspend(
+//   std::coroutine_handle<>)
+//
+//   PURPOSE: Have the system thread pool wait for the object, then hand the
+//   waiter over to the loop, which keeps its deadline like that of any
+//   other waiter. The callback only raises fSignaled and wakes the loop;
+//   the loop unregisters the wait, waiting for a callback in progress, and
+//   resumes the coroutine, so the wait handle is stored before anyone can
+//   read it and the frame outlives the callback. Stop cuts the wait short
+//   the same way. If the wait cannot be registered, the coroutine goes on
+//   at once as if it had timed out.
+//
+bool CAsyncLoop::ObjectAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    hCoroutine = h;
+    Deadline = AsyncTimeout(m_dwMilliseconds);
+    if (!RegisterWaitForSingleObject(&hWait, m_hObject, WaitCallback, this,
+        INFINITE, WT_EXECUTEONLYONCE))
+    {
+        hWait = NULL;
+        return false;
+    }
+    m_loop.Register(this);
+    return true;
+}
+
+
+// The object was signaled before the coroutine suspended, or the loop has
+// decided the wait (see LoopThread).
+bool CAsyncLoop::ObjectAwaiter::await_resume(void)
+{
+    if (hWait)
+    {
+        m_fSignaled = !fTimedOut;
+    }
+    return m_fSignaled;
+}
+
+
+VOID CALLBACK CAsyncLoop::ObjectAwaiter::WaitCallback(PVOID pContext,
+                                                      BOOLEAN fTimedOut)
+{
+    UNREFERENCED_PARAMETER(fTimedOut);
+
+    // The loop only checks the flag when it wakes, so it is woken even if
+    // it is not asleep yet; the event stays set until then.
+    ObjectAwaiter *pAwaiter = static_cast<ObjectAwaiter *>(pContext);
+    pAwaiter->fSignaled.store(true, std::memory_order_release);
+    SetEvent(pAwaiter->m_loop.m_hWake);
+}
+
+#pragma endregion
+
+
+#pragma region Channel
+
+CAsyncChannel::CAsyncChannel(CAsyncLoop &loop, IPC_SECTION_HEADER *pHeader,
+                             uint32_t iSession, bool fServer, HANDLE hNotify)
+: m_loop(loop),
+  m_geometry(pHeader->Geometry),
+  m_fDurable(IpcIsDurable(pHeader)),
+  m_hNotify(hNotify)
+{
+    IPC_RING_HEADER *pRequests = IpcGetRing(pHeader, iSession,
+        IPC_RING_REQUEST);
+    IPC_RING_HEADER *pReplies = IpcGetRing(pHeader, iSession,
+        IPC_RING_REPLY);
+
+    if (fServer)
+    {
+        m_pIn = pRequests;
+        m_pOut = pReplies;
+        m_pPeerSleeping = &IpcGetSession(pHeader, iSession)->ClientSleeping;
+    }
+    else
+    {
+        m_pIn = pReplies;
+        m_pOut = pRequests;
+        m_pPeerSleeping = &IpcGetShard(pHeader,
+            IpcShardOfSession(pHeader->Geometry, iSession))->ServerSleeping;
+    }
+}
+
+
+bool CAsyncChannel::IsReady(int kind)
+{
+    if (kind == ASYNC_WAITER::Readable)
+    {
+        return IpcRingCount(m_pIn) != 0;
+    }
+    return IpcRingCredits(m_geometry, m_pOut) != 0;
+}
+
+
+// Read a message and let the peer fill the whole ring again: a coroutine
+// consumes its messages as they come.
+bool CAsyncChannel::TryRecv(void *pBuffer, size_t cbBuffer, size_t *pcbData)
+{
+    if (!IpcRingRead(m_geometry, m_pIn, pBuffer, cbBuffer, pcbData))
+    {
+        return false;
+    }
+    if (IpcRingGrant(m_geometry, m_pIn, m_geometry.cSlots) && m_hNotify)
+    {
+        SetEvent(m_hNotify);
+    }
+    return true;
+}
+
+
+bool CAsyncChannel::TrySend(const void *pData, size_t cbData)
+{
+    if (!IpcRingWrite(m_geometry, m_pOut, pData, cbData, m_fDurable))
+    {
+        return false;
+    }
+    Notify();
+    return true;
+}
+
+
+// Wake the peer if it sleeps (see CSessionBroker::Wait for the reasoning
+// behind the fence).
+void CAsyncChannel::Notify(void)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_hNotify && m_pPeerSleeping->load(std::memory_order_relaxed))
+    {
+        SetEvent(m_hNotify);
+    }
+}
+
+
+CAsyncChannel::RecvAwaiter::RecvAwaiter(CAsyncChannel &channel,
+                                        void *pBuffer, size_t cbBuffer,
+                                        size_t *pcbData, DWORD dwTimeout)
+: m_channel(channel),
+  m_pBuffer(pBuffer),
+  m_cbBuffer(cbBuffer),
+  m_pcbData(pcbData),
+  m_dwTimeout(dwTimeout),
+  m_fDone(false)
+{
+    pNext = NULL;
+    pChannel = &channel;
+    Kind = Readable;
+    Deadline = 0;
+    fTimedOut = false;
+}
+
+
+bool CAsyncChannel::RecvAwaiter::await_ready(void)
+{
+    m_fDone = m_channel.TryRecv(m_pBuffer, m_cbBuffer, m_pcbData);
+    return m_fDone || m_dwTimeout == 0;
+}
+
+
+void CAsyncChannel::RecvAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    hCoroutine = h;
+    Deadline = AsyncTimeout(m_dwTimeout);
+    m_channel.m_loop.Register(this);
+}
+
+
+// The loop only resumes the coroutine early when a message is waiting, so
+// the read succeeds unless the wait timed out. A message that arrived just
+// after the deadline is still taken.
+bool CAsyncChannel::RecvAwaiter::await_resume(void)
+{
+    if (m_fDone)
+    {
+        return true;
+    }
+    if (fTimedOut && m_channel.m_loop.IsStopping())
+    {
+        return false;
+    }
+    return m_channel.TryRecv(m_pBuffer, m_cbBuffer, m_pcbData);
+}
+
+
+CAsyncChannel::SendAwaiter::SendAwaiter(CAsyncChannel &channel,
+                                        const void *pData, size_t cbData,
+                                        DWORD dwTimeout)
+: m_channel(channel),
+  m_pData(pData),
+  m_cbData(cbData),
+  m_dwTimeout(dwTimeout),
+  m_fDone(false)
+{
+    pNext = NULL;
+    pChannel = &channel;
+    Kind = Writable;
+    Deadline = 0;
+    fTimedOut = false;
+}
+
+
+// A message that can never fit does not wait for credits.
+bool CAsyncChannel::SendAwaiter::await_ready(void)
+{
+    m_fDone = m_channel.TrySend(m_pData, m_cbData);
+    return m_fDone || m_dwTimeout == 0 ||
+        m_cbData > IpcMaxMessageSize(m_channel.m_geometry);
+}
+
+
+void CAsyncChannel::SendAwaiter::await_suspend(std::coroutine_handle<> h)
+{
+    hCoroutine = h;
+    Deadline = AsyncTimeout(m_dwTimeout);
+    m_channel.m_loop.Register(this);
+}
+
+
+bool CAsyncChannel::SendAwaiter::await_resume(void)
+{
+    if (m_fDone)
+    {
+        return true;
+    }
+    if (fTimedOut && m_channel.m_loop.IsStopping())
+    {
+        return false;
+    }
+    return m_channel.TrySend(m_pData, m_cbData);
+}
+
+#pragma endregion
@@ -0,0 +1,443 @@
+/****************************** Module Header ******************************\
+* Module Name:  AsyncChannel.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares an awaitable API over the session rings of the shared section
+* (see IpcChannel.h), so that a session can be written as a coroutine
+* instead of a thread that blocks:
+* 
+*     CAsyncTask Echo(CAsyncChannel &channel)
+*     {
+*         BYTE buffer[256];
+*         size_t cb;
+*         while (co_await channel.Recv(buffer, sizeof(buffer), &cb))
+*         {
+*             co_await channel.Send(buffer, cb);
+*         }
+*     }
+* 
+*     CAsyncLoop loop;
+*     loop.Start();
+*     loop.Spawn(Echo(channel));
+*     ...
+*     loop.Stop();        // Cancels the waits and waits for the coroutines
+* 
+* A single loop thread watches the rings and timers that coroutines wait
+* for and resumes each coroutine on a thread pool worker once it can make
+* progress, so thousands of sessions share a handful of threads. Deadlines
+* are kept in a timing wheel (see TimerWheel.h) that the loop advances, and
+* the loop spins rather than sleeps when the next one is less than a
+* millisecond away, so timeouts hold to a fraction of a millisecond.
+* Coroutine frames are recycled through per-thread free lists (CFramePool)
+* instead of being allocated from the heap for every session.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <thread>
+#include <vector>
+#include "IpcChannel.h"
+#include "ThreadPool.h"
+#include "TimerWheel.h"
+
+// Coroutine frames are rounded up to ASYNC_FRAME_GRANULARITY bytes. Frames
+// up to ASYNC_MAX_POOLED_FRAME bytes are recycled; each thread keeps at
+// most ASYNC_FRAME_CACHE free frames of each size.
+#define ASYNC_FRAME_GRANULARITY 64
+#define ASYNC_MAX_POOLED_FRAME  2048
+#define ASYNC_FRAME_CACHE       1024
+
+// Number of idle passes the loop spins before it sleeps, and the longest
+// it sleeps, in milliseconds, while coroutines wait for rings that another
+// process fills.
+#define ASYNC_SPIN_COUNT        64
+#define ASYNC_POLL_INTERVAL     1
+
+
+class CAsyncLoop;
+class CAsyncChannel;
+
+
+#pragma region Frame Pool
+
+class CFramePool
+{
+public:
+
+    static void *Allocate(size_t cbFrame);
+    static void Free(void *pFrame, size_t cbFrame);
+
+private:
+
+    static const size_t ClassCount =
+        ASYNC_MAX_POOLED_FRAME / ASYNC_FRAME_GRANULARITY;
+
+    struct FREE_FRAME
+    {
+        FREE_FRAME *pNext;
+    };
+
+    // The free frames of one thread. Frames are freed by whichever thread
+    // finishes the coroutine, so a cache may hold frames allocated by
+    // another thread.
+    struct CACHE
+    {
+        FREE_FRAME *pHead[ClassCount];
+        size_t cFrames[ClassCount];
+
+        CACHE(void);
+        ~CACHE(void);
+    };
+
+    static CACHE &GetCache(void);
+};
+
+#pragma endregion
+
+
+#pragma region Task
+
+//
+//   CLASS: CAsyncTask
+//
+//   PURPOSE: The return type of a coroutine started with CAsyncLoop::Spawn.
+//   The coroutine runs until it returns; nobody waits for its result. It
+//   must not let an exception escape.
+//
+class CAsyncTask
+{
+public:
+
+    struct promise_type
+    {
+        CAsyncLoop *pLoop;
+
+        promise_type(void) : pLoop(NULL)
+        {
+        }
+
+        CAsyncTask get_return_object(void)
+        {
+            return CAsyncTask(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        // The coroutine is started by Spawn, on the thread pool.
+        std::suspend_always initial_suspend(void) noexcept
+        {
+            return std::suspend_always();
+        }
+
+        struct FinalAwaiter
+        {
+            bool await_ready(void) noexcept { return false; }
+            void await_suspend(std::coroutine_handle<promise_type> h) noexcept;
+            void await_resume(void) noexcept {}
+        };
+
+        FinalAwaiter final_suspend(void) noexcept
+        {
+            return FinalAwaiter();
+        }
+
+        void return_void(void)
+        {
+        }
+
+        void unhandled_exception(void)
+        {
+            std::terminate();
+        }
+
+        static void *operator new(size_t cbFrame)
+        {
+            return CFramePool::Allocate(cbFrame);
+        }
+
+        static void operator delete(void *pFrame, size_t cbFrame)
+        {
+            CFramePool::Free(pFrame, cbFrame);
+        }
+    };
+
+    CAsyncTask(CAsyncTask &&other) : m_hCoroutine(other.m_hCoroutine)
+    {
+        other.m_hCoroutine = NULL;
+    }
+
+    // A task that was never spawned is destroyed without running.
+    ~CAsyncTask(void)
+    {
+        if (m_hCoroutine)
+        {
+            m_hCoroutine.destroy();
+        }
+    }
+
+private:
+
+    friend class CAsyncLoop;
+
+    explicit CAsyncTask(std::coroutine_handle<promise_type> hCoroutine)
+        : m_hCoroutine(hCoroutine)
+    {
+    }
+
+    CAsyncTask(const CAsyncTask &);
+    CAsyncTask &operator=(const CAsyncTask &);
+
+    std::coroutine_handle<promise_type> m_hCoroutine;
+};
+
+#pragma endregion
+
+
+#pragma region Waiters
+
+// What a suspended coroutine waits for. Waiters live in the frame of the
+// waiting coroutine and are linked into the loop while it is suspended.
+struct ASYNC_WAITER
+{
+    enum
+    {
+        Timer,                      // Only the deadline
+        Readable,                   // A message in the input ring
+        Writable,                   // Credits for the output ring
+        Object                      // A kernel object to be signaled
+    };
+
+    ASYNC_WAITER *pNext;
+    std::coroutine_handle<> hCoroutine;
+    CAsyncChannel *pChannel;
+    int Kind;
+    uint64_t Deadline;              // IpcTimestamp ticks; 0 for none
+    bool fTimedOut;                 // Resumed by the deadline or by Stop
+
+    // Object: the wait registered with the system thread pool, and the
+    // flag its callback sets. Only the loop thread unregisters the wait,
+    // and resumes the coroutine after that.
+    HANDLE hWait;
+    std::atomic<bool> fSignaled;
+
+    // Armed by the loop thread with the deadline.
+    TIMER_ENTRY Timeout;
+};
+
+#pragma endregion
+
+
+#pragma region Loop
+
+class CAsyncLoop
+{
+public:
+
+    // Coroutines are resumed on the workers of the pool. Throws the Win32
+    // error code if the wake event cannot be created.
+    explicit CAsyncLoop(CThreadPool &pool = CThreadPool::Default());
+
+    // Stop the loop if it is running.
+    ~CAsyncLoop(void);
+
+    // Start the loop thread.
+    void Start(void);
+
+    // Resume every waiting coroutine as timed out, wait until all the
+    // spawned coroutines have returned and join the loop thread. Coroutines
+    // should check IsStopping when a wait fails and return.
+    void Stop(void);
+
+    bool IsStopping(void) const
+    {
+        return m_fStopping.load(std::memory_order_acquire);
+    }
+
+    // Run a coroutine on the thread pool. The loop keeps track of it until
+    // it returns.
+    void Spawn(CAsyncTask task);
+
+    // Number of spawned coroutines that have not returned yet.
+    long GetCoroutineCount(void) const
+    {
+        return m_cCoroutines.load(std::memory_order_relaxed);
+    }
+
+    // co_await loop.Delay(ms), loop.DelayMicroseconds(us): resume the
+    // coroutine after the delay. The result is false if the loop is
+    // stopping.
+    class DelayAwaiter : private ASYNC_WAITER
+    {
+    public:
+        DelayAwaiter(CAsyncLoop &loop, uint64_t cMicroseconds);
+        bool await_ready(void) { return false; }
+        void await_suspend(std::coroutine_handle<> hCoroutine);
+        bool await_resume(void) { return !m_loop.IsStopping(); }
+    private:
+        CAsyncLoop &m_loop;
+        uint64_t m_cMicroseconds;
+    };
+
+    DelayAwaiter Delay(DWORD dwMilliseconds)
+    {
+        return DelayAwaiter(*this, (uint64_t)dwMilliseconds * 1000);
+    }
+
+    DelayAwaiter DelayMicroseconds(uint64_t cMicroseconds)
+    {
+        return DelayAwaiter(*this, cMicroseconds);
+    }
+
+    // co_await loop.Wait(handle, ms): resume the coroutine when the kernel
+    // object is signaled, the timeout elapses or the loop is stopping. The
+    // result is true if the object was signaled.
+    class ObjectAwaiter : private ASYNC_WAITER
+    {
+    public:
+        ObjectAwaiter(CAsyncLoop &loop, HANDLE hObject, DWORD dwMilliseconds);
+        bool await_ready(void);
+        bool await_suspend(std::coroutine_handle<> hCoroutine);
+        bool await_resume(void);
+    private:
+        static VOID CALLBACK WaitCallback(PVOID pContext, BOOLEAN fTimedOut);
+        CAsyncLoop &m_loop;
+        HANDLE m_hObject;
+        DWORD m_dwMilliseconds;
+        bool m_fSignaled;
+    };
+
+    ObjectAwaiter Wait(HANDLE hObject, DWORD dwMilliseconds)
+    {
+        return ObjectAwaiter(*this, hObject, dwMilliseconds);
+    }
+
+private:
+
+    friend struct CAsyncTask::promise_type::FinalAwaiter;
+    friend class CAsyncChannel;
+
+    CAsyncLoop(const CAsyncLoop &);
+    CAsyncLoop &operator=(const CAsyncLoop &);
+
+    void Register(ASYNC_WAITER *pWaiter);
+    void Resume(std::coroutine_handle<> hCoroutine);
+    void OnCoroutineDone(void);
+    void Wake(void);
+    void LoopThread(void);
+    static void OnTimeout(TIMER_ENTRY *pTimer, PVOID pContext);
+
+    CThreadPool &m_pool;
+    HANDLE m_hWake;
+    std::thread m_thread;
+
+    // Waiters registered since the last pass of the loop, pushed by the
+    // coroutines and taken all at once by the loop thread.
+    std::atomic<ASYNC_WAITER *> m_pRegistered;
+
+    // Deadlines of the waiters; only touched by the loop thread.
+    CTimerWheel m_timers;
+
+    std::atomic<bool> m_fStopping;
+    std::atomic<bool> m_fSleeping;
+    std::atomic<long> m_cCoroutines;
+};
+
+#pragma endregion
+
+
+#pragma region Channel
+
+class CAsyncChannel
+{
+public:
+
+    // One end of a session. The client end writes the request ring and
+    // reads the reply ring; the server end does the opposite. hNotify is
+    // the event to set when the peer sleeps and a message or credits are
+    // published: the doorbell for a client, the session event for a
+    // server. It may be NULL when the peer never sleeps.
+    CAsyncChannel(CAsyncLoop &loop, IPC_SECTION_HEADER *pHeader,
+        uint32_t iSession, bool fServer, HANDLE hNotify = NULL);
+
+    // co_await channel.Recv(buffer, cb, &cbData[, timeout]): wait for the
+    // next message and copy it into the buffer. The result is false on
+    // timeout or when the loop is stopping.
+    class RecvAwaiter : private ASYNC_WAITER
+    {
+    public:
+        RecvAwaiter(CAsyncChannel &channel, void *pBuffer, size_t cbBuffer,
+            size_t *pcbData, DWORD dwTimeout);
+        bool await_ready(void);
+        void await_suspend(std::coroutine_handle<> hCoroutine);
+        bool await_resume(void);
+    private:
+        CAsyncChannel &m_channel;
+        void *m_pBuffer;
+        size_t m_cbBuffer;
+        size_t *m_pcbData;
+        DWORD m_dwTimeout;
+        bool m_fDone;
+    };
+
+    RecvAwaiter Recv(void *pBuffer, size_t cbBuffer, size_t *pcbData,
+        DWORD dwTimeout = INFINITE)
+    {
+        return RecvAwaiter(*this, pBuffer, cbBuffer, pcbData, dwTimeout);
+    }
+
+    // co_await channel.Send(data, cb[, timeout]): wait for a credit and
+    // publish the message. The result is false on timeout, when the loop
+    // is stopping or when the message does not fit into a slot.
+    class SendAwaiter : private ASYNC_WAITER
+    {
+    public:
+        SendAwaiter(CAsyncChannel &channel, const void *pData, size_t cbData,
+            DWORD dwTimeout);
+        bool await_ready(void);
+        void await_suspend(std::coroutine_handle<> hCoroutine);
+        bool await_resume(void);
+    private:
+        CAsyncChannel &m_channel;
+        const void *m_pData;
+        size_t m_cbData;
+        DWORD m_dwTimeout;
+        bool m_fDone;
+    };
+
+    SendAwaiter Send(const void *pData, size_t cbData,
+        DWORD dwTimeout = INFINITE)
+    {
+        return SendAwaiter(*this, pData, cbData, dwTimeout);
+    }
+
+private:
+
+    friend class CAsyncLoop;
+
+    bool IsReady(int kind);
+    bool TryRecv(void *pBuffer, size_t cbBuffer, size_t *pcbData);
+    bool TrySend(const void *pData, size_t cbData);
+    void Notify(void);
+
+    CAsyncLoop &m_loop;
+    IPC_GEOMETRY m_geometry;
+    IPC_RING_HEADER *m_pIn;
+    IPC_RING_HEADER *m_pOut;
+    bool m_fDurable;
+    std::atomic<uint32_t> *m_pPeerSleeping;
+    HANDLE m_hNotify;
+};
+
+#pragma endregion
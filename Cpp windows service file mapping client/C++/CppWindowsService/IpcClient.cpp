@@ -0,0 +1,489 @@
+/****************************** Module Header ******************************\
+* Module Name:  IpcClient.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the reconnecting client of the shared section.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <stdio.h>
+#include "IpcClient.h"
+#pragma endregion
+
+
+// Number of sessions the process has opened, mixed into the hash that
+// picks the shard of the next one.
+static std::atomic<uint32_t> g_cSessionsOpened(0);
+
+
+CIpcClient::CIpcClient(PCWSTR pszMapName)
+: m_pszMapName(pszMapName),
+  m_hMapFile(NULL),
+  m_pView(NULL),
+  m_pHeader(NULL),
+  m_generation(0),
+  m_iSession(-1),
+  m_iShard(0),
+  m_hServerProcess(NULL),
+  m_hDoorbell(NULL),
+  m_hReplyEvent(NULL),
+  m_dwBackoff(IPC_RECONNECT_MIN_DELAY),
+  m_ullNextAttempt(0),
+  m_cConnects(0)
+{
+    memset(&m_geometry, 0, sizeof(m_geometry));
+}
+
+
+CIpcClient::~CIpcClient(void)
+{
+    Close();
+}
+
+
+//
+//   FUNCTION: CIpcClient::EnsureConnected(void)
+//
+//   PURPOSE: Make one connection attempt if the client is disconnected and
+//   the attempt is due. A failed attempt doubles the delay before the next
+//   one; a successful one resets it.
+//
+//   RETURN VALUE: true if the client is connected. Otherwise false, and
+//   GetLastError tells why the last attempt failed.
+//
+bool CIpcClient::EnsureConnected(void)
+{
+    if (IsConnected())
+    {
+        return true;
+    }
+
+    ULONGLONG ullNow = GetTickCount64();
+    if (ullNow < m_ullNextAttempt)
+    {
+        SetLastError(ERROR_RETRY);
+        return false;
+    }
+
+    DWORD dwError = Connect();
+    if (dwError == ERROR_SUCCESS)
+    {
+        m_dwBackoff = IPC_RECONNECT_MIN_DELAY;
+        m_cConnects++;
+        return true;
+    }
+
+    Close();
+    m_ullNextAttempt = GetTickCount64() + m_dwBackoff;
+    m_dwBackoff = (m_dwBackoff < IPC_RECONNECT_MAX_DELAY / 2) ?
+        m_dwBackoff * 2 : IPC_RECONNECT_MAX_DELAY;
+
+    SetLastError(dwError);
+    return false;
+}
+
+
+void CIpcClient::Disconnect(void)
+{
+    Close();
+    m_dwBackoff = IPC_RECONNECT_MIN_DELAY;
+    m_ullNextAttempt = 0;
+}
+
+
+bool CIpcClient::CheckServer(void)
+{
+    if (!IsConnected())
+    {
+        return false;
+    }
+    if (IsServerLost() || IsSessionClosed())
+    {
+        Disconnect();
+        return false;
+    }
+    return true;
+}
+
+
+//
+//   FUNCTION: CIpcClient::Send(const void *, size_t)
+//
+//   PURPOSE: Publish a request and wake the server if it sleeps. A request
+//   the server has not granted credits for is not queued: the caller sheds
+//   it, or tries again after reading replies.
+//
+bool CIpcClient::Send(const void *pData, size_t cbData)
+{
+    if (!IsConnected())
+    {
+        SetLastError(ERROR_NOT_CONNECTED);
+        return false;
+    }
+    if (cbData > IpcMaxMessageSize(m_geometry))
+    {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return false;
+    }
+    if (!IpcRingWrite(m_geometry,
+        IpcGetRing(m_pHeader, m_iSession, IPC_RING_REQUEST), pData, cbData,
+        IpcIsDurable(m_pHeader)))
+    {
+        SetLastError(ERROR_BUSY);
+        return false;
+    }
+
+    RingDoorbell();
+    return true;
+}
+
+
+//
+//   FUNCTION: CIpcClient::Receive(void *, size_t, size_t *, DWORD)
+//
+//   PURPOSE: Wait for the next reply. The client polls the reply ring for
+//   a short while, then advertises that it is sleeping and waits for the
+//   server to signal the session event, or for the server process to exit.
+//
+bool CIpcClient::Receive(void *pBuffer, size_t cbBuffer, size_t *pcbData,
+                         DWORD dwTimeout)
+{
+    if (!IsConnected())
+    {
+        return false;
+    }
+
+    IPC_SESSION *pSession = IpcGetSession(m_pHeader, m_iSession);
+    IPC_RING_HEADER *pReplies = IpcGetRing(m_pHeader, m_iSession,
+        IPC_RING_REPLY);
+    ULONGLONG ullStart = GetTickCount64();
+
+    for (unsigned int i = 0; ; i++)
+    {
+        if (IpcRingRead(m_geometry, pReplies, pBuffer, cbBuffer, pcbData))
+        {
+            // The reply is consumed at once, so the server may fill the
+            // whole ring; wake it if it was waiting for the slot.
+            if (IpcRingGrant(m_geometry, pReplies, m_geometry.cSlots))
+            {
+                SetEvent(m_hDoorbell);
+            }
+            return true;
+        }
+        if (i < IPC_CLIENT_SPIN_COUNT)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        ULONGLONG ullElapsed = GetTickCount64() - ullStart;
+        if (ullElapsed >= dwTimeout)
+        {
+            return false;
+        }
+        DWORD dwWait = (DWORD)(dwTimeout - ullElapsed);
+
+        // Without a handle to the server process, wake up now and then to
+        // look at the generation of the section.
+        HANDLE handles[2] = { m_hReplyEvent, m_hServerProcess };
+        DWORD cHandles = 2;
+        if (m_hServerProcess == NULL)
+        {
+            cHandles = 1;
+            if (dwWait > IPC_SERVER_CHECK_INTERVAL)
+            {
+                dwWait = IPC_SERVER_CHECK_INTERVAL;
+            }
+        }
+
+        // Advertise that the client is waiting and look once more, so that
+        // a reply published in between is not missed (see
+        // CSessionBroker::Wait on the server).
+        pSession->ClientSleeping.store(1, std::memory_order_seq_cst);
+        DWORD dwResult = WAIT_TIMEOUT;
+        if (IpcRingCount(pReplies) == 0)
+        {
+            dwResult = WaitForMultipleObjects(cHandles, handles, FALSE, dwWait);
+        }
+        pSession->ClientSleeping.store(0, std::memory_order_relaxed);
+
+        if (dwResult == WAIT_OBJECT_0 + 1 || IsServerLost() ||
+            IsSessionClosed())
+        {
+            Disconnect();
+            return false;
+        }
+    }
+}
+
+
+DWORD CIpcClient::GetRetryDelay(void) const
+{
+    ULONGLONG ullNow = GetTickCount64();
+    if (IsConnected() || ullNow >= m_ullNextAttempt)
+    {
+        return 0;
+    }
+    return (DWORD)(m_ullNextAttempt - ullNow);
+}
+
+
+//
+//   FUNCTION: CIpcClient::Connect(void)
+//
+//   PURPOSE: Map the section, open a session in it and wait until the
+//   server accepts the session. On failure the caller closes whatever was
+//   opened.
+//
+//   RETURN VALUE: ERROR_SUCCESS, or the Win32 error code of the step that
+//   failed.
+//
+DWORD CIpcClient::Connect(void)
+{
+    DWORD dwError = OpenSection(m_pszMapName);
+    if (dwError != ERROR_SUCCESS)
+    {
+        return dwError;
+    }
+
+    // A server that has resized the section points from the first section
+    // to the current one.
+    uint32_t successor = IpcGetHeader(m_pView)->Successor.load(
+        std::memory_order_acquire);
+    if (successor != 0)
+    {
+        wchar_t szMapName[MAX_PATH];
+        swprintf_s(szMapName, ARRAYSIZE(szMapName), IPC_SUCCESSOR_FORMAT,
+            m_pszMapName, successor);
+        UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+        CloseHandle(m_hMapFile);
+        m_hMapFile = NULL;
+
+        dwError = OpenSection(szMapName);
+        if (dwError != ERROR_SUCCESS)
+        {
+            return dwError;
+        }
+
+        // Superseded again in the meantime; the next attempt starts over.
+        if (IpcGetHeader(m_pView)->Successor.load(std::memory_order_acquire))
+        {
+            return ERROR_RETRY;
+        }
+    }
+
+    m_pHeader = IpcGetHeader(m_pView);
+    m_geometry = m_pHeader->Geometry;
+    m_generation = m_pHeader->Generation.load(std::memory_order_acquire);
+
+    // Watch the server process, so that its exit is noticed at once. A
+    // server that runs under another account may not let the client open
+    // it; a new server is then still noticed by the generation.
+    m_hServerProcess = OpenProcess(SYNCHRONIZE, FALSE, m_pHeader->ServerPid);
+
+    // The hash spreads the clients over the shards of the server; the
+    // doorbell is the one of the shard the session ends up in.
+    m_iSession = IpcOpenSession(m_pHeader, GetCurrentProcessId(),
+        IpcHashClient(GetCurrentProcessId(),
+        g_cSessionsOpened.fetch_add(1, std::memory_order_relaxed)));
+    if (m_iSession < 0)
+    {
+        return ERROR_NO_MORE_ITEMS;
+    }
+    m_iShard = IpcShardOfSession(m_geometry, (uint32_t)m_iSession);
+
+    wchar_t szDoorbellName[64];
+    IpcFormatDoorbellName(szDoorbellName, ARRAYSIZE(szDoorbellName), m_iShard);
+    m_hDoorbell = OpenEvent(EVENT_MODIFY_STATE, FALSE, szDoorbellName);
+    if (m_hDoorbell == NULL)
+    {
+        return GetLastError();
+    }
+
+    if (!WaitForAccept())
+    {
+        return ERROR_TIMEOUT;
+    }
+
+    wchar_t szEventName[64];
+    swprintf_s(szEventName, ARRAYSIZE(szEventName), IPC_SESSION_EVENT_FORMAT,
+        (unsigned int)m_iSession);
+    m_hReplyEvent = OpenEvent(SYNCHRONIZE, FALSE, szEventName);
+    if (m_hReplyEvent == NULL)
+    {
+        return GetLastError();
+    }
+
+    return ERROR_SUCCESS;
+}
+
+
+//
+//   FUNCTION: CIpcClient::OpenSection(PCWSTR)
+//
+//   PURPOSE: Open and map a section and check that the server has laid it
+//   out. On failure the caller closes whatever was opened.
+//
+//   RETURN VALUE: ERROR_SUCCESS, or the Win32 error code of the step that
+//   failed.
+//
+DWORD CIpcClient::OpenSection(PCWSTR pszMapName)
+{
+    m_hMapFile = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, pszMapName);
+    if (m_hMapFile == NULL)
+    {
+        return GetLastError();
+    }
+
+    // Map the whole section, whatever its size.
+    m_pView = MapViewOfFile(m_hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (m_pView == NULL)
+    {
+        return GetLastError();
+    }
+
+    MEMORY_BASIC_INFORMATION info;
+    SIZE_T cbView = 0;
+    if (VirtualQuery(m_pView, &info, sizeof(info)) != 0)
+    {
+        cbView = info.RegionSize;
+    }
+
+    // The server may not have finished laying the section out.
+    if (!IpcValidateSection(m_pView, cbView))
+    {
+        return ERROR_INVALID_DATA;
+    }
+    return ERROR_SUCCESS;
+}
+
+
+bool CIpcClient::WaitForAccept(void)
+{
+    IPC_SESSION *pSession = IpcGetSession(m_pHeader, m_iSession);
+    ULONGLONG ullDeadline = GetTickCount64() + IPC_ACCEPT_TIMEOUT;
+
+    RingDoorbell();
+    for (;;)
+    {
+        uint32_t state = pSession->State.load(std::memory_order_acquire);
+        if (state == IPC_SESSION_ACTIVE)
+        {
+            return true;
+        }
+        if (state != IPC_SESSION_CONNECTING || IsServerLost() ||
+            GetTickCount64() >= ullDeadline)
+        {
+            return false;
+        }
+        ::Sleep(1);
+    }
+}
+
+
+//
+//   FUNCTION: CIpcClient::IsServerLost(void)
+//
+//   PURPOSE: Whether the server that the client connected to has exited,
+//   or another server has laid the section out or recovered it since.
+//
+bool CIpcClient::IsServerLost(void) const
+{
+    if (m_hServerProcess &&
+        WaitForSingleObject(m_hServerProcess, 0) == WAIT_OBJECT_0)
+    {
+        return true;
+    }
+    return m_pHeader->Magic != IPC_SECTION_MAGIC ||
+        m_pHeader->Generation.load(std::memory_order_acquire) != m_generation;
+}
+
+
+//
+//   FUNCTION: CIpcClient::IsSessionClosed(void)
+//
+//   PURPOSE: Whether the server has closed the session, because it stayed
+//   idle for too long, or has already handed the slot to another client.
+//
+bool CIpcClient::IsSessionClosed(void) const
+{
+    IPC_SESSION *pSession = IpcGetSession(m_pHeader, m_iSession);
+    return pSession->State.load(std::memory_order_acquire) !=
+        IPC_SESSION_ACTIVE || pSession->ClientPid != GetCurrentProcessId();
+}
+
+
+// Wake the shard of the server that serves the session if it is waiting
+// for requests (see CSessionBroker::Wait for the reasoning behind the
+// fence).
+void CIpcClient::RingDoorbell(void)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (IpcGetShard(m_pHeader, m_iShard)->ServerSleeping.load(
+        std::memory_order_relaxed))
+    {
+        SetEvent(m_hDoorbell);
+    }
+}
+
+
+void CIpcClient::Close(void)
+{
+    if (m_iSession >= 0)
+    {
+        // Give the session back so that the broker frees it. Once another
+        // server has laid the section out, or the broker has freed the slot
+        // of an idle session, the slot is no longer the client's and is
+        // left alone.
+        IPC_SESSION *pSession = IpcGetSession(m_pHeader, (uint32_t)m_iSession);
+        if (m_pHeader->Generation.load(std::memory_order_acquire) ==
+            m_generation &&
+            pSession->State.load(std::memory_order_acquire) != IPC_SESSION_FREE &&
+            pSession->ClientPid == GetCurrentProcessId())
+        {
+            IpcCloseSession(m_pHeader, (uint32_t)m_iSession);
+            RingDoorbell();
+        }
+        m_iSession = -1;
+    }
+
+    if (m_hReplyEvent)
+    {
+        CloseHandle(m_hReplyEvent);
+        m_hReplyEvent = NULL;
+    }
+    if (m_hDoorbell)
+    {
+        CloseHandle(m_hDoorbell);
+        m_hDoorbell = NULL;
+    }
+    if (m_hServerProcess)
+    {
+        CloseHandle(m_hServerProcess);
+        m_hServerProcess = NULL;
+    }
+
+    // Unmap the view, so that a new server creates a fresh section instead
+    // of reusing the one this client kept alive.
+    m_pHeader = NULL;
+    if (m_pView)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+    }
+    if (m_hMapFile)
+    {
+        CloseHandle(m_hMapFile);
+        m_hMapFile = NULL;
+    }
+}
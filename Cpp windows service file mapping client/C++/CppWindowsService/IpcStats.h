@@ -0,0 +1,372 @@
+/****************************** Module Header ******************************\
+* Module Name:  IpcStats.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Defines the statistics section that the services publish next to the
+* shared section. The section is created by the service and mapped read-only
+* by monitoring tools such as ipcstat, which sample it without sending a
+* message to the service.
+* 
+*     IPC_STATS_HEADER         magic, version, clock frequency and the
+*                              counters not attributed to a listed session
+*     after the header         IPC_SESSION_STATS[cSessions]
+* 
+* Every counter has exactly one writer at a time: a session's counters are
+* written by the worker that serves it, and the header counters by the
+* service thread. Updates are therefore plain relaxed loads and stores, with
+* no locked instruction on the hot path. Readers see each counter
+* atomically but not a consistent snapshot of all of them, which is enough
+* for monitoring.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "IpcChannel.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <sddl.h>
+#endif
+
+
+#pragma region Names and Layout
+
+// Statistics of the server service and of the client service.
+#define IPC_STATS_NAME          L"Global\\SampleMapStats"
+#define IPC_CLIENT_STATS_NAME   L"Global\\SampleMapClientStats"
+
+#define IPC_STATS_MAGIC         0x53435049      // 'IPCS'
+#define IPC_STATS_VERSION       2
+
+// Latency histogram: bucket 0 counts messages answered in less than 1
+// microsecond, bucket i (i > 0) those answered in [2^(i-1), 2^i)
+// microseconds. The last bucket also counts everything slower.
+#define IPC_LATENCY_BUCKETS     24
+
+struct IPC_STATS_COUNTERS
+{
+    std::atomic<uint64_t> cMessagesIn;
+    std::atomic<uint64_t> cBytesIn;
+    std::atomic<uint64_t> cMessagesOut;
+    std::atomic<uint64_t> cBytesOut;
+    std::atomic<uint64_t> cDropped;         // Messages discarded unanswered
+    std::atomic<uint64_t> InDepth;          // Incoming messages waiting
+    std::atomic<uint64_t> OutDepth;         // Outgoing messages not yet read
+    std::atomic<uint64_t> Credits;          // Incoming messages the peer may
+                                            // still queue (see IpcRingGrant)
+    std::atomic<uint64_t> cBackpressure;    // Outgoing messages held back or
+                                            // shed for lack of credits, and
+                                            // incoming ones held back by a
+                                            // rate limit
+    std::atomic<uint64_t> Latency[IPC_LATENCY_BUCKETS];
+};
+
+struct IPC_SESSION_STATS
+{
+    alignas(64) std::atomic<uint32_t> fActive;
+    std::atomic<uint32_t> ClientPid;
+    IPC_STATS_COUNTERS Counters;
+};
+
+struct IPC_STATS_HEADER
+{
+    alignas(64) uint32_t Magic;             // IPC_STATS_MAGIC
+    uint32_t Version;                       // IPC_STATS_VERSION
+    uint64_t cbSection;
+    uint32_t ProcessId;                     // The publishing process
+    uint32_t cSessions;                     // Entries in the session table
+    uint64_t Frequency;                     // Timestamp ticks per second
+    uint64_t StartTime;                     // Timestamp of the publication
+
+    std::atomic<uint64_t> cSessionsOpened;
+    std::atomic<uint64_t> cSessionsClosed;
+
+    // Traffic not attributed to a listed session: the client's own traffic,
+    // and on the server the totals of the sessions that have closed.
+    IPC_STATS_COUNTERS Counters;
+};
+
+static_assert(sizeof(IPC_STATS_HEADER) % alignof(IPC_SESSION_STATS) == 0,
+    "The session table must follow the header without padding");
+
+// A plain copy of the counters, summed over the header and the sessions.
+struct IPC_STATS_SNAPSHOT
+{
+    uint64_t cMessagesIn;
+    uint64_t cBytesIn;
+    uint64_t cMessagesOut;
+    uint64_t cBytesOut;
+    uint64_t cDropped;
+    uint64_t InDepth;
+    uint64_t OutDepth;
+    uint64_t Credits;
+    uint64_t cBackpressure;
+    uint64_t Latency[IPC_LATENCY_BUCKETS];
+    uint64_t cSessionsOpened;
+    uint64_t cSessionsClosed;
+    uint32_t cActiveSessions;
+};
+
+#pragma endregion
+
+
+#pragma region Helpers
+
+inline size_t IpcStatsSize(uint32_t cSessions)
+{
+    return sizeof(IPC_STATS_HEADER) +
+        static_cast<size_t>(cSessions) * sizeof(IPC_SESSION_STATS);
+}
+
+inline IPC_SESSION_STATS *IpcGetSessionStats(IPC_STATS_HEADER *pStats,
+                                             uint32_t iSession)
+{
+    return reinterpret_cast<IPC_SESSION_STATS *>(pStats + 1) + iSession;
+}
+
+inline const IPC_SESSION_STATS *IpcGetSessionStats(
+    const IPC_STATS_HEADER *pStats, uint32_t iSession)
+{
+    return reinterpret_cast<const IPC_SESSION_STATS *>(pStats + 1) + iSession;
+}
+
+// Add to a counter that has a single writer.
+inline void IpcStatsAdd(std::atomic<uint64_t> &counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+        std::memory_order_relaxed);
+}
+
+inline void IpcStatsSet(std::atomic<uint64_t> &counter, uint64_t value)
+{
+    counter.store(value, std::memory_order_relaxed);
+}
+
+// The histogram bucket of a latency, in timestamp ticks.
+inline unsigned int IpcLatencyBucket(uint64_t ticks, uint64_t frequency)
+{
+    uint64_t microseconds = ticks * 1000000 / frequency;
+    unsigned int bucket = 0;
+    while (microseconds != 0 && bucket < IPC_LATENCY_BUCKETS - 1)
+    {
+        microseconds >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// Upper bound, in microseconds, of a histogram bucket.
+inline uint64_t IpcLatencyBucketLimit(unsigned int bucket)
+{
+    return 1ull << bucket;
+}
+
+inline void IpcStatsReset(IPC_STATS_COUNTERS &counters)
+{
+    IpcStatsSet(counters.cMessagesIn, 0);
+    IpcStatsSet(counters.cBytesIn, 0);
+    IpcStatsSet(counters.cMessagesOut, 0);
+    IpcStatsSet(counters.cBytesOut, 0);
+    IpcStatsSet(counters.cDropped, 0);
+    IpcStatsSet(counters.InDepth, 0);
+    IpcStatsSet(counters.OutDepth, 0);
+    IpcStatsSet(counters.Credits, 0);
+    IpcStatsSet(counters.cBackpressure, 0);
+    for (unsigned int i = 0; i < IPC_LATENCY_BUCKETS; i++)
+    {
+        IpcStatsSet(counters.Latency[i], 0);
+    }
+}
+
+// Fold the counters of a closing session into the header totals. Depths
+// and credits are not cumulative and are left out.
+inline void IpcStatsRetire(IPC_STATS_COUNTERS &totals,
+                           const IPC_STATS_COUNTERS &counters)
+{
+    IpcStatsAdd(totals.cMessagesIn, counters.cMessagesIn.load(std::memory_order_relaxed));
+    IpcStatsAdd(totals.cBytesIn, counters.cBytesIn.load(std::memory_order_relaxed));
+    IpcStatsAdd(totals.cMessagesOut, counters.cMessagesOut.load(std::memory_order_relaxed));
+    IpcStatsAdd(totals.cBytesOut, counters.cBytesOut.load(std::memory_order_relaxed));
+    IpcStatsAdd(totals.cDropped, counters.cDropped.load(std::memory_order_relaxed));
+    IpcStatsAdd(totals.cBackpressure, counters.cBackpressure.load(std::memory_order_relaxed));
+    for (unsigned int i = 0; i < IPC_LATENCY_BUCKETS; i++)
+    {
+        IpcStatsAdd(totals.Latency[i], counters.Latency[i].load(std::memory_order_relaxed));
+    }
+}
+
+//
+//   FUNCTION: IpcInitializeStats(void *, size_t, uint32_t, uint32_t,
+//   uint64_t, uint64_t)
+//
+//   PURPOSE: Lay out a new, zero-filled statistics section. The magic is
+//   written last, so a reader that sees it sees a complete header.
+//
+inline IPC_STATS_HEADER *IpcInitializeStats(void *pView, size_t cbView,
+                                            uint32_t cSessions,
+                                            uint32_t processId,
+                                            uint64_t frequency,
+                                            uint64_t startTime)
+{
+    IPC_STATS_HEADER *pStats = static_cast<IPC_STATS_HEADER *>(pView);
+
+    pStats->Version = IPC_STATS_VERSION;
+    pStats->cbSection = cbView;
+    pStats->ProcessId = processId;
+    pStats->cSessions = cSessions;
+    pStats->Frequency = frequency;
+    pStats->StartTime = startTime;
+
+    std::atomic_thread_fence(std::memory_order_release);
+    pStats->Magic = IPC_STATS_MAGIC;
+    return pStats;
+}
+
+inline bool IpcValidateStats(const void *pView, size_t cbView)
+{
+    const IPC_STATS_HEADER *pStats = static_cast<const IPC_STATS_HEADER *>(pView);
+    if (cbView < sizeof(IPC_STATS_HEADER) || pStats->Magic != IPC_STATS_MAGIC)
+    {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return pStats->Version == IPC_STATS_VERSION && pStats->Frequency != 0 &&
+        IpcStatsSize(pStats->cSessions) <= cbView;
+}
+
+//
+//   FUNCTION: IpcSnapshotStats(const IPC_STATS_HEADER *, IPC_STATS_SNAPSHOT *)
+//
+//   PURPOSE: Sum the header counters and those of the active sessions into
+//   a plain structure. Reads the section only.
+//
+inline void IpcSnapshotStats(const IPC_STATS_HEADER *pStats,
+                             IPC_STATS_SNAPSHOT *pSnapshot)
+{
+    memset(pSnapshot, 0, sizeof(*pSnapshot));
+    pSnapshot->cSessionsOpened = pStats->cSessionsOpened.load(std::memory_order_relaxed);
+    pSnapshot->cSessionsClosed = pStats->cSessionsClosed.load(std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i <= pStats->cSessions; i++)
+    {
+        const IPC_STATS_COUNTERS *pCounters = &pStats->Counters;
+        if (i != 0)
+        {
+            const IPC_SESSION_STATS *pSession = IpcGetSessionStats(pStats, i - 1);
+            if (!pSession->fActive.load(std::memory_order_relaxed))
+            {
+                continue;
+            }
+            pSnapshot->cActiveSessions++;
+            pCounters = &pSession->Counters;
+        }
+
+        pSnapshot->cMessagesIn += pCounters->cMessagesIn.load(std::memory_order_relaxed);
+        pSnapshot->cBytesIn += pCounters->cBytesIn.load(std::memory_order_relaxed);
+        pSnapshot->cMessagesOut += pCounters->cMessagesOut.load(std::memory_order_relaxed);
+        pSnapshot->cBytesOut += pCounters->cBytesOut.load(std::memory_order_relaxed);
+        pSnapshot->cDropped += pCounters->cDropped.load(std::memory_order_relaxed);
+        pSnapshot->InDepth += pCounters->InDepth.load(std::memory_order_relaxed);
+        pSnapshot->OutDepth += pCounters->OutDepth.load(std::memory_order_relaxed);
+        pSnapshot->Credits += pCounters->Credits.load(std::memory_order_relaxed);
+        pSnapshot->cBackpressure += pCounters->cBackpressure.load(std::memory_order_relaxed);
+        for (unsigned int j = 0; j < IPC_LATENCY_BUCKETS; j++)
+        {
+            pSnapshot->Latency[j] += pCounters->Latency[j].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+#pragma endregion
+
+
+#ifdef _WIN32
+
+#pragma region Publishing
+
+// Everyone may map the statistics for reading; only the system,
+// administrators and the publishing service may write them.
+#define IPC_STATS_SDDL          L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GA;;;OW)(A;;GR;;;WD)"
+
+//
+//   FUNCTION: IpcCreateStats(PCWSTR, uint32_t, HANDLE *)
+//
+//   PURPOSE: Create and map a statistics section for the calling process
+//   and initialize it. Readers get read access only.
+//
+//   RETURN VALUE: The header of the section, or NULL on failure, in which
+//   case GetLastError gives the reason.
+//
+inline IPC_STATS_HEADER *IpcCreateStats(PCWSTR pszName, uint32_t cSessions,
+                                        HANDLE *phMapFile)
+{
+    SECURITY_ATTRIBUTES SecAttr, *pSec = NULL;
+    PSECURITY_DESCRIPTOR pSecDesc = NULL;
+    if (ConvertStringSecurityDescriptorToSecurityDescriptorW(IPC_STATS_SDDL,
+        SDDL_REVISION_1, &pSecDesc, NULL))
+    {
+        SecAttr.nLength = sizeof(SecAttr);
+        SecAttr.lpSecurityDescriptor = pSecDesc;
+        SecAttr.bInheritHandle = FALSE;
+        pSec = &SecAttr;
+    }
+
+    size_t cbStats = IpcStatsSize(cSessions);
+    HANDLE hMapFile = CreateFileMapping(INVALID_HANDLE_VALUE, pSec,
+        PAGE_READWRITE, 0, (DWORD)cbStats, pszName);
+    DWORD dwError = GetLastError();
+    if (pSecDesc)
+    {
+        LocalFree(pSecDesc);
+    }
+    if (hMapFile == NULL)
+    {
+        SetLastError(dwError);
+        return NULL;
+    }
+
+    void *pView = MapViewOfFile(hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, cbStats);
+    if (pView == NULL)
+    {
+        dwError = GetLastError();
+        CloseHandle(hMapFile);
+        SetLastError(dwError);
+        return NULL;
+    }
+
+    // A reader may still hold the section of a previous run; start over.
+    memset(pView, 0, cbStats);
+
+    *phMapFile = hMapFile;
+    return IpcInitializeStats(pView, cbStats, cSessions,
+        GetCurrentProcessId(), IpcTimestampFrequency(), IpcTimestamp());
+}
+
+inline void IpcCloseStats(IPC_STATS_HEADER *pStats, HANDLE hMapFile)
+{
+    if (pStats)
+    {
+        UnmapViewOfFile(pStats);
+    }
+    if (hMapFile)
+    {
+        CloseHandle(hMapFile);
+    }
+}
+
+#pragma endregion
+
+#endif
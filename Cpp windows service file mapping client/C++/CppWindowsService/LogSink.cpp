@@ -0,0 +1,475 @@
+/****************************** Module Header ******************************\
+* Module Name:  LogSink.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the asynchronous logger and its event log and file sinks.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <stdlib.h>
+#endif
+#include <string.h>
+#include <time.h>
+#include <chrono>
+#include "LogSink.h"
+#pragma endregion
+
+
+#pragma region Helper Functions
+
+static unsigned long long CurrentTimestamp(void)
+{
+    return static_cast<unsigned long long>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+static bool IsSameMessage(const LOG_RECORD &a, const LOG_RECORD &b)
+{
+    return a.wType == b.wType && wcscmp(a.szMessage, b.szMessage) == 0;
+}
+
+#pragma endregion
+
+
+#pragma region Event Log Sink
+
+#ifdef _WIN32
+
+CEventLogSink::CEventLogSink(const wchar_t *pszSourceName)
+: m_pszSourceName(pszSourceName)
+{
+    m_hEventSource = RegisterEventSource(NULL, pszSourceName);
+}
+
+
+CEventLogSink::~CEventLogSink(void)
+{
+    if (m_hEventSource)
+    {
+        DeregisterEventSource(m_hEventSource);
+        m_hEventSource = NULL;
+    }
+}
+
+
+//
+//   FUNCTION: CEventLogSink::WriteBatch(const LOG_RECORD *, size_t)
+//
+//   PURPOSE: Report a batch of records to the Application event log with
+//   the event source that was registered when the sink was created.
+//
+void CEventLogSink::WriteBatch(const LOG_RECORD *pRecords, size_t cRecords)
+{
+    if (m_hEventSource == NULL)
+    {
+        // The source could not be registered when the service started
+        // (the event log service may have been starting too). Try again.
+        m_hEventSource = RegisterEventSource(NULL, m_pszSourceName);
+        if (m_hEventSource == NULL)
+        {
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < cRecords; i++)
+    {
+        LPCWSTR lpszStrings[2] = { m_pszSourceName, pRecords[i].szMessage };
+
+        ReportEvent(m_hEventSource, // Event log handle
+            pRecords[i].wType,      // Event type
+            0,                      // Event category
+            0,                      // Event identifier
+            NULL,                   // No security identifier
+            2,                      // Size of lpszStrings array
+            0,                      // No binary data
+            lpszStrings,            // Array of strings
+            NULL                    // No binary data
+            );
+    }
+}
+
+#endif
+
+#pragma endregion
+
+
+#pragma region File Sink
+
+CFileLogSink::CFileLogSink(const wchar_t *pszPath) : m_pFile(NULL)
+{
+#ifdef _WIN32
+    _wfopen_s(&m_pFile, pszPath, L"a");
+#else
+    char szPath[4096];
+    if (wcstombs(szPath, pszPath, sizeof(szPath)) < sizeof(szPath))
+    {
+        m_pFile = fopen(szPath, "a");
+    }
+#endif
+}
+
+
+CFileLogSink::~CFileLogSink(void)
+{
+    if (m_pFile)
+    {
+        fclose(m_pFile);
+        m_pFile = NULL;
+    }
+}
+
+
+//
+//   FUNCTION: CFileLogSink::WriteBatch(const LOG_RECORD *, size_t)
+//
+//   PURPOSE: Append a batch of records to the file as lines of the form
+//   "2013-05-01 12:00:00.000 INFO message", then flush the file once.
+//
+void CFileLogSink::WriteBatch(const LOG_RECORD *pRecords, size_t cRecords)
+{
+    if (m_pFile == NULL)
+    {
+        return;
+    }
+
+    for (size_t i = 0; i < cRecords; i++)
+    {
+        const LOG_RECORD &record = pRecords[i];
+
+        time_t seconds = static_cast<time_t>(record.ullTimestamp / 1000);
+        struct tm utc;
+#ifdef _WIN32
+        gmtime_s(&utc, &seconds);
+#else
+        gmtime_r(&seconds, &utc);
+#endif
+
+        const wchar_t *pszType =
+            (record.wType == LOG_TYPE_ERROR) ? L"ERROR" :
+            (record.wType == LOG_TYPE_WARNING) ? L"WARN " : L"INFO ";
+
+        fwprintf(m_pFile, L"%04d-%02d-%02d %02d:%02d:%02d.%03u %ls %ls\n",
+            utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+            utc.tm_hour, utc.tm_min, utc.tm_sec,
+            static_cast<unsigned int>(record.ullTimestamp % 1000),
+            pszType, record.szMessage);
+    }
+
+    fflush(m_pFile);
+}
+
+#pragma endregion
+
+
+#pragma region Async Logger
+
+CAsyncLogger::CAsyncLogger(CLogSink *pSink, unsigned int cRateLimit)
+: m_pSink(pSink),
+  m_fSleeping(false),
+  m_fStopping(false),
+  m_fFlushRequested(false),
+  m_cQueued(0),
+  m_cProcessed(0),
+  m_cDropped(0),
+  m_cSuppressed(0),
+  m_cBatch(0),
+  m_cRepeats(0),
+  m_cSuppressedPending(0),
+  m_cRateLimit(cRateLimit),
+  m_tokens(cRateLimit),
+  m_ullLastRefill(0)
+{
+    m_last.wType = 0;
+    m_last.ullTimestamp = 0;
+    m_last.szMessage[0] = L'\0';
+
+    m_thread = std::thread(&CAsyncLogger::LoggerThread, this);
+}
+
+
+CAsyncLogger::~CAsyncLogger(void)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_fStopping = true;
+        m_cvWork.notify_one();
+    }
+    m_thread.join();
+}
+
+
+//
+//   FUNCTION: CAsyncLogger::Log(unsigned short, const wchar_t *)
+//
+//   PURPOSE: Queue a message for the logger thread. The message is copied
+//   (and truncated to LOG_MESSAGE_LENGTH) into a queue slot; the function
+//   never waits for the sink.
+//
+bool CAsyncLogger::Log(unsigned short wType, const wchar_t *pszMessage)
+{
+    return LogFormat(wType, L"%ls", pszMessage);
+}
+
+
+bool CAsyncLogger::LogFormat(unsigned short wType,
+                             const wchar_t *pszFormat, ...)
+{
+    va_list args;
+    va_start(args, pszFormat);
+    bool fQueued = LogFormatV(wType, pszFormat, args);
+    va_end(args);
+    return fQueued;
+}
+
+
+bool CAsyncLogger::LogFormatV(unsigned short wType,
+                              const wchar_t *pszFormat, va_list args)
+{
+    size_t position;
+    LOG_RECORD *pRecord = m_queue.BeginPush(position);
+    if (pRecord == NULL)
+    {
+        m_cDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    pRecord->wType = wType;
+    pRecord->ullTimestamp = CurrentTimestamp();
+    if (vswprintf(pRecord->szMessage, LOG_MESSAGE_LENGTH, pszFormat, args) < 0)
+    {
+        // The message did not fit. Keep what was formatted.
+        pRecord->szMessage[LOG_MESSAGE_LENGTH - 1] = L'\0';
+    }
+
+    Publish(position);
+    return true;
+}
+
+
+void CAsyncLogger::Publish(size_t position)
+{
+    m_cQueued.fetch_add(1, std::memory_order_relaxed);
+    m_queue.EndPush(position);
+
+    // Only wake the logger thread if it is asleep, so that logging takes
+    // the mutex only when the logger is idle. The fence pairs with the one
+    // in LoggerThread: either the logger sees this record before it waits,
+    // or this thread sees m_fSleeping set. The notification is made under
+    // the mutex, which the logger holds from its last look at the queue
+    // until it waits, so it cannot be lost in between.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_fSleeping.load())
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_cvWork.notify_one();
+    }
+}
+
+
+void CAsyncLogger::Flush(void)
+{
+    unsigned long long cTarget = m_cQueued.load();
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_fFlushRequested = true;
+    m_cvWork.notify_one();
+    while (m_fFlushRequested || m_cProcessed.load() < cTarget)
+    {
+        m_cvFlushed.wait(lock);
+    }
+}
+
+
+unsigned long long CAsyncLogger::GetDroppedCount(void) const
+{
+    return m_cDropped.load(std::memory_order_relaxed);
+}
+
+
+unsigned long long CAsyncLogger::GetSuppressedCount(void) const
+{
+    return m_cSuppressed.load(std::memory_order_relaxed);
+}
+
+
+//
+//   FUNCTION: CAsyncLogger::LoggerThread(void)
+//
+//   PURPOSE: The logger thread. It drains the queue into a batch, filters
+//   the records, writes the batch to the sink and sleeps when there is
+//   nothing left to do.
+//
+void CAsyncLogger::LoggerThread(void)
+{
+    m_ullLastRefill = CurrentTimestamp();
+
+    for (;;)
+    {
+        // Drain up to a batch. Filter appends at most three records (two
+        // summaries and the record itself).
+        LOG_RECORD record;
+        while (m_cBatch + 3 <= LOG_BATCH_SIZE && m_queue.TryPop(record))
+        {
+            Filter(record);
+            m_cProcessed.fetch_add(1);
+        }
+
+        if (m_cBatch > 0)
+        {
+            WriteBatch();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if (m_queue.IsHeadReady())
+        {
+            continue;
+        }
+
+        // A cell a producer has claimed but not yet published counts in
+        // GetCount but cannot be taken yet. Finish a flush or a stop only
+        // once it has been processed; until then sleep below, and Publish
+        // wakes the logger when the producer is done.
+        if ((m_fFlushRequested || m_fStopping) && m_queue.GetCount() == 0)
+        {
+            // Everything queued has been processed; report what was held
+            // back so the sink is complete.
+            lock.unlock();
+            AppendSummaries(CurrentTimestamp());
+            WriteBatch();
+            lock.lock();
+
+            m_fFlushRequested = false;
+            m_cvFlushed.notify_all();
+
+            if (m_fStopping && m_queue.GetCount() == 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        m_fSleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::cv_status status = std::cv_status::no_timeout;
+        if (!m_queue.IsHeadReady())
+        {
+            status = m_cvWork.wait_for(lock,
+                std::chrono::milliseconds(LOG_IDLE_INTERVAL));
+        }
+        m_fSleeping.store(false);
+
+        if (status == std::cv_status::timeout && !m_queue.IsHeadReady())
+        {
+            lock.unlock();
+            AppendSummaries(CurrentTimestamp());
+            WriteBatch();
+        }
+    }
+}
+
+
+//
+//   FUNCTION: CAsyncLogger::Filter(const LOG_RECORD &)
+//
+//   PURPOSE: Decide what to do with a record taken from the queue. A record
+//   that repeats the previous one appended within LOG_REPEAT_WINDOW of it
+//   is only counted. Otherwise the record is appended, after the pending
+//   summaries, if the rate limit allows it, and becomes the previous one;
+//   a record the limit drops is counted as suppressed, and so are its
+//   repeats while the limit lasts, since it never reached the log.
+//
+void CAsyncLogger::Filter(const LOG_RECORD &record)
+{
+    if (IsSameMessage(record, m_last) &&
+        record.ullTimestamp < m_last.ullTimestamp + LOG_REPEAT_WINDOW)
+    {
+        m_cRepeats++;
+        return;
+    }
+
+    // Refill the token bucket. The bucket holds at most one second worth
+    // of records.
+    if (record.ullTimestamp > m_ullLastRefill)
+    {
+        unsigned long long ullElapsed = record.ullTimestamp - m_ullLastRefill;
+        m_tokens += ullElapsed * m_cRateLimit / 1000.0;
+        if (m_tokens > m_cRateLimit)
+        {
+            m_tokens = m_cRateLimit;
+        }
+        m_ullLastRefill = record.ullTimestamp;
+    }
+
+    if (m_tokens < 1.0)
+    {
+        m_cSuppressedPending++;
+        m_cSuppressed.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    AppendSummaries(record.ullTimestamp);
+    m_last = record;
+    m_tokens -= 1.0;
+    m_batch[m_cBatch++] = record;
+}
+
+
+void CAsyncLogger::AppendSummaries(unsigned long long ullTimestamp)
+{
+    if (m_cRepeats > 0)
+    {
+        Append(m_last.wType, ullTimestamp,
+            L"The previous message was repeated %lu more time(s)", m_cRepeats);
+        m_cRepeats = 0;
+    }
+
+    if (m_cSuppressedPending > 0)
+    {
+        Append(LOG_TYPE_WARNING, ullTimestamp,
+            L"%lu message(s) were suppressed by the rate limit",
+            m_cSuppressedPending);
+        m_cSuppressedPending = 0;
+    }
+}
+
+
+void CAsyncLogger::Append(unsigned short wType,
+                          unsigned long long ullTimestamp,
+                          const wchar_t *pszFormat, ...)
+{
+    LOG_RECORD &record = m_batch[m_cBatch++];
+    record.wType = wType;
+    record.ullTimestamp = ullTimestamp;
+
+    va_list args;
+    va_start(args, pszFormat);
+    vswprintf(record.szMessage, LOG_MESSAGE_LENGTH, pszFormat, args);
+    va_end(args);
+}
+
+
+void CAsyncLogger::WriteBatch(void)
+{
+    if (m_cBatch > 0)
+    {
+        m_pSink->WriteBatch(m_batch, m_cBatch);
+        m_cBatch = 0;
+    }
+}
+
+#pragma endregion
@@ -0,0 +1,172 @@
+/****************************** Module Header ******************************\
+* Module Name:  MpscQueue.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* A bounded, lock-free, multiple-producer single-consumer queue. The queue
+* is an array of cells, each carrying a sequence number that tells
+* producers and the consumer whose turn it is to use the cell (the scheme
+* described by Dmitry Vyukov). Producers claim a cell with one atomic
+* increment and never wait for each other or for the consumer: when the
+* queue is full, TryPush fails immediately and the caller decides what to
+* drop.
+* 
+*     CMpscQueue<LOG_RECORD, 1024> queue;
+* 
+*     // Any thread.
+*     size_t position;
+*     LOG_RECORD *pRecord = queue.BeginPush(position);
+*     if (pRecord)
+*     {
+*         // Fill in *pRecord.
+*         queue.EndPush(position);
+*     }
+* 
+*     // The consumer thread.
+*     LOG_RECORD record;
+*     while (queue.TryPop(record)) { ... }
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+
+template <typename T, size_t Capacity>
+class CMpscQueue
+{
+    static_assert((Capacity & (Capacity - 1)) == 0,
+        "Capacity must be a power of two");
+
+public:
+
+    CMpscQueue() : m_tail(0), m_head(0)
+    {
+        for (size_t i = 0; i < Capacity; i++)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Claim a cell to construct an element in place. Returns NULL when the
+    // queue is full. Every successful BeginPush must be followed by
+    // EndPush with the position it returned.
+    T *BeginPush(size_t &position)
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = m_cells[pos & (Capacity - 1)];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            ptrdiff_t diff = static_cast<ptrdiff_t>(sequence) -
+                static_cast<ptrdiff_t>(pos);
+
+            if (diff == 0)
+            {
+                if (m_tail.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed))
+                {
+                    position = pos;
+                    return &cell.value;
+                }
+            }
+            else if (diff < 0)
+            {
+                // The consumer has not freed this cell yet: full.
+                return NULL;
+            }
+            else
+            {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Publish an element claimed with BeginPush to the consumer.
+    void EndPush(size_t position)
+    {
+        m_cells[position & (Capacity - 1)].sequence.store(position + 1,
+            std::memory_order_release);
+    }
+
+    // Copy an element into the queue. Returns false when the queue is full.
+    bool TryPush(const T &value)
+    {
+        size_t position;
+        T *pValue = BeginPush(position);
+        if (pValue == NULL)
+        {
+            return false;
+        }
+        *pValue = value;
+        EndPush(position);
+        return true;
+    }
+
+    // Take the oldest element. Must only be called from the consumer
+    // thread. Returns false when the queue is empty or when the oldest
+    // element is still being written by its producer.
+    bool TryPop(T &value)
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        Cell &cell = m_cells[pos & (Capacity - 1)];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+
+        if (sequence != pos + 1)
+        {
+            return false;
+        }
+
+        value = std::move(cell.value);
+        cell.sequence.store(pos + Capacity, std::memory_order_release);
+        m_head.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Whether the oldest element has been published and TryPop would take
+    // it. Must only be called from the consumer thread. Unlike GetCount,
+    // this excludes a cell that a producer has claimed but not yet
+    // published.
+    bool IsHeadReady() const
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        return m_cells[pos & (Capacity - 1)].sequence.load(
+            std::memory_order_acquire) == pos + 1;
+    }
+
+    // An estimate of the number of queued elements, including those whose
+    // producers have not finished writing them.
+    size_t GetCount() const
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_relaxed);
+        return (tail > head) ? (tail - head) : 0;
+    }
+
+private:
+
+    CMpscQueue(const CMpscQueue &);
+    CMpscQueue &operator=(const CMpscQueue &);
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    // Producers and the consumer update different indices; keep them on
+    // different cache lines.
+    alignas(64) std::atomic<size_t> m_tail;
+    alignas(64) std::atomic<size_t> m_head;
+    alignas(64) Cell m_cells[Capacity];
+};
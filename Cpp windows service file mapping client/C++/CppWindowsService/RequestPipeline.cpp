@@ -0,0 +1,452 @@
+/****************************** Module Header ******************************\
+* Module Name:  RequestPipeline.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the staged pipeline of decode, handler and reply threads.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include "RequestPipeline.h"
+#include "IpcChannel.h"
+#include <stdio.h>
+#include <string.h>
+#pragma endregion
+
+
+CRequestPipeline::CRequestPipeline(unsigned int cHandlers,
+                                   unsigned int cBatch)
+: m_cHandlers(cHandlers),
+  m_cBatch(cBatch),
+  m_cStages(cHandlers + 2),
+  m_cClosedLevels(0),
+  m_fStarted(false),
+  m_nextSequence(0),
+  m_lastReport(IpcTimestamp())
+{
+    if (cHandlers == 0 || cHandlers > PIPELINE_MAX_HANDLERS || cBatch == 0)
+    {
+        throw (DWORD)ERROR_INVALID_PARAMETER;
+    }
+
+    m_pHandlerIn.reset(new ITEM_QUEUE[m_cHandlers]);
+    m_pHandlerOut.reset(new ITEM_QUEUE[m_cHandlers]);
+    m_pStages.reset(new STAGE[m_cStages]);
+
+    for (unsigned int i = 0; i < m_cStages; i++)
+    {
+        STAGE &stage = m_pStages[i];
+        stage.Level = (i == 0) ? LevelDecode :
+            (i <= m_cHandlers) ? LevelHandle : LevelReply;
+        stage.hWake = NULL;
+        stage.fSleeping.store(0, std::memory_order_relaxed);
+        stage.cItems.store(0, std::memory_order_relaxed);
+        stage.BusyTime.store(0, std::memory_order_relaxed);
+        stage.PeakDepth.store(0, std::memory_order_relaxed);
+        stage.cItemsReported = 0;
+        stage.BusyTimeReported = 0;
+    }
+
+    for (unsigned int i = 0; i < m_cStages; i++)
+    {
+        m_pStages[i].hWake = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (m_pStages[i].hWake == NULL)
+        {
+            DWORD dwError = GetLastError();
+            for (unsigned int j = 0; j < i; j++)
+            {
+                CloseHandle(m_pStages[j].hWake);
+            }
+            throw dwError;
+        }
+    }
+}
+
+
+CRequestPipeline::~CRequestPipeline(void)
+{
+    Stop();
+
+    for (unsigned int i = 0; i < m_cStages; i++)
+    {
+        CloseHandle(m_pStages[i].hWake);
+    }
+}
+
+
+void CRequestPipeline::Start(void)
+{
+    if (m_fStarted)
+    {
+        return;
+    }
+
+    m_cClosedLevels.store(0, std::memory_order_release);
+    m_lastReport = IpcTimestamp();
+    m_fStarted = true;
+
+    m_pStages[0].thread = std::thread(&CRequestPipeline::RunDecode, this);
+    for (unsigned int i = 0; i < m_cHandlers; i++)
+    {
+        m_pStages[1 + i].thread = std::thread(&CRequestPipeline::RunHandler,
+            this, i);
+    }
+    m_pStages[m_cStages - 1].thread = std::thread(&CRequestPipeline::RunReply,
+        this);
+}
+
+
+// Close the levels one after the other: once the threads of a level have
+// been joined nothing more enters the queues of the next one, which then
+// drains them and exits in turn.
+void CRequestPipeline::Stop(void)
+{
+    if (!m_fStarted)
+    {
+        return;
+    }
+
+    for (unsigned int level = 0; level < LevelCount; level++)
+    {
+        m_cClosedLevels.store(level + 1, std::memory_order_seq_cst);
+        for (unsigned int i = 0; i < m_cStages; i++)
+        {
+            if (m_pStages[i].Level == level)
+            {
+                SetEvent(m_pStages[i].hWake);
+            }
+        }
+        for (unsigned int i = 0; i < m_cStages; i++)
+        {
+            if (m_pStages[i].Level == level &&
+                m_pStages[i].thread.joinable())
+            {
+                m_pStages[i].thread.join();
+            }
+        }
+    }
+
+    m_fStarted = false;
+}
+
+
+bool CRequestPipeline::Submit(uint32_t key, const void *pData, size_t cbData)
+{
+    if (!m_fStarted)
+    {
+        return false;
+    }
+
+    PIPELINE_ITEM *pItem = m_input.BeginPush();
+    if (pItem == NULL)
+    {
+        return false;
+    }
+
+    pItem->Key = key;
+    pItem->Sequence = m_nextSequence++;
+    pItem->Timestamp = IpcTimestamp();
+    pItem->dwResult = ERROR_SUCCESS;
+    if (cbData > sizeof(pItem->Data))
+    {
+        cbData = sizeof(pItem->Data);
+        pItem->dwResult = ERROR_MORE_DATA;
+    }
+    pItem->cbData = (uint32_t)cbData;
+    memcpy(pItem->Data, pData, cbData);
+    m_input.EndPush();
+
+    Wake(0);
+    return true;
+}
+
+
+void CRequestPipeline::FormatReport(PWSTR pszReport, size_t cchReport)
+{
+    uint64_t now = IpcTimestamp();
+    uint64_t elapsed = now - m_lastReport;
+    m_lastReport = now;
+    if (elapsed == 0)
+    {
+        elapsed = 1;
+    }
+
+    size_t cch = 0;
+    pszReport[0] = L'\0';
+    for (unsigned int i = 0; i < m_cStages && cch < cchReport; i++)
+    {
+        STAGE &stage = m_pStages[i];
+        uint64_t cItems = stage.cItems.load(std::memory_order_relaxed);
+        uint64_t busy = stage.BusyTime.load(std::memory_order_relaxed);
+        uint64_t peak = stage.PeakDepth.exchange(0,
+            std::memory_order_relaxed);
+
+        uint64_t cItemsDelta = cItems - stage.cItemsReported;
+        uint64_t busyDelta = busy - stage.BusyTimeReported;
+        stage.cItemsReported = cItems;
+        stage.BusyTimeReported = busy;
+
+        WCHAR szName[32];
+        if (stage.Level == LevelHandle)
+        {
+            swprintf_s(szName, ARRAYSIZE(szName), L"handle %u", i - 1);
+        }
+        else
+        {
+            swprintf_s(szName, ARRAYSIZE(szName), L"%s",
+                (stage.Level == LevelDecode) ? L"decode" : L"reply");
+        }
+
+        int cchWritten = _snwprintf_s(pszReport + cch, cchReport - cch,
+            _TRUNCATE, L"%s%s: %llu messages, %llu%% busy, depth %llu "
+            L"(peak %llu)", (i == 0) ? L"" : L"; ", szName,
+            (unsigned long long)cItemsDelta,
+            (unsigned long long)(busyDelta * 100 / elapsed),
+            (unsigned long long)GetDepth(i), (unsigned long long)peak);
+        if (cchWritten < 0)
+        {
+            break;
+        }
+        cch += cchWritten;
+    }
+}
+
+
+void CRequestPipeline::Decode(PIPELINE_ITEM &)
+{
+}
+
+
+void CRequestPipeline::Handle(PIPELINE_ITEM &)
+{
+}
+
+
+void CRequestPipeline::Reply(PIPELINE_ITEM &)
+{
+}
+
+
+//
+//   FUNCTION: CRequestPipeline::RunDecode(void)
+//
+//   PURPOSE: The decode thread. It decodes the submitted messages in place
+//   and copies each into the queue of the handler that owns its session.
+//   When that queue is full it wakes the handler and waits for room, which
+//   holds back the rest of the batch and, in the end, Submit.
+//
+void CRequestPipeline::RunDecode(void)
+{
+    while (WaitForWork(0))
+    {
+        uint64_t start = IpcTimestamp();
+        size_t depth = GetDepth(0);
+        uint64_t touched = 0;
+        size_t cItems = 0;
+
+        PIPELINE_ITEM *pItem;
+        while (cItems < m_cBatch && (pItem = m_input.Front()) != NULL)
+        {
+            Decode(*pItem);
+
+            unsigned int iHandler = pItem->Key % m_cHandlers;
+            ITEM_QUEUE &queue = m_pHandlerIn[iHandler];
+            PIPELINE_ITEM *pOut;
+            while ((pOut = queue.BeginPush()) == NULL)
+            {
+                Wake(1 + iHandler);
+                std::this_thread::yield();
+            }
+            memcpy(pOut, pItem, offsetof(PIPELINE_ITEM, Data) +
+                pItem->cbData);
+            queue.EndPush();
+            m_input.Pop();
+
+            touched |= (uint64_t)1 << iHandler;
+            cItems++;
+        }
+
+        for (unsigned int i = 0; i < m_cHandlers; i++)
+        {
+            if (touched & ((uint64_t)1 << i))
+            {
+                Wake(1 + i);
+            }
+        }
+        Account(0, start, cItems, depth);
+    }
+}
+
+
+//
+//   FUNCTION: CRequestPipeline::RunHandler(unsigned int)
+//
+//   PURPOSE: A handler thread. It handles the messages of its sessions in
+//   place, in the order they arrive, and passes them on to the reply
+//   thread through a queue of its own.
+//
+void CRequestPipeline::RunHandler(unsigned int iHandler)
+{
+    unsigned int iStage = 1 + iHandler;
+    ITEM_QUEUE &input = m_pHandlerIn[iHandler];
+    ITEM_QUEUE &output = m_pHandlerOut[iHandler];
+
+    while (WaitForWork(iStage))
+    {
+        uint64_t start = IpcTimestamp();
+        size_t depth = GetDepth(iStage);
+        size_t cItems = 0;
+
+        PIPELINE_ITEM *pItem;
+        while (cItems < m_cBatch && (pItem = input.Front()) != NULL)
+        {
+            Handle(*pItem);
+
+            PIPELINE_ITEM *pOut;
+            while ((pOut = output.BeginPush()) == NULL)
+            {
+                Wake(m_cStages - 1);
+                std::this_thread::yield();
+            }
+            memcpy(pOut, pItem, offsetof(PIPELINE_ITEM, Data) +
+                pItem->cbData);
+            output.EndPush();
+            input.Pop();
+            cItems++;
+        }
+
+        Wake(m_cStages - 1);
+        Account(iStage, start, cItems, depth);
+    }
+}
+
+
+//
+//   FUNCTION: CRequestPipeline::RunReply(void)
+//
+//   PURPOSE: The reply thread. It takes up to a batch from the queue of
+//   every handler in turn, so a busy handler cannot starve the others.
+//
+void CRequestPipeline::RunReply(void)
+{
+    unsigned int iStage = m_cStages - 1;
+
+    while (WaitForWork(iStage))
+    {
+        uint64_t start = IpcTimestamp();
+        size_t depth = GetDepth(iStage);
+        size_t cItems = 0;
+
+        for (unsigned int i = 0; i < m_cHandlers; i++)
+        {
+            ITEM_QUEUE &queue = m_pHandlerOut[i];
+            PIPELINE_ITEM *pItem;
+            for (unsigned int c = 0; c < m_cBatch &&
+                (pItem = queue.Front()) != NULL; c++)
+            {
+                Reply(*pItem);
+                queue.Pop();
+                cItems++;
+            }
+        }
+
+        Account(iStage, start, cItems, depth);
+    }
+}
+
+
+// Wait until the stage has work. Spins for a while, then advertises that
+// it sleeps and waits for its producer to wake it. Returns false once the
+// level of the stage is closed and its input is empty.
+bool CRequestPipeline::WaitForWork(unsigned int iStage)
+{
+    STAGE &stage = m_pStages[iStage];
+
+    for (unsigned int cSpins = 0; ; cSpins++)
+    {
+        if (GetDepth(iStage) != 0)
+        {
+            return true;
+        }
+        if (m_cClosedLevels.load(std::memory_order_acquire) > stage.Level)
+        {
+            // Nothing enters a closed level; look once more for a message
+            // pushed just before it was closed.
+            return GetDepth(iStage) != 0;
+        }
+        if (cSpins < PIPELINE_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        stage.fSleeping.store(1, std::memory_order_seq_cst);
+        if (GetDepth(iStage) == 0 &&
+            m_cClosedLevels.load(std::memory_order_seq_cst) <= stage.Level)
+        {
+            WaitForSingleObject(stage.hWake, PIPELINE_IDLE_WAIT);
+        }
+        stage.fSleeping.store(0, std::memory_order_relaxed);
+        cSpins = 0;
+    }
+}
+
+
+// The number of messages waiting for the stage.
+size_t CRequestPipeline::GetDepth(unsigned int iStage)
+{
+    if (iStage == 0)
+    {
+        return m_input.GetCount();
+    }
+    if (iStage <= m_cHandlers)
+    {
+        return m_pHandlerIn[iStage - 1].GetCount();
+    }
+
+    size_t depth = 0;
+    for (unsigned int i = 0; i < m_cHandlers; i++)
+    {
+        depth += m_pHandlerOut[i].GetCount();
+    }
+    return depth;
+}
+
+
+// Wake a stage after pushing into its input. The fence orders the push
+// before the check of fSleeping, as the stage orders fSleeping before its
+// last look at the queue, so one of the two always sees the other.
+void CRequestPipeline::Wake(unsigned int iStage)
+{
+    STAGE &stage = m_pStages[iStage];
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (stage.fSleeping.load(std::memory_order_relaxed))
+    {
+        SetEvent(stage.hWake);
+    }
+}
+
+
+// Add a batch to the counters of the stage. Only the thread of the stage
+// writes them, so plain stores suffice.
+void CRequestPipeline::Account(unsigned int iStage, uint64_t start,
+                               size_t cItems, size_t depth)
+{
+    STAGE &stage = m_pStages[iStage];
+    stage.cItems.store(stage.cItems.load(std::memory_order_relaxed) +
+        cItems, std::memory_order_relaxed);
+    stage.BusyTime.store(stage.BusyTime.load(std::memory_order_relaxed) +
+        (IpcTimestamp() - start), std::memory_order_relaxed);
+    if (depth > stage.PeakDepth.load(std::memory_order_relaxed))
+    {
+        stage.PeakDepth.store(depth, std::memory_order_relaxed);
+    }
+}
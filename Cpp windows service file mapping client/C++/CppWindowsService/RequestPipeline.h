@@ -0,0 +1,177 @@
+/****************************** Module Header ******************************\
+* Module Name:  RequestPipeline.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares CRequestPipeline, which processes the messages of the sessions
+* in three stages, each on threads of its own and connected by
+* single-producer single-consumer queues (see SpscQueue.h):
+* 
+*     Submit -> decode -> handle[0..n-1] -> reply
+* 
+* The decode stage checks and parses a message and routes it by its key,
+* the session it belongs to, to one of the handler threads, where the
+* expensive work runs in parallel. All the messages of a session go
+* through the same handler, and every queue is first in, first out, so
+* the reply stage sees the messages of each session in the order they
+* were submitted. Each stage takes up to a batch of messages at a time and
+* wakes the next stage once per batch. A stage that runs out of work spins
+* for a while and then sleeps on an event, which its producer only sets
+* when the stage advertises that it sleeps (the doorbell protocol of the
+* session rings). A full queue holds its producer back, and a full input
+* queue makes Submit fail, so a slow handler shows up as backpressure at
+* the caller instead of as unbounded memory.
+* 
+* Every stage counts the messages it processed and the time it was busy,
+* and the depth of its input queue; FormatReport turns them into the
+* occupancy of each stage since the last report.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "SpscQueue.h"
+
+// Default number of handler threads and of messages a stage takes at a
+// time; a batch of 1 hands every message on at once.
+#define PIPELINE_HANDLERS       4
+#define PIPELINE_BATCH          16
+
+// Most handler threads a pipeline may have.
+#define PIPELINE_MAX_HANDLERS   64
+
+// Messages each queue between two stages holds, and the largest message
+// a stage carries; longer ones are cut and marked.
+#define PIPELINE_QUEUE          256
+#define PIPELINE_MAX_MESSAGE    512
+
+// Number of idle passes a stage spins before it sleeps, and the longest
+// it sleeps, in milliseconds, without being woken.
+#define PIPELINE_SPIN_COUNT     64
+#define PIPELINE_IDLE_WAIT      100
+
+
+struct PIPELINE_ITEM
+{
+    uint32_t Key;                   // Session; orders the messages
+    uint32_t cbData;
+    uint64_t Sequence;              // Number of the message in the pipeline
+    uint64_t Timestamp;             // IpcTimestamp() when it was submitted
+    DWORD dwResult;                 // Set by the stages; ERROR_SUCCESS until
+                                    // one of them rejects the message
+    BYTE Data[PIPELINE_MAX_MESSAGE];
+};
+
+
+class CRequestPipeline
+{
+public:
+
+    // Create the events of the stages. Throws the Win32 error code on
+    // failure.
+    explicit CRequestPipeline(unsigned int cHandlers = PIPELINE_HANDLERS,
+        unsigned int cBatch = PIPELINE_BATCH);
+
+    // Stop the stages if they still run.
+    virtual ~CRequestPipeline(void);
+
+    // Start the threads of the stages.
+    void Start(void);
+
+    // Let every stage finish the messages already submitted, then join
+    // its threads. Called by the owner before the state the stages use
+    // goes away.
+    void Stop(void);
+
+    // Queue a message for the decode stage. Must be called by one thread
+    // at a time. Returns false if the pipeline is full or stopped.
+    bool Submit(uint32_t key, const void *pData, size_t cbData);
+
+    // Describe what every stage did since the last report: the messages
+    // it processed, the share of the time it was busy and the depth of
+    // its input queue, current and highest.
+    void FormatReport(PWSTR pszReport, size_t cchReport);
+
+protected:
+
+    // The stages. Decode runs on one thread, Handle on the handler thread
+    // of the session of the message and Reply on one thread, in the order
+    // of submission for each session. A stage that rejects a message sets
+    // its dwResult; the message still goes through the later stages, so
+    // the reply stage accounts for every message. The defaults do nothing.
+    virtual void Decode(PIPELINE_ITEM &item);
+    virtual void Handle(PIPELINE_ITEM &item);
+    virtual void Reply(PIPELINE_ITEM &item);
+
+private:
+
+    CRequestPipeline(const CRequestPipeline &);
+    CRequestPipeline &operator=(const CRequestPipeline &);
+
+    typedef CSpscQueue<PIPELINE_ITEM, PIPELINE_QUEUE> ITEM_QUEUE;
+
+    // Stage levels: a level stops once every level before it has stopped
+    // and its input queues are empty.
+    enum
+    {
+        LevelDecode = 0,
+        LevelHandle = 1,
+        LevelReply  = 2,
+        LevelCount  = 3
+    };
+
+    struct STAGE
+    {
+        unsigned int Level;
+        HANDLE hWake;               // Auto-reset; set when fSleeping
+        alignas(64) std::atomic<uint32_t> fSleeping;
+        std::thread thread;
+
+        // Written by the thread of the stage only.
+        std::atomic<uint64_t> cItems;
+        std::atomic<uint64_t> BusyTime;     // In IpcTimestamp() ticks
+        std::atomic<uint64_t> PeakDepth;
+
+        // Values at the last report.
+        uint64_t cItemsReported;
+        uint64_t BusyTimeReported;
+    };
+
+    void RunDecode(void);
+    void RunHandler(unsigned int iHandler);
+    void RunReply(void);
+    bool WaitForWork(unsigned int iStage);
+    size_t GetDepth(unsigned int iStage);
+    void Wake(unsigned int iStage);
+    void Account(unsigned int iStage, uint64_t start, size_t cItems,
+        size_t depth);
+
+    unsigned int m_cHandlers;
+    unsigned int m_cBatch;
+
+    // Stage 0 decodes, stages 1..m_cHandlers handle, the last one replies.
+    unsigned int m_cStages;
+    std::unique_ptr<STAGE[]> m_pStages;
+
+    ITEM_QUEUE m_input;
+    std::unique_ptr<ITEM_QUEUE[]> m_pHandlerIn;
+    std::unique_ptr<ITEM_QUEUE[]> m_pHandlerOut;
+
+    // Number of levels told to stop.
+    std::atomic<unsigned int> m_cClosedLevels;
+    bool m_fStarted;
+    uint64_t m_nextSequence;
+    uint64_t m_lastReport;
+};
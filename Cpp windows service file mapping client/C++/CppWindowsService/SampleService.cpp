@@ -6,7 +6,8 @@
 * Provides a sample service class that derives from the service base class - 
 * CServiceBase. The sample service logs the service start and stop 
 * information to the Application event log, and shows how to run the main 
-* function of the service in a thread pool worker thread.
+* function of the service as a coroutine on the thread pool (see 
+* AsyncChannel.h).
 * 
 * This source is subject to the Microsoft Public License.
 * See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
@@ -19,35 +20,25 @@
 
 #pragma region Includes
 #include "SampleService.h"
-#include "ThreadPool.h"
+#include "IpcClient.h"
+#include "IpcStats.h"
 #include <Windows.h>
+#include <memory>
 #pragma endregion
 
 CSampleService::CSampleService(PWSTR pszServiceName, 
                                BOOL fCanStop, 
                                BOOL fCanShutdown, 
                                BOOL fCanPauseContinue)
-: CServiceBase(pszServiceName, fCanStop, fCanShutdown, fCanPauseContinue)
+: CServiceBase(pszServiceName, fCanStop, fCanShutdown, fCanPauseContinue),
+  m_loop(CThreadPool::Default())
 {
     m_fStopping = FALSE;
-
-    // Create a manual-reset event that is not signaled at first to indicate 
-    // the stopped signal of the service.
-    m_hStoppedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (m_hStoppedEvent == NULL)
-    {
-        throw GetLastError();
-    }
 }
 
 
 CSampleService::~CSampleService(void)
 {
-    if (m_hStoppedEvent)
-    {
-        CloseHandle(m_hStoppedEvent);
-        m_hStoppedEvent = NULL;
-    }
 }
 
 
@@ -58,8 +49,8 @@ CSampleService::~CSampleService(void)
 //   service by the SCM or when the operating system starts (for a service 
 //   that starts automatically). It specifies actions to take when the 
 //   service starts. In this code sample, OnStart logs a service-start 
-//   message to the Application log, and queues the main service function for 
-//   execution in a thread pool worker thread.
+//   message to the Application log, starts the coroutine loop and spawns 
+//   the main service function on it.
 //
 //   PARAMETERS:
 //   * dwArgc   - number of command line arguments
@@ -74,7 +65,8 @@ CSampleService::~CSampleService(void)
 //   a timer in OnStart. The timer would then raise events in your code 
 //   periodically, at which time your service could do its monitoring. The 
 //   other solution is to spawn a new thread to perform the main service 
-//   functions, which is demonstrated in this code sample.
+//   functions. This code sample spawns a coroutine instead, which only 
+//   occupies a thread pool worker while it has work to do.
 //
 void CSampleService::OnStart(DWORD dwArgc, LPWSTR *lpszArgv)
 {
@@ -82,88 +74,201 @@ void CSampleService::OnStart(DWORD dwArgc, LPWSTR *lpszArgv)
     WriteEventLogEntry(L"CppWindowsService in OnStart", 
         EVENTLOG_INFORMATION_TYPE);
 
-    // Queue the main service function for execution in a worker thread.
-    CThreadPool::QueueUserWorkItem(&CSampleService::ServiceWorkerThread, this);
+    // Run the main service function on the coroutine loop.
+    m_loop.Start();
+    m_loop.Spawn(ServiceWorker());
 }
 
 
 //
-//   FUNCTION: CSampleService::ServiceWorkerThread(void)
+//   FUNCTION: CSampleService::ServiceWorker(void)
 //
-//   PURPOSE: The method performs the main function of the service. It runs 
-//   on a thread pool worker thread.
+//   PURPOSE: The method performs the main function of the service. It is a 
+//   coroutine: whenever it waits for the server, a reply or the next 
+//   request, it is suspended and gives its thread pool worker back. The 
+//   client connects to the server whenever it is up, sends it a request 
+//   every REQUEST_INTERVAL and reconnects on its own when the server is 
+//   restarted.
 //
-void CSampleService::ServiceWorkerThread(void)
+CAsyncTask CSampleService::ServiceWorker(void)
 {
-	// Log a service message to the ServiceWorkerThread.
-    WriteEventLogMsg(L"ServiceWorkerThread is started");
+	// Log a service message to the ServiceWorker.
+    WriteEventLogMsg(L"ServiceWorker is started");
 
-    HANDLE hMapFile = NULL;
-    PVOID pInOutView = NULL;
+    HANDLE hStatsFile = NULL;
+    IPC_STATS_HEADER *pStats = NULL;
+    CIpcClient client(FULL_MAP_NAME);
+    std::unique_ptr<CAsyncChannel> pChannel;
+    BYTE reply[IPC_PAGE_SIZE];
+    size_t cbReply = 0;
+    unsigned long cConnects = 0;
+    wchar_t szMessage[128];
+    wchar_t szReport[1024];
+    std::unique_ptr<CReplyPipeline> pPipeline;
+    ULONGLONG ullNextReport = GetTickCount64() + PIPELINE_REPORT_INTERVAL;
 
-    // Try to open the named file mapping identified by the map name.
-    hMapFile = OpenFileMapping(
-        FILE_MAP_ALL_ACCESS,    // Read Write access
-        FALSE,                  // Do not inherit the name
-        FULL_MAP_NAME           // File mapping name 
-        );
+    // Prepare a message to be sent to the server.
+    PWSTR pszMessage = MESSAGE;
+    DWORD cbMessage = (wcslen(pszMessage) + 1) * sizeof(*pszMessage);
+
+    // Publish the traffic of the client for monitoring tools.
+    pStats = IpcCreateStats(IPC_CLIENT_STATS_NAME, 0, &hStatsFile);
+    if (pStats == NULL)
+    {
+        WriteErrorLogEntry(L"IpcCreateStats");
+    }
 
-    if (hMapFile == NULL)
-        goto Cleanup;
+    // Check the replies on the stages of the pipeline rather than here. If
+    // it cannot be set up the replies are only counted.
+    try
+    {
+        pPipeline.reset(new CReplyPipeline(pStats));
+        pPipeline->Start();
+    }
+    catch (DWORD dwError)
+    {
+        pPipeline.reset();
+        WriteErrorLogEntry(L"CReplyPipeline", dwError);
+    }
+
+	// Periodically check if the service is stopping.
+    while (!m_fStopping)
+    {
+        // Open the named file mapping and a session in it. The server may 
+        // not be up yet, or may be restarting: retry after a delay that 
+        // grows while it stays away.
+        if (!client.EnsureConnected())
+        {
+            DWORD dwDelay = client.GetRetryDelay();
+            co_await m_loop.Delay(dwDelay ? dwDelay : IPC_RECONNECT_MIN_DELAY);
+            continue;
+        }
 
-    WriteEventLogMsg(L"The file mapping is opened");
+        if (client.GetConnectCount() != cConnects)
+        {
+            cConnects = client.GetConnectCount();
+            swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+                L"The file mapping is opened (generation %u, connection %lu)", 
+                client.GetGeneration(), cConnects);
+            WriteEventLogMsg(szMessage);
+            if (pStats)
+            {
+                IpcStatsSet(pStats->Counters.Credits, client.GetReplyWindow());
+            }
+            pChannel.reset(new CAsyncChannel(m_loop, client.GetHeader(), 
+                client.GetSession(), false, client.GetDoorbell()));
 
-    // Map a input view of the file mapping into the address space of the current 
-    // process.
-    pInOutView = MapViewOfFile(
-        hMapFile,               // Handle of the map object
-        FILE_MAP_ALL_ACCESS,    // Read Write access
-        0,                      // High-order DWORD of the file offset 
-        IN_VIEW_OFFSET,         // Low-order DWORD of the file offset
-        VIEW_SIZE               // The number of bytes to map to view
-        );
+            // Read and display the greeting of the server.
+            PCWSTR pszGreeting = client.GetGreeting();
+            size_t cbGreeting = (wcsnlen(pszGreeting, 
+                VIEW_SIZE / sizeof(WCHAR)) + 1) * sizeof(WCHAR);
+            WriteEventLogMsg((PWSTR)pszGreeting);
+            if (pStats)
+            {
+                IpcStatsAdd(pStats->Counters.cMessagesIn, 1);
+                IpcStatsAdd(pStats->Counters.cBytesIn, cbGreeting);
+            }
+        }
 
-	if (pInOutView == NULL)
-        goto Cleanup;
+        // Send the message to the server and wait for its reply. The message 
+        // always fits into a slot, so a request that cannot be sent at once 
+        // is out of credits: shed it rather than queue it behind a server 
+        // that is already late.
+        if (co_await pChannel->Send(pszMessage, cbMessage, 0))
+        {
+            if (pStats)
+            {
+                IpcStatsAdd(pStats->Counters.cMessagesOut, 1);
+                IpcStatsAdd(pStats->Counters.cBytesOut, cbMessage);
+            }
+            if (co_await pChannel->Recv(reply, sizeof(reply), &cbReply, 
+                REPLY_TIMEOUT))
+            {
+                // The replies of a session keep their order through the 
+                // pipeline; one that does not fit is shed like a request.
+                if (pPipeline)
+                {
+                    if (!pPipeline->Submit(client.GetSession(), reply, 
+                        cbReply) && pStats)
+                    {
+                        IpcStatsAdd(pStats->Counters.cBackpressure, 1);
+                        IpcStatsAdd(pStats->Counters.cDropped, 1);
+                    }
+                }
+                else if (pStats)
+                {
+                    IpcStatsAdd(pStats->Counters.cMessagesIn, 1);
+                    IpcStatsAdd(pStats->Counters.cBytesIn, cbReply);
+                }
+            }
+        }
+        else if (pStats)
+        {
+            IpcStatsAdd(pStats->Counters.cBackpressure, 1);
+            IpcStatsAdd(pStats->Counters.cDropped, 1);
+        }
 
-    WriteEventLogMsg(L"The file view is mapped");
+        // Wait for the next request, but notice at once if the server 
+        // exits in the meantime.
+        HANDLE hServer = client.GetServerProcess();
+        if (hServer)
+        {
+            co_await m_loop.Wait(hServer, REQUEST_INTERVAL);
+        }
+        else
+        {
+            co_await m_loop.Delay(REQUEST_INTERVAL);
+        }
 
-	// Read and display the content in view.
-    WriteEventLogMsg((PWSTR)pInOutView);
+        if (client.IsConnected() && !client.CheckServer())
+        {
+            WriteEventLogMsg(L"The server is gone, reconnecting");
+            pChannel.reset();
+        }
 
-	// Periodically check if the service is stopping.
-    while (!m_fStopping)
-    {
-        ::Sleep(2000);  // Simulate some lengthy operations.
-		
+        if (pPipeline && GetTickCount64() >= ullNextReport)
+        {
+            ullNextReport = GetTickCount64() + PIPELINE_REPORT_INTERVAL;
+            pPipeline->FormatReport(szReport, ARRAYSIZE(szReport));
+            WriteEventLogMsg(szReport);
+        }
     }
 
-    WriteEventLogMsg(L"ServiceWorkerThread is terminated");
-	// Prepare a message to be written to the server view.
-    PWSTR pszMessage = MESSAGE;
-    DWORD cbMessage = (wcslen(pszMessage) + 1) * sizeof(*pszMessage);
+    WriteEventLogMsg(L"ServiceWorker is terminated");
 
 	// Write the message to the server view.
-    memcpy_s((pInOutView), VIEW_SIZE, pszMessage, cbMessage);
-
-Cleanup:
-    WriteEventLogMsg(L"The file view is unmapped");
-    if (hMapFile)
+    if (client.IsConnected())
     {
-        if (pInOutView)
+        memcpy_s((PVOID)client.GetGreeting(), VIEW_SIZE, pszMessage, 
+            cbMessage);
+        if (pStats)
         {
-            // Unmap the file view.
-            UnmapViewOfFile(pInOutView);
-            pInOutView = NULL;
+            IpcStatsAdd(pStats->Counters.cMessagesOut, 1);
+            IpcStatsAdd(pStats->Counters.cBytesOut, cbMessage);
         }
-		
-        // Close the file mapping object.
-        CloseHandle(hMapFile);
-        hMapFile = NULL;
     }
-    
-	// Signal the stopped event.
-    SetEvent(m_hStoppedEvent);
+
+    // Let the pipeline account for the replies it still holds before the 
+    // statistics go away.
+    if (pPipeline)
+    {
+        pPipeline->Stop();
+        pPipeline->FormatReport(szReport, ARRAYSIZE(szReport));
+        WriteEventLogMsg(szReport);
+        swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+            L"%llu replies did not echo the request", 
+            pPipeline->GetMismatchCount());
+        WriteEventLogMsg(szMessage);
+        pPipeline.reset();
+    }
+
+    IpcCloseStats(pStats, hStatsFile);
+
+    // Close the session and unmap the file view. Returning lets OnStop go 
+    // on.
+    pChannel.reset();
+    client.Disconnect();
+    WriteEventLogMsg(L"The file view is unmapped");
 }
 
 
@@ -186,10 +291,61 @@ void CSampleService::OnStop()
         EVENTLOG_INFORMATION_TYPE);
 
     // Indicate that the service is stopping and wait for the finish of the 
-    // main service function (ServiceWorkerThread).
+    // main service function (ServiceWorker). Stopping the loop cuts its 
+    // current wait short.
     m_fStopping = TRUE;
-    if (WaitForSingleObject(m_hStoppedEvent, INFINITE) != WAIT_OBJECT_0)
+    m_loop.Stop();
+}
+
+
+CReplyPipeline::CReplyPipeline(IPC_STATS_HEADER *pStats)
+: m_pStats(pStats),
+  m_cMismatches(0)
+{
+}
+
+
+// A reply is a string of wide characters, terminated within the message.
+void CReplyPipeline::Decode(PIPELINE_ITEM &item)
+{
+    if (item.dwResult != ERROR_SUCCESS)
     {
-        throw GetLastError();
+        return;
     }
-}
\ No newline at end of file
+
+    size_t cch = item.cbData / sizeof(WCHAR);
+    if (cch == 0 || item.cbData % sizeof(WCHAR) != 0 ||
+        ((PCWSTR)item.Data)[cch - 1] != L'\0')
+    {
+        item.dwResult = ERROR_INVALID_DATA;
+    }
+}
+
+
+// The server echoes the request, so any other reply is corrupt.
+void CReplyPipeline::Handle(PIPELINE_ITEM &item)
+{
+    if (item.dwResult == ERROR_SUCCESS &&
+        wcscmp((PCWSTR)item.Data, MESSAGE) != 0)
+    {
+        item.dwResult = ERROR_INVALID_DATA;
+    }
+}
+
+
+void CReplyPipeline::Reply(PIPELINE_ITEM &item)
+{
+    if (item.dwResult != ERROR_SUCCESS)
+    {
+        m_cMismatches.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (m_pStats)
+    {
+        IpcStatsAdd(m_pStats->Counters.cMessagesIn, 1);
+        IpcStatsAdd(m_pStats->Counters.cBytesIn, item.cbData);
+        if (item.dwResult != ERROR_SUCCESS)
+        {
+            IpcStatsAdd(m_pStats->Counters.cDropped, 1);
+        }
+    }
+}
@@ -6,7 +6,8 @@
 * Provides a sample service class that derives from the service base class - 
 * CServiceBase. The sample service logs the service start and stop 
 * information to the Application event log, and shows how to run the main 
-* function of the service in a thread pool worker thread.
+* function of the service as a coroutine on the thread pool (see 
+* AsyncChannel.h).
 * 
 * This source is subject to the Microsoft Public License.
 * See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
@@ -20,6 +21,9 @@
 #pragma once
 
 #include "ServiceBase.h"
+#include "AsyncChannel.h"
+#include "IpcStats.h"
+#include "RequestPipeline.h"
 
 // In terminal services: The name can have a "Global\" or "Local\" prefix 
 // to explicitly create the object in the global or session namespace. The 
@@ -44,6 +48,45 @@
 // must be less than the view size (VIEW_SIZE).
 #define MESSAGE             L"Message from the client process."
 
+// Interval, in milliseconds, between two requests sent to the server, and
+// how long the client waits for each reply.
+#define REQUEST_INTERVAL    2000
+#define REPLY_TIMEOUT       1000
+
+// Interval, in milliseconds, at which the occupancy of the stages of the
+// reply pipeline is written to the event log.
+#define PIPELINE_REPORT_INTERVAL 60000
+
+
+// Checks the replies of the server off the thread of the service: the
+// decode stage takes each reply for a string, the handlers compare it with
+// the request the server echoes and the reply stage counts it into the
+// statistics of the client.
+class CReplyPipeline : public CRequestPipeline
+{
+public:
+
+    explicit CReplyPipeline(IPC_STATS_HEADER *pStats);
+
+    // Number of replies that were not the echo of the request.
+    unsigned long long GetMismatchCount(void) const
+    {
+        return m_cMismatches.load(std::memory_order_relaxed);
+    }
+
+protected:
+
+    virtual void Decode(PIPELINE_ITEM &item);
+    virtual void Handle(PIPELINE_ITEM &item);
+    virtual void Reply(PIPELINE_ITEM &item);
+
+private:
+
+    IPC_STATS_HEADER *m_pStats;
+    std::atomic<unsigned long long> m_cMismatches;
+};
+
+
 class CSampleService : public CServiceBase
 {
 public:
@@ -59,10 +102,13 @@ protected:
     virtual void OnStart(DWORD dwArgc, PWSTR *pszArgv);
     virtual void OnStop();
 
-    void ServiceWorkerThread(void);
+    CAsyncTask ServiceWorker(void);
 
 private:
 
     BOOL m_fStopping;
-    HANDLE m_hStoppedEvent;
+
+    // Runs the main service function; stopping it waits for the function
+    // to return.
+    CAsyncLoop m_loop;
 };
\ No newline at end of file
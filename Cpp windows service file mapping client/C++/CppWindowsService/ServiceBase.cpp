@@ -176,6 +176,10 @@ CServiceBase::CServiceBase(PWSTR pszServiceName,
     m_status.dwServiceSpecificExitCode = 0;
     m_status.dwCheckPoint = 0;
     m_status.dwWaitHint = 0;
+
+    // Start the logger thread. Messages are written to the Application 
+    // event log in the background, in batches.
+    m_pLogger.reset(new CAsyncLogger(new CEventLogSink(m_name)));
 }
 
 
@@ -493,6 +497,13 @@ void CServiceBase::SetServiceStatus(DWORD dwCurrentState,
         (dwCurrentState == SERVICE_STOPPED)) ? 
         0 : dwCheckPoint++;
 
+    // The process may exit as soon as the SCM learns that the service has 
+    // stopped. Make sure the queued messages reach the event log first.
+    if (dwCurrentState == SERVICE_STOPPED)
+    {
+        m_pLogger->Flush();
+    }
+
     // Report the status of the service to the SCM.
     ::SetServiceStatus(m_statusHandle, &m_status);
 }
@@ -501,7 +512,11 @@ void CServiceBase::SetServiceStatus(DWORD dwCurrentState,
 //
 //   FUNCTION: CServiceBase::WriteEventLogEntry(PWSTR, WORD)
 //
-//   PURPOSE: Log a message to the Application event log.
+//   PURPOSE: Log a message to the Application event log. The message is 
+//   copied to the queue of the logger thread, which writes it together with 
+//   other queued messages. Repeated messages are collapsed and a rate limit 
+//   applies; if the queue is full the message is dropped rather than 
+//   blocking the caller.
 //
 //   PARAMETERS:
 //   * pszMessage - string message to be logged.
@@ -517,28 +532,7 @@ void CServiceBase::SetServiceStatus(DWORD dwCurrentState,
 //
 void CServiceBase::WriteEventLogEntry(PWSTR pszMessage, WORD wType)
 {
-    HANDLE hEventSource = NULL;
-    LPCWSTR lpszStrings[2] = { NULL, NULL };
-
-    hEventSource = RegisterEventSource(NULL, m_name);
-    if (hEventSource)
-    {
-        lpszStrings[0] = m_name;
-        lpszStrings[1] = pszMessage;
-
-        ReportEvent(hEventSource,  // Event log handle
-            wType,                 // Event type
-            0,                     // Event category
-            0,                     // Event identifier
-            NULL,                  // No security identifier
-            2,                     // Size of lpszStrings array
-            0,                     // No binary data
-            lpszStrings,           // Array of strings
-            NULL                   // No binary data
-            );
-
-        DeregisterEventSource(hEventSource);
-    }
+    m_pLogger->Log(wType, pszMessage);
 }
 
 
@@ -553,10 +547,9 @@ void CServiceBase::WriteEventLogEntry(PWSTR pszMessage, WORD wType)
 //
 void CServiceBase::WriteErrorLogEntry(PWSTR pszFunction, DWORD dwError)
 {
-    wchar_t szMessage[260];
-    StringCchPrintf(szMessage, ARRAYSIZE(szMessage), 
-        L"%s failed w/err 0x%08lx", pszFunction, dwError);
-    WriteEventLogEntry(szMessage, EVENTLOG_ERROR_TYPE);
+    // Format straight into the logger's queue.
+    m_pLogger->LogFormat(EVENTLOG_ERROR_TYPE, 
+        L"%ls failed w/err 0x%08lx", pszFunction, dwError);
 }
 
 //
@@ -569,9 +562,8 @@ void CServiceBase::WriteErrorLogEntry(PWSTR pszFunction, DWORD dwError)
 //
 void CServiceBase::WriteEventLogMsg(PWSTR pszFunction)
 {
-    wchar_t szMessage[260];
-    StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
-        L"Client: %s ", pszFunction);
-    WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+    // Format straight into the logger's queue.
+    m_pLogger->LogFormat(EVENTLOG_INFORMATION_TYPE, 
+        L"Client: %ls ", pszFunction);
 }
 #pragma endregion
\ No newline at end of file
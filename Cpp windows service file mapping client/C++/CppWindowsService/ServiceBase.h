@@ -19,6 +19,8 @@
 #pragma once
 
 #include <windows.h>
+#include <memory>
+#include "LogSink.h"
 
 
 class CServiceBase
@@ -79,7 +81,8 @@ protected:
         DWORD dwWin32ExitCode = NO_ERROR, 
         DWORD dwWaitHint = 0);
 
-    // Log a message to the Application event log.
+    // Log a message to the Application event log. The message is queued to 
+    // the logger thread; the call never waits for the event log.
     void WriteEventLogEntry(PWSTR pszMessage, WORD wType);
 
     // Log an error message to the Application event log.
@@ -121,4 +124,7 @@ private:
 
     // The service status handle
     SERVICE_STATUS_HANDLE m_statusHandle;
+
+    // The asynchronous logger that writes to the Application event log
+    std::unique_ptr<CAsyncLogger> m_pLogger;
 };
\ No newline at end of file
@@ -0,0 +1,152 @@
+/****************************** Module Header ******************************\
+* Module Name:  SpscQueue.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* A bounded, lock-free, single-producer single-consumer queue. The producer
+* owns the tail and the consumer owns the head; each keeps a cached copy of
+* the other's index and only reads the shared one when the cache says the
+* queue is full or empty, so a busy queue costs one cache miss per
+* wrap-around rather than one per element. Elements are built and consumed
+* in place, so large elements are never copied through a temporary.
+* 
+*     CSpscQueue<PIPELINE_ITEM, 256> queue;
+* 
+*     // The producer thread.
+*     PIPELINE_ITEM *pItem = queue.BeginPush();
+*     if (pItem)
+*     {
+*         // Fill in *pItem.
+*         queue.EndPush();
+*     }
+* 
+*     // The consumer thread.
+*     while ((pItem = queue.Front()) != NULL)
+*     {
+*         // Use *pItem.
+*         queue.Pop();
+*     }
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+
+template <typename T, size_t Capacity>
+class CSpscQueue
+{
+    static_assert((Capacity & (Capacity - 1)) == 0,
+        "Capacity must be a power of two");
+
+public:
+
+    CSpscQueue() : m_head(0), m_cachedTail(0), m_tail(0), m_cachedHead(0)
+    {
+    }
+
+    // The slot of the next element, to be filled in place by the producer.
+    // Returns NULL when the queue is full. Every successful BeginPush must
+    // be followed by EndPush.
+    T *BeginPush()
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cachedHead == Capacity)
+        {
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail - m_cachedHead == Capacity)
+            {
+                return NULL;
+            }
+        }
+        return &m_cells[tail & (Capacity - 1)];
+    }
+
+    // Publish the element filled in since BeginPush to the consumer.
+    void EndPush()
+    {
+        m_tail.store(m_tail.load(std::memory_order_relaxed) + 1,
+            std::memory_order_release);
+    }
+
+    // Copy an element into the queue. Returns false when the queue is full.
+    bool TryPush(const T &value)
+    {
+        T *pValue = BeginPush();
+        if (pValue == NULL)
+        {
+            return false;
+        }
+        *pValue = value;
+        EndPush();
+        return true;
+    }
+
+    // The oldest element, which the consumer may use in place until it
+    // calls Pop. Returns NULL when the queue is empty.
+    T *Front()
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_cachedTail)
+        {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (head == m_cachedTail)
+            {
+                return NULL;
+            }
+        }
+        return &m_cells[head & (Capacity - 1)];
+    }
+
+    // Give the slot of the element returned by Front back to the producer.
+    void Pop()
+    {
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1,
+            std::memory_order_release);
+    }
+
+    // Take the oldest element. Returns false when the queue is empty.
+    bool TryPop(T &value)
+    {
+        T *pValue = Front();
+        if (pValue == NULL)
+        {
+            return false;
+        }
+        value = std::move(*pValue);
+        Pop();
+        return true;
+    }
+
+    // An estimate of the number of queued elements; exact when called by
+    // the producer or the consumer while the other is idle.
+    size_t GetCount() const
+    {
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        size_t head = m_head.load(std::memory_order_acquire);
+        return (tail > head) ? (tail - head) : 0;
+    }
+
+private:
+
+    CSpscQueue(const CSpscQueue &);
+    CSpscQueue &operator=(const CSpscQueue &);
+
+    // The consumer's index and its view of the producer's, then the
+    // producer's, each on a cache line of its own.
+    alignas(64) std::atomic<size_t> m_head;
+    size_t m_cachedTail;
+    alignas(64) std::atomic<size_t> m_tail;
+    size_t m_cachedHead;
+    alignas(64) T m_cells[Capacity];
+};
@@ -0,0 +1,135 @@
+/****************************** Module Header ******************************\
+* Module Name:  TimerWheel.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares CTimerWheel, a hierarchical timing wheel that keeps the request
+* timeouts, heartbeats and idle deadlines of an event loop without a thread
+* or a kernel timer per deadline.
+* 
+* Time is cut into ticks of TIMER_WHEEL_RESOLUTION microseconds. The wheel
+* has TIMER_WHEEL_LEVELS levels of 256 slots; a slot of level n spans 256^n
+* ticks, so the levels together cover 2^32 ticks (about three days). A
+* timer is linked into the slot of the lowest level that reaches its
+* expiry. Whenever the lowest level wraps around, the next slot of the
+* level above is emptied into the levels below ("cascading"). Timers are
+* intrusive, so scheduling and cancelling one is O(1) and never allocates,
+* and bitmaps of the occupied slots let the owner find out how long it may
+* sleep without walking the timers.
+* 
+*     TIMER_ENTRY timer;
+*     CTimerWheel::Initialize(&timer, OnTimeout, pContext);
+*     wheel.Schedule(&timer, IpcTimestamp() + timeout);
+*     ...
+*     wheel.Advance(IpcTimestamp());      // Runs the callbacks that are due
+* 
+* A timer never fires before its deadline and at most one tick after the
+* first Advance past it. The wheel is not thread-safe: it belongs to the
+* thread of the loop that advances it, and the callbacks run on it.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+#include "IpcChannel.h"
+
+// Length of a tick, in microseconds, and the number of levels of the
+// wheel.
+#define TIMER_WHEEL_RESOLUTION  64
+#define TIMER_WHEEL_LEVELS      4
+
+// Returned by GetNextExpiry when no timer is pending.
+#define TIMER_WHEEL_NEVER       UINT64_MAX
+
+
+struct TIMER_ENTRY;
+
+typedef void (*PTIMER_CALLBACK)(TIMER_ENTRY *pTimer, PVOID pContext);
+
+// A timer. The owner embeds it into its own state; the wheel only links it.
+struct TIMER_ENTRY
+{
+    TIMER_ENTRY *pNext;
+    TIMER_ENTRY *pPrev;
+    uint64_t Expiry;                // Tick at which the timer fires
+    uint32_t iSlot;                 // Level * 256 + slot while pending
+    bool fPending;
+    PTIMER_CALLBACK pfnCallback;
+    PVOID pContext;
+};
+
+
+class CTimerWheel
+{
+public:
+
+    // Start the wheel at the given IpcTimestamp.
+    explicit CTimerWheel(uint64_t now = IpcTimestamp());
+
+    // Set the callback of a timer that is not pending.
+    static void Initialize(TIMER_ENTRY *pTimer, PTIMER_CALLBACK pfnCallback,
+        PVOID pContext);
+
+    // Arm the timer to fire at the deadline, an IpcTimestamp. A pending
+    // timer is moved. A deadline that has already passed fires on the next
+    // Advance.
+    void Schedule(TIMER_ENTRY *pTimer, uint64_t deadline);
+
+    // Disarm the timer. Returns false if it was not pending.
+    bool Cancel(TIMER_ENTRY *pTimer);
+
+    // Fire every timer whose deadline is at or before now, an IpcTimestamp,
+    // in order of expiry. The callbacks may schedule and cancel timers.
+    // Returns the number of timers fired.
+    size_t Advance(uint64_t now);
+
+    // Fire every pending timer at once, whatever its deadline; used when
+    // the loop that owns the wheel shuts down.
+    size_t ExpireAll(void);
+
+    // A lower bound, as an IpcTimestamp, of the next deadline: the owner
+    // may sleep until then without missing a timer. TIMER_WHEEL_NEVER if
+    // no timer is pending.
+    uint64_t GetNextExpiry(void) const;
+
+    size_t GetCount(void) const { return m_cTimers; }
+
+    static bool IsPending(const TIMER_ENTRY *pTimer)
+    {
+        return pTimer->fPending;
+    }
+
+private:
+
+    CTimerWheel(const CTimerWheel &);
+    CTimerWheel &operator=(const CTimerWheel &);
+
+    static const uint32_t SlotBits = 8;
+    static const uint32_t SlotCount = 1 << SlotBits;
+    static const uint32_t SlotMask = SlotCount - 1;
+
+    void Link(TIMER_ENTRY *pTimer);
+    void Unlink(TIMER_ENTRY *pTimer);
+    void Cascade(uint32_t iLevel);
+    bool IsOccupied(uint32_t iLevel, uint32_t iSlot) const;
+    int FindOccupied(uint32_t iLevel, uint32_t iFirst) const;
+    void Fire(TIMER_ENTRY *pTimer);
+
+    uint64_t m_tickLength;          // Length of a tick, in timestamp units
+    uint64_t m_current;             // Next tick to process
+    size_t m_cTimers;
+
+    // A circular list per slot with its head as the sentinel, and a bit per
+    // slot that is set while the list is not empty.
+    TIMER_ENTRY m_slots[TIMER_WHEEL_LEVELS][SlotCount];
+    uint64_t m_occupied[TIMER_WHEEL_LEVELS][SlotCount / 64];
+};
@@ -0,0 +1,946 @@
+/****************************** Module Header ******************************\
+* Module Name:  Benchmark.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* The file implements the console microbenchmarks that can be run from the 
+* command line with "-benchmark".
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND, 
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED 
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <stdio.h>
+#include <windows.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "AsyncChannel.h"
+#include "Benchmark.h"
+#include "IpcClient.h"
+#include "SampleService.h"
+#include "ShardedBroker.h"
+#include "ThreadPool.h"
+#include "TimerWheel.h"
+#pragma endregion
+
+
+// Number of tasks queued per measurement.
+#define BENCHMARK_TASKS     1000000
+
+// Number of tasks each fan-out task queues from inside the pool.
+#define BENCHMARK_FANOUT    100
+
+// Number of times the server is killed and restarted, the time the client 
+// runs under load before each restart and how long it is given to be 
+// served again afterwards, in milliseconds.
+#define BENCHMARK_RESTARTS          5
+#define BENCHMARK_LOAD_TIME         1000
+#define BENCHMARK_RECOVERY_TIMEOUT  10000
+
+// Time, in milliseconds, the client waits for each reply under load.
+#define BENCHMARK_REPLY_TIMEOUT     100
+
+// Round trips each session makes, the size of its messages and the most
+// sessions the thread-per-session baseline is run with (two threads each).
+#define BENCHMARK_ROUND_TRIPS       1000
+#define BENCHMARK_MESSAGE_SIZE      32
+#define BENCHMARK_MAX_SESSION_THREADS 1024
+
+// Number of timers pending at once, the span, in seconds, over which their
+// deadlines are spread, and the step, in microseconds, by which the clock
+// of the wheel moves while they expire.
+#define BENCHMARK_TIMERS            1000000
+#define BENCHMARK_TIMER_SPAN        60
+#define BENCHMARK_TIMER_STEP        1000
+
+// Sessions per shard and requests the client of each shard sends.
+#define BENCHMARK_SHARD_SESSIONS    4
+#define BENCHMARK_SHARD_REQUESTS    1000000
+
+// Number of times the server is started, and the time, in milliseconds, 
+// it is given to serve its first request.
+#define BENCHMARK_STARTS            5
+#define BENCHMARK_START_TIMEOUT     10000
+
+
+#pragma region Helper Functions
+
+typedef std::chrono::high_resolution_clock BenchmarkClock;
+
+static double ElapsedSeconds(BenchmarkClock::time_point start)
+{
+    return std::chrono::duration<double>(BenchmarkClock::now() - start).count();
+}
+
+static void WaitForCount(const std::atomic<long> &count, long target)
+{
+    while (count.load(std::memory_order_acquire) < target)
+    {
+        std::this_thread::yield();
+    }
+}
+
+static void PrintResult(PCWSTR pszName, unsigned int cThreads, 
+                        long cTasks, double seconds)
+{
+    wprintf(L"  %-28s %3u thread(s) %12.0f tasks/s\n", pszName, cThreads, 
+        cTasks / seconds);
+}
+
+#pragma endregion
+
+
+#pragma region Thread Pool
+
+// The previous CThreadPool implementation: one heap-allocated pair per work 
+// item handed to the Windows thread pool.
+static std::atomic<long> g_cSystemPoolTasks;
+
+static DWORD WINAPI SystemPoolThreadProc(PVOID context)
+{
+    delete static_cast<long *>(context);
+    g_cSystemPoolTasks.fetch_add(1, std::memory_order_release);
+    return 0;
+}
+
+static void BenchmarkSystemThreadPool(void)
+{
+    g_cSystemPoolTasks = 0;
+
+    BenchmarkClock::time_point start = BenchmarkClock::now();
+    for (long i = 0; i < BENCHMARK_TASKS; i++)
+    {
+        ::QueueUserWorkItem(SystemPoolThreadProc, new long(i), 
+            WT_EXECUTEDEFAULT);
+    }
+    WaitForCount(g_cSystemPoolTasks, BENCHMARK_TASKS);
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    PrintResult(L"QueueUserWorkItem (system)", si.dwNumberOfProcessors, 
+        BENCHMARK_TASKS, ElapsedSeconds(start));
+}
+
+void BenchmarkThreadPool(void)
+{
+    wprintf(L"CThreadPool task throughput\n");
+
+    unsigned int cMaxThreads = std::thread::hardware_concurrency();
+    if (cMaxThreads == 0)
+    {
+        cMaxThreads = 1;
+    }
+
+    for (unsigned int cThreads = 1; cThreads <= cMaxThreads; 
+        cThreads = (cThreads < cMaxThreads && cThreads * 2 > cMaxThreads) ? 
+        cMaxThreads : cThreads * 2)
+    {
+        CThreadPool pool(cThreads);
+        std::atomic<long> count(0);
+
+        // Tasks queued by a thread outside of the pool.
+        BenchmarkClock::time_point start = BenchmarkClock::now();
+        for (long i = 0; i < BENCHMARK_TASKS; i++)
+        {
+            pool.Post([&count] { count.fetch_add(1, std::memory_order_release); });
+        }
+        WaitForCount(count, BENCHMARK_TASKS);
+        PrintResult(L"Post (external)", cThreads, BENCHMARK_TASKS, 
+            ElapsedSeconds(start));
+
+        // Tasks queued by the workers themselves, which exercises the local 
+        // deques and stealing.
+        count = 0;
+        start = BenchmarkClock::now();
+        for (long i = 0; i < BENCHMARK_TASKS / BENCHMARK_FANOUT; i++)
+        {
+            pool.Post([&pool, &count]
+            {
+                for (int j = 0; j < BENCHMARK_FANOUT; j++)
+                {
+                    pool.Post([&count] 
+                    { 
+                        count.fetch_add(1, std::memory_order_release); 
+                    });
+                }
+            });
+        }
+        WaitForCount(count, BENCHMARK_TASKS);
+        PrintResult(L"Post (fan-out from workers)", cThreads, 
+            BENCHMARK_TASKS, ElapsedSeconds(start));
+
+        // Submit pays for the future's shared state.
+        start = BenchmarkClock::now();
+        for (long i = 0; i < BENCHMARK_TASKS / 10; i++)
+        {
+            pool.Submit([] { return 0; }).get();
+        }
+        PrintResult(L"Submit + get (round trip)", cThreads, 
+            BENCHMARK_TASKS / 10, ElapsedSeconds(start));
+    }
+
+    BenchmarkSystemThreadPool();
+}
+
+#pragma endregion
+
+
+#pragma region Reconnect
+
+struct RECONNECT_LOAD
+{
+    std::atomic<bool> fStop;
+    std::atomic<long> cReplies;
+
+    // Timestamps of the last time the client noticed that the server was 
+    // gone, and of the first reply it received on its latest connection.
+    std::atomic<uint64_t> LostTime;
+    std::atomic<uint64_t> ServedTime;
+};
+
+static void ReconnectLoad(RECONNECT_LOAD *pLoad)
+{
+    CIpcClient client(FULL_MAP_NAME);
+    BYTE request[64] = { 0 };
+    BYTE reply[IPC_PAGE_SIZE];
+    size_t cbReply = 0;
+    unsigned long cServed = 0;
+
+    while (!pLoad->fStop.load(std::memory_order_relaxed))
+    {
+        if (!client.EnsureConnected())
+        {
+            ::Sleep(client.GetRetryDelay());
+            continue;
+        }
+
+        if (client.Send(request, sizeof(request)) && 
+            client.Receive(reply, sizeof(reply), &cbReply, BENCHMARK_REPLY_TIMEOUT))
+        {
+            if (client.GetConnectCount() != cServed)
+            {
+                cServed = client.GetConnectCount();
+                pLoad->ServedTime.store(IpcTimestamp(), 
+                    std::memory_order_release);
+            }
+            pLoad->cReplies.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        if (!client.IsConnected())
+        {
+            pLoad->LostTime.store(IpcTimestamp(), std::memory_order_release);
+        }
+    }
+}
+
+// Start "CppWindowsService.exe -serve" and return its process handle.
+static HANDLE StartServerProcess(void)
+{
+    wchar_t szPath[MAX_PATH];
+    if (GetModuleFileName(NULL, szPath, ARRAYSIZE(szPath)) == 0)
+    {
+        return NULL;
+    }
+
+    wchar_t szCommandLine[MAX_PATH + 16];
+    swprintf_s(szCommandLine, ARRAYSIZE(szCommandLine), L"\"%s\" -serve", 
+        szPath);
+
+    STARTUPINFO si = { sizeof(si) };
+    PROCESS_INFORMATION pi;
+    if (!CreateProcess(NULL, szCommandLine, NULL, NULL, FALSE, 0, NULL, NULL, 
+        &si, &pi))
+    {
+        return NULL;
+    }
+    CloseHandle(pi.hThread);
+    return pi.hProcess;
+}
+
+void BenchmarkReconnect(void)
+{
+    wprintf(L"Client reconnect after a server restart\n");
+
+    double msPerTick = 1000.0 / IpcTimestampFrequency();
+    HANDLE hServer = StartServerProcess();
+    if (hServer == NULL)
+    {
+        wprintf(L"  The server cannot be started w/err 0x%08lx\n", 
+            GetLastError());
+        return;
+    }
+
+    RECONNECT_LOAD load;
+    load.fStop = false;
+    load.cReplies = 0;
+    load.LostTime = 0;
+    load.ServedTime = 0;
+    std::thread loader(ReconnectLoad, &load);
+
+    BenchmarkClock::time_point start = BenchmarkClock::now();
+    double maxRecovery = 0;
+    for (int i = 0; i < BENCHMARK_RESTARTS && hServer; i++)
+    {
+        ::Sleep(BENCHMARK_LOAD_TIME);
+
+        uint64_t killed = IpcTimestamp();
+        TerminateProcess(hServer, 1);
+        WaitForSingleObject(hServer, INFINITE);
+        CloseHandle(hServer);
+
+        hServer = StartServerProcess();
+        if (hServer == NULL)
+        {
+            wprintf(L"  The server cannot be restarted w/err 0x%08lx\n", 
+                GetLastError());
+            break;
+        }
+
+        ULONGLONG ullDeadline = GetTickCount64() + BENCHMARK_RECOVERY_TIMEOUT;
+        while (load.ServedTime.load(std::memory_order_acquire) <= killed && 
+            GetTickCount64() < ullDeadline)
+        {
+            ::Sleep(1);
+        }
+
+        uint64_t lost = load.LostTime.load(std::memory_order_acquire);
+        uint64_t served = load.ServedTime.load(std::memory_order_acquire);
+        if (served <= killed)
+        {
+            wprintf(L"  restart %d: not served again within %u ms\n", i + 1, 
+                BENCHMARK_RECOVERY_TIMEOUT);
+            continue;
+        }
+
+        double recovery = (served - killed) * msPerTick;
+        if (recovery > maxRecovery)
+        {
+            maxRecovery = recovery;
+        }
+        wprintf(L"  restart %d: lost after %8.3f ms, served again after "
+            L"%8.3f ms\n", i + 1, 
+            (lost > killed) ? (lost - killed) * msPerTick : 0.0, recovery);
+    }
+
+    load.fStop = true;
+    loader.join();
+    double seconds = ElapsedSeconds(start);
+
+    if (hServer)
+    {
+        TerminateProcess(hServer, 0);
+        CloseHandle(hServer);
+    }
+
+    wprintf(L"  %12.0f requests/s, worst recovery %.3f ms\n", 
+        load.cReplies / seconds, maxRecovery);
+}
+
+#pragma endregion
+
+
+#pragma region Coroutines
+
+// Short rings of small slots, so that thousands of sessions fit into an
+// in-process section.
+static const uint32_t g_cBenchmarkSessions[] = { 64, 256, 1024, 4096 };
+#define BENCHMARK_SLOTS             8
+#define BENCHMARK_SLOT_SIZE         64
+
+static IPC_SECTION_HEADER *CreateBenchmarkSection(uint32_t cSessions,
+                                                  PVOID *ppView)
+{
+    IPC_GEOMETRY geometry = { cSessions, BENCHMARK_SLOTS, BENCHMARK_SLOT_SIZE,
+        0 };
+    size_t cbSection = IpcSectionSize(geometry);
+    *ppView = VirtualAlloc(NULL, cbSection, MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (*ppView == NULL)
+    {
+        return NULL;
+    }
+
+    IpcInitializeSection(*ppView, cbSection, geometry, GetCurrentProcessId());
+    IPC_SECTION_HEADER *pHeader = IpcGetHeader(*ppView);
+
+    // Both ends live in this process; no broker accepts the sessions.
+    for (uint32_t i = 0; i < cSessions; i++)
+    {
+        IpcOpenSession(pHeader, GetCurrentProcessId());
+        IpcGetSession(pHeader, i)->State.store(IPC_SESSION_ACTIVE);
+    }
+    return pHeader;
+}
+
+static void PrintSessionResult(PCWSTR pszName, uint32_t cSessions,
+                               unsigned int cThreads, double seconds)
+{
+    unsigned int cCores = std::thread::hardware_concurrency();
+    if (cCores == 0)
+    {
+        cCores = 1;
+    }
+    double rate = (double)cSessions * BENCHMARK_ROUND_TRIPS / seconds;
+    wprintf(L"  %-18s %5u sessions %5u thread(s) %12.0f round trips/s "
+        L"%10.0f per core\n", pszName, cSessions, cThreads, rate,
+        rate / cCores);
+}
+
+static CAsyncTask EchoCoroutine(CAsyncChannel *pChannel)
+{
+    BYTE buffer[BENCHMARK_MESSAGE_SIZE];
+    size_t cbData;
+    while (co_await pChannel->Recv(buffer, sizeof(buffer), &cbData))
+    {
+        co_await pChannel->Send(buffer, cbData);
+    }
+}
+
+static CAsyncTask ClientCoroutine(CAsyncChannel *pChannel,
+                                  std::atomic<long> *pcDone)
+{
+    BYTE buffer[BENCHMARK_MESSAGE_SIZE] = { 0 };
+    size_t cbData;
+    for (long i = 0; i < BENCHMARK_ROUND_TRIPS; i++)
+    {
+        if (!co_await pChannel->Send(buffer, sizeof(buffer)) ||
+            !co_await pChannel->Recv(buffer, sizeof(buffer), &cbData))
+        {
+            break;
+        }
+    }
+    pcDone->fetch_add(1, std::memory_order_release);
+}
+
+static void BenchmarkCoroutineSessions(uint32_t cSessions)
+{
+    PVOID pView;
+    IPC_SECTION_HEADER *pHeader = CreateBenchmarkSection(cSessions, &pView);
+    if (pHeader == NULL)
+    {
+        wprintf(L"  VirtualAlloc failed w/err 0x%08lx\n", GetLastError());
+        return;
+    }
+
+    CThreadPool pool;
+    std::atomic<long> cDone(0);
+    std::vector<std::unique_ptr<CAsyncChannel> > channels;
+    {
+        CAsyncLoop loop(pool);
+        for (uint32_t i = 0; i < cSessions; i++)
+        {
+            channels.push_back(std::unique_ptr<CAsyncChannel>(
+                new CAsyncChannel(loop, pHeader, i, true)));
+            channels.push_back(std::unique_ptr<CAsyncChannel>(
+                new CAsyncChannel(loop, pHeader, i, false)));
+        }
+
+        BenchmarkClock::time_point start = BenchmarkClock::now();
+        loop.Start();
+        for (uint32_t i = 0; i < cSessions; i++)
+        {
+            loop.Spawn(EchoCoroutine(channels[2 * i].get()));
+            loop.Spawn(ClientCoroutine(channels[2 * i + 1].get(), &cDone));
+        }
+        WaitForCount(cDone, (long)cSessions);
+        PrintSessionResult(L"coroutines", cSessions,
+            pool.GetThreadCount() + 1, ElapsedSeconds(start));
+
+        // Cancels the echo coroutines, which still wait for requests.
+        loop.Stop();
+    }
+
+    VirtualFree(pView, 0, MEM_RELEASE);
+}
+
+// The thread-per-session baseline: each end of a session has a thread of
+// its own that polls its ring and yields while it is empty.
+static void EchoThread(IPC_SECTION_HEADER *pHeader, uint32_t iSession,
+                       const std::atomic<bool> *pfStop)
+{
+    const IPC_GEOMETRY &geometry = pHeader->Geometry;
+    IPC_RING_HEADER *pRequests = IpcGetRing(pHeader, iSession,
+        IPC_RING_REQUEST);
+    IPC_RING_HEADER *pReplies = IpcGetRing(pHeader, iSession,
+        IPC_RING_REPLY);
+    BYTE buffer[BENCHMARK_MESSAGE_SIZE];
+    size_t cbData;
+
+    while (!pfStop->load(std::memory_order_acquire))
+    {
+        if (!IpcRingRead(geometry, pRequests, buffer, sizeof(buffer), &cbData))
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        IpcRingGrant(geometry, pRequests, geometry.cSlots);
+        while (!IpcRingWrite(geometry, pReplies, buffer, cbData) &&
+            !pfStop->load(std::memory_order_acquire))
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void ClientThread(IPC_SECTION_HEADER *pHeader, uint32_t iSession,
+                         std::atomic<long> *pcDone)
+{
+    const IPC_GEOMETRY &geometry = pHeader->Geometry;
+    IPC_RING_HEADER *pRequests = IpcGetRing(pHeader, iSession,
+        IPC_RING_REQUEST);
+    IPC_RING_HEADER *pReplies = IpcGetRing(pHeader, iSession,
+        IPC_RING_REPLY);
+    BYTE buffer[BENCHMARK_MESSAGE_SIZE] = { 0 };
+    size_t cbData;
+
+    for (long i = 0; i < BENCHMARK_ROUND_TRIPS; i++)
+    {
+        while (!IpcRingWrite(geometry, pRequests, buffer, sizeof(buffer)))
+        {
+            std::this_thread::yield();
+        }
+        while (!IpcRingRead(geometry, pReplies, buffer, sizeof(buffer),
+            &cbData))
+        {
+            std::this_thread::yield();
+        }
+        IpcRingGrant(geometry, pReplies, geometry.cSlots);
+    }
+    pcDone->fetch_add(1, std::memory_order_release);
+}
+
+static void BenchmarkThreadSessions(uint32_t cSessions)
+{
+    PVOID pView;
+    IPC_SECTION_HEADER *pHeader = CreateBenchmarkSection(cSessions, &pView);
+    if (pHeader == NULL)
+    {
+        wprintf(L"  VirtualAlloc failed w/err 0x%08lx\n", GetLastError());
+        return;
+    }
+
+    std::atomic<bool> fStop(false);
+    std::atomic<long> cDone(0);
+    std::vector<std::thread> threads;
+    threads.reserve(2 * cSessions);
+
+    BenchmarkClock::time_point start = BenchmarkClock::now();
+    for (uint32_t i = 0; i < cSessions; i++)
+    {
+        threads.push_back(std::thread(EchoThread, pHeader, i, &fStop));
+        threads.push_back(std::thread(ClientThread, pHeader, i, &cDone));
+    }
+    WaitForCount(cDone, (long)cSessions);
+    PrintSessionResult(L"thread per session", cSessions,
+        (unsigned int)threads.size(), ElapsedSeconds(start));
+
+    fStop.store(true, std::memory_order_release);
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    VirtualFree(pView, 0, MEM_RELEASE);
+}
+
+void BenchmarkCoroutines(void)
+{
+    wprintf(L"Echo sessions: coroutines on the pool vs. thread per session\n");
+
+    for (size_t i = 0; i < ARRAYSIZE(g_cBenchmarkSessions); i++)
+    {
+        uint32_t cSessions = g_cBenchmarkSessions[i];
+        BenchmarkCoroutineSessions(cSessions);
+        if (cSessions <= BENCHMARK_MAX_SESSION_THREADS)
+        {
+            BenchmarkThreadSessions(cSessions);
+        }
+    }
+}
+
+#pragma endregion
+
+
+#pragma region Timers
+
+static size_t g_cTimersFired;
+
+static void CountTimer(TIMER_ENTRY *pTimer, PVOID pContext)
+{
+    UNREFERENCED_PARAMETER(pTimer);
+    UNREFERENCED_PARAMETER(pContext);
+    g_cTimersFired++;
+}
+
+static void PrintTimerResult(PCWSTR pszName, size_t cOperations, double seconds)
+{
+    wprintf(L"  %-28s %10.1f ns/op %14.0f ops/s\n", pszName,
+        seconds * 1e9 / cOperations, cOperations / seconds);
+}
+
+void BenchmarkTimers(void)
+{
+    wprintf(L"Timer wheel: %u pending timers over %u s\n", BENCHMARK_TIMERS,
+        BENCHMARK_TIMER_SPAN);
+
+    // The wheel runs on a simulated clock, so that the expiry of a minute
+    // of deadlines is measured without waiting for it.
+    uint64_t frequency = IpcTimestampFrequency();
+    uint64_t span = BENCHMARK_TIMER_SPAN * frequency;
+    std::unique_ptr<CTimerWheel> pWheel(new CTimerWheel(0));
+    std::vector<TIMER_ENTRY> timers(BENCHMARK_TIMERS);
+    std::vector<uint64_t> deadlines(BENCHMARK_TIMERS);
+
+    uint64_t seed = 88172645463325252ULL;
+    for (size_t i = 0; i < timers.size(); i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        deadlines[i] = 1 + seed % span;
+        CTimerWheel::Initialize(&timers[i], CountTimer, NULL);
+    }
+
+    BenchmarkClock::time_point start = BenchmarkClock::now();
+    for (size_t i = 0; i < timers.size(); i++)
+    {
+        pWheel->Schedule(&timers[i], deadlines[i]);
+    }
+    PrintTimerResult(L"schedule", timers.size(), ElapsedSeconds(start));
+
+    // Move every timer, as a heartbeat that is pushed back does.
+    start = BenchmarkClock::now();
+    for (size_t i = 0; i < timers.size(); i++)
+    {
+        pWheel->Schedule(&timers[i], span - deadlines[i] + 1);
+    }
+    PrintTimerResult(L"reschedule", timers.size(), ElapsedSeconds(start));
+
+    // Cancel every other timer, as a request answered in time does.
+    start = BenchmarkClock::now();
+    for (size_t i = 0; i < timers.size(); i += 2)
+    {
+        pWheel->Cancel(&timers[i]);
+    }
+    PrintTimerResult(L"cancel", timers.size() / 2, ElapsedSeconds(start));
+
+    g_cTimersFired = 0;
+    uint64_t step = BENCHMARK_TIMER_STEP * frequency / 1000000;
+    size_t cSteps = 0;
+    start = BenchmarkClock::now();
+    for (uint64_t now = 0; now <= span + step; now += step)
+    {
+        pWheel->Advance(now);
+        cSteps++;
+    }
+    double seconds = ElapsedSeconds(start);
+    PrintTimerResult(L"expire", g_cTimersFired, seconds);
+    wprintf(L"  %zu timers fired in %zu steps, %zu left pending\n",
+        g_cTimersFired, cSteps, pWheel->GetCount());
+}
+
+#pragma endregion
+
+
+#pragma region Shards
+
+// The client of one shard keeps the request rings of its sessions full and
+// collects the replies, so the shard is never short of work.
+static void ShardClientThread(IPC_SECTION_HEADER *pHeader, uint32_t iShard,
+                              std::atomic<long> *pcDone)
+{
+    const IPC_GEOMETRY &geometry = pHeader->Geometry;
+    uint32_t iFirst = IpcShardFirstSession(geometry, iShard);
+    uint32_t iLast = IpcShardFirstSession(geometry, iShard + 1);
+    std::atomic<uint32_t> &serverSleeping =
+        IpcGetShard(pHeader, iShard)->ServerSleeping;
+
+    wchar_t szDoorbell[64];
+    IpcFormatDoorbellName(szDoorbell, ARRAYSIZE(szDoorbell), iShard);
+    HANDLE hDoorbell = OpenEvent(EVENT_MODIFY_STATE, FALSE, szDoorbell);
+
+    BYTE buffer[BENCHMARK_MESSAGE_SIZE] = { 0 };
+    size_t cbData;
+    long cSent = 0;
+    long cReceived = 0;
+    while (cReceived < BENCHMARK_SHARD_REQUESTS)
+    {
+        bool fRing = false;
+        for (uint32_t i = iFirst; i < iLast; i++)
+        {
+            IPC_RING_HEADER *pRequests = IpcGetRing(pHeader, i,
+                IPC_RING_REQUEST);
+            IPC_RING_HEADER *pReplies = IpcGetRing(pHeader, i,
+                IPC_RING_REPLY);
+            while (cSent < BENCHMARK_SHARD_REQUESTS &&
+                IpcRingWrite(geometry, pRequests, buffer, sizeof(buffer)))
+            {
+                cSent++;
+                fRing = true;
+            }
+            while (IpcRingRead(geometry, pReplies, buffer, sizeof(buffer),
+                &cbData))
+            {
+                cReceived++;
+            }
+            fRing |= IpcRingGrant(geometry, pReplies, geometry.cSlots);
+        }
+
+        if (!fRing)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (hDoorbell && serverSleeping.load(std::memory_order_relaxed))
+        {
+            SetEvent(hDoorbell);
+        }
+    }
+
+    if (hDoorbell)
+    {
+        CloseHandle(hDoorbell);
+    }
+    pcDone->fetch_add(1, std::memory_order_release);
+}
+
+static void BenchmarkShardCount(uint32_t cShards)
+{
+    IPC_GEOMETRY geometry = { cShards * BENCHMARK_SHARD_SESSIONS,
+        BENCHMARK_SLOTS, BENCHMARK_SLOT_SIZE, cShards };
+    size_t cbSection = IpcSectionSize(geometry);
+    PVOID pView = VirtualAlloc(NULL, cbSection, MEM_COMMIT | MEM_RESERVE,
+        PAGE_READWRITE);
+    if (pView == NULL)
+    {
+        wprintf(L"  VirtualAlloc failed w/err 0x%08lx\n", GetLastError());
+        return;
+    }
+
+    IpcInitializeSection(pView, cbSection, geometry, GetCurrentProcessId());
+    IPC_SECTION_HEADER *pHeader = IpcGetHeader(pView);
+    for (uint32_t i = 0; i < cShards; i++)
+    {
+        for (uint32_t j = 0; j < BENCHMARK_SHARD_SESSIONS; j++)
+        {
+            IpcOpenSession(pHeader, GetCurrentProcessId(), i);
+        }
+    }
+
+    try
+    {
+        CShardedBroker broker(pHeader, NULL);
+        while (broker.GetActiveCount() < geometry.cSessions)
+        {
+            if (broker.Poll() == 0)
+            {
+                broker.Wait(1);
+            }
+        }
+
+        std::atomic<long> cDone(0);
+        std::vector<std::thread> clients;
+        BenchmarkClock::time_point start = BenchmarkClock::now();
+        for (uint32_t i = 0; i < cShards; i++)
+        {
+            clients.push_back(std::thread(ShardClientThread, pHeader, i,
+                &cDone));
+        }
+        while (cDone.load(std::memory_order_acquire) < (long)cShards)
+        {
+            // Only a section of a single shard is polled by this thread.
+            if (broker.Poll() == 0)
+            {
+                broker.Wait(1);
+            }
+        }
+        double seconds = ElapsedSeconds(start);
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            clients[i].join();
+        }
+
+        double rate = (double)cShards * BENCHMARK_SHARD_REQUESTS / seconds;
+        wprintf(L"  %-18s %3u shard(s) %12.0f requests/s %12.0f per shard\n",
+            (cShards == 1) ? L"thread pool" : L"pinned shards", cShards, rate,
+            rate / cShards);
+    }
+    catch (DWORD dwError)
+    {
+        wprintf(L"  CShardedBroker failed w/err 0x%08lx\n", dwError);
+    }
+
+    VirtualFree(pView, 0, MEM_RELEASE);
+}
+
+void BenchmarkShards(void)
+{
+    wprintf(L"Request throughput by number of shards\n");
+
+    // Every shard has a client thread next to its own, so the shards stop
+    // scaling at half the hardware threads.
+    unsigned int cMaxShards = std::thread::hardware_concurrency() / 2;
+    if (cMaxShards == 0)
+    {
+        cMaxShards = 1;
+    }
+    if (cMaxShards > IPC_MAX_SHARDS)
+    {
+        cMaxShards = IPC_MAX_SHARDS;
+    }
+
+    for (unsigned int cShards = 1; cShards < cMaxShards; cShards *= 2)
+    {
+        BenchmarkShardCount(cShards);
+    }
+    BenchmarkShardCount(cMaxShards);
+}
+
+#pragma endregion
+
+
+#pragma region Startup
+
+void BenchmarkStartup(void)
+{
+    wprintf(L"Server start to the first request served\n");
+
+    double msPerTick = 1000.0 / IpcTimestampFrequency();
+    double total = 0;
+    double worst = 0;
+    int cStarts = 0;
+    BYTE request[64] = { 0 };
+    BYTE reply[IPC_PAGE_SIZE];
+    size_t cbReply = 0;
+
+    for (int i = 0; i < BENCHMARK_STARTS; i++)
+    {
+        uint64_t started = IpcTimestamp();
+        HANDLE hServer = StartServerProcess();
+        if (hServer == NULL)
+        {
+            wprintf(L"  The server cannot be started w/err 0x%08lx\n", 
+                GetLastError());
+            break;
+        }
+
+        // A failed attempt is made again at once rather than after the 
+        // growing delay of the client, which would hide the startup time.
+        CIpcClient client(FULL_MAP_NAME);
+        uint64_t connected = 0;
+        uint64_t served = 0;
+        ULONGLONG ullDeadline = GetTickCount64() + BENCHMARK_START_TIMEOUT;
+        while (served == 0 && GetTickCount64() < ullDeadline)
+        {
+            if (!client.EnsureConnected())
+            {
+                client.Disconnect();
+                std::this_thread::yield();
+                continue;
+            }
+            if (connected == 0)
+            {
+                connected = IpcTimestamp();
+            }
+            if (client.Send(request, sizeof(request)) && 
+                client.Receive(reply, sizeof(reply), &cbReply, 
+                BENCHMARK_REPLY_TIMEOUT))
+            {
+                served = IpcTimestamp();
+            }
+        }
+
+        // The next server must create the section anew.
+        client.Disconnect();
+        TerminateProcess(hServer, 0);
+        WaitForSingleObject(hServer, INFINITE);
+        CloseHandle(hServer);
+
+        if (served == 0)
+        {
+            wprintf(L"  start %d: not served within %u ms\n", i + 1, 
+                BENCHMARK_START_TIMEOUT);
+            continue;
+        }
+
+        double startup = (served - started) * msPerTick;
+        total += startup;
+        cStarts++;
+        if (startup > worst)
+        {
+            worst = startup;
+        }
+        wprintf(L"  start %d: connected after %8.3f ms, served after "
+            L"%8.3f ms\n", i + 1, (connected - started) * msPerTick, startup);
+    }
+
+    if (cStarts != 0)
+    {
+        wprintf(L"  average %.3f ms, worst %.3f ms\n", total / cStarts, 
+            worst);
+    }
+}
+
+#pragma endregion
+
+
+#pragma region Benchmark Selection
+
+// The benchmarks that can be selected on the command line.
+static const struct
+{
+    PCWSTR pszName;
+    void (*pfnRun)(void);
+}
+g_benchmarks[] = 
+{
+    { L"threadpool",    BenchmarkThreadPool },
+    { L"reconnect",     BenchmarkReconnect },
+    { L"coroutines",    BenchmarkCoroutines },
+    { L"timers",        BenchmarkTimers },
+    { L"shards",        BenchmarkShards },
+    { L"startup",       BenchmarkStartup },
+};
+
+
+void RunBenchmarks(int argc, wchar_t *argv[])
+{
+    for (int i = 0; i < argc; i++)
+    {
+        BOOL fFound = FALSE;
+        for (size_t j = 0; j < ARRAYSIZE(g_benchmarks); j++)
+        {
+            fFound |= (_wcsicmp(argv[i], g_benchmarks[j].pszName) == 0);
+        }
+        if (!fFound)
+        {
+            wprintf(L"Unknown benchmark: %s\n", argv[i]);
+        }
+    }
+
+    for (size_t j = 0; j < ARRAYSIZE(g_benchmarks); j++)
+    {
+        BOOL fSelected = (argc == 0);
+        for (int i = 0; i < argc; i++)
+        {
+            fSelected |= (_wcsicmp(argv[i], g_benchmarks[j].pszName) == 0);
+        }
+        if (fSelected)
+        {
+            g_benchmarks[j].pfnRun();
+            wprintf(L"\n");
+        }
+    }
+}
+
+#pragma endregion
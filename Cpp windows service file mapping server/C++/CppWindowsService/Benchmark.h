@@ -0,0 +1,115 @@
+/****************************** Module Header ******************************\
+* Module Name:  Benchmark.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* The file declares the console microbenchmarks that can be run from the 
+* command line with "-benchmark". They exercise the building blocks of the 
+* service outside of the SCM so that changes can be measured on a 
+* developer machine.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND, 
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED 
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+
+//
+//   FUNCTION: RunBenchmarks(int, wchar_t *[])
+//
+//   PURPOSE: Run the benchmarks selected on the command line and print the 
+//   results to the standard output stream. With no selection every 
+//   benchmark is run.
+//
+//   PARAMETERS:
+//   * argc - number of benchmark names
+//   * argv - array of benchmark names, for example "threadpool"
+//
+void RunBenchmarks(int argc, wchar_t *argv[]);
+
+
+//
+//   FUNCTION: BenchmarkThreadPool(void)
+//
+//   PURPOSE: Measure the task throughput of CThreadPool. Small tasks are 
+//   queued from outside the pool and from inside the pool (fan-out), for 
+//   one worker up to one worker per hardware thread. On Windows, the 
+//   throughput of the system thread pool with one heap allocation per 
+//   work item (the previous implementation) is reported for comparison.
+//
+void BenchmarkThreadPool(void);
+
+
+//
+//   FUNCTION: BenchmarkReconnect(void)
+//
+//   PURPOSE: Measure how fast a client finds the server again after it is 
+//   killed and restarted under load. A server is started in a child process 
+//   ("-serve") and a CIpcClient sends it requests back to back; the server 
+//   is then killed and started again a number of times. For each restart 
+//   the time until the client notices the loss and the time until it is 
+//   served by the new server are reported. Creating the global objects of 
+//   the server requires an elevated console.
+//
+void BenchmarkReconnect(void);
+
+
+//
+//   FUNCTION: BenchmarkCoroutines(void)
+//
+//   PURPOSE: Compare how many echo sessions a core serves when each session 
+//   is a pair of coroutines on CAsyncLoop (see AsyncChannel.h) with the 
+//   thread-per-session approach. The sessions live in an in-process section 
+//   and each makes a fixed number of round trips; the round trips per 
+//   second, in total and per core, are reported for an increasing number 
+//   of sessions.
+//
+void BenchmarkCoroutines(void);
+
+
+//
+//   FUNCTION: BenchmarkTimers(void)
+//
+//   PURPOSE: Measure the timing wheel (see TimerWheel.h) that keeps the 
+//   timeouts and heartbeats of the sessions. A million timers are 
+//   scheduled, moved and partly cancelled, and the wheel is then advanced 
+//   through their deadlines on a simulated clock; the cost of each 
+//   operation and the rate at which timers expire are reported.
+//
+void BenchmarkTimers(void);
+
+
+//
+//   FUNCTION: BenchmarkShards(void)
+//
+//   PURPOSE: Measure how the request throughput of the broker grows with 
+//   the number of shards (see ShardedBroker.h). An in-process section gets 
+//   a few sessions per shard and a client thread per shard that keeps 
+//   their rings full; the requests answered per second, in total and per 
+//   shard, are reported for one shard on the thread pool and for up to one 
+//   pinned shard per two hardware threads. Creating the global events of 
+//   the sessions requires an elevated console, and no server may be 
+//   running.
+//
+void BenchmarkShards(void);
+
+
+//
+//   FUNCTION: BenchmarkStartup(void)
+//
+//   PURPOSE: Measure how long after its start the server serves its first 
+//   request, which is what the clients wait for after a host reboot. A 
+//   server is started in a child process ("-serve") a number of times, 
+//   while a client tries to connect and send a request from the moment the 
+//   process is created. For each start the time until the client is 
+//   connected and the time until it gets its first reply are reported. 
+//   Creating the global objects of the server requires an elevated 
+//   console, and no other server may be running.
+//
+void BenchmarkStartup(void);
@@ -22,6 +22,7 @@
 #include "ServiceInstaller.h"
 #include "ServiceBase.h"
 #include "SampleService.h"
+#include "Benchmark.h"
 #pragma endregion
 
 
@@ -86,12 +87,28 @@ int wmain(int argc, wchar_t *argv[])
             // "-remove" or "/remove".
             UninstallService(SERVICE_NAME);
         }
+        else if (_wcsicmp(L"benchmark", argv[1] + 1) == 0)
+        {
+            // Run the console benchmarks when the command is 
+            // "-benchmark [name ...]" or "/benchmark [name ...]".
+            RunBenchmarks(argc - 2, argv + 2);
+        }
+        else if (_wcsicmp(L"serve", argv[1] + 1) == 0)
+        {
+            // Serve the clients from the console when the command is 
+            // "-serve [-durable <file>] [-config <file>]" or "/serve ...", 
+            // until a line is entered.
+            CSampleService service(SERVICE_NAME);
+            service.RunConsole(argc - 1, argv + 1);
+        }
     }
     else
     {
         wprintf(L"Parameters:\n");
         wprintf(L" -install  to install the service.\n");
         wprintf(L" -remove   to remove the service.\n");
+        wprintf(L" -benchmark [name ...]  to run the benchmarks.\n");
+        wprintf(L" -serve    to serve the clients from the console.\n");
 
         CSampleService service(SERVICE_NAME);
         if (!CServiceBase::Run(service))
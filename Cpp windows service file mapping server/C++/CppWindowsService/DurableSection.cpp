@@ -0,0 +1,167 @@
+/****************************** Module Header ******************************\
+* Module Name:  DurableSection.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the file-backed shared section.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include "DurableSection.h"
+#pragma endregion
+
+
+CDurableSection::CDurableSection(PCWSTR pszPath, PCWSTR pszMapName,
+                                 LPSECURITY_ATTRIBUTES pSecurityAttributes,
+                                 const IPC_GEOMETRY &geometry)
+: m_hFile(INVALID_HANDLE_VALUE),
+  m_hMapFile(NULL),
+  m_pView(NULL),
+  m_cbSection(IpcSectionSize(geometry)),
+  m_fRecovered(false),
+  m_ullRecoveryTime(0),
+  m_hStopFlusher(NULL)
+{
+    DWORD dwError = ERROR_SUCCESS;
+    LARGE_INTEGER liSize;
+    liSize.QuadPart = (LONGLONG)m_cbSection;
+
+    memset(&m_recovery, 0, sizeof(m_recovery));
+
+    // Open the backing file, or create it. Clients only ever see the file
+    // through the mapping, so the file itself is not shared for writing.
+    m_hFile = CreateFile(pszPath, GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        goto Error;
+    }
+
+    // Preallocate the whole section, so that writing to it never has to
+    // extend the file.
+    if (!SetFilePointerEx(m_hFile, liSize, NULL, FILE_BEGIN) ||
+        !SetEndOfFile(m_hFile))
+    {
+        goto Error;
+    }
+
+    m_hMapFile = CreateFileMapping(m_hFile, pSecurityAttributes,
+        PAGE_READWRITE, liSize.HighPart, liSize.LowPart, pszMapName);
+    if (m_hMapFile == NULL)
+    {
+        goto Error;
+    }
+
+    m_pView = MapViewOfFile(m_hMapFile, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (m_pView == NULL)
+    {
+        goto Error;
+    }
+
+    m_hStopFlusher = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_hStopFlusher == NULL)
+    {
+        goto Error;
+    }
+
+    {
+        ULONGLONG ullStart = GetTickCount64();
+        m_fRecovered = IpcRecoverSection(m_pView, m_cbSection, geometry,
+            GetCurrentProcessId(), &m_recovery);
+        if (!m_fRecovered)
+        {
+            IpcInitializeSection(m_pView, m_cbSection, geometry,
+                GetCurrentProcessId(), IPC_SECTION_DURABLE);
+        }
+        m_ullRecoveryTime = GetTickCount64() - ullStart;
+    }
+    return;
+
+Error:
+    dwError = GetLastError();
+    Close();
+    throw dwError;
+}
+
+
+CDurableSection::~CDurableSection(void)
+{
+    if (m_flusher.joinable())
+    {
+        SetEvent(m_hStopFlusher);
+        m_flusher.join();
+    }
+
+    Flush();
+    Close();
+}
+
+
+void CDurableSection::StartFlusher(DWORD dwInterval)
+{
+    if (!m_flusher.joinable())
+    {
+        m_flusher = std::thread(&CDurableSection::FlusherThread, this,
+            dwInterval);
+    }
+}
+
+
+//
+//   FUNCTION: CDurableSection::Flush(void)
+//
+//   PURPOSE: Write the dirty pages of the view to the file and flush the
+//   file to disk. A restart of the service alone loses nothing even
+//   without flushing, since the pages stay in the system cache; flushing
+//   is what makes the messages survive a crash of the system.
+//
+BOOL CDurableSection::Flush(void)
+{
+    if (m_pView == NULL)
+    {
+        return FALSE;
+    }
+    return FlushViewOfFile(m_pView, 0) && FlushFileBuffers(m_hFile);
+}
+
+
+void CDurableSection::Close(void)
+{
+    if (m_hStopFlusher)
+    {
+        CloseHandle(m_hStopFlusher);
+        m_hStopFlusher = NULL;
+    }
+    if (m_pView)
+    {
+        UnmapViewOfFile(m_pView);
+        m_pView = NULL;
+    }
+    if (m_hMapFile)
+    {
+        CloseHandle(m_hMapFile);
+        m_hMapFile = NULL;
+    }
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+}
+
+
+void CDurableSection::FlusherThread(DWORD dwInterval)
+{
+    while (WaitForSingleObject(m_hStopFlusher, dwInterval) == WAIT_TIMEOUT)
+    {
+        Flush();
+    }
+}
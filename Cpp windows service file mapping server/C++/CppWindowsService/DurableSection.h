@@ -0,0 +1,81 @@
+/****************************** Module Header ******************************\
+* Module Name:  DurableSection.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares CDurableSection, which backs the shared section with a
+* preallocated file instead of the paging file. Messages queued in the
+* rings then survive a restart of the service: the file is flushed to disk
+* periodically by a background thread, and on startup the section is
+* recovered from it with IpcRecoverSection (see IpcChannel.h).
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <thread>
+#include "IpcChannel.h"
+
+// Interval, in milliseconds, between two flushes of the backing file.
+#define DURABLE_FLUSH_INTERVAL  1000
+
+
+class CDurableSection
+{
+public:
+
+    // Open or create the backing file, size it for the geometry and map it
+    // under the given name. If the file holds a section of the same version
+    // and geometry, it is recovered; otherwise a new section is laid out.
+    // Throws the Win32 error code on failure.
+    CDurableSection(PCWSTR pszPath, PCWSTR pszMapName,
+        LPSECURITY_ATTRIBUTES pSecurityAttributes,
+        const IPC_GEOMETRY &geometry);
+
+    // Stop the flusher, flush the section a last time and unmap it.
+    ~CDurableSection(void);
+
+    // Start flushing the section to disk every dwInterval milliseconds.
+    void StartFlusher(DWORD dwInterval = DURABLE_FLUSH_INTERVAL);
+
+    // Write the dirty pages of the section to disk and wait until they are
+    // on it.
+    BOOL Flush(void);
+
+    PVOID GetView(void) const { return m_pView; }
+    size_t GetSize(void) const { return m_cbSection; }
+
+    // Whether the section was recovered from the file, what was found in
+    // it and how long recovery took, in milliseconds.
+    bool IsRecovered(void) const { return m_fRecovered; }
+    const IPC_RECOVERY &GetRecovery(void) const { return m_recovery; }
+    ULONGLONG GetRecoveryTime(void) const { return m_ullRecoveryTime; }
+
+private:
+
+    CDurableSection(const CDurableSection &);
+    CDurableSection &operator=(const CDurableSection &);
+
+    void Close(void);
+    void FlusherThread(DWORD dwInterval);
+
+    HANDLE m_hFile;
+    HANDLE m_hMapFile;
+    PVOID m_pView;
+    size_t m_cbSection;
+
+    bool m_fRecovered;
+    IPC_RECOVERY m_recovery;
+    ULONGLONG m_ullRecoveryTime;
+
+    HANDLE m_hStopFlusher;
+    std::thread m_flusher;
+};
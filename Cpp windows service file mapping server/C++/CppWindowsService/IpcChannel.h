@@ -0,0 +1,943 @@
+/****************************** Module Header ******************************\
+* Module Name:  IpcChannel.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Defines the layout of the shared section (Global\SampleMap) and the
+* lock-free operations that the server and its clients use on it. The
+* section is laid out as follows:
+* 
+*     offset 0                 greeting text written by the server (the
+*                              original one-message protocol, VIEW_SIZE
+*                              bytes)
+*     IPC_HEADER_OFFSET        IPC_SECTION_HEADER
+*     after the header         IPC_SESSION[cSessions]
+*     after the sessions       two rings per session: requests (client to
+*                              server) and replies (server to client)
+* 
+* Each ring is a single-producer, single-consumer queue of fixed-size
+* slots. The producer owns Head and the consumer owns Tail; both only ever
+* increase, so a ring never needs a lock. The consumer also grants the
+* producer credits: the position up to which it may publish. A producer
+* out of credits stops, or sheds the message, instead of queueing behind a
+* consumer that is already late, which keeps the waiting time in the ring
+* bounded. The geometry (number of sessions,
+* slots per ring and slot size) is recorded in the header when the server
+* creates the section, so clients do not depend on compile-time sizes.
+* 
+* A client claims a free session slot, resets its rings and marks it
+* CONNECTING. The server accepts it (ACTIVE), serves its requests and
+* frees the slot again after the client marks it CLOSING or exits.
+* 
+* The sessions may be split into cShards contiguous shards, each served by
+* a thread of its own with its own doorbell (IPC_DOORBELL_SHARD_FORMAT)
+* and sleeping flag, so the shards share nothing but the section. A
+* client hashes itself onto a shard and claims a slot there first.
+* 
+* When the section is backed by a file, a restarted server takes the
+* sessions and their queued messages over with IpcRecoverSection.
+* 
+* Every time a server lays out or recovers the section it increments the
+* generation in the header. A client remembers the generation under which
+* it opened its session; when it changes, the session it holds is no
+* longer the server's and the client must open a new one.
+* 
+* To change the geometry while it runs, the server lays out a successor
+* section named IPC_SUCCESSOR_FORMAT, records its number in the header of
+* the section it replaces and of the first one, and then increments the
+* generation of the section it replaces. Clients reconnect, open the
+* first section by its name as always and follow the successor number to
+* the current one.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+    "The section requires lock-free atomics that work across processes");
+
+
+#pragma region Names and Defaults
+
+// Auto-reset event that clients signal when they publish a request while
+// the server is waiting.
+#define IPC_DOORBELL_NAME       L"Global\\SampleMapDoorbell"
+
+// Doorbell of the shards other than the first, which rings
+// IPC_DOORBELL_NAME. Formatted with the shard index.
+#define IPC_DOORBELL_SHARD_FORMAT L"Global\\SampleMapDoorbell.%u"
+
+// Auto-reset event, one per session, that the server signals when it
+// publishes a reply while the client is waiting. Formatted with the
+// session index.
+#define IPC_SESSION_EVENT_FORMAT L"Global\\SampleMapSession%u"
+
+// Name of the successor sections of a section, formatted with the name of
+// the first section and the number of the successor.
+#define IPC_SUCCESSOR_FORMAT    L"%s.%u"
+
+// Offset of the section header. The bytes before it hold the greeting.
+#define IPC_HEADER_OFFSET       4096
+
+// Default geometry of the section.
+#define IPC_DEFAULT_SESSIONS    256
+#define IPC_DEFAULT_SLOTS       64
+#define IPC_DEFAULT_SLOT_SIZE   256
+
+#define IPC_SECTION_MAGIC       0x31435049      // 'IPC1'
+#define IPC_SECTION_VERSION     7
+
+// Section flags.
+#define IPC_SECTION_DURABLE     0x00000001  // Backed by a file and recovered
+                                            // after a crash; slots carry a
+                                            // checksum
+
+// Largest number of shards a section may be split into.
+#define IPC_MAX_SHARDS          64
+
+#define IPC_CACHE_LINE          64
+#define IPC_PAGE_SIZE           4096
+
+#pragma endregion
+
+
+#pragma region Section Layout
+
+// Session states.
+enum
+{
+    IPC_SESSION_FREE        = 0,    // Available to clients
+    IPC_SESSION_OPENING     = 1,    // Claimed by a client, rings being reset
+    IPC_SESSION_CONNECTING  = 2,    // Waiting to be accepted by the server
+    IPC_SESSION_ACTIVE      = 3,    // Accepted; requests are served
+    IPC_SESSION_CLOSING     = 4     // Closed by the client, or abandoned
+};
+
+// Ring selectors.
+enum
+{
+    IPC_RING_REQUEST        = 0,    // Client to server
+    IPC_RING_REPLY          = 1     // Server to client
+};
+
+struct IPC_GEOMETRY
+{
+    uint32_t cSessions;             // Number of session slots
+    uint32_t cSlots;                // Slots per ring, a power of two
+    uint32_t cbSlot;                // Bytes per slot, including its header;
+                                    // a power of two up to IPC_PAGE_SIZE
+    uint32_t cShards;               // Shards the sessions are split into;
+                                    // 0 is the same as 1
+};
+
+// The part of the header that belongs to one shard, on a cache line of its
+// own so the shards do not slow each other down.
+struct IPC_SHARD
+{
+    // Set by the thread of the shard while it waits on its doorbell.
+    alignas(IPC_CACHE_LINE) std::atomic<uint32_t> ServerSleeping;
+};
+
+struct IPC_SECTION_HEADER
+{
+    uint32_t Magic;                 // IPC_SECTION_MAGIC
+    uint32_t Version;               // IPC_SECTION_VERSION
+    uint64_t cbSection;             // Size of the whole section
+    IPC_GEOMETRY Geometry;
+    uint32_t ServerPid;             // Process that serves the section
+    std::atomic<uint32_t> Generation;   // Incremented by every server start
+
+    // Number of the section that replaces this one (IPC_SUCCESSOR_FORMAT),
+    // or 0 while this one is current.
+    std::atomic<uint32_t> Successor;
+
+    uint32_t Flags;                 // IPC_SECTION_*
+
+    IPC_SHARD Shards[IPC_MAX_SHARDS];
+
+    // Number of sessions in the ACTIVE state.
+    alignas(IPC_CACHE_LINE) std::atomic<uint32_t> cActiveSessions;
+};
+
+struct IPC_SESSION
+{
+    std::atomic<uint32_t> State;    // IPC_SESSION_*
+    uint32_t ClientPid;             // Process that owns the session
+
+    // Set by the client while it waits on its session event.
+    std::atomic<uint32_t> ClientSleeping;
+
+    uint8_t Reserved[IPC_CACHE_LINE - 3 * sizeof(uint32_t)];
+};
+
+struct IPC_RING_HEADER
+{
+    alignas(IPC_CACHE_LINE) std::atomic<uint64_t> Head;    // Producer
+
+    // Set by the producer when it runs out of credits, so that the
+    // consumer wakes it when it grants more.
+    std::atomic<uint32_t> Blocked;
+
+    alignas(IPC_CACHE_LINE) std::atomic<uint64_t> Tail;    // Consumer
+
+    // Position up to which the producer may publish, granted by the
+    // consumer. Never more than cSlots past Tail.
+    std::atomic<uint64_t> Credit;
+};
+
+struct IPC_SLOT_HEADER
+{
+    uint32_t cbData;                // Bytes of payload that follow
+
+    // Low 32 bits of the position + 1. Written last, by IpcSealSlot.
+    std::atomic<uint32_t> Sequence;
+
+    uint64_t Timestamp;             // IpcTimestamp() when it was written
+    uint32_t Checksum;              // IpcChecksum() of the payload, in a
+                                    // durable section only
+    uint32_t Reserved;
+};
+
+static_assert(sizeof(IPC_SESSION) == IPC_CACHE_LINE,
+    "A session must fill exactly one cache line");
+
+#pragma endregion
+
+
+#pragma region Layout Helpers
+
+// A reading of a clock that is consistent across processes, in ticks of
+// IpcTimestampFrequency() per second.
+inline uint64_t IpcTimestamp(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return static_cast<uint64_t>(counter.QuadPart);
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+#endif
+}
+
+inline uint64_t IpcTimestampFrequency(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return static_cast<uint64_t>(frequency.QuadPart);
+#else
+    return 1000000000;
+#endif
+}
+
+inline size_t IpcAlignUp(size_t cb, size_t alignment)
+{
+    return (cb + alignment - 1) & ~(alignment - 1);
+}
+
+// Offset of the first slot of a ring, relative to the ring header. Slots
+// are aligned on their own size, and the rings start on a page, so a slot
+// never straddles two pages: a page written back to a backing file carries
+// either all of a slot or none of it.
+inline size_t IpcSlotsOffset(const IPC_GEOMETRY &geometry)
+{
+    return IpcAlignUp(sizeof(IPC_RING_HEADER), geometry.cbSlot);
+}
+
+// Size of one ring, header included.
+inline size_t IpcRingSize(const IPC_GEOMETRY &geometry)
+{
+    return IpcSlotsOffset(geometry) +
+        static_cast<size_t>(geometry.cSlots) * geometry.cbSlot;
+}
+
+// Offset of the first session, relative to the section header.
+inline size_t IpcSessionsOffset(void)
+{
+    return IpcAlignUp(sizeof(IPC_SECTION_HEADER), IPC_CACHE_LINE);
+}
+
+// Offset of the first ring, relative to the section header.
+inline size_t IpcRingsOffset(const IPC_GEOMETRY &geometry)
+{
+    return IpcAlignUp(IpcSessionsOffset() +
+        static_cast<size_t>(geometry.cSessions) * sizeof(IPC_SESSION),
+        IPC_PAGE_SIZE);
+}
+
+// Size of the whole section for the given geometry, greeting included.
+inline size_t IpcSectionSize(const IPC_GEOMETRY &geometry)
+{
+    return IPC_HEADER_OFFSET + IpcRingsOffset(geometry) +
+        2 * static_cast<size_t>(geometry.cSessions) * IpcRingSize(geometry);
+}
+
+// Largest payload a single message can carry.
+inline size_t IpcMaxMessageSize(const IPC_GEOMETRY &geometry)
+{
+    return geometry.cbSlot - sizeof(IPC_SLOT_HEADER);
+}
+
+// A checksum of a payload, seeded with its size. Recovery compares it with
+// the one in the slot to tell a slot that reached the backing file whole
+// from one whose page was written back while its producer was copying it.
+inline uint32_t IpcChecksum(const void *pData, size_t cbData)
+{
+    const unsigned char *pb = static_cast<const unsigned char *>(pData);
+    uint64_t hash = 0xCBF29CE484222325ULL ^ cbData;
+    for (; cbData >= sizeof(uint64_t); pb += sizeof(uint64_t),
+        cbData -= sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, pb, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; cbData > 0; pb++, cbData--)
+    {
+        hash = (hash ^ *pb) * 0x100000001B3ULL;
+    }
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+inline bool IpcIsValidGeometry(const IPC_GEOMETRY &geometry)
+{
+    return geometry.cSessions > 0 &&
+        geometry.cSlots > 0 && (geometry.cSlots & (geometry.cSlots - 1)) == 0 &&
+        geometry.cbSlot > sizeof(IPC_SLOT_HEADER) &&
+        geometry.cbSlot <= IPC_PAGE_SIZE &&
+        (geometry.cbSlot & (geometry.cbSlot - 1)) == 0 &&
+        geometry.cShards <= IPC_MAX_SHARDS &&
+        geometry.cShards <= geometry.cSessions;
+}
+
+inline uint32_t IpcShardCount(const IPC_GEOMETRY &geometry)
+{
+    return (geometry.cShards > 1) ? geometry.cShards : 1;
+}
+
+// First session of a shard; shard cShards is one past the last session.
+// The sessions are spread evenly, so shards differ by one session at most.
+inline uint32_t IpcShardFirstSession(const IPC_GEOMETRY &geometry,
+                                     uint32_t iShard)
+{
+    return static_cast<uint32_t>(static_cast<uint64_t>(iShard) *
+        geometry.cSessions / IpcShardCount(geometry));
+}
+
+// The shard a session belongs to: the inverse of IpcShardFirstSession.
+inline uint32_t IpcShardOfSession(const IPC_GEOMETRY &geometry,
+                                  uint32_t iSession)
+{
+    return static_cast<uint32_t>(((static_cast<uint64_t>(iSession) + 1) *
+        IpcShardCount(geometry) - 1) / geometry.cSessions);
+}
+
+inline IPC_SECTION_HEADER *IpcGetHeader(void *pView)
+{
+    return reinterpret_cast<IPC_SECTION_HEADER *>(
+        static_cast<uint8_t *>(pView) + IPC_HEADER_OFFSET);
+}
+
+inline IPC_SESSION *IpcGetSession(IPC_SECTION_HEADER *pHeader, uint32_t iSession)
+{
+    return reinterpret_cast<IPC_SESSION *>(reinterpret_cast<uint8_t *>(pHeader) +
+        IpcSessionsOffset()) + iSession;
+}
+
+inline IPC_SHARD *IpcGetShard(IPC_SECTION_HEADER *pHeader, uint32_t iShard)
+{
+    return &pHeader->Shards[iShard];
+}
+
+inline IPC_RING_HEADER *IpcGetRing(IPC_SECTION_HEADER *pHeader,
+                                   uint32_t iSession, int ring)
+{
+    return reinterpret_cast<IPC_RING_HEADER *>(
+        reinterpret_cast<uint8_t *>(pHeader) + IpcRingsOffset(pHeader->Geometry) +
+        (2 * static_cast<size_t>(iSession) + ring) * IpcRingSize(pHeader->Geometry));
+}
+
+inline IPC_SLOT_HEADER *IpcGetSlot(const IPC_GEOMETRY &geometry,
+                                   IPC_RING_HEADER *pRing, uint64_t position)
+{
+    return reinterpret_cast<IPC_SLOT_HEADER *>(
+        reinterpret_cast<uint8_t *>(pRing) + IpcSlotsOffset(geometry) +
+        static_cast<size_t>(position & (geometry.cSlots - 1)) * geometry.cbSlot);
+}
+
+#ifdef _WIN32
+// Name of the doorbell of a shard. The first shard keeps the name of the
+// single doorbell of an unsharded section.
+inline void IpcFormatDoorbellName(wchar_t *pszName, size_t cchName,
+                                  uint32_t iShard)
+{
+    if (iShard == 0)
+    {
+        wcscpy_s(pszName, cchName, IPC_DOORBELL_NAME);
+    }
+    else
+    {
+        swprintf_s(pszName, cchName, IPC_DOORBELL_SHARD_FORMAT, iShard);
+    }
+}
+#endif
+
+#pragma endregion
+
+
+#pragma region Section Operations
+
+//
+//   FUNCTION: IpcInitializeSection(void *, size_t, const IPC_GEOMETRY &,
+//   uint32_t, uint32_t)
+//
+//   PURPOSE: Lay out a new section: write the header and mark every session
+//   free. Called by the server on a zero-filled view, or on the section of
+//   a previous server that clients still map; the new generation tells
+//   those clients that their sessions are gone.
+//
+inline void IpcInitializeSection(void *pView, size_t cbView,
+                                 const IPC_GEOMETRY &geometry,
+                                 uint32_t serverPid, uint32_t flags = 0)
+{
+    IPC_SECTION_HEADER *pHeader = IpcGetHeader(pView);
+
+    // The section may outlive a server as long as a client maps it. Carry
+    // its generation over, and hide the header from clients until it is
+    // complete again.
+    uint32_t generation = 0;
+    if (pHeader->Magic == IPC_SECTION_MAGIC)
+    {
+        generation = pHeader->Generation.load(std::memory_order_relaxed);
+    }
+    pHeader->Magic = 0;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    pHeader->Geometry = geometry;
+    pHeader->cbSection = cbView;
+    pHeader->ServerPid = serverPid;
+    pHeader->Successor.store(0, std::memory_order_relaxed);
+    pHeader->Flags = flags;
+    for (uint32_t i = 0; i < IPC_MAX_SHARDS; i++)
+    {
+        pHeader->Shards[i].ServerSleeping.store(0, std::memory_order_relaxed);
+    }
+    pHeader->cActiveSessions.store(0, std::memory_order_relaxed);
+
+    for (uint32_t i = 0; i < geometry.cSessions; i++)
+    {
+        IPC_SESSION *pSession = IpcGetSession(pHeader, i);
+        pSession->ClientPid = 0;
+        pSession->ClientSleeping.store(0, std::memory_order_relaxed);
+        pSession->State.store(IPC_SESSION_FREE, std::memory_order_relaxed);
+    }
+
+    pHeader->Version = IPC_SECTION_VERSION;
+    pHeader->Generation.store(generation + 1, std::memory_order_relaxed);
+
+    // The magic is written last: a client that sees it sees a complete
+    // header.
+    std::atomic_thread_fence(std::memory_order_release);
+    pHeader->Magic = IPC_SECTION_MAGIC;
+}
+
+//
+//   FUNCTION: IpcValidateSection(void *, size_t)
+//
+//   PURPOSE: Check that a mapped view holds an initialized section of a
+//   version this code understands, and that the geometry recorded in it
+//   fits in the view.
+//
+inline bool IpcValidateSection(void *pView, size_t cbView)
+{
+    if (cbView < IPC_HEADER_OFFSET + sizeof(IPC_SECTION_HEADER))
+    {
+        return false;
+    }
+
+    IPC_SECTION_HEADER *pHeader = IpcGetHeader(pView);
+    if (pHeader->Magic != IPC_SECTION_MAGIC)
+    {
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return pHeader->Version == IPC_SECTION_VERSION &&
+        IpcIsValidGeometry(pHeader->Geometry) &&
+        IpcSectionSize(pHeader->Geometry) <= cbView;
+}
+
+// Whether the producers of the section checksum their slots for recovery.
+// Read once per message or batch, and passed to IpcRingWrite, IpcRingStage
+// and IpcSealSlot.
+inline bool IpcIsDurable(const IPC_SECTION_HEADER *pHeader)
+{
+    return (pHeader->Flags & IPC_SECTION_DURABLE) != 0;
+}
+
+//
+//   FUNCTION: IpcSupersedeSection(IPC_SECTION_HEADER *, uint32_t)
+//
+//   PURPOSE: Hand the clients of a section over to its successor. The
+//   successor is recorded before the generation changes, so a client that
+//   notices the new generation and reconnects always finds it.
+//
+inline void IpcSupersedeSection(IPC_SECTION_HEADER *pHeader, uint32_t successor)
+{
+    pHeader->Successor.store(successor, std::memory_order_release);
+    pHeader->Generation.fetch_add(1, std::memory_order_acq_rel);
+}
+
+#pragma endregion
+
+
+#pragma region Recovery
+
+struct IPC_RECOVERY
+{
+    uint32_t cSessions;             // Sessions handed back to the broker
+    uint64_t cMessages;             // Messages found intact in their rings
+    uint64_t cDiscarded;            // Messages dropped as incomplete
+};
+
+//
+//   FUNCTION: IpcRecoverRing(const IPC_GEOMETRY &, IPC_RING_HEADER *,
+//   IPC_RECOVERY *)
+//
+//   PURPOSE: Check the published but unconsumed slots of a ring that was
+//   read back from a backing file. A slot is intact if its sequence number
+//   matches its position and its payload its checksum; the ring is cut at
+//   the first slot that is not, since the slots after it were published
+//   later. The scan visits at most cSlots slots, whatever the history of
+//   the ring.
+//
+inline void IpcRecoverRing(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing,
+                           IPC_RECOVERY *pRecovery)
+{
+    uint64_t tail = pRing->Tail.load(std::memory_order_relaxed);
+    uint64_t head = pRing->Head.load(std::memory_order_relaxed);
+
+    uint64_t position = tail;
+    if (head >= tail && head - tail <= geometry.cSlots)
+    {
+        while (position != head)
+        {
+            IPC_SLOT_HEADER *pSlot = IpcGetSlot(geometry, pRing, position);
+            if (pSlot->Sequence.load(std::memory_order_acquire) !=
+                static_cast<uint32_t>(position + 1) ||
+                pSlot->cbData > IpcMaxMessageSize(geometry) ||
+                pSlot->Checksum != IpcChecksum(pSlot + 1, pSlot->cbData))
+            {
+                break;
+            }
+            position++;
+        }
+        pRecovery->cDiscarded += head - position;
+    }
+
+    pRecovery->cMessages += position - tail;
+    if (position != head)
+    {
+        // A producer that still maps the section may have published more
+        // in the meantime; leave its messages alone.
+        pRing->Head.compare_exchange_strong(head, position);
+    }
+}
+
+//
+//   FUNCTION: IpcRecoverSection(void *, size_t, const IPC_GEOMETRY &,
+//   uint32_t, IPC_RECOVERY *)
+//
+//   PURPOSE: Take over a section left by a previous run of the server, as
+//   read back from a backing file. Sessions that were connecting or active
+//   keep their queued messages and are marked CONNECTING again, so the
+//   broker accepts them (or closes them if their client has exited).
+//   Half-opened sessions are freed. The time taken is bounded by the number
+//   of sessions and ring slots, not by the number of messages ever sent.
+//
+//   RETURN VALUE: true if the section was recovered, false if it is not a
+//   durable section of this version and geometry and must be initialized
+//   afresh.
+//
+inline bool IpcRecoverSection(void *pView, size_t cbView,
+                              const IPC_GEOMETRY &geometry,
+                              uint32_t serverPid, IPC_RECOVERY *pRecovery)
+{
+    memset(pRecovery, 0, sizeof(*pRecovery));
+
+    if (!IpcValidateSection(pView, cbView))
+    {
+        return false;
+    }
+
+    // Only the slots of a durable section carry checksums to check.
+    IPC_SECTION_HEADER *pHeader = IpcGetHeader(pView);
+    if (memcmp(&pHeader->Geometry, &geometry, sizeof(geometry)) != 0 ||
+        !IpcIsDurable(pHeader))
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < geometry.cSessions; i++)
+    {
+        IPC_SESSION *pSession = IpcGetSession(pHeader, i);
+        switch (pSession->State.load(std::memory_order_relaxed))
+        {
+        case IPC_SESSION_FREE:
+            break;
+
+        case IPC_SESSION_CONNECTING:
+        case IPC_SESSION_ACTIVE:
+            IpcRecoverRing(geometry, IpcGetRing(pHeader, i, IPC_RING_REQUEST),
+                pRecovery);
+            IpcRecoverRing(geometry, IpcGetRing(pHeader, i, IPC_RING_REPLY),
+                pRecovery);
+            pSession->State.store(IPC_SESSION_CONNECTING,
+                std::memory_order_relaxed);
+            pRecovery->cSessions++;
+            break;
+
+        case IPC_SESSION_CLOSING:
+            // Freed by the broker.
+            break;
+
+        default:
+            // Claimed by a client that had not finished opening it.
+            pSession->ClientPid = 0;
+            pSession->State.store(IPC_SESSION_FREE, std::memory_order_relaxed);
+            break;
+        }
+    }
+
+    pHeader->cbSection = cbView;
+    pHeader->ServerPid = serverPid;
+    for (uint32_t i = 0; i < IPC_MAX_SHARDS; i++)
+    {
+        pHeader->Shards[i].ServerSleeping.store(0, std::memory_order_relaxed);
+    }
+    pHeader->cActiveSessions.store(0, std::memory_order_relaxed);
+    pHeader->Generation.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+#pragma endregion
+
+
+#pragma region Ring Operations
+
+//
+//   FUNCTION: IpcSealSlot(IPC_SLOT_HEADER *, uint64_t, size_t, bool)
+//
+//   PURPOSE: Finish a slot whose payload of cbData bytes has been written.
+//   The size and, in a durable section, the checksum go first and the
+//   sequence number last, with release ordering, so a slot whose sequence
+//   number matches its position is never missing part of its payload,
+//   neither to a reader nor in a page the flusher of a durable section
+//   writes back. Should the write back still catch the page half way, the
+//   checksum gives it away. Only recovery reads the checksum, so sections
+//   in memory do without it.
+//
+inline void IpcSealSlot(IPC_SLOT_HEADER *pSlot, uint64_t position,
+                        size_t cbData, bool fDurable)
+{
+    pSlot->cbData = static_cast<uint32_t>(cbData);
+    if (fDurable)
+    {
+        pSlot->Checksum = IpcChecksum(pSlot + 1, cbData);
+    }
+    pSlot->Sequence.store(static_cast<uint32_t>(position + 1),
+        std::memory_order_release);
+}
+
+//
+//   FUNCTION: IpcRingStage(const IPC_GEOMETRY &, IPC_RING_HEADER *,
+//   uint64_t, const void *, size_t, bool)
+//
+//   PURPOSE: Copy a message into the slot at a position the producer has
+//   not published yet. The caller has checked the size of the message and
+//   the credits for the position, and publishes the slot, alone or with
+//   the ones staged after it, with IpcRingPublish. fDurable is
+//   IpcIsDurable() of the section.
+//
+inline void IpcRingStage(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing,
+                         uint64_t position, const void *pData, size_t cbData,
+                         bool fDurable = false)
+{
+    IPC_SLOT_HEADER *pSlot = IpcGetSlot(geometry, pRing, position);
+    memcpy(static_cast<void *>(pSlot + 1), pData, cbData);
+    pSlot->Timestamp = IpcTimestamp();
+    IpcSealSlot(pSlot, position, cbData, fDurable);
+}
+
+// Hand every slot staged before head to the consumer at once.
+inline void IpcRingPublish(IPC_RING_HEADER *pRing, uint64_t head)
+{
+    pRing->Head.store(head, std::memory_order_release);
+}
+
+//
+//   FUNCTION: IpcRingPeek(const IPC_GEOMETRY &, IPC_RING_HEADER *,
+//   uint64_t, void *, size_t)
+//
+//   PURPOSE: Copy the message at a published position the consumer has not
+//   released yet. A message larger than the buffer is truncated.
+//
+//   RETURN VALUE: The number of bytes copied.
+//
+inline size_t IpcRingPeek(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing,
+                          uint64_t position, void *pBuffer, size_t cbBuffer)
+{
+    IPC_SLOT_HEADER *pSlot = IpcGetSlot(geometry, pRing, position);
+    size_t cbData = pSlot->cbData;
+    if (cbData > IpcMaxMessageSize(geometry))
+    {
+        cbData = IpcMaxMessageSize(geometry);
+    }
+    if (cbData > cbBuffer)
+    {
+        cbData = cbBuffer;
+    }
+    memcpy(pBuffer, pSlot + 1, cbData);
+    return cbData;
+}
+
+// Give every slot before tail back to the producer at once.
+inline void IpcRingRelease(IPC_RING_HEADER *pRing, uint64_t tail)
+{
+    pRing->Tail.store(tail, std::memory_order_release);
+}
+
+//
+//   FUNCTION: IpcRingWrite(const IPC_GEOMETRY &, IPC_RING_HEADER *,
+//   const void *, size_t, bool)
+//
+//   PURPOSE: Copy a message into the next free slot of a ring and publish
+//   it. Must only be called by the producer of the ring. fDurable is
+//   IpcIsDurable() of the section.
+//
+//   RETURN VALUE: true if the message was published, false if the
+//   producer is out of credits (see IpcRingCredits) or the message does not
+//   fit into a slot.
+//
+inline bool IpcRingWrite(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing,
+                         const void *pData, size_t cbData,
+                         bool fDurable = false)
+{
+    if (cbData > IpcMaxMessageSize(geometry))
+    {
+        return false;
+    }
+
+    uint64_t head = pRing->Head.load(std::memory_order_relaxed);
+    uint64_t tail = pRing->Tail.load(std::memory_order_acquire);
+    uint64_t credit = pRing->Credit.load(std::memory_order_acquire);
+    if (head - tail >= geometry.cSlots || head >= credit)
+    {
+        return false;
+    }
+
+    IpcRingStage(geometry, pRing, head, pData, cbData, fDurable);
+    IpcRingPublish(pRing, head + 1);
+    return true;
+}
+
+//
+//   FUNCTION: IpcRingRead(const IPC_GEOMETRY &, IPC_RING_HEADER *, void *,
+//   size_t, size_t *)
+//
+//   PURPOSE: Copy the oldest message out of a ring and free its slot. Must
+//   only be called by the consumer of the ring. A message larger than the
+//   buffer is truncated.
+//
+//   RETURN VALUE: true if a message was read, false if the ring is empty.
+//
+inline bool IpcRingRead(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing,
+                        void *pBuffer, size_t cbBuffer, size_t *pcbData)
+{
+    uint64_t tail = pRing->Tail.load(std::memory_order_relaxed);
+    uint64_t head = pRing->Head.load(std::memory_order_acquire);
+    if (tail == head)
+    {
+        return false;
+    }
+
+    *pcbData = IpcRingPeek(geometry, pRing, tail, pBuffer, cbBuffer);
+    IpcRingRelease(pRing, tail + 1);
+    return true;
+}
+
+// Number of messages waiting in a ring.
+inline uint64_t IpcRingCount(IPC_RING_HEADER *pRing)
+{
+    return pRing->Head.load(std::memory_order_acquire) -
+        pRing->Tail.load(std::memory_order_acquire);
+}
+
+//
+//   FUNCTION: IpcRingCredits(const IPC_GEOMETRY &, IPC_RING_HEADER *)
+//
+//   PURPOSE: Number of messages the producer may still publish: the
+//   credits granted by the consumer, bounded by the free slots.
+//
+inline uint64_t IpcRingCredits(const IPC_GEOMETRY &geometry,
+                               IPC_RING_HEADER *pRing)
+{
+    uint64_t head = pRing->Head.load(std::memory_order_relaxed);
+    uint64_t tail = pRing->Tail.load(std::memory_order_acquire);
+    uint64_t credit = pRing->Credit.load(std::memory_order_acquire);
+    if (head - tail >= geometry.cSlots || head >= credit)
+    {
+        return 0;
+    }
+
+    uint64_t cCredits = credit - head;
+    uint64_t cFree = geometry.cSlots - (head - tail);
+    return (cCredits < cFree) ? cCredits : cFree;
+}
+
+//
+//   FUNCTION: IpcRingGrant(const IPC_GEOMETRY &, IPC_RING_HEADER *,
+//   uint32_t)
+//
+//   PURPOSE: Let the producer publish up to cWindow messages past those
+//   the consumer has read. Must only be called by the consumer. A window
+//   smaller than the messages already queued holds the producer back until
+//   the consumer catches up.
+//
+//   RETURN VALUE: true if the producer was waiting for credits and must be
+//   woken up.
+//
+inline bool IpcRingGrant(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing,
+                         uint32_t cWindow)
+{
+    if (cWindow > geometry.cSlots)
+    {
+        cWindow = geometry.cSlots;
+    }
+    uint64_t tail = pRing->Tail.load(std::memory_order_relaxed);
+    pRing->Credit.store(tail + cWindow, std::memory_order_release);
+
+    // Pairs with the fence in IpcRingBlock: either the producer sees the
+    // new credits, or the consumer sees that it is blocked.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return cWindow != 0 &&
+        pRing->Blocked.exchange(0, std::memory_order_relaxed) != 0;
+}
+
+//
+//   FUNCTION: IpcRingBlock(const IPC_GEOMETRY &, IPC_RING_HEADER *)
+//
+//   PURPOSE: Record that the producer is waiting for credits, then check
+//   them once more. Must only be called by the producer.
+//
+//   RETURN VALUE: true if the producer is still out of credits and may
+//   wait for the consumer to wake it.
+//
+inline bool IpcRingBlock(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing)
+{
+    pRing->Blocked.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (IpcRingCredits(geometry, pRing) != 0)
+    {
+        pRing->Blocked.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+// Empty the ring and grant the producer every slot.
+inline void IpcRingReset(const IPC_GEOMETRY &geometry, IPC_RING_HEADER *pRing)
+{
+    pRing->Head.store(0, std::memory_order_relaxed);
+    pRing->Blocked.store(0, std::memory_order_relaxed);
+    pRing->Tail.store(0, std::memory_order_relaxed);
+    pRing->Credit.store(geometry.cSlots, std::memory_order_relaxed);
+}
+
+#pragma endregion
+
+
+#pragma region Client Session Operations
+
+// Spread clients over the shards: mix the process id with a number the
+// process picks per session, so the sessions of one process spread too.
+inline uint32_t IpcHashClient(uint32_t clientPid, uint32_t counter)
+{
+    uint32_t hash = clientPid * 0x9E3779B1 ^ counter * 0x85EBCA77;
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6D;
+    hash ^= hash >> 12;
+    return hash;
+}
+
+//
+//   FUNCTION: IpcOpenSession(IPC_SECTION_HEADER *, uint32_t, uint32_t)
+//
+//   PURPOSE: Claim a free session slot for the calling client process,
+//   reset its rings and ask the server to accept it. The search starts
+//   at the shard the hash selects and moves on to the next shards when
+//   that one is full.
+//
+//   RETURN VALUE: The index of the session, or -1 if every slot is in use.
+//
+inline int IpcOpenSession(IPC_SECTION_HEADER *pHeader, uint32_t clientPid,
+                          uint32_t hash = 0)
+{
+    const uint32_t cSessions = pHeader->Geometry.cSessions;
+    const uint32_t iFirst = IpcShardFirstSession(pHeader->Geometry,
+        hash % IpcShardCount(pHeader->Geometry));
+    for (uint32_t n = 0; n < cSessions; n++)
+    {
+        uint32_t i = (iFirst + n < cSessions) ? iFirst + n : iFirst + n - cSessions;
+        IPC_SESSION *pSession = IpcGetSession(pHeader, i);
+        uint32_t state = IPC_SESSION_FREE;
+        if (pSession->State.compare_exchange_strong(state, IPC_SESSION_OPENING))
+        {
+            pSession->ClientPid = clientPid;
+            pSession->ClientSleeping.store(0, std::memory_order_relaxed);
+            IpcRingReset(pHeader->Geometry,
+                IpcGetRing(pHeader, i, IPC_RING_REQUEST));
+            IpcRingReset(pHeader->Geometry,
+                IpcGetRing(pHeader, i, IPC_RING_REPLY));
+
+            pSession->State.store(IPC_SESSION_CONNECTING,
+                std::memory_order_release);
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+//
+//   FUNCTION: IpcCloseSession(IPC_SECTION_HEADER *, uint32_t)
+//
+//   PURPOSE: Tell the server that the client is done with the session. The
+//   server frees the slot once it has noticed.
+//
+inline void IpcCloseSession(IPC_SECTION_HEADER *pHeader, uint32_t iSession)
+{
+    IpcGetSession(pHeader, iSession)->State.store(IPC_SESSION_CLOSING,
+        std::memory_order_release);
+}
+
+#pragma endregion
@@ -0,0 +1,199 @@
+/****************************** Module Header ******************************\
+* Module Name:  LogSink.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares an asynchronous logger and the sinks it writes to. Threads that
+* log only format the message into a slot of a lock-free queue and return;
+* a background thread drains the queue, collapses repeated messages,
+* applies a rate limit and hands the records to the sink in batches.
+* 
+* CEventLogSink writes to the Application event log and is what the
+* services use. CFileLogSink appends lines to a text file and is portable,
+* so the logger can be exercised on Linux.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <wchar.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "MpscQueue.h"
+
+// The record types. They have the same values as the EVENTLOG_*_TYPE
+// constants so that they can be passed straight to ReportEvent.
+#define LOG_TYPE_ERROR          0x0001
+#define LOG_TYPE_WARNING        0x0002
+#define LOG_TYPE_INFORMATION    0x0004
+
+// Maximum length of a message, in characters, including the terminator.
+#define LOG_MESSAGE_LENGTH      260
+
+// Number of records the queue can hold. When it is full, new records are
+// dropped and counted instead of blocking the caller.
+#define LOG_QUEUE_CAPACITY      1024
+
+// Maximum number of records handed to the sink in one call.
+#define LOG_BATCH_SIZE          64
+
+// Default number of records per second written to the sink. Records over
+// the limit are counted and reported in a summary record.
+#define LOG_DEFAULT_RATE_LIMIT  100
+
+// Interval, in milliseconds, after which an idle logger reports pending
+// repeat and suppression counts.
+#define LOG_IDLE_INTERVAL       1000
+
+// Interval, in milliseconds, over which a repeated message is collapsed.
+// A repeat that comes later than that after the last written copy is
+// written again, after the summary of the repeats before it.
+#define LOG_REPEAT_WINDOW       10000
+
+
+// A preformatted log record.
+struct LOG_RECORD
+{
+    unsigned short wType;
+    unsigned long long ullTimestamp;    // Milliseconds since 1970-01-01 UTC
+    wchar_t szMessage[LOG_MESSAGE_LENGTH];
+};
+
+
+// The destination of the records. WriteBatch is only called from the
+// logger thread, so sinks need no locking of their own.
+class CLogSink
+{
+public:
+
+    virtual ~CLogSink(void) {}
+
+    virtual void WriteBatch(const LOG_RECORD *pRecords, size_t cRecords) = 0;
+};
+
+
+#ifdef _WIN32
+
+// Writes records to the Application event log under the given source name.
+// The event source is registered once for the lifetime of the sink.
+class CEventLogSink : public CLogSink
+{
+public:
+
+    explicit CEventLogSink(const wchar_t *pszSourceName);
+    virtual ~CEventLogSink(void);
+
+    virtual void WriteBatch(const LOG_RECORD *pRecords, size_t cRecords);
+
+private:
+
+    const wchar_t *m_pszSourceName;
+    void *m_hEventSource;
+};
+
+#endif
+
+
+// Appends records to a text file, one line per record, and flushes the file
+// once per batch. The file is opened in text mode, so the wide messages are
+// converted to the multibyte encoding of the current locale as they are
+// written.
+class CFileLogSink : public CLogSink
+{
+public:
+
+    explicit CFileLogSink(const wchar_t *pszPath);
+    virtual ~CFileLogSink(void);
+
+    virtual void WriteBatch(const LOG_RECORD *pRecords, size_t cRecords);
+
+private:
+
+    FILE *m_pFile;
+};
+
+
+class CAsyncLogger
+{
+public:
+
+    // Start the logger thread. The logger takes ownership of the sink.
+    explicit CAsyncLogger(CLogSink *pSink,
+        unsigned int cRateLimit = LOG_DEFAULT_RATE_LIMIT);
+
+    // Write everything that is queued and stop the logger thread.
+    ~CAsyncLogger(void);
+
+    // Queue a message. Never blocks; returns false if the queue is full and
+    // the message was dropped.
+    bool Log(unsigned short wType, const wchar_t *pszMessage);
+
+    // Format a message directly into its queue slot. Never blocks; returns
+    // false if the queue is full and the message was dropped.
+    bool LogFormat(unsigned short wType, const wchar_t *pszFormat, ...);
+    bool LogFormatV(unsigned short wType, const wchar_t *pszFormat,
+        va_list args);
+
+    // Block until every message queued before the call has been written to
+    // the sink, including pending repeat and suppression summaries. Used
+    // before the process may exit; never call it on a hot path.
+    void Flush(void);
+
+    // Number of messages dropped because the queue was full.
+    unsigned long long GetDroppedCount(void) const;
+
+    // Number of messages not written because of the rate limit.
+    unsigned long long GetSuppressedCount(void) const;
+
+private:
+
+    CAsyncLogger(const CAsyncLogger &);
+    CAsyncLogger &operator=(const CAsyncLogger &);
+
+    void LoggerThread(void);
+    void Filter(const LOG_RECORD &record);
+    void Append(unsigned short wType, unsigned long long ullTimestamp,
+        const wchar_t *pszFormat, ...);
+    void AppendSummaries(unsigned long long ullTimestamp);
+    void WriteBatch(void);
+    void Publish(size_t position);
+
+    CMpscQueue<LOG_RECORD, LOG_QUEUE_CAPACITY> m_queue;
+    std::unique_ptr<CLogSink> m_pSink;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cvWork;
+    std::condition_variable m_cvFlushed;
+    std::atomic<bool> m_fSleeping;
+    bool m_fStopping;
+    bool m_fFlushRequested;
+
+    std::atomic<unsigned long long> m_cQueued;
+    std::atomic<unsigned long long> m_cProcessed;
+    std::atomic<unsigned long long> m_cDropped;
+    std::atomic<unsigned long long> m_cSuppressed;
+
+    // State owned by the logger thread.
+    LOG_RECORD m_batch[LOG_BATCH_SIZE];
+    size_t m_cBatch;
+    LOG_RECORD m_last;
+    unsigned long m_cRepeats;
+    unsigned long m_cSuppressedPending;
+    unsigned int m_cRateLimit;
+    double m_tokens;
+    unsigned long long m_ullLastRefill;
+
+    std::thread m_thread;
+};
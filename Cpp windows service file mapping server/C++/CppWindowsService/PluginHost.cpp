@@ -0,0 +1,238 @@
+/****************************** Module Header ******************************\
+* Module Name:  PluginHost.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements loading, calling and swapping the message-handler plugin.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <stdio.h>
+#include <stddef.h>
+#include "PluginHost.h"
+#include "IpcChannel.h"
+#pragma endregion
+
+
+// Size of the first version of the table, which every plugin fills in.
+#define PLUGIN_TABLE_V1_SIZE \
+    (offsetof(IPC_PLUGIN_TABLE, pfnHandle) + sizeof(void *))
+
+
+CPluginHost::CPluginHost(void)
+: m_readerSet(0),
+  m_pCurrent(NULL),
+  m_cLoads(0),
+  m_msLastGrace(0)
+{
+    for (size_t i = 0; i < PLUGIN_READER_SLOTS; i++)
+    {
+        m_slots[i].cReaders[0].store(0, std::memory_order_relaxed);
+        m_slots[i].cReaders[1].store(0, std::memory_order_relaxed);
+    }
+}
+
+
+CPluginHost::~CPluginHost(void)
+{
+    Release(m_pCurrent.exchange(NULL));
+}
+
+
+//
+//   FUNCTION: CPluginHost::Load(PCWSTR)
+//
+//   PURPOSE: Resolve everything the service calls in the new plugin, the
+//   factory and the table, before any request reaches it; then publish it
+//   and retire the old one (see Publish).
+//
+DWORD CPluginHost::Load(PCWSTR pszPath)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (pszPath == NULL || *pszPath == L'\0')
+    {
+        Publish(NULL);
+        return ERROR_SUCCESS;
+    }
+
+    PLUGIN *pPlugin = new PLUGIN;
+    memset(pPlugin, 0, sizeof(*pPlugin));
+    wcsncpy_s(pPlugin->szPath, ARRAYSIZE(pPlugin->szPath), pszPath,
+        _TRUNCATE);
+
+    DWORD dwError = ERROR_SUCCESS;
+    PFN_IPC_GET_PLUGIN pfnGetPlugin = NULL;
+    const IPC_PLUGIN_TABLE *pTable = NULL;
+
+    pPlugin->hModule = LoadLibrary(pszPath);
+    if (pPlugin->hModule == NULL)
+    {
+        dwError = GetLastError();
+        goto Cleanup;
+    }
+
+    pfnGetPlugin = (PFN_IPC_GET_PLUGIN)GetProcAddress(pPlugin->hModule,
+        IPC_PLUGIN_FACTORY);
+    if (pfnGetPlugin == NULL)
+    {
+        dwError = GetLastError();
+        goto Cleanup;
+    }
+
+    pTable = pfnGetPlugin(IPC_PLUGIN_ABI_VERSION);
+    if (pTable == NULL || pTable->AbiVersion != IPC_PLUGIN_ABI_VERSION ||
+        pTable->cbSize < PLUGIN_TABLE_V1_SIZE || pTable->pfnHandle == NULL)
+    {
+        dwError = ERROR_INVALID_DATA;
+        goto Cleanup;
+    }
+    pPlugin->pTable = pTable;
+    if (pTable->pfnAttach != NULL)
+    {
+        pPlugin->pContext = pTable->pfnAttach();
+    }
+
+    Publish(pPlugin);
+    pPlugin = NULL;
+    m_cLoads++;
+
+Cleanup:
+
+    if (pPlugin != NULL)
+    {
+        Release(pPlugin);
+    }
+    return dwError;
+}
+
+
+//
+//   FUNCTION: CPluginHost::Handle(uint32_t, const void *, size_t, void *,
+//   size_t, size_t *)
+//
+//   PURPOSE: Call the current plugin inside a read-side critical section:
+//   the count in the reader slot keeps the plugin loaded until the call
+//   returns. The count is raised before the pointer is loaded; a swap that
+//   does not see the count therefore published the new plugin before the
+//   load, which then returns the new plugin.
+//
+bool CPluginHost::Handle(uint32_t iSession, const void *pRequest,
+                         size_t cbRequest, void *pReply, size_t cbReply,
+                         size_t *pcbReply)
+{
+    READER_SLOT &slot = m_slots[GetCurrentThreadId() % PLUGIN_READER_SLOTS];
+    uint32_t set = m_readerSet.load(std::memory_order_seq_cst) & 1;
+    slot.cReaders[set].fetch_add(1, std::memory_order_seq_cst);
+
+    PLUGIN *pPlugin = m_pCurrent.load(std::memory_order_seq_cst);
+    if (pPlugin != NULL)
+    {
+        size_t cbData = pPlugin->pTable->pfnHandle(pPlugin->pContext,
+            iSession, pRequest, cbRequest, pReply, cbReply);
+        *pcbReply = (cbData < cbReply) ? cbData : cbReply;
+    }
+
+    slot.cReaders[set].fetch_sub(1, std::memory_order_release);
+    return pPlugin != NULL;
+}
+
+
+void CPluginHost::Describe(PWSTR pszDescription, size_t cchDescription)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    PLUGIN *pPlugin = m_pCurrent.load(std::memory_order_acquire);
+    if (pPlugin == NULL)
+    {
+        swprintf_s(pszDescription, cchDescription, L"none");
+        return;
+    }
+    swprintf_s(pszDescription, cchDescription, L"%hs %u (%s)",
+        pPlugin->pTable->pszName ? pPlugin->pTable->pszName : "",
+        pPlugin->pTable->PluginVersion, pPlugin->szPath);
+}
+
+
+PCWSTR CPluginHost::GetPath(void) const
+{
+    PLUGIN *pPlugin = m_pCurrent.load(std::memory_order_acquire);
+    return pPlugin ? pPlugin->szPath : L"";
+}
+
+
+// Make pPlugin the plugin of new calls, wait for the calls of the old one
+// to return and unload it. Called with m_mutex held.
+void CPluginHost::Publish(PLUGIN *pPlugin)
+{
+    PLUGIN *pOld = m_pCurrent.exchange(pPlugin, std::memory_order_seq_cst);
+    if (pOld == NULL)
+    {
+        return;
+    }
+
+    uint64_t start = IpcTimestamp();
+    Synchronize();
+    m_msLastGrace = (IpcTimestamp() - start) * 1000.0 /
+        IpcTimestampFrequency();
+    Release(pOld);
+}
+
+
+//
+//   FUNCTION: CPluginHost::Synchronize(void)
+//
+//   PURPOSE: Wait for a grace period: until every call that started before
+//   the swap has returned. New calls are first sent to the other set of
+//   counts, so the set waited for only drains; after both sets have been
+//   drained once, no call can still hold the old plugin.
+//
+void CPluginHost::Synchronize(void)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint32_t set = m_readerSet.fetch_add(1, std::memory_order_seq_cst) & 1;
+        for (size_t i = 0; i < PLUGIN_READER_SLOTS; i++)
+        {
+            for (unsigned int n = 0; m_slots[i].cReaders[set].load(
+                std::memory_order_acquire) != 0; n++)
+            {
+                if (n < PLUGIN_SPIN_COUNT)
+                {
+                    YieldProcessor();
+                }
+                else
+                {
+                    Sleep(1);
+                }
+            }
+        }
+    }
+}
+
+
+// Detach a plugin no call uses any more and unload its DLL.
+void CPluginHost::Release(PLUGIN *pPlugin)
+{
+    if (pPlugin == NULL)
+    {
+        return;
+    }
+    if (pPlugin->pTable != NULL && pPlugin->pTable->pfnDetach != NULL)
+    {
+        pPlugin->pTable->pfnDetach(pPlugin->pContext);
+    }
+    if (pPlugin->hModule != NULL)
+    {
+        FreeLibrary(pPlugin->hModule);
+    }
+    delete pPlugin;
+}
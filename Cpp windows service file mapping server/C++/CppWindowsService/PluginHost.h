@@ -0,0 +1,118 @@
+/****************************** Module Header ******************************\
+* Module Name:  PluginHost.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares CPluginHost, which loads a message-handler plugin (see
+* IpcPlugin.h) and lets the brokers call it, and which swaps in another
+* plugin while they do.
+* 
+* A call reads the current plugin with no lock: it counts itself in a
+* reader slot of its thread, loads the pointer to the plugin and calls
+* through the table the plugin returned when it was loaded. A swap
+* publishes the new plugin first, so every call that starts afterwards
+* goes to it, and then waits until the calls that may have started
+* before have left their slots, the grace period of read-copy-update.
+* Only then is the old plugin detached and its DLL unloaded. No request
+* waits for a swap or is dropped by one; the calls of a session move to
+* the new plugin between two requests.
+* 
+* The counts of the slots come in two sets, and a grace period switches
+* the set new calls use before it waits for the other one, twice, so a
+* steady stream of calls cannot keep it waiting.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include "IpcPlugin.h"
+
+// Number of reader slots; the threads that call the plugin are spread
+// over them by their id.
+#define PLUGIN_READER_SLOTS     64
+
+// Number of times a swap polls the reader slots before it sleeps between
+// two polls.
+#define PLUGIN_SPIN_COUNT       1000
+
+
+class CPluginHost
+{
+public:
+
+    CPluginHost(void);
+
+    // Unload the current plugin. The brokers must have stopped calling it.
+    ~CPluginHost(void);
+
+    // Load the plugin DLL pszPath and make it the handler of the requests
+    // that follow, then unload the previous plugin once its last call has
+    // returned. NULL or an empty path only unloads the current plugin. May
+    // be called from any thread while the brokers call the plugin.
+    //
+    // Returns ERROR_SUCCESS, the Win32 error code of LoadLibrary or
+    // GetProcAddress, or ERROR_INVALID_DATA if the plugin offers no table
+    // of a version the host understands; the current plugin then stays.
+    DWORD Load(PCWSTR pszPath);
+
+    // Let the current plugin answer a request. Returns false if no plugin
+    // is loaded; otherwise *pcbReply receives the size of its reply.
+    bool Handle(uint32_t iSession, const void *pRequest, size_t cbRequest,
+        void *pReply, size_t cbReply, size_t *pcbReply);
+
+    // Describe the current plugin: its name, version and path, or "none".
+    void Describe(PWSTR pszDescription, size_t cchDescription);
+
+    // Path of the current plugin; empty if none is loaded. Only valid on
+    // the thread that calls Load.
+    PCWSTR GetPath(void) const;
+
+    // Number of plugins loaded so far, and the time, in milliseconds, the
+    // last swap waited for the calls of the old plugin.
+    unsigned long GetLoadCount(void) const { return m_cLoads; }
+    double GetLastGracePeriod(void) const { return m_msLastGrace; }
+
+private:
+
+    CPluginHost(const CPluginHost &);
+    CPluginHost &operator=(const CPluginHost &);
+
+    struct PLUGIN
+    {
+        HMODULE hModule;
+        const IPC_PLUGIN_TABLE *pTable;
+        void *pContext;
+        wchar_t szPath[MAX_PATH];
+    };
+
+    // The calls in progress of the threads of a slot, counted in the set
+    // that was current when they started.
+    struct READER_SLOT
+    {
+        alignas(64) std::atomic<uint32_t> cReaders[2];
+    };
+
+    void Publish(PLUGIN *pPlugin);
+    void Synchronize(void);
+    static void Release(PLUGIN *pPlugin);
+
+    READER_SLOT m_slots[PLUGIN_READER_SLOTS];
+    std::atomic<uint32_t> m_readerSet;
+    std::atomic<PLUGIN *> m_pCurrent;
+
+    // Serializes Load.
+    std::mutex m_mutex;
+    unsigned long m_cLoads;
+    double m_msLastGrace;
+};
@@ -6,7 +6,9 @@
 * Provides a sample service class that derives from the service base class - 
 * CServiceBase. The sample service logs the service start and stop 
 * information to the Application event log, and shows how to run the main 
-* function of the service in a thread pool worker thread.
+* function of the service in a thread pool worker thread, which takes its 
+* stop, pause, continue, reconfigure and drain commands from a lock-free 
+* queue.
 * 
 * This source is subject to the Microsoft Public License.
 * See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
@@ -19,8 +21,15 @@
 
 #pragma region Includes
 #include "SampleService.h"
+#include "DurableSection.h"
+#include "ServiceConfig.h"
+#include "ShardedBroker.h"
 #include "ThreadPool.h"
 #include <Windows.h>
+#include <stdio.h>
+#include <future>
+#include <thread>
+#include <vector>
 #pragma endregion
 
 CSampleService::CSampleService(PWSTR pszServiceName, 
@@ -29,25 +38,66 @@ CSampleService::CSampleService(PWSTR pszServiceName,
                                BOOL fCanPauseContinue)
 : CServiceBase(pszServiceName, fCanStop, fCanShutdown, fCanPauseContinue)
 {
-    m_fStopping = FALSE;
+    m_pszServiceName = pszServiceName;
+    m_szDurablePath[0] = L'\0';
+    m_szConfigPath[0] = L'\0';
+    m_hCommandDone = NULL;
+    m_hStoppedEvent = NULL;
+    m_pSec = NULL;
+    m_hMapFile = NULL;
+    m_pInOutView = NULL;
+    m_hStatsFile = NULL;
+    m_pStats = NULL;
 
-    // Create a manual-reset event that is not signaled at first to indicate 
-    // the stopped signal of the service.
-    m_hStoppedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    // Create the auto-reset events that wake the main function when a 
+    // command is queued and acknowledge the commands, and a manual-reset 
+    // event that is not signaled at first to indicate the stopped signal of 
+    // the service.
+    m_hCommandEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (m_hCommandEvent != NULL)
+    {
+        m_hCommandDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+    }
+    if (m_hCommandDone != NULL)
+    {
+        m_hStoppedEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    }
     if (m_hStoppedEvent == NULL)
     {
-        throw GetLastError();
+        DWORD dwError = GetLastError();
+        if (m_hCommandDone)
+        {
+            CloseHandle(m_hCommandDone);
+        }
+        if (m_hCommandEvent)
+        {
+            CloseHandle(m_hCommandEvent);
+        }
+        throw dwError;
     }
 }
 
 
 CSampleService::~CSampleService(void)
 {
+    // Nothing is left to release unless the main function never ran.
+    ReleaseSection();
+
     if (m_hStoppedEvent)
     {
         CloseHandle(m_hStoppedEvent);
         m_hStoppedEvent = NULL;
     }
+    if (m_hCommandDone)
+    {
+        CloseHandle(m_hCommandDone);
+        m_hCommandDone = NULL;
+    }
+    if (m_hCommandEvent)
+    {
+        CloseHandle(m_hCommandEvent);
+        m_hCommandEvent = NULL;
+    }
 }
 
 
@@ -58,12 +108,18 @@ CSampleService::~CSampleService(void)
 //   service by the SCM or when the operating system starts (for a service 
 //   that starts automatically). It specifies actions to take when the 
 //   service starts. In this code sample, OnStart logs a service-start 
-//   message to the Application log, and queues the main service function for 
-//   execution in a thread pool worker thread.
+//   message to the Application log, prepares the shared section (see 
+//   PrepareSection) and queues the main service function for execution in 
+//   a thread pool worker thread. The SCM learns that the service runs only 
+//   once the section is ready to serve; if it cannot be prepared, OnStart 
+//   throws and the service stops.
 //
 //   PARAMETERS:
 //   * dwArgc   - number of command line arguments
-//   * lpszArgv - array of command line arguments
+//   * lpszArgv - array of command line arguments. "-durable <file>" backs 
+//     the shared section with the file instead of the paging file; 
+//     "-config <file>" reads the configuration from the file (see 
+//     ServiceConfig.h).
 //
 //   NOTE: A service application is designed to be long running. Therefore, 
 //   it usually polls or monitors something in the system. The monitoring is 
@@ -82,104 +138,700 @@ void CSampleService::OnStart(DWORD dwArgc, LPWSTR *lpszArgv)
     WriteEventLogEntry(L"CppWindowsService in OnStart", 
         EVENTLOG_INFORMATION_TYPE);
 
+    ParseArguments(dwArgc, lpszArgv);
+
+    uint64_t start = IpcTimestamp();
+    PrepareSection();
+
+    wchar_t szMessage[64];
+    swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+        L"The service is ready to serve in %.3f ms", 
+        (IpcTimestamp() - start) * 1000.0 / IpcTimestampFrequency());
+    WriteEventLogMsg(szMessage);
+
     // Queue the main service function for execution in a worker thread.
     CThreadPool::QueueUserWorkItem(&CSampleService::ServiceWorkerThread, this);
 }
 
+void CSampleService::RunConsole(DWORD dwArgc, PWSTR *pszArgv)
+{
+    ParseArguments(dwArgc, pszArgv);
+
+    try
+    {
+        PrepareSection();
+    }
+    catch (DWORD dwError)
+    {
+        WriteErrorLogEntry(L"PrepareSection", dwError);
+        return;
+    }
+
+    // The reader blocks until a line is entered; it is left behind if the 
+    // process ends first.
+    std::thread([this]
+    {
+        wchar_t szLine[64];
+        while (fgetws(szLine, ARRAYSIZE(szLine), stdin))
+        {
+            if (_wcsnicmp(szLine, L"pause", 5) == 0)
+            {
+                PostCommand(ServiceCommandPause, false);
+            }
+            else if (_wcsnicmp(szLine, L"continue", 8) == 0)
+            {
+                PostCommand(ServiceCommandContinue, false);
+            }
+            else if (_wcsnicmp(szLine, L"drain", 5) == 0)
+            {
+                PostCommand(ServiceCommandDrain, false);
+            }
+            else if (_wcsnicmp(szLine, L"reconfigure", 11) == 0)
+            {
+                PostCommand(ServiceCommandReconfigure, false);
+            }
+            else
+            {
+                break;
+            }
+        }
+        PostCommand(ServiceCommandStop, false);
+    }).detach();
+
+    ServiceWorkerThread();
+}
+
+// The first argument is the name of the service, or the command that runs 
+// it from the console.
+void CSampleService::ParseArguments(DWORD dwArgc, PWSTR *pszArgv)
+{
+    for (DWORD i = 1; i < dwArgc; i++)
+    {
+        if ((*pszArgv[i] != L'-' && *pszArgv[i] != L'/') || i + 1 >= dwArgc)
+        {
+            continue;
+        }
+        if (_wcsicmp(L"durable", pszArgv[i] + 1) == 0)
+        {
+            wcscpy_s(m_szDurablePath, ARRAYSIZE(m_szDurablePath), 
+                pszArgv[++i]);
+        }
+        else if (_wcsicmp(L"config", pszArgv[i] + 1) == 0)
+        {
+            wcscpy_s(m_szConfigPath, ARRAYSIZE(m_szConfigPath), 
+                pszArgv[++i]);
+        }
+    }
+}
+
+
+//
+//   FUNCTION: PrefaultView(PVOID, ULONGLONG, bool)
+//
+//   PURPOSE: Touch every page of a view, so that the page faults are taken 
+//   now rather than by the first requests that use the page. A view whose 
+//   content matters, such as a backing file with recovered messages or a 
+//   section that clients of a previous server still map, is only read.
+//
+static void PrefaultView(PVOID pView, ULONGLONG cbView, bool fWrite)
+{
+    volatile BYTE *pPage = static_cast<BYTE *>(pView);
+    for (ULONGLONG offset = 0; offset < cbView; offset += IPC_PAGE_SIZE)
+    {
+        if (fWrite)
+        {
+            pPage[offset] = 0;
+        }
+        else
+        {
+            (void)pPage[offset];
+        }
+    }
+}
+
+
+//
+//   FUNCTION: CreateSuccessorSection(SECTION_RESIZE *, LPSECURITY_ATTRIBUTES)
+//
+//   PURPOSE: Create, map and lay out the section that replaces the current 
+//   one when the geometry changes, and touch every page of it, so that the 
+//   clients moved to it do not take the page faults. Runs on the thread 
+//   pool while the broker keeps serving the current section.
+//
+static void CreateSuccessorSection(SECTION_RESIZE *pResize, 
+                                   LPSECURITY_ATTRIBUTES pSec)
+{
+    wchar_t szMapName[MAX_PATH];
+    swprintf_s(szMapName, ARRAYSIZE(szMapName), IPC_SUCCESSOR_FORMAT, 
+        FULL_MAP_NAME, pResize->iSuccessor);
+    ULONGLONG cbSection = IpcSectionSize(pResize->Geometry);
+    MEMORY_BASIC_INFORMATION info;
+
+    pResize->dwError = ERROR_SUCCESS;
+    pResize->hMapFile = CreateFileMapping(INVALID_HANDLE_VALUE, pSec, 
+        PAGE_READWRITE, (DWORD)(cbSection >> 32), 
+        (DWORD)(cbSection & 0xFFFFFFFF), szMapName);
+    if (pResize->hMapFile == NULL)
+    {
+        pResize->dwError = GetLastError();
+    }
+    else
+    {
+        BOOL fExisting = (GetLastError() == ERROR_ALREADY_EXISTS);
+        pResize->pView = MapViewOfFile(pResize->hMapFile, FILE_MAP_ALL_ACCESS, 
+            0, 0, 0);
+        if (pResize->pView == NULL)
+        {
+            pResize->dwError = GetLastError();
+        }
+        else if (fExisting && 
+            (VirtualQuery(pResize->pView, &info, sizeof(info)) == 0 || 
+            info.RegionSize < cbSection))
+        {
+            // A client of a previous run still maps a smaller successor.
+            pResize->dwError = ERROR_ALREADY_EXISTS;
+        }
+        else
+        {
+            PrefaultView(pResize->pView, cbSection, true);
+
+            PWSTR pszMessage = MESSAGE;
+            memcpy_s(pResize->pView, VIEW_SIZE, pszMessage, 
+                (wcslen(pszMessage) + 1) * sizeof(*pszMessage));
+            IpcInitializeSection(pResize->pView, (size_t)cbSection, 
+                pResize->Geometry, GetCurrentProcessId());
+        }
+    }
+
+    pResize->fReady.store(true, std::memory_order_release);
+}
+
+
+// Close a successor section that is no longer served, or was never used.
+static void CloseSuccessorSection(HANDLE hMapFile, PVOID pView)
+{
+    if (pView)
+    {
+        UnmapViewOfFile(pView);
+    }
+    if (hMapFile)
+    {
+        CloseHandle(hMapFile);
+    }
+}
+
+//
+//   FUNCTION: CSampleService::PrepareSection(void)
+//
+//   PURPOSE: The startup phase of the service, run before the service 
+//   reports SERVICE_RUNNING. It creates and maps the section, touches 
+//   every page of it, lays out the session table and rings, writes the 
+//   greeting, publishes the statistics, starts the broker and runs a task 
+//   on every worker of the thread pool. The main function then only 
+//   serves: a client that finds the section is served at once, and the 
+//   page faults and thread creation are not paid by the first requests.
+//
+void CSampleService::PrepareSection(void)
+{
+    MEMORY_BASIC_INFORMATION info;
+    BOOL fExisting = FALSE;
+
+    m_pSec = NULL;
+    if (InitializeSecurityDescriptor(&m_secDesc, SECURITY_DESCRIPTOR_REVISION) &&
+        SetSecurityDescriptorDacl(&m_secDesc, TRUE, (PACL)0, FALSE))
+    {
+      m_secAttr.nLength = sizeof(m_secAttr);
+      m_secAttr.lpSecurityDescriptor = &m_secDesc;
+      m_secAttr.bInheritHandle = TRUE;
+      m_pSec = &m_secAttr;
+    }
+
+    DWORD dwError = LoadServiceConfig(m_pszServiceName, m_szConfigPath, 
+        &m_config);
+    if (dwError != ERROR_SUCCESS)
+    {
+        WriteErrorLogEntry(L"LoadServiceConfig", dwError);
+    }
+    IPC_GEOMETRY geometry = m_config.Geometry;
+    ULONGLONG cbSection = IpcSectionSize(geometry);
+
+    try
+    {
+        if (m_szDurablePath[0] != L'\0')
+        {
+            // Back the file mapping with the file and take over the 
+            // sessions and messages a previous run left in it. Recovery 
+            // reads the whole file; keep the SCM waiting.
+            SetServiceStatus(SERVICE_START_PENDING, NO_ERROR, 
+                SERVICE_START_WAIT_HINT);
+            try
+            {
+                m_pDurable.reset(new CDurableSection(m_szDurablePath, 
+                    FULL_MAP_NAME, m_pSec, geometry));
+            }
+            catch (DWORD dwError)
+            {
+                WriteErrorLogEntry(L"CDurableSection", dwError);
+                throw;
+            }
+            m_pInOutView = m_pDurable->GetView();
+
+            // As for a section in the paging file below.
+            SetServiceStatus(SERVICE_START_PENDING, NO_ERROR, 
+                SERVICE_START_WAIT_HINT);
+            PrefaultView(m_pInOutView, m_pDurable->GetSize(), false);
+            m_pDurable->StartFlusher();
+
+            wchar_t szMessage[256];
+            const IPC_RECOVERY &recovery = m_pDurable->GetRecovery();
+            if (m_pDurable->IsRecovered())
+            {
+                swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+                    L"%u session(s) and %llu message(s) were recovered from "
+                    L"%s in %llu ms, %llu incomplete message(s) were "
+                    L"discarded", recovery.cSessions, recovery.cMessages, 
+                    m_szDurablePath, m_pDurable->GetRecoveryTime(), 
+                    recovery.cDiscarded);
+            }
+            else
+            {
+                swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+                    L"A new file mapping is backed by %s", m_szDurablePath);
+            }
+            WriteEventLogMsg(szMessage);
+        }
+        else
+        {
+            // Create the file mapping object.
+            m_hMapFile = CreateFileMapping(
+                INVALID_HANDLE_VALUE,   // Use paging file - shared memory
+                m_pSec,                 // Default security attributes
+                PAGE_READWRITE,         // Allow read and write access
+                (DWORD)(cbSection >> 32),       // High-order DWORD of max size
+                (DWORD)(cbSection & 0xFFFFFFFF),// Low-order DWORD of max size
+                FULL_MAP_NAME           // Name of the file mapping object
+                );
+
+            if (m_hMapFile == NULL) 
+                throw GetLastError();
+
+            // Clients of a previous server that have not noticed its exit 
+            // yet keep its file mapping object alive, and it is opened 
+            // again.
+            fExisting = (GetLastError() == ERROR_ALREADY_EXISTS);
+
+            WriteEventLogMsg(fExisting ? L"The file mapping is reused" : 
+                L"The file mapping is created");
+
+            // Map the whole file mapping into the address space of the 
+            // current process: the greeting at OUT_VIEW_OFFSET and the 
+            // session channels.
+            m_pInOutView = MapViewOfFile(
+                m_hMapFile,             // Handle of the map object
+                FILE_MAP_ALL_ACCESS,    // Read Write access
+                0,                      // High-order DWORD of the file offset 
+                OUT_VIEW_OFFSET,        // Low-order DWORD of the file offset 
+                0                       // Map the whole file mapping
+                );
+
+            if (m_pInOutView == NULL)
+                throw GetLastError();
+
+            WriteEventLogMsg(L"The file view is mapped");
+
+            if (fExisting && 
+                (VirtualQuery(m_pInOutView, &info, sizeof(info)) == 0 || 
+                info.RegionSize < cbSection))
+            {
+                WriteErrorLogEntry(L"The file mapping is too small", 
+                    ERROR_ALREADY_EXISTS);
+                throw (DWORD)ERROR_ALREADY_EXISTS;
+            }
+
+            // Touching a large section takes a while; keep the SCM 
+            // waiting.
+            SetServiceStatus(SERVICE_START_PENDING, NO_ERROR, 
+                SERVICE_START_WAIT_HINT);
+            PrefaultView(m_pInOutView, cbSection, !fExisting);
+
+            // Lay out the session table and rings. This starts a new 
+            // generation of the section, which tells the clients of a 
+            // previous server to open their sessions again.
+            IpcInitializeSection(m_pInOutView, (size_t)cbSection, geometry,
+                GetCurrentProcessId());
+        }
+
+        // Prepare a message to be written to the view.
+        PWSTR pszMessage = MESSAGE;
+        DWORD cbMessage = (wcslen(pszMessage) + 1) * sizeof(*pszMessage);
+
+        // Write the message to the file-mapping view.
+        memcpy_s(m_pInOutView, VIEW_SIZE, pszMessage, cbMessage);
+
+        // Publish the statistics of the sessions for monitoring tools.
+        m_pStats = IpcCreateStats(IPC_STATS_NAME, geometry.cSessions, 
+            &m_hStatsFile);
+        if (m_pStats == NULL)
+        {
+            WriteErrorLogEntry(L"IpcCreateStats");
+        }
+
+        SetServiceStatus(SERVICE_START_PENDING, NO_ERROR, 
+            SERVICE_START_WAIT_HINT);
+        try
+        {
+            m_pBroker.reset(new CShardedBroker(IpcGetHeader(m_pInOutView), 
+                m_pSec, m_pStats));
+        }
+        catch (DWORD dwError)
+        {
+            WriteErrorLogEntry(L"CShardedBroker", dwError);
+            throw;
+        }
+        m_pBroker->SetRateLimits(m_config.dwMessageRate, 
+            m_config.dwByteRate);
+        ApplyPlugin();
+        m_pBroker->SetPluginHost(&m_plugins);
+
+        // Start the workers of the thread pool, which the broker dispatches 
+        // to, and let each of them run a task.
+        CThreadPool &pool = CThreadPool::Default();
+        std::vector<std::future<void>> warm;
+        for (unsigned int i = 0; i < pool.GetThreadCount(); i++)
+        {
+            warm.push_back(pool.Submit([] {}));
+        }
+        for (size_t i = 0; i < warm.size(); i++)
+        {
+            warm[i].get();
+        }
+    }
+    catch (DWORD)
+    {
+        ReleaseSection();
+        throw;
+    }
+}
+
+
+void CSampleService::ReleaseSection(void)
+{
+    m_pBroker.reset();
+
+    IpcCloseStats(m_pStats, m_hStatsFile);
+    m_pStats = NULL;
+    m_hStatsFile = NULL;
+
+    // Flush the durable file mapping a last time and unmap it.
+    if (m_pDurable)
+    {
+        m_pDurable.reset();
+        m_pInOutView = NULL;
+    }
+
+    if (m_hMapFile)
+    {
+        if (m_pInOutView)
+        {
+            // Unmap the file view.
+            UnmapViewOfFile(m_pInOutView);
+            m_pInOutView = NULL;
+        }
+
+        CloseHandle(m_hMapFile);
+        m_hMapFile = NULL;
+    }
+}
+
+
 //#define FILE_MAPPING_KERNELDRIVER
 //#if defined(FILE_MAPPING_KERNELDRIVER)
 //#define FULL_MAP_KERNELDRIVER_NAME       L"Global\\UserKernelSharedSection"
 //#endif
+//
+//   FUNCTION: CSampleService::ApplyPlugin(void)
+//
+//   PURPOSE: Load the plugin the configuration names when it differs from 
+//   the one that answers the requests. The brokers keep serving while the 
+//   plugins are swapped; a plugin that fails to load leaves the current 
+//   one in place.
+//
+void CSampleService::ApplyPlugin(void)
+{
+    if (_wcsicmp(m_config.szPlugin, m_plugins.GetPath()) == 0)
+    {
+        return;
+    }
+
+    DWORD dwError = m_plugins.Load(m_config.szPlugin);
+    if (dwError != ERROR_SUCCESS)
+    {
+        WriteErrorLogEntry(L"CPluginHost::Load", dwError);
+        return;
+    }
+
+    wchar_t szPlugin[MAX_PATH + 64];
+    m_plugins.Describe(szPlugin, ARRAYSIZE(szPlugin));
+    wchar_t szMessage[MAX_PATH + 160];
+    swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+        L"The requests are handled by the plugin %s; the previous one was "
+        L"released after %.3f ms", szPlugin, m_plugins.GetLastGracePeriod());
+    WriteEventLogMsg(szMessage);
+}
+
+
 //
 //   FUNCTION: CSampleService::ServiceWorkerThread(void)
 //
 //   PURPOSE: The method performs the main function of the service. It runs 
-//   on a thread pool worker thread.
+//   on a thread pool worker thread and serves the section that OnStart 
+//   prepared (see PrepareSection).
+//
+//   A reconfigure command that changes the geometry resizes the section 
+//   while the clients are served. The successor section is laid out in the 
+//   background; the broker then stops accepting sessions and is given up 
+//   to SERVICE_RESIZE_TIMEOUT to answer the queued requests. Finally the 
+//   clients are moved over at once by the generation of the section (see 
+//   IpcSupersedeSection) and a new broker serves the successor. The first 
+//   section stays mapped, since clients find the successor through it. A 
+//   new number of shards is applied the same way.
 //
 void CSampleService::ServiceWorkerThread(void)
 {
 	// Log a service message to the ServiceWorkerThread.
     WriteEventLogMsg(L"ServiceWorkerThread is started");
 
-	HANDLE hMapFile = NULL;
-    PVOID pInOutView = NULL;
+    bool fDrained = false;
+    DWORD dwError;
+    HANDLE hSuccessorFile = NULL;
+    PVOID pSuccessorView = NULL;
+    std::unique_ptr<SECTION_RESIZE> pResize;
+    LPSECURITY_ATTRIBUTES pSec = m_pSec;
+    IPC_GEOMETRY geometry = m_config.Geometry;
 
-    SECURITY_ATTRIBUTES SecAttr, *pSec = 0;
-    SECURITY_DESCRIPTOR SecDesc;
-    if (InitializeSecurityDescriptor(&SecDesc, SECURITY_DESCRIPTOR_REVISION) &&
-        SetSecurityDescriptorDacl(&SecDesc, TRUE, (PACL)0, FALSE))
+    try
     {
-      SecAttr.nLength = sizeof(SecAttr);
-      SecAttr.lpSecurityDescriptor = &SecDesc;
-      SecAttr.bInheritHandle = TRUE;
-      pSec = &SecAttr;
-    }
+        IPC_SECTION_HEADER *pFirst = IpcGetHeader(m_pInOutView);
+        IPC_SECTION_HEADER *pCurrent = pFirst;
+        uint32_t iSuccessor = 0;
+        std::unique_ptr<CShardedBroker> pBroker(std::move(m_pBroker));
+        unsigned long long cRequests = 0;
+        DWORD dwIdleWait = m_config.dwIdleWait;
+        ULONGLONG ullResizeDeadline = 0;
+        bool fStopping = false;
+        bool fPaused = false;
+        bool fDraining = false;
+
+        while (!fStopping)
+        {
+            // Apply the commands queued since the last iteration.
+            SERVICE_COMMAND command;
+            while (m_commands.TryPop(command))
+            {
+                switch (command.Type)
+                {
+                case ServiceCommandStop:
+                    fStopping = true;
+                    break;
+
+                case ServiceCommandPause:
+                    fPaused = true;
+                    pBroker->SetPaused(true);
+                    break;
+
+                case ServiceCommandContinue:
+                    fPaused = false;
+                    pBroker->SetPaused(false);
+                    break;
+
+                case ServiceCommandReconfigure:
+                    dwError = LoadServiceConfig(m_pszServiceName, 
+                        m_szConfigPath, &m_config);
+                    if (dwError != ERROR_SUCCESS)
+                    {
+                        WriteErrorLogEntry(L"LoadServiceConfig", dwError);
+                        break;
+                    }
+                    dwIdleWait = m_config.dwIdleWait;
+                    pBroker->SetRateLimits(m_config.dwMessageRate, 
+                        m_config.dwByteRate);
+                    ApplyPlugin();
+                    if (pResize || memcmp(&m_config.Geometry, 
+                        &pCurrent->Geometry, sizeof(IPC_GEOMETRY)) == 0)
+                    {
+                        break;
+                    }
+                    if (m_pDurable)
+                    {
+                        // The backing file keeps the geometry it was 
+                        // created with.
+                        WriteErrorLogEntry(L"Resize of a durable section", 
+                            ERROR_NOT_SUPPORTED);
+                        break;
+                    }
+                    pResize.reset(new SECTION_RESIZE());
+                    pResize->Geometry = m_config.Geometry;
+                    pResize->iSuccessor = iSuccessor + 1;
+                    {
+                        SECTION_RESIZE *p = pResize.get();
+                        CThreadPool::Default().Post([p, pSec]
+                        {
+                            CreateSuccessorSection(p, pSec);
+                        });
+                    }
+                    WriteEventLogMsg(L"The file mapping is being resized");
+                    break;
+
+                case ServiceCommandDrain:
+                    fDraining = true;
+                    pBroker->SetAccepting(false);
+                    WriteEventLogMsg(L"The service is draining");
+                    break;
+                }
+                if (command.fAcknowledge)
+                {
+                    SetEvent(m_hCommandDone);
+                }
+            }
 
-    // Create the file mapping object.
-    hMapFile = CreateFileMapping(
-        INVALID_HANDLE_VALUE,   // Use paging file - shared memory
-        pSec,                   // Default security attributes
-        PAGE_READWRITE,         // Allow read and write access
-        0,                      // High-order DWORD of file mapping max size
-        MAP_SIZE,               // Low-order DWORD of file mapping max size
-        FULL_MAP_NAME           // Name of the file mapping object
-        );
-    
-	if (hMapFile == NULL) 
-        goto Cleanup;
+            if (fStopping)
+            {
+                break;
+            }
+            if (fPaused)
+            {
+                // Leave the requests queued in the rings until the service 
+                // continues.
+                WaitForSingleObject(m_hCommandEvent, INFINITE);
+                continue;
+            }
 
-    WriteEventLogMsg(L"The file mapping is created");
+            // Once the successor is laid out, answer what is queued in the 
+            // current section before the clients move.
+            if (pResize && ullResizeDeadline == 0 && 
+                pResize->fReady.load(std::memory_order_acquire))
+            {
+                if (pResize->dwError != ERROR_SUCCESS)
+                {
+                    WriteErrorLogEntry(L"CreateSuccessorSection", 
+                        pResize->dwError);
+                    CloseSuccessorSection(pResize->hMapFile, pResize->pView);
+                    pResize.reset();
+                }
+                else
+                {
+                    pBroker->SetAccepting(false);
+                    ullResizeDeadline = GetTickCount64() + SERVICE_RESIZE_TIMEOUT;
+                }
+            }
 
-    // Map a output view of the file mapping into the address space of the current 
-    // process.
-    pInOutView = MapViewOfFile(
-        hMapFile,               // Handle of the map object
-        FILE_MAP_ALL_ACCESS,    // Read Write access
-        0,                      // High-order DWORD of the file offset 
-        OUT_VIEW_OFFSET,        // Low-order DWORD of the file offset 
-        VIEW_SIZE               // The number of bytes to map to view
-        );
-    
-	if (pInOutView == NULL)
-        goto Cleanup;
+            unsigned int cDispatched = pBroker->Poll();
 
-    WriteEventLogMsg(L"The file view is mapped");
+            if (ullResizeDeadline != 0 && 
+                ((cDispatched == 0 && pBroker->IsDrained()) || 
+                GetTickCount64() >= ullResizeDeadline))
+            {
+                // Clients that reconnect through the first section must 
+                // find the new successor, then the clients of the current 
+                // section are moved.
+                if (pCurrent != pFirst)
+                {
+                    pFirst->Successor.store(pResize->iSuccessor, 
+                        std::memory_order_release);
+                }
+                IpcSupersedeSection(pCurrent, pResize->iSuccessor);
+                cRequests += pBroker->GetRequestCount();
+                pBroker.reset();
 
-	// Prepare a message to be written to the view.
-    PWSTR pszMessage = MESSAGE;
-    DWORD cbMessage = (wcslen(pszMessage) + 1) * sizeof(*pszMessage);
+                CloseSuccessorSection(hSuccessorFile, pSuccessorView);
+                hSuccessorFile = pResize->hMapFile;
+                pSuccessorView = pResize->pView;
+                iSuccessor = pResize->iSuccessor;
+                pCurrent = IpcGetHeader(pSuccessorView);
+                pResize.reset();
+                ullResizeDeadline = 0;
 
-    // Write the message to the file-mapping view.
-    memcpy_s(pInOutView, VIEW_SIZE, pszMessage, cbMessage);
+                // The statistics must cover every session.
+                if (pCurrent->Geometry.cSessions > geometry.cSessions)
+                {
+                    geometry.cSessions = pCurrent->Geometry.cSessions;
+                    IpcCloseStats(m_pStats, m_hStatsFile);
+                    m_hStatsFile = NULL;
+                    m_pStats = IpcCreateStats(IPC_STATS_NAME, 
+                        geometry.cSessions, &m_hStatsFile);
+                    if (m_pStats == NULL)
+                    {
+                        WriteErrorLogEntry(L"IpcCreateStats");
+                    }
+                }
 
-	// Periodically check if the service is stopping.
-    while (!m_fStopping)
+                pBroker.reset(new CShardedBroker(pCurrent, pSec, m_pStats));
+                pBroker->SetAccepting(!fDraining);
+                pBroker->SetRateLimits(m_config.dwMessageRate, 
+                    m_config.dwByteRate);
+                pBroker->SetPluginHost(&m_plugins);
+
+                wchar_t szMessage[128];
+                swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+                    L"The clients are moved to a file mapping of %u "
+                    L"session(s) of %u slot(s) of %u bytes in %u shard(s)", 
+                    pCurrent->Geometry.cSessions, pCurrent->Geometry.cSlots, 
+                    pCurrent->Geometry.cbSlot, pBroker->GetShardCount());
+                WriteEventLogMsg(szMessage);
+                continue;
+            }
+
+            if (cDispatched == 0)
+            {
+                if (fDraining && pBroker->IsDrained())
+                {
+                    WriteEventLogMsg(L"The service is drained");
+                    fDrained = true;
+                    break;
+                }
+                pBroker->Wait(ullResizeDeadline ? 1 : dwIdleWait, 
+                    m_hCommandEvent);
+            }
+        }
+
+        wchar_t szMessage[64];
+        swprintf_s(szMessage, ARRAYSIZE(szMessage), 
+            L"%llu request(s) were served", 
+            cRequests + pBroker->GetRequestCount());
+        WriteEventLogMsg(szMessage);
+    }
+    catch (DWORD dwError)
     {
-        ::Sleep(2000);  // Simulate some lengthy operations.
-		
+        WriteErrorLogEntry(L"CShardedBroker", dwError);
     }
 
     WriteEventLogMsg(L"ServiceWorkerThread is terminated");
-	WriteEventLogMsg((PWSTR)pInOutView);
+	WriteEventLogMsg((PWSTR)m_pInOutView);
 
-Cleanup:
-    WriteEventLogMsg(L"The file view is unmapped");
-    if (hMapFile)
+    // A successor that is still being laid out on the thread pool writes 
+    // to pResize.
+    if (pResize)
     {
-        if (pInOutView)
+        while (!pResize->fReady.load(std::memory_order_acquire))
         {
-            // Unmap the file view.
-            UnmapViewOfFile(pInOutView);
-            pInOutView = NULL;
+            ::Sleep(1);
         }
-
-        CloseHandle(hMapFile);
-        hMapFile = NULL;
+        CloseSuccessorSection(pResize->hMapFile, pResize->pView);
     }
+    CloseSuccessorSection(hSuccessorFile, pSuccessorView);
 
+    // Close the statistics, then flush and unmap the file view.
+    ReleaseSection();
+    WriteEventLogMsg(L"The file view is unmapped");
 
 	// Signal the stopped event.
     SetEvent(m_hStoppedEvent);
+
+    // Nobody stopped a drained service; tell the SCM that it has stopped.
+    if (fDrained)
+    {
+        SetServiceStatus(SERVICE_STOPPED);
+    }
 }
 
 
@@ -189,7 +841,8 @@ Cleanup:
 //   PURPOSE: The function is executed when a Stop command is sent to the 
 //   service by SCM. It specifies actions to take when a service stops 
 //   running. In this code sample, OnStop logs a service-stop message to the 
-//   Application log, and waits for the finish of the main service function.
+//   Application log, queues a stop command and waits for the finish of the 
+//   main service function.
 //
 //   COMMENTS:
 //   Be sure to periodically call ReportServiceStatus() with 
@@ -201,11 +854,102 @@ void CSampleService::OnStop()
     WriteEventLogEntry(L"CppWindowsService in OnStop", 
         EVENTLOG_INFORMATION_TYPE);
 
-    // Indicate that the service is stopping and wait for the finish of the 
-    // main service function (ServiceWorkerThread).
-    m_fStopping = TRUE;
+    // Tell the main service function (ServiceWorkerThread) to stop and 
+    // wait for its finish.
+    PostCommand(ServiceCommandStop, false);
     if (WaitForSingleObject(m_hStoppedEvent, INFINITE) != WAIT_OBJECT_0)
     {
         throw GetLastError();
     }
+}
+
+
+//
+//   FUNCTION: CSampleService::OnPause(void)
+//
+//   PURPOSE: The function is executed when a Pause command is sent to the 
+//   service by SCM. The main service function stops serving the sessions; 
+//   the requests the clients queue meanwhile stay in the rings. OnPause 
+//   returns once the main service function has paused.
+//
+void CSampleService::OnPause()
+{
+    WriteEventLogEntry(L"CppWindowsService in OnPause", 
+        EVENTLOG_INFORMATION_TYPE);
+
+    PostCommand(ServiceCommandPause, true);
+}
+
+
+//
+//   FUNCTION: CSampleService::OnContinue(void)
+//
+//   PURPOSE: The function is executed when a Continue command is sent to 
+//   the service by SCM. The main service function serves the sessions 
+//   again, starting with the requests queued while it was paused.
+//
+void CSampleService::OnContinue()
+{
+    WriteEventLogEntry(L"CppWindowsService in OnContinue", 
+        EVENTLOG_INFORMATION_TYPE);
+
+    PostCommand(ServiceCommandContinue, true);
+}
+
+
+//
+//   FUNCTION: CSampleService::OnCustomCommand(DWORD)
+//
+//   PURPOSE: The function is executed when a user-defined control code is 
+//   sent to the service by SCM. SERVICE_CONTROL_DRAIN drains the service: 
+//   no new session is accepted and the main service function ends once the 
+//   queued requests are answered, and reports that the service has 
+//   stopped. SERVICE_CONTROL_RECONFIGURE reads the configuration again (see 
+//   ServiceConfig.h) and resizes the section if its geometry changed.
+//
+void CSampleService::OnCustomCommand(DWORD dwCtrl)
+{
+    switch (dwCtrl)
+    {
+    case SERVICE_CONTROL_DRAIN:
+        WriteEventLogEntry(L"CppWindowsService in OnCustomCommand (drain)", 
+            EVENTLOG_INFORMATION_TYPE);
+        PostCommand(ServiceCommandDrain, true);
+        break;
+
+    case SERVICE_CONTROL_RECONFIGURE:
+        WriteEventLogEntry(
+            L"CppWindowsService in OnCustomCommand (reconfigure)", 
+            EVENTLOG_INFORMATION_TYPE);
+        PostCommand(ServiceCommandReconfigure, true);
+        break;
+    }
+}
+
+
+//
+//   FUNCTION: CSampleService::PostCommand(SERVICE_COMMAND_TYPE, bool)
+//
+//   PURPOSE: Queue a command for the main service function and wake it. 
+//   The queue only fills up if the main service function has ended or is 
+//   yet to start; the caller then retries until it either takes commands 
+//   again or has ended.
+//
+void CSampleService::PostCommand(SERVICE_COMMAND_TYPE type, bool fAcknowledge)
+{
+    SERVICE_COMMAND command = { type, fAcknowledge };
+    while (!m_commands.TryPush(command))
+    {
+        if (WaitForSingleObject(m_hStoppedEvent, 1) == WAIT_OBJECT_0)
+        {
+            return;
+        }
+    }
+    SetEvent(m_hCommandEvent);
+
+    if (fAcknowledge)
+    {
+        HANDLE handles[2] = { m_hCommandDone, m_hStoppedEvent };
+        WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+    }
 }
\ No newline at end of file
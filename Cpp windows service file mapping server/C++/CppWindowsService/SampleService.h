@@ -6,7 +6,31 @@
 * Provides a sample service class that derives from the service base class - 
 * CServiceBase. The sample service logs the service start and stop 
 * information to the Application event log, and shows how to run the main 
-* function of the service in a thread pool worker thread.
+* function of the service in a thread pool worker thread. The main function
+* creates the shared section and serves the client sessions in it with a
+* CShardedBroker, on the thread pool or on a pinned thread per shard of
+* the sessions. Started with "-durable <file>", the service backs the 
+* section with that file, so that queued messages survive a restart. The 
+* geometry of the section is read from the registry or from the file given 
+* with "-config <file>" (see ServiceConfig.h), and a reconfigure command 
+* resizes the section without a restart. A plugin DLL named in the 
+* configuration answers the requests in place of the echo, and is swapped 
+* for another on a reconfigure command while the sessions are served (see 
+* PluginHost.h).
+* 
+* OnStart prepares the section before the service reports that it runs: 
+* the file mapping is created, every page of it is touched, the sessions 
+* are laid out, the broker is started and the thread pool is warmed. A 
+* client that connects right after the start of the service is served at 
+* once instead of racing the main function while it sets the section up.
+* 
+* The control handler and the console never touch the state of the main 
+* function: they queue commands (stop, pause, continue, reconfigure and 
+* drain) into a lock-free queue and wake it. The main function applies them 
+* at the start of its next iteration. A paused service stops serving but 
+* keeps the queued requests, which are answered once it continues; a 
+* drained service accepts no new sessions, answers the queued requests and 
+* then stops.
 * 
 * This source is subject to the Microsoft Public License.
 * See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
@@ -19,7 +43,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include "ServiceBase.h"
+#include "IpcChannel.h"
+#include "IpcStats.h"
+#include "MpscQueue.h"
+#include "PluginHost.h"
+#include "ServiceConfig.h"
+
+class CDurableSection;
+class CShardedBroker;
 
 // In terminal services: The name can have a "Global\" or "Local\"  prefix 
 // to explicitly create the object in the global or session namespace. The 
@@ -30,15 +64,50 @@
 #define MAP_NAME            L"SampleMap"
 #define FULL_MAP_NAME       MAP_PREFIX MAP_NAME
 
-// Max size of the file mapping object.
-#define MAP_SIZE            65536
+// Number of client sessions the broker serves, the number of messages
+// each of their rings can hold and the size of a message slot, unless the
+// configuration says otherwise. The size of the file mapping object
+// follows from them (see IpcSectionSize).
+#define MAP_SESSIONS        IPC_DEFAULT_SESSIONS
+#define MAP_RING_SLOTS      IPC_DEFAULT_SLOTS
+#define MAP_SLOT_SIZE       IPC_DEFAULT_SLOT_SIZE
+
+// Number of shards the sessions are split into, each served by a pinned
+// thread of its own (see ShardedBroker.h). A single shard is served on the
+// thread pool.
+#define MAP_SHARDS          1
+
+// Interval, in milliseconds, after which an idle broker polls the sessions
+// even if no client rang the doorbell.
+#define BROKER_IDLE_WAIT    250
+
+// Requests and request bytes a session may send per second before the
+// broker holds it back; 0 for no limit.
+#define BROKER_MESSAGE_RATE 0
+#define BROKER_BYTE_RATE    0
+
+// Number of control commands that can be queued for the main function.
+#define SERVICE_COMMAND_QUEUE   16
+
+// User-defined control codes that drain the service and make it read its 
+// configuration again, for example with "sc control CppWindowsService 128".
+#define SERVICE_CONTROL_DRAIN       128
+#define SERVICE_CONTROL_RECONFIGURE 129
+
+// Time, in milliseconds, the broker of a section that is being resized is 
+// given to answer the queued requests before its clients are moved.
+#define SERVICE_RESIZE_TIMEOUT  1000
+
+// Time, in milliseconds, the SCM is told to allow for each step of the 
+// startup phase, which touches every page of the section.
+#define SERVICE_START_WAIT_HINT 30000
 
 // File offset where the view is to begin.
 #define OUT_VIEW_OFFSET     0
 #define IN_VIEW_OFFSET      1024
 
 // The number of bytes of a file mapping to map to the view. All bytes of the 
-// view must be within the maximum size of the file mapping object (MAP_SIZE). 
+// view must be before the section header (IPC_HEADER_OFFSET). 
 // If VIEW_SIZE is 0, the mapping extends from the offset (VIEW_OFFSET) to  
 // the end of the file mapping.
 #define VIEW_SIZE           1024
@@ -47,6 +116,40 @@
 // must be less than the view size (VIEW_SIZE).
 #define MESSAGE             L"Message from the server process."
 
+// A command for the main function of the service.
+enum SERVICE_COMMAND_TYPE
+{
+    ServiceCommandStop,
+    ServiceCommandPause,
+    ServiceCommandContinue,
+    ServiceCommandReconfigure,
+    ServiceCommandDrain
+};
+
+struct SERVICE_COMMAND
+{
+    SERVICE_COMMAND_TYPE Type;
+    bool fAcknowledge;              // Set m_hCommandDone once applied
+};
+
+// A successor section with a new geometry, laid out on the thread pool 
+// while the current section is served.
+struct SECTION_RESIZE
+{
+    IPC_GEOMETRY Geometry;
+    uint32_t iSuccessor;            // Number in IPC_SUCCESSOR_FORMAT
+    HANDLE hMapFile;
+    PVOID pView;
+    DWORD dwError;
+    std::atomic<bool> fReady;       // Set once the fields above are final
+
+    SECTION_RESIZE() : iSuccessor(0), hMapFile(NULL), pView(NULL), 
+        dwError(ERROR_SUCCESS), fReady(false)
+    {
+        memset(&Geometry, 0, sizeof(Geometry));
+    }
+};
+
 class CSampleService : public CServiceBase
 {
 public:
@@ -54,18 +157,81 @@ public:
     CSampleService(PWSTR pszServiceName, 
         BOOL fCanStop = TRUE, 
         BOOL fCanShutdown = TRUE, 
-        BOOL fCanPauseContinue = FALSE);
+        BOOL fCanPauseContinue = TRUE);
     virtual ~CSampleService(void);
 
+    // Run the main function of the service on the calling thread, outside 
+    // of the SCM, until it is stopped or the process is terminated. The 
+    // arguments are those of OnStart. Lines read from the standard input 
+    // stream are commands: "pause", "continue", "drain" and "reconfigure"; 
+    // any other line stops the service. Used by the benchmarks that 
+    // restart the server.
+    void RunConsole(DWORD dwArgc, PWSTR *pszArgv);
+
 protected:
 
     virtual void OnStart(DWORD dwArgc, PWSTR *pszArgv);
     virtual void OnStop();
+    virtual void OnPause();
+    virtual void OnContinue();
+    virtual void OnCustomCommand(DWORD dwCtrl);
 
     void ServiceWorkerThread(void);
     boolean ReadKernelDriverMsg(void);
 private:
 
-    BOOL m_fStopping;
+    void ParseArguments(DWORD dwArgc, PWSTR *pszArgv);
+
+    // The startup phase: create, prefault and lay out the section, publish 
+    // the statistics, start the broker and warm the thread pool. Throws 
+    // the Win32 error code on failure, after releasing what it created.
+    void PrepareSection(void);
+
+    // Stop the broker, close the statistics and unmap the section.
+    void ReleaseSection(void);
+
+    // Swap in the plugin of the configuration if it is not the loaded one, 
+    // and log the outcome.
+    void ApplyPlugin(void);
+
+    // Queue a command for the main function and wake it. With 
+    // fAcknowledge, wait until it has been applied or the main function 
+    // has ended.
+    void PostCommand(SERVICE_COMMAND_TYPE type, bool fAcknowledge);
+
+    // Commands from the control handler and the console, consumed by the 
+    // main function. m_hCommandEvent wakes the main function when one is 
+    // queued; m_hCommandDone acknowledges one. Only the control handler, 
+    // which the SCM never runs twice at once, waits for acknowledgements.
+    CMpscQueue<SERVICE_COMMAND, SERVICE_COMMAND_QUEUE> m_commands;
+    HANDLE m_hCommandEvent;
+    HANDLE m_hCommandDone;
     HANDLE m_hStoppedEvent;
+
+    PWSTR m_pszServiceName;
+
+    // Backing file of the shared section in durable mode, or an empty 
+    // string to back it with the paging file.
+    WCHAR m_szDurablePath[MAX_PATH];
+
+    // Configuration file, or an empty string to read the configuration 
+    // from the registry only.
+    WCHAR m_szConfigPath[MAX_PATH];
+
+    // The state PrepareSection sets up for the main function. The main 
+    // function takes the broker over and releases the rest when it ends.
+    SECURITY_ATTRIBUTES m_secAttr;
+    SECURITY_DESCRIPTOR m_secDesc;
+    LPSECURITY_ATTRIBUTES m_pSec;
+    SERVICE_CONFIG m_config;
+    HANDLE m_hMapFile;
+    PVOID m_pInOutView;
+    HANDLE m_hStatsFile;
+    IPC_STATS_HEADER *m_pStats;
+    std::unique_ptr<CDurableSection> m_pDurable;
+
+    // The message-handler plugin, which outlives every broker that calls 
+    // it.
+    CPluginHost m_plugins;
+    std::unique_ptr<CShardedBroker> m_pBroker;
 };
\ No newline at end of file
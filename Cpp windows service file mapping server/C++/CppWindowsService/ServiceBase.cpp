@@ -122,7 +122,12 @@ void WINAPI CServiceBase::ServiceCtrlHandler(DWORD dwCtrl)
     case SERVICE_CONTROL_CONTINUE: s_service->Continue(); break;
     case SERVICE_CONTROL_SHUTDOWN: s_service->Shutdown(); break;
     case SERVICE_CONTROL_INTERROGATE: break;
-    default: break;
+    default:
+        if (dwCtrl >= 128 && dwCtrl <= 255)
+        {
+            s_service->CustomCommand(dwCtrl);
+        }
+        break;
     }
 }
 
@@ -176,6 +181,10 @@ CServiceBase::CServiceBase(PWSTR pszServiceName,
     m_status.dwServiceSpecificExitCode = 0;
     m_status.dwCheckPoint = 0;
     m_status.dwWaitHint = 0;
+
+    // Start the logger thread. Messages are written to the Application 
+    // event log in the background, in batches.
+    m_pLogger.reset(new CAsyncLogger(new CEventLogSink(m_name)));
 }
 
 
@@ -460,6 +469,53 @@ void CServiceBase::OnShutdown()
 {
 }
 
+
+//
+//   FUNCTION: CServiceBase::CustomCommand(DWORD)
+//
+//   PURPOSE: The function executes when a user-defined control code is 
+//   sent to the service. It calls the OnCustomCommand virtual function in 
+//   which you can specify the actions to take. If an error occurs, the 
+//   error will be logged in the Application event log; the state of the 
+//   service does not change.
+//
+//   PARAMETERS:
+//   * dwCtrl - the control code, from 128 to 255
+//
+void CServiceBase::CustomCommand(DWORD dwCtrl)
+{
+    try
+    {
+        // Perform the service-specific command.
+        OnCustomCommand(dwCtrl);
+    }
+    catch (DWORD dwError)
+    {
+        // Log the error.
+        WriteErrorLogEntry(L"Service Custom Command", dwError);
+    }
+    catch (...)
+    {
+        // Log the error.
+        WriteEventLogEntry(L"Service failed to run a custom command.", 
+            EVENTLOG_ERROR_TYPE);
+    }
+}
+
+
+//
+//   FUNCTION: CServiceBase::OnCustomCommand(DWORD)
+//
+//   PURPOSE: When implemented in a derived class, executes when a 
+//   user-defined control code is sent to the service by the SCM.
+//
+//   PARAMETERS:
+//   * dwCtrl - the control code, from 128 to 255
+//
+void CServiceBase::OnCustomCommand(DWORD dwCtrl)
+{
+}
+
 #pragma endregion
 
 
@@ -493,6 +549,13 @@ void CServiceBase::SetServiceStatus(DWORD dwCurrentState,
         (dwCurrentState == SERVICE_STOPPED)) ? 
         0 : dwCheckPoint++;
 
+    // The process may exit as soon as the SCM learns that the service has 
+    // stopped. Make sure the queued messages reach the event log first.
+    if (dwCurrentState == SERVICE_STOPPED)
+    {
+        m_pLogger->Flush();
+    }
+
     // Report the status of the service to the SCM.
     ::SetServiceStatus(m_statusHandle, &m_status);
 }
@@ -501,7 +564,11 @@ void CServiceBase::SetServiceStatus(DWORD dwCurrentState,
 //
 //   FUNCTION: CServiceBase::WriteEventLogEntry(PWSTR, WORD)
 //
-//   PURPOSE: Log a message to the Application event log.
+//   PURPOSE: Log a message to the Application event log. The message is 
+//   copied to the queue of the logger thread, which writes it together with 
+//   other queued messages. Repeated messages are collapsed and a rate limit 
+//   applies; if the queue is full the message is dropped rather than 
+//   blocking the caller.
 //
 //   PARAMETERS:
 //   * pszMessage - string message to be logged.
@@ -517,28 +584,7 @@ void CServiceBase::SetServiceStatus(DWORD dwCurrentState,
 //
 void CServiceBase::WriteEventLogEntry(PWSTR pszMessage, WORD wType)
 {
-    HANDLE hEventSource = NULL;
-    LPCWSTR lpszStrings[2] = { NULL, NULL };
-
-    hEventSource = RegisterEventSource(NULL, m_name);
-    if (hEventSource)
-    {
-        lpszStrings[0] = m_name;
-        lpszStrings[1] = pszMessage;
-
-        ReportEvent(hEventSource,  // Event log handle
-            wType,                 // Event type
-            0,                     // Event category
-            0,                     // Event identifier
-            NULL,                  // No security identifier
-            2,                     // Size of lpszStrings array
-            0,                     // No binary data
-            lpszStrings,           // Array of strings
-            NULL                   // No binary data
-            );
-
-        DeregisterEventSource(hEventSource);
-    }
+    m_pLogger->Log(wType, pszMessage);
 }
 
 
@@ -553,10 +599,9 @@ void CServiceBase::WriteEventLogEntry(PWSTR pszMessage, WORD wType)
 //
 void CServiceBase::WriteErrorLogEntry(PWSTR pszFunction, DWORD dwError)
 {
-    wchar_t szMessage[260];
-    StringCchPrintf(szMessage, ARRAYSIZE(szMessage), 
-        L"%s failed w/err 0x%08lx", pszFunction, dwError);
-    WriteEventLogEntry(szMessage, EVENTLOG_ERROR_TYPE);
+    // Format straight into the logger's queue.
+    m_pLogger->LogFormat(EVENTLOG_ERROR_TYPE, 
+        L"%ls failed w/err 0x%08lx", pszFunction, dwError);
 }
 
 //
@@ -569,9 +614,8 @@ void CServiceBase::WriteErrorLogEntry(PWSTR pszFunction, DWORD dwError)
 //
 void CServiceBase::WriteEventLogMsg(PWSTR pszFunction)
 {
-    wchar_t szMessage[260];
-    StringCchPrintf(szMessage, ARRAYSIZE(szMessage),
-        L"Server: %s ", pszFunction);
-    WriteEventLogEntry(szMessage, EVENTLOG_INFORMATION_TYPE);
+    // Format straight into the logger's queue.
+    m_pLogger->LogFormat(EVENTLOG_INFORMATION_TYPE, 
+        L"Server: %ls ", pszFunction);
 }
 #pragma endregion
\ No newline at end of file
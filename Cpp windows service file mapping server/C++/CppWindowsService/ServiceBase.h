@@ -19,6 +19,8 @@
 #pragma once
 
 #include <windows.h>
+#include <memory>
+#include "LogSink.h"
 
 
 class CServiceBase
@@ -74,12 +76,18 @@ protected:
     // system shutting down.
     virtual void OnShutdown();
 
+    // When implemented in a derived class, executes when a user-defined 
+    // control code (128 to 255) is sent to the service by the SCM, for 
+    // example with "sc control <service> <code>".
+    virtual void OnCustomCommand(DWORD dwCtrl);
+
     // Set the service status and report the status to the SCM.
     void SetServiceStatus(DWORD dwCurrentState, 
         DWORD dwWin32ExitCode = NO_ERROR, 
         DWORD dwWaitHint = 0);
 
-    // Log a message to the Application event log.
+    // Log a message to the Application event log. The message is queued to 
+    // the logger thread; the call never waits for the event log.
     void WriteEventLogEntry(PWSTR pszMessage, WORD wType);
 
     // Log an error message to the Application event log.
@@ -110,6 +118,9 @@ private:
     // Execute when the system is shutting down.
     void Shutdown();
 
+    // Execute a user-defined control code.
+    void CustomCommand(DWORD dwCtrl);
+
     // The singleton service instance.
     static CServiceBase *s_service;
 
@@ -121,4 +132,7 @@ private:
 
     // The service status handle
     SERVICE_STATUS_HANDLE m_statusHandle;
+
+    // The asynchronous logger that writes to the Application event log
+    std::unique_ptr<CAsyncLogger> m_pLogger;
 };
\ No newline at end of file
@@ -0,0 +1,101 @@
+/****************************** Module Header ******************************\
+* Module Name:  ServiceConfig.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements reading the runtime configuration of the service.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <stdio.h>
+#include "ServiceConfig.h"
+#include "SampleService.h"
+#pragma endregion
+
+
+// Name of the string value that selects the plugin.
+#define SERVICE_CONFIG_PLUGIN       L"Plugin"
+
+// The configurable values, by name, in the registry key and the file.
+static const struct
+{
+    PCWSTR pszName;
+    size_t offset;
+}
+g_configValues[] =
+{
+    { L"Sessions",    offsetof(SERVICE_CONFIG, Geometry.cSessions) },
+    { L"RingSlots",   offsetof(SERVICE_CONFIG, Geometry.cSlots) },
+    { L"SlotSize",    offsetof(SERVICE_CONFIG, Geometry.cbSlot) },
+    { L"Shards",      offsetof(SERVICE_CONFIG, Geometry.cShards) },
+    { L"IdleWait",    offsetof(SERVICE_CONFIG, dwIdleWait) },
+    { L"MessageRate", offsetof(SERVICE_CONFIG, dwMessageRate) },
+    { L"ByteRate",    offsetof(SERVICE_CONFIG, dwByteRate) },
+};
+
+static DWORD *GetConfigValue(SERVICE_CONFIG *pConfig, size_t i)
+{
+    return reinterpret_cast<DWORD *>(
+        reinterpret_cast<BYTE *>(pConfig) + g_configValues[i].offset);
+}
+
+
+DWORD LoadServiceConfig(PCWSTR pszServiceName, PCWSTR pszConfigFile,
+                        SERVICE_CONFIG *pConfig)
+{
+    SERVICE_CONFIG config = { { MAP_SESSIONS, MAP_RING_SLOTS, MAP_SLOT_SIZE,
+        MAP_SHARDS }, BROKER_IDLE_WAIT, BROKER_MESSAGE_RATE,
+        BROKER_BYTE_RATE };
+    *pConfig = config;
+
+    wchar_t szKey[MAX_PATH];
+    swprintf_s(szKey, ARRAYSIZE(szKey), SERVICE_CONFIG_KEY_FORMAT,
+        pszServiceName);
+    for (size_t i = 0; i < ARRAYSIZE(g_configValues); i++)
+    {
+        DWORD dwValue;
+        DWORD cbValue = sizeof(dwValue);
+        if (RegGetValue(HKEY_LOCAL_MACHINE, szKey, g_configValues[i].pszName,
+            RRF_RT_REG_DWORD, NULL, &dwValue, &cbValue) == ERROR_SUCCESS)
+        {
+            *GetConfigValue(&config, i) = dwValue;
+        }
+    }
+    DWORD cbPlugin = sizeof(config.szPlugin);
+    if (RegGetValue(HKEY_LOCAL_MACHINE, szKey, SERVICE_CONFIG_PLUGIN,
+        RRF_RT_REG_SZ, NULL, config.szPlugin, &cbPlugin) != ERROR_SUCCESS)
+    {
+        config.szPlugin[0] = L'\0';
+    }
+
+    if (pszConfigFile && *pszConfigFile)
+    {
+        for (size_t i = 0; i < ARRAYSIZE(g_configValues); i++)
+        {
+            DWORD *pValue = GetConfigValue(&config, i);
+            *pValue = GetPrivateProfileInt(SERVICE_CONFIG_SECTION,
+                g_configValues[i].pszName, (INT)*pValue, pszConfigFile);
+        }
+
+        WCHAR szDefault[MAX_PATH];
+        wcscpy_s(szDefault, ARRAYSIZE(szDefault), config.szPlugin);
+        GetPrivateProfileString(SERVICE_CONFIG_SECTION, SERVICE_CONFIG_PLUGIN,
+            szDefault, config.szPlugin, ARRAYSIZE(config.szPlugin),
+            pszConfigFile);
+    }
+
+    if (!IpcIsValidGeometry(config.Geometry))
+    {
+        return ERROR_INVALID_DATA;
+    }
+    *pConfig = config;
+    return ERROR_SUCCESS;
+}
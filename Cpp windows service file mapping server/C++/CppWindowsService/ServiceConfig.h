@@ -0,0 +1,81 @@
+/****************************** Module Header ******************************\
+* Module Name:  ServiceConfig.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares the runtime configuration of the service: the geometry of the
+* shared section, the idle wait of the broker and the rate limits of the
+* sessions. The compiled-in defaults (MAP_SESSIONS, MAP_RING_SLOTS,
+* MAP_SLOT_SIZE, MAP_SHARDS, BROKER_IDLE_WAIT, BROKER_MESSAGE_RATE and
+* BROKER_BYTE_RATE) are
+* overridden by the DWORD values of the Parameters key of the service
+* 
+*     HKLM\SYSTEM\CurrentControlSet\Services\<name>\Parameters
+*         Sessions, RingSlots, SlotSize, Shards, IdleWait,
+*         MessageRate, ByteRate
+* 
+* and those by the [Channel] section of the configuration file given with
+* "-config <file>", which has the same keys:
+* 
+*     [Channel]
+*     Sessions=1024
+*     RingSlots=128
+*     Shards=8
+*     MessageRate=10000
+* 
+* The string value Plugin, in the key or the section, names the DLL of a
+* message-handler plugin (see IpcPlugin.h) that answers the requests in
+* place of the built-in echo.
+* 
+* The service reads the configuration when it starts and again on every
+* reconfigure command; a new geometry is applied by moving the clients to
+* a resized section (see CSampleService::ServiceWorkerThread), while new
+* rate limits apply to the next requests served and a new plugin is
+* swapped in under load (see PluginHost.h).
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include "IpcChannel.h"
+
+// Key of the configuration in HKEY_LOCAL_MACHINE, formatted with the name
+// of the service, and the section of the configuration file.
+#define SERVICE_CONFIG_KEY_FORMAT   L"SYSTEM\\CurrentControlSet\\Services\\%s\\Parameters"
+#define SERVICE_CONFIG_SECTION      L"Channel"
+
+struct SERVICE_CONFIG
+{
+    IPC_GEOMETRY Geometry;
+    DWORD dwIdleWait;               // BROKER_IDLE_WAIT, in milliseconds
+    DWORD dwMessageRate;            // Requests per second and session
+    DWORD dwByteRate;               // Request bytes per second and session
+    WCHAR szPlugin[MAX_PATH];       // Plugin DLL, or empty for the echo
+};
+
+
+//
+//   FUNCTION: LoadServiceConfig(PCWSTR, PCWSTR, SERVICE_CONFIG *)
+//
+//   PURPOSE: Read the configuration of the service from the registry and
+//   the configuration file. Values that are missing keep their defaults.
+//
+//   PARAMETERS:
+//   * pszServiceName - name of the service, which names its registry key
+//   * pszConfigFile - full path of the configuration file, or NULL or an
+//     empty string for none
+//   * pConfig - receives the configuration
+//
+//   RETURN VALUE: ERROR_SUCCESS, or ERROR_INVALID_DATA if the geometry is
+//   not valid (see IpcIsValidGeometry); pConfig then holds the defaults.
+//
+DWORD LoadServiceConfig(PCWSTR pszServiceName, PCWSTR pszConfigFile,
+    SERVICE_CONFIG *pConfig);
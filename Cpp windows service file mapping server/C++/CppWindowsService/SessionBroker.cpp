@@ -0,0 +1,812 @@
+/****************************** Module Header ******************************\
+* Module Name:  SessionBroker.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the broker that serves the client sessions of the shared
+* section.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include "SessionBroker.h"
+#include <stdio.h>
+#include <thread>
+#pragma endregion
+
+
+CSessionBroker::CSessionBroker(IPC_SECTION_HEADER *pHeader,
+                               LPSECURITY_ATTRIBUTES pSecurityAttributes,
+                               IPC_STATS_HEADER *pStats,
+                               CThreadPool &pool)
+: m_pHeader(pHeader),
+  m_pSecurityAttributes(pSecurityAttributes),
+  m_pStats(pStats),
+  m_pPool(&pool),
+  m_iShard(0),
+  m_iFirst(0),
+  m_iLast(pHeader->Geometry.cSessions),
+  m_pSleeping(&IpcGetShard(pHeader, 0)->ServerSleeping),
+  m_hDoorbell(NULL),
+  m_targetDelay(BROKER_TARGET_DELAY * IpcTimestampFrequency() / 1000000),
+  m_reapInterval(BROKER_REAP_INTERVAL * IpcTimestampFrequency() / 1000),
+  m_idleTimeout(BROKER_IDLE_TIMEOUT * IpcTimestampFrequency() / 1000),
+  m_fAccepting(true),
+  m_messageRate(0),
+  m_byteRate(0),
+  m_pPlugins(NULL),
+  m_cInFlight(0),
+  m_cRequests(0)
+{
+    // Clients of a sharded section ring the doorbells of their shards.
+    if (IpcShardCount(pHeader->Geometry) != 1)
+    {
+        throw (DWORD)ERROR_INVALID_PARAMETER;
+    }
+    Initialize();
+}
+
+
+CSessionBroker::CSessionBroker(IPC_SECTION_HEADER *pHeader,
+                               LPSECURITY_ATTRIBUTES pSecurityAttributes,
+                               IPC_STATS_HEADER *pStats,
+                               uint32_t iShard)
+: m_pHeader(pHeader),
+  m_pSecurityAttributes(pSecurityAttributes),
+  m_pStats(pStats),
+  m_pPool(NULL),
+  m_iShard(iShard),
+  m_iFirst(IpcShardFirstSession(pHeader->Geometry, iShard)),
+  m_iLast(IpcShardFirstSession(pHeader->Geometry, iShard + 1)),
+  m_pSleeping(&IpcGetShard(pHeader, iShard)->ServerSleeping),
+  m_hDoorbell(NULL),
+  m_targetDelay(BROKER_TARGET_DELAY * IpcTimestampFrequency() / 1000000),
+  m_reapInterval(BROKER_REAP_INTERVAL * IpcTimestampFrequency() / 1000),
+  m_idleTimeout(BROKER_IDLE_TIMEOUT * IpcTimestampFrequency() / 1000),
+  m_fAccepting(true),
+  m_messageRate(0),
+  m_byteRate(0),
+  m_pPlugins(NULL),
+  m_cInFlight(0),
+  m_cRequests(0)
+{
+    if (iShard >= IpcShardCount(pHeader->Geometry))
+    {
+        throw (DWORD)ERROR_INVALID_PARAMETER;
+    }
+    Initialize();
+}
+
+
+void CSessionBroker::Initialize(void)
+{
+    if (m_pStats && m_pStats->cSessions < m_pHeader->Geometry.cSessions)
+    {
+        m_pStats = NULL;
+    }
+
+    m_pSessions.reset(new SESSION_CONTEXT[m_iLast - m_iFirst]);
+    for (uint32_t i = m_iFirst; i < m_iLast; i++)
+    {
+        SESSION_CONTEXT &context = GetContext(i);
+        context.fScheduled.store(false, std::memory_order_relaxed);
+        context.fActive = false;
+        context.hClientProcess = NULL;
+        context.hReplyEvent = NULL;
+        context.cCredits = 0;
+        context.LastActivity.store(0, std::memory_order_relaxed);
+        CTimerWheel::Initialize(&context.Heartbeat, OnHeartbeat, this);
+        context.ThrottledUntil.store(0, std::memory_order_relaxed);
+    }
+
+    // Create an auto-reset event that clients set when they publish a
+    // request while the broker is waiting.
+    wchar_t szDoorbellName[64];
+    IpcFormatDoorbellName(szDoorbellName, ARRAYSIZE(szDoorbellName), m_iShard);
+    m_hDoorbell = CreateEvent(m_pSecurityAttributes, FALSE, FALSE,
+        szDoorbellName);
+    if (m_hDoorbell == NULL)
+    {
+        throw GetLastError();
+    }
+}
+
+
+CSessionBroker::~CSessionBroker(void)
+{
+    // The workers hold a pointer to the broker; let them finish.
+    while (m_cInFlight.load(std::memory_order_acquire) != 0)
+    {
+        std::this_thread::yield();
+    }
+
+    for (uint32_t i = m_iFirst; i < m_iLast; i++)
+    {
+        if (GetContext(i).fActive)
+        {
+            Teardown(i);
+        }
+    }
+
+    if (m_hDoorbell)
+    {
+        CloseHandle(m_hDoorbell);
+        m_hDoorbell = NULL;
+    }
+}
+
+
+//
+//   FUNCTION: CSessionBroker::Poll(void)
+//
+//   PURPOSE: Run the heartbeats that are due, then walk the session table
+//   once. New sessions are accepted, closed ones are torn down, and every
+//   session with pending requests that is not already being served is
+//   handed to the thread pool, or served at once by a shard broker.
+//
+//   RETURN VALUE: The number of sessions dispatched.
+//
+unsigned int CSessionBroker::Poll(void)
+{
+    unsigned int cDispatched = 0;
+    uint64_t now = IpcTimestamp();
+
+    m_timers.Advance(now);
+
+    for (uint32_t i = m_iFirst; i < m_iLast; i++)
+    {
+        SESSION_CONTEXT &context = GetContext(i);
+        IPC_SESSION *pSession = IpcGetSession(m_pHeader, i);
+
+        switch (pSession->State.load(std::memory_order_acquire))
+        {
+        case IPC_SESSION_CONNECTING:
+            if (!context.fActive && m_fAccepting)
+            {
+                Accept(i);
+            }
+            break;
+
+        case IPC_SESSION_ACTIVE:
+            if (!context.fActive)
+            {
+                break;
+            }
+            if (HasWork(i) && !IsThrottled(i, now) &&
+                !context.fScheduled.exchange(true, std::memory_order_acquire))
+            {
+                Dispatch(i);
+                cDispatched++;
+            }
+            break;
+
+        case IPC_SESSION_CLOSING:
+            if (!context.fActive)
+            {
+                // Closed before the broker accepted it.
+                pSession->ClientPid = 0;
+                pSession->State.store(IPC_SESSION_FREE,
+                    std::memory_order_release);
+            }
+            else if (!context.fScheduled.exchange(true,
+                std::memory_order_acquire))
+            {
+                Teardown(i);
+            }
+            break;
+        }
+    }
+
+    return cDispatched;
+}
+
+
+//
+//   FUNCTION: CSessionBroker::Wait(DWORD, HANDLE)
+//
+//   PURPOSE: Sleep until a client rings the doorbell, the next heartbeat
+//   is due, a throttled session may be served again, the owner of the
+//   broker signals hAlert or the timeout elapses. The broker first
+//   advertises that it is
+//   sleeping and then looks for work once more, so a request published in
+//   between is never missed: either the client sees the flag and rings, or
+//   the broker sees the request.
+//
+void CSessionBroker::Wait(DWORD dwMilliseconds, HANDLE hAlert)
+{
+    uint64_t nextExpiry = m_timers.GetNextExpiry();
+    if (nextExpiry != TIMER_WHEEL_NEVER)
+    {
+        uint64_t now = IpcTimestamp();
+        uint64_t frequency = IpcTimestampFrequency();
+        uint64_t ms = (nextExpiry > now) ?
+            ((nextExpiry - now) * 1000 + frequency - 1) / frequency : 0;
+        if (ms < dwMilliseconds)
+        {
+            dwMilliseconds = (DWORD)ms;
+        }
+    }
+
+    m_pSleeping->store(1, std::memory_order_seq_cst);
+
+    uint64_t now = IpcTimestamp();
+    bool fPending = false;
+    for (uint32_t i = m_iFirst; i < m_iLast && !fPending; i++)
+    {
+        switch (IpcGetSession(m_pHeader, i)->State.load(std::memory_order_acquire))
+        {
+        case IPC_SESSION_CONNECTING:
+            fPending = m_fAccepting;
+            break;
+
+        case IPC_SESSION_CLOSING:
+            fPending = true;
+            break;
+
+        case IPC_SESSION_ACTIVE:
+            if (!GetContext(i).fActive ||
+                GetContext(i).fScheduled.load(std::memory_order_relaxed) ||
+                !HasWork(i))
+            {
+                break;
+            }
+            if (!IsThrottled(i, now))
+            {
+                fPending = true;
+                break;
+            }
+            {
+                uint64_t until = GetContext(i).ThrottledUntil.load(
+                    std::memory_order_relaxed);
+                uint64_t frequency = IpcTimestampFrequency();
+                uint64_t ms = ((until - now) * 1000 + frequency - 1) / frequency;
+                if (ms < dwMilliseconds)
+                {
+                    dwMilliseconds = (DWORD)ms;
+                }
+            }
+            break;
+        }
+    }
+
+    if (!fPending)
+    {
+        HANDLE handles[2] = { m_hDoorbell, hAlert };
+        WaitForMultipleObjects(hAlert ? 2 : 1, handles, FALSE, dwMilliseconds);
+    }
+
+    m_pSleeping->store(0, std::memory_order_relaxed);
+}
+
+
+bool CSessionBroker::IsDrained(void)
+{
+    if (m_cInFlight.load(std::memory_order_acquire) != 0)
+    {
+        return false;
+    }
+    for (uint32_t i = m_iFirst; i < m_iLast; i++)
+    {
+        if (GetContext(i).fActive && HasWork(i))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+unsigned int CSessionBroker::GetActiveCount(void) const
+{
+    return m_pHeader->cActiveSessions.load(std::memory_order_relaxed);
+}
+
+
+unsigned long long CSessionBroker::GetRequestCount(void) const
+{
+    return m_cRequests.load(std::memory_order_relaxed);
+}
+
+
+size_t CSessionBroker::HandleRequest(uint32_t iSession,
+                                     const void *pRequest, size_t cbRequest,
+                                     void *pReply, size_t cbReply)
+{
+    CPluginHost *pPlugins = m_pPlugins.load(std::memory_order_acquire);
+    size_t cbData;
+    if (pPlugins != NULL &&
+        pPlugins->Handle(iSession, pRequest, cbRequest, pReply, cbReply,
+        &cbData))
+    {
+        return cbData;
+    }
+
+    cbData = (cbRequest < cbReply) ? cbRequest : cbReply;
+    memcpy(pReply, pRequest, cbData);
+    return cbData;
+}
+
+
+//
+//   FUNCTION: CSessionBroker::Accept(uint32_t)
+//
+//   PURPOSE: Set up the per-session state of a connecting client: a handle
+//   to its process, to notice when it exits, and the event the broker sets
+//   when it publishes replies. A client that cannot be opened is refused.
+//
+bool CSessionBroker::Accept(uint32_t iSession)
+{
+    SESSION_CONTEXT &context = GetContext(iSession);
+    IPC_SESSION *pSession = IpcGetSession(m_pHeader, iSession);
+
+    context.hClientProcess = OpenProcess(SYNCHRONIZE, FALSE, pSession->ClientPid);
+    if (context.hClientProcess == NULL)
+    {
+        pSession->State.store(IPC_SESSION_CLOSING, std::memory_order_release);
+        return false;
+    }
+
+    wchar_t szEventName[64];
+    swprintf_s(szEventName, ARRAYSIZE(szEventName), IPC_SESSION_EVENT_FORMAT,
+        iSession);
+    context.hReplyEvent = CreateEvent(m_pSecurityAttributes, FALSE, FALSE,
+        szEventName);
+    if (context.hReplyEvent == NULL)
+    {
+        CloseHandle(context.hClientProcess);
+        context.hClientProcess = NULL;
+        pSession->State.store(IPC_SESSION_CLOSING, std::memory_order_release);
+        return false;
+    }
+
+    // The event outlives a session while a previous client still holds it.
+    ResetEvent(context.hReplyEvent);
+
+    // The buckets fill up on the first refill.
+    context.Messages.Tokens = 0;
+    context.Messages.LastRefill = 0;
+    context.Bytes.Tokens = 0;
+    context.Bytes.LastRefill = 0;
+    context.ThrottledUntil.store(0, std::memory_order_relaxed);
+
+    // Start with a full window; it shrinks if the broker falls behind.
+    context.cCredits = m_pHeader->Geometry.cSlots;
+    IpcRingGrant(m_pHeader->Geometry,
+        IpcGetRing(m_pHeader, iSession, IPC_RING_REQUEST), context.cCredits);
+
+    context.fActive = true;
+    m_pHeader->cActiveSessions.fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t now = IpcTimestamp();
+    context.LastActivity.store(now, std::memory_order_relaxed);
+    m_timers.Schedule(&context.Heartbeat, now + m_reapInterval);
+
+    if (m_pStats)
+    {
+        IPC_SESSION_STATS *pSessionStats = IpcGetSessionStats(m_pStats, iSession);
+        IpcStatsReset(pSessionStats->Counters);
+        pSessionStats->ClientPid.store(pSession->ClientPid, std::memory_order_relaxed);
+        IpcStatsSet(pSessionStats->Counters.Credits, context.cCredits);
+        pSessionStats->fActive.store(1, std::memory_order_relaxed);
+        IpcStatsAdd(m_pStats->cSessionsOpened, 1);
+    }
+
+    // If the client closed the session in the meantime, it stays CLOSING
+    // and is torn down by the next poll.
+    uint32_t state = IPC_SESSION_CONNECTING;
+    pSession->State.compare_exchange_strong(state, IPC_SESSION_ACTIVE,
+        std::memory_order_release, std::memory_order_relaxed);
+    return true;
+}
+
+
+//
+//   FUNCTION: CSessionBroker::Teardown(uint32_t)
+//
+//   PURPOSE: Release the per-session state and return the slot to the free
+//   list. The caller owns the session (fScheduled is set), so no worker is
+//   serving it.
+//
+void CSessionBroker::Teardown(uint32_t iSession)
+{
+    SESSION_CONTEXT &context = GetContext(iSession);
+    IPC_SESSION *pSession = IpcGetSession(m_pHeader, iSession);
+
+    m_timers.Cancel(&context.Heartbeat);
+
+    if (context.hReplyEvent)
+    {
+        CloseHandle(context.hReplyEvent);
+        context.hReplyEvent = NULL;
+    }
+    if (context.hClientProcess)
+    {
+        CloseHandle(context.hClientProcess);
+        context.hClientProcess = NULL;
+    }
+
+    context.fActive = false;
+    m_pHeader->cActiveSessions.fetch_sub(1, std::memory_order_relaxed);
+
+    if (m_pStats)
+    {
+        // Requests the client left behind are never answered.
+        uint64_t cPending = IpcRingCount(
+            IpcGetRing(m_pHeader, iSession, IPC_RING_REQUEST));
+        if (cPending > m_pHeader->Geometry.cSlots)
+        {
+            cPending = 0;
+        }
+
+        IPC_SESSION_STATS *pSessionStats = IpcGetSessionStats(m_pStats, iSession);
+        pSessionStats->fActive.store(0, std::memory_order_relaxed);
+        IpcStatsAdd(pSessionStats->Counters.cDropped, cPending);
+        IpcStatsRetire(m_pStats->Counters, pSessionStats->Counters);
+        IpcStatsAdd(m_pStats->cSessionsClosed, 1);
+    }
+
+    pSession->ClientPid = 0;
+    pSession->State.store(IPC_SESSION_FREE, std::memory_order_release);
+    context.fScheduled.store(false, std::memory_order_release);
+}
+
+
+// A session has work when a request is waiting and the client has granted
+// credits for its reply.
+bool CSessionBroker::HasWork(uint32_t iSession)
+{
+    IPC_RING_HEADER *pRequests = IpcGetRing(m_pHeader, iSession, IPC_RING_REQUEST);
+    IPC_RING_HEADER *pReplies = IpcGetRing(m_pHeader, iSession, IPC_RING_REPLY);
+
+    return IpcRingCount(pRequests) != 0 &&
+        IpcRingCredits(m_pHeader->Geometry, pReplies) != 0;
+}
+
+
+bool CSessionBroker::IsThrottled(uint32_t iSession, uint64_t now)
+{
+    return GetContext(iSession).ThrottledUntil.load(std::memory_order_acquire) >
+        now;
+}
+
+
+//
+//   FUNCTION: CSessionBroker::Refill(TOKEN_BUCKET &, uint32_t, uint64_t)
+//
+//   PURPOSE: Add the tokens earned since the last refill at the given rate
+//   per second, up to BROKER_RATE_BURST milliseconds worth of the rate. At
+//   most a second is accounted for, which bounds the arithmetic and is
+//   more than the depth of the bucket anyway.
+//
+void CSessionBroker::Refill(TOKEN_BUCKET &bucket, uint32_t rate, uint64_t now)
+{
+    const uint64_t frequency = IpcTimestampFrequency();
+    int64_t depth = (int64_t)rate * (int64_t)(frequency * BROKER_RATE_BURST / 1000);
+    if (depth < (int64_t)frequency)
+    {
+        depth = (int64_t)frequency;
+    }
+
+    uint64_t elapsed = (now > bucket.LastRefill) ? now - bucket.LastRefill : 0;
+    if (elapsed > frequency)
+    {
+        elapsed = frequency;
+    }
+    bucket.LastRefill = now;
+
+    bucket.Tokens += (int64_t)(elapsed * rate);
+    if (bucket.Tokens > depth)
+    {
+        bucket.Tokens = depth;
+    }
+}
+
+
+// The IpcTimestamp() at which a bucket that is out of tokens has a
+// positive balance again.
+uint64_t CSessionBroker::GetRefillTime(const TOKEN_BUCKET &bucket,
+                                       uint32_t rate, uint64_t now)
+{
+    if (rate == 0 || bucket.Tokens > 0)
+    {
+        return now;
+    }
+    return now + (uint64_t)(-bucket.Tokens) / rate + 1;
+}
+
+
+//
+//   FUNCTION: CSessionBroker::GrantRequests(uint32_t, uint64_t)
+//
+//   PURPOSE: Adapt the window of requests a client may queue to how long
+//   the oldest request of the last batch waited, in ticks, and grant it
+//   past the requests read so far. The window is halved when the wait
+//   exceeds the target and grows by one otherwise, so a client the broker
+//   cannot keep up with only queues what can be answered in time.
+//
+void CSessionBroker::GrantRequests(uint32_t iSession, uint64_t queued)
+{
+    SESSION_CONTEXT &context = GetContext(iSession);
+    const IPC_GEOMETRY &geometry = m_pHeader->Geometry;
+
+    if (queued > m_targetDelay)
+    {
+        context.cCredits = (context.cCredits / 2 > BROKER_MIN_CREDITS) ?
+            context.cCredits / 2 : BROKER_MIN_CREDITS;
+    }
+    else if (context.cCredits < geometry.cSlots)
+    {
+        context.cCredits++;
+    }
+
+    if (IpcRingGrant(geometry, IpcGetRing(m_pHeader, iSession, IPC_RING_REQUEST),
+        context.cCredits))
+    {
+        SetEvent(context.hReplyEvent);
+    }
+
+    if (m_pStats)
+    {
+        IpcStatsSet(IpcGetSessionStats(m_pStats, iSession)->Counters.Credits,
+            context.cCredits);
+    }
+}
+
+
+void CSessionBroker::Dispatch(uint32_t iSession)
+{
+    m_cInFlight.fetch_add(1, std::memory_order_relaxed);
+    if (m_pPool == NULL)
+    {
+        Serve(iSession);
+        return;
+    }
+    m_pPool->Post([this, iSession] { Serve(iSession); });
+}
+
+
+//
+//   FUNCTION: CSessionBroker::OnHeartbeat(TIMER_ENTRY *, PVOID)
+//
+//   PURPOSE: Check on an active session, from Poll. A session whose client
+//   exited without closing it, or that has been idle for longer than
+//   BROKER_IDLE_TIMEOUT, is closed and torn down by the next poll; any
+//   other session gets its next heartbeat. The heartbeats of the sessions
+//   are spread over time, so no poll has to look at every client process.
+//
+void CSessionBroker::OnHeartbeat(TIMER_ENTRY *pTimer, PVOID pContext)
+{
+    CSessionBroker *pBroker = static_cast<CSessionBroker *>(pContext);
+    SESSION_CONTEXT *pContextOfSession = CONTAINING_RECORD(pTimer,
+        SESSION_CONTEXT, Heartbeat);
+    uint32_t iSession = pBroker->m_iFirst +
+        (uint32_t)(pContextOfSession - pBroker->m_pSessions.get());
+    IPC_SESSION *pSession = IpcGetSession(pBroker->m_pHeader, iSession);
+
+    uint64_t now = IpcTimestamp();
+    uint64_t lastActivity = pContextOfSession->LastActivity.load(
+        std::memory_order_relaxed);
+    bool fExited = WaitForSingleObject(pContextOfSession->hClientProcess, 0) ==
+        WAIT_OBJECT_0;
+    bool fIdle = now > lastActivity && now - lastActivity > pBroker->m_idleTimeout;
+
+    if (fExited || fIdle)
+    {
+        uint32_t state = IPC_SESSION_ACTIVE;
+        pSession->State.compare_exchange_strong(state, IPC_SESSION_CLOSING,
+            std::memory_order_release, std::memory_order_relaxed);
+        return;
+    }
+
+    pBroker->m_timers.Schedule(pTimer, now + pBroker->m_reapInterval);
+}
+
+
+//
+//   FUNCTION: CSessionBroker::Serve(uint32_t)
+//
+//   PURPOSE: Answer up to BROKER_SERVE_BATCH requests of a session on a
+//   thread pool worker. Requests are handled in place in their slots and
+//   the replies are written in place too; both rings are published once
+//   for the whole batch. If requests remain, the session is queued again
+//   behind the other sessions; a shard broker serves it again on its next
+//   poll instead.
+//
+void CSessionBroker::Serve(uint32_t iSession)
+{
+    SESSION_CONTEXT &context = GetContext(iSession);
+    IPC_SESSION *pSession = IpcGetSession(m_pHeader, iSession);
+    const IPC_GEOMETRY &geometry = m_pHeader->Geometry;
+    const size_t cbMaxMessage = IpcMaxMessageSize(geometry);
+    const bool fDurable = IpcIsDurable(m_pHeader);
+
+    IPC_RING_HEADER *pRequests = IpcGetRing(m_pHeader, iSession, IPC_RING_REQUEST);
+    IPC_RING_HEADER *pReplies = IpcGetRing(m_pHeader, iSession, IPC_RING_REPLY);
+
+    uint64_t requestTail = pRequests->Tail.load(std::memory_order_relaxed);
+    uint64_t requestHead = pRequests->Head.load(std::memory_order_acquire);
+    uint64_t replyHead = pReplies->Head.load(std::memory_order_relaxed);
+    uint64_t replyTail = pReplies->Tail.load(std::memory_order_acquire);
+
+    uint64_t cRequests = requestHead - requestTail;
+    uint64_t cFree = geometry.cSlots - (replyHead - replyTail);
+    if (cRequests > geometry.cSlots || cFree > geometry.cSlots)
+    {
+        // The client corrupted its rings; drop it.
+        pSession->State.store(IPC_SESSION_CLOSING, std::memory_order_release);
+        cRequests = 0;
+    }
+
+    // Reply only as far as the client has granted credits. Out of them,
+    // the session waits until the client reads its replies and wakes the
+    // broker.
+    uint64_t cCredits = (cRequests != 0) ?
+        IpcRingCredits(geometry, pReplies) : 0;
+    if (cRequests != 0 && cCredits == 0 && IpcRingBlock(geometry, pReplies) &&
+        m_pStats)
+    {
+        IpcStatsAdd(IpcGetSessionStats(m_pStats, iSession)->Counters.cBackpressure, 1);
+    }
+
+    uint64_t cBatch = cRequests;
+    if (cBatch > cCredits)
+    {
+        cBatch = cCredits;
+    }
+    if (cBatch > BROKER_SERVE_BATCH)
+    {
+        cBatch = BROKER_SERVE_BATCH;
+    }
+
+    // Serve no more requests than the rate limits allow. A request is
+    // served while its bucket has a positive balance and then charged in
+    // full, so a request larger than the bucket still gets through.
+    const uint32_t messageRate = m_messageRate.load(std::memory_order_relaxed);
+    const uint32_t byteRate = m_byteRate.load(std::memory_order_relaxed);
+    const int64_t tokenUnit = (int64_t)IpcTimestampFrequency();
+    uint64_t refillNow = 0;
+    if (cBatch != 0 && (messageRate != 0 || byteRate != 0))
+    {
+        refillNow = IpcTimestamp();
+        if (messageRate != 0)
+        {
+            Refill(context.Messages, messageRate, refillNow);
+            uint64_t cAllowed = (context.Messages.Tokens > 0) ?
+                (uint64_t)((context.Messages.Tokens + tokenUnit - 1) / tokenUnit) : 0;
+            if (cBatch > cAllowed)
+            {
+                cBatch = cAllowed;
+            }
+        }
+        if (byteRate != 0)
+        {
+            Refill(context.Bytes, byteRate, refillNow);
+        }
+    }
+
+    uint64_t cbIn = 0;
+    uint64_t cbOut = 0;
+    uint64_t cServed;
+    for (cServed = 0; cServed < cBatch; cServed++)
+    {
+        IPC_SLOT_HEADER *pRequest = IpcGetSlot(geometry, pRequests,
+            requestTail + cServed);
+        IPC_SLOT_HEADER *pReply = IpcGetSlot(geometry, pReplies,
+            replyHead + cServed);
+
+        // The client may rewrite its slot at any time; read the size once.
+        size_t cbRequest = pRequest->cbData;
+        if (cbRequest > cbMaxMessage)
+        {
+            cbRequest = cbMaxMessage;
+        }
+
+        if (byteRate != 0)
+        {
+            if (context.Bytes.Tokens <= 0)
+            {
+                break;
+            }
+            context.Bytes.Tokens -= (int64_t)cbRequest * tokenUnit;
+        }
+
+        size_t cbReply = HandleRequest(iSession, pRequest + 1, cbRequest,
+            pReply + 1, cbMaxMessage);
+        IpcSealSlot(pReply, replyHead + cServed, cbReply, fDurable);
+
+        cbIn += cbRequest;
+        cbOut += cbReply;
+    }
+    cBatch = cServed;
+
+    if (refillNow != 0)
+    {
+        if (messageRate != 0)
+        {
+            context.Messages.Tokens -= (int64_t)cBatch * tokenUnit;
+        }
+
+        // Out of tokens with requests left: the session waits for the
+        // later of its two buckets.
+        uint64_t until = GetRefillTime(context.Messages, messageRate, refillNow);
+        uint64_t untilBytes = GetRefillTime(context.Bytes, byteRate, refillNow);
+        if (untilBytes > until)
+        {
+            until = untilBytes;
+        }
+        if (until > refillNow && cRequests > cBatch)
+        {
+            context.ThrottledUntil.store(until, std::memory_order_release);
+            if (m_pStats)
+            {
+                IpcStatsAdd(IpcGetSessionStats(m_pStats, iSession)->Counters.cBackpressure,
+                    cRequests - cBatch);
+            }
+        }
+    }
+
+    if (cBatch != 0)
+    {
+        // Stamp the replies and record how long each request took from
+        // being published to being answered.
+        uint64_t now = IpcTimestamp();
+        uint64_t oldest = IpcGetSlot(geometry, pRequests, requestTail)->Timestamp;
+        IPC_STATS_COUNTERS *pCounters = m_pStats ?
+            &IpcGetSessionStats(m_pStats, iSession)->Counters : NULL;
+        for (uint64_t i = 0; i < cBatch; i++)
+        {
+            IpcGetSlot(geometry, pReplies, replyHead + i)->Timestamp = now;
+            if (pCounters)
+            {
+                uint64_t sent = IpcGetSlot(geometry, pRequests, requestTail + i)->Timestamp;
+                IpcStatsAdd(pCounters->Latency[IpcLatencyBucket(
+                    (now > sent) ? now - sent : 0, m_pStats->Frequency)], 1);
+            }
+        }
+
+        pRequests->Tail.store(requestTail + cBatch, std::memory_order_release);
+        pReplies->Head.store(replyHead + cBatch, std::memory_order_release);
+        m_cRequests.fetch_add(cBatch, std::memory_order_relaxed);
+        GrantRequests(iSession, (now > oldest) ? now - oldest : 0);
+        context.LastActivity.store(now, std::memory_order_relaxed);
+
+        if (pCounters)
+        {
+            IpcStatsAdd(pCounters->cMessagesIn, cBatch);
+            IpcStatsAdd(pCounters->cBytesIn, cbIn);
+            IpcStatsAdd(pCounters->cMessagesOut, cBatch);
+            IpcStatsAdd(pCounters->cBytesOut, cbOut);
+            IpcStatsSet(pCounters->InDepth, cRequests - cBatch);
+            IpcStatsSet(pCounters->OutDepth, IpcRingCount(pReplies));
+        }
+
+        // Wake the client if it is waiting for replies (see Wait for the
+        // reasoning behind the fence).
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (pSession->ClientSleeping.load(std::memory_order_relaxed))
+        {
+            SetEvent(context.hReplyEvent);
+        }
+    }
+
+    // Give the session back, then take it again if more requests arrived
+    // while it was being served.
+    context.fScheduled.store(false, std::memory_order_release);
+    if (m_pPool != NULL &&
+        pSession->State.load(std::memory_order_acquire) == IPC_SESSION_ACTIVE &&
+        HasWork(iSession) && !IsThrottled(iSession, IpcTimestamp()) &&
+        !context.fScheduled.exchange(true, std::memory_order_acquire))
+    {
+        m_pPool->Post([this, iSession] { Serve(iSession); });
+        return;
+    }
+
+    m_cInFlight.fetch_sub(1, std::memory_order_release);
+}
@@ -0,0 +1,223 @@
+/****************************** Module Header ******************************\
+* Module Name:  SessionBroker.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares the broker that serves the client sessions of the shared section
+* (see IpcChannel.h). The service thread calls Poll and Wait in a loop.
+* Poll accepts new sessions, tears down closed and abandoned ones, and
+* hands every session with pending requests to the thread pool. A session
+* is served by at most one worker at a time, so its requests are answered
+* in order, while different sessions run on all cores. A worker serves a
+* bounded batch and then requeues the session, so a busy client cannot
+* starve the others. Every active session has a heartbeat timer in a
+* timing wheel (see TimerWheel.h) that Poll advances: it closes the session
+* when the client process has exited or the session has been idle for too
+* long. Traffic, queue depths and latencies are published in the
+* statistics section (see IpcStats.h).
+* 
+* Every session may be held to a rate of requests and of request bytes per
+* second by a pair of token buckets. A session over its rate is not served
+* until its buckets refill; its requests wait in its ring, so the client
+* runs out of credits and sees backpressure rather than losing requests,
+* and the other sessions keep their latency.
+* 
+* A broker may also serve a single shard of the section (see IpcChannel.h)
+* without a thread pool: it then answers the requests inline, on the
+* thread that calls Poll, and waits on the doorbell of its shard. The
+* brokers of different shards share no state (see ShardedBroker.h).
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <memory>
+#include "IpcChannel.h"
+#include "IpcStats.h"
+#include "PluginHost.h"
+#include "ThreadPool.h"
+#include "TimerWheel.h"
+
+// Maximum number of requests a worker serves for one session before it
+// gives the other sessions a turn.
+#define BROKER_SERVE_BATCH      32
+
+// Interval, in milliseconds, between two heartbeats of a session, which
+// check for a client process that exited without closing its session.
+#define BROKER_REAP_INTERVAL    1000
+
+// Time, in milliseconds, after which a session that has sent no request is
+// closed. The client notices and opens a new one when it needs it again.
+#define BROKER_IDLE_TIMEOUT     60000
+
+// Flow control of the request rings. When the oldest request of a batch
+// has waited longer than BROKER_TARGET_DELAY microseconds, the window of
+// requests its client may queue is halved, down to BROKER_MIN_CREDITS;
+// otherwise it grows by one request per batch, up to the ring size. A
+// client out of credits sheds its requests instead of queueing them.
+#define BROKER_TARGET_DELAY     1000
+#define BROKER_MIN_CREDITS      1
+
+// Depth, in milliseconds of the rate, of the token buckets that limit the
+// requests and request bytes of a session (see SetRateLimits).
+#define BROKER_RATE_BURST       100
+
+
+class CSessionBroker
+{
+public:
+
+    // Create the doorbell event. Throws the Win32 error code on failure.
+    // The statistics section is optional and must have a session table at
+    // least as large as the shared section. The first form serves every
+    // session of an unsharded section on the thread pool; the second
+    // serves one shard inline.
+    CSessionBroker(IPC_SECTION_HEADER *pHeader,
+        LPSECURITY_ATTRIBUTES pSecurityAttributes,
+        IPC_STATS_HEADER *pStats = NULL,
+        CThreadPool &pool = CThreadPool::Default());
+    CSessionBroker(IPC_SECTION_HEADER *pHeader,
+        LPSECURITY_ATTRIBUTES pSecurityAttributes,
+        IPC_STATS_HEADER *pStats, uint32_t iShard);
+
+    // Wait for the running batches and close every session.
+    virtual ~CSessionBroker(void);
+
+    // Accept, reap and dispatch sessions. Returns the number of sessions
+    // handed to the thread pool, or served inline.
+    unsigned int Poll(void);
+
+    // Block until a client rings the doorbell, hAlert (optional) is
+    // signaled or the timeout elapses.
+    void Wait(DWORD dwMilliseconds, HANDLE hAlert = NULL);
+
+    // Whether Poll accepts new sessions. A broker that is being drained
+    // leaves them connecting; their clients give up and try again later.
+    void SetAccepting(bool fAccepting) { m_fAccepting = fAccepting; }
+
+    // Limit every session to cMessages requests and cbBytes bytes of
+    // requests per second; 0 lifts a limit. May be called from any thread
+    // while the broker runs.
+    void SetRateLimits(uint32_t cMessages, uint32_t cbBytes)
+    {
+        m_messageRate.store(cMessages, std::memory_order_relaxed);
+        m_byteRate.store(cbBytes, std::memory_order_relaxed);
+    }
+
+    // Let the plugin of a host answer the requests while one is loaded
+    // (see PluginHost.h); NULL, or no plugin, restores the echo. May be
+    // called from any thread while the broker runs.
+    void SetPluginHost(CPluginHost *pPlugins)
+    {
+        m_pPlugins.store(pPlugins, std::memory_order_release);
+    }
+
+    // Whether every request that can be answered has been: no batch is
+    // running and no active session has a request with room for its reply.
+    bool IsDrained(void);
+
+    // Number of sessions in the ACTIVE state.
+    unsigned int GetActiveCount(void) const;
+
+    // Total number of requests answered.
+    unsigned long long GetRequestCount(void) const;
+
+protected:
+
+    // Produce the reply to one request. Returns the size of the reply. The
+    // default implementation hands the request to the plugin, if one is
+    // loaded, and otherwise echoes it back.
+    virtual size_t HandleRequest(uint32_t iSession,
+        const void *pRequest, size_t cbRequest,
+        void *pReply, size_t cbReply);
+
+private:
+
+    CSessionBroker(const CSessionBroker &);
+    CSessionBroker &operator=(const CSessionBroker &);
+
+    // Tokens are kept in units of 1/IpcTimestampFrequency() of a token, so
+    // that a refill adds the rate once per elapsed tick. They go negative
+    // when a request costs more than is left, and the session waits until
+    // the debt is paid.
+    struct TOKEN_BUCKET
+    {
+        int64_t Tokens;
+        uint64_t LastRefill;        // IpcTimestamp() of the last refill
+    };
+
+    struct SESSION_CONTEXT
+    {
+        // Set while the session is queued to or served by a worker, and
+        // while the broker thread accepts or tears it down.
+        std::atomic<bool> fScheduled;
+        bool fActive;
+        HANDLE hClientProcess;
+        HANDLE hReplyEvent;
+
+        // Requests the client may queue past those the broker has read.
+        uint32_t cCredits;
+
+        // When a request was last answered, and the timer that checks on
+        // the session every BROKER_REAP_INTERVAL.
+        std::atomic<uint64_t> LastActivity;
+        TIMER_ENTRY Heartbeat;
+
+        // The rate limits, touched only by whoever serves the session, and
+        // the IpcTimestamp() before which it is not served again.
+        TOKEN_BUCKET Messages;
+        TOKEN_BUCKET Bytes;
+        std::atomic<uint64_t> ThrottledUntil;
+    };
+
+    bool Accept(uint32_t iSession);
+    void Teardown(uint32_t iSession);
+    bool HasWork(uint32_t iSession);
+    bool IsThrottled(uint32_t iSession, uint64_t now);
+    void Refill(TOKEN_BUCKET &bucket, uint32_t rate, uint64_t now);
+    uint64_t GetRefillTime(const TOKEN_BUCKET &bucket, uint32_t rate,
+        uint64_t now);
+    void Dispatch(uint32_t iSession);
+    void Initialize(void);
+    SESSION_CONTEXT &GetContext(uint32_t iSession)
+    {
+        return m_pSessions[iSession - m_iFirst];
+    }
+    void Serve(uint32_t iSession);
+    void GrantRequests(uint32_t iSession, uint64_t queued);
+    static void OnHeartbeat(TIMER_ENTRY *pTimer, PVOID pContext);
+
+    IPC_SECTION_HEADER *m_pHeader;
+    LPSECURITY_ATTRIBUTES m_pSecurityAttributes;
+    IPC_STATS_HEADER *m_pStats;
+    CThreadPool *m_pPool;               // NULL to serve inline
+    uint32_t m_iShard;
+    uint32_t m_iFirst;                  // Sessions of the shard
+    uint32_t m_iLast;
+    std::atomic<uint32_t> *m_pSleeping; // Sleeping flag of the shard
+    HANDLE m_hDoorbell;
+    std::unique_ptr<SESSION_CONTEXT[]> m_pSessions;
+    uint64_t m_targetDelay;             // BROKER_TARGET_DELAY in ticks
+    uint64_t m_reapInterval;            // BROKER_REAP_INTERVAL in ticks
+    uint64_t m_idleTimeout;             // BROKER_IDLE_TIMEOUT in ticks
+
+    // Heartbeats of the active sessions; only touched by the thread that
+    // calls Poll.
+    CTimerWheel m_timers;
+
+    bool m_fAccepting;
+    std::atomic<uint32_t> m_messageRate;
+    std::atomic<uint32_t> m_byteRate;
+    std::atomic<CPluginHost *> m_pPlugins;
+    std::atomic<unsigned int> m_cInFlight;
+    std::atomic<unsigned long long> m_cRequests;
+};
@@ -0,0 +1,331 @@
+/****************************** Module Header ******************************\
+* Module Name:  ShardedBroker.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the broker that serves every shard of the section on a pinned
+* thread of its own.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include "ShardedBroker.h"
+#pragma endregion
+
+
+CShardedBroker::CShardedBroker(IPC_SECTION_HEADER *pHeader,
+                               LPSECURITY_ATTRIBUTES pSecurityAttributes,
+                               IPC_STATS_HEADER *pStats)
+: m_pHeader(pHeader),
+  m_cShards(IpcShardCount(pHeader->Geometry)),
+  m_fStopping(false),
+  m_fAccepting(true),
+  m_fPaused(false),
+  m_dwIdleWait(SHARD_DEFAULT_IDLE_WAIT)
+{
+    if (m_cShards == 1)
+    {
+        m_pBroker.reset(new CSessionBroker(pHeader, pSecurityAttributes,
+            pStats));
+        return;
+    }
+
+    m_pShards.reset(new SHARD[m_cShards]);
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        m_pShards[i].hAlert = NULL;
+        m_pShards[i].fDrained.store(true, std::memory_order_relaxed);
+    }
+
+    try
+    {
+        // Every shard is set up before the first thread starts, so a
+        // failure leaves no thread to stop.
+        for (uint32_t i = 0; i < m_cShards; i++)
+        {
+            SHARD &shard = m_pShards[i];
+            shard.hAlert = CreateEvent(NULL, FALSE, FALSE, NULL);
+            if (shard.hAlert == NULL)
+            {
+                throw GetLastError();
+            }
+            shard.pBroker.reset(new CSessionBroker(pHeader,
+                pSecurityAttributes, pStats, i));
+        }
+
+        for (uint32_t i = 0; i < m_cShards; i++)
+        {
+            m_pShards[i].thread = std::thread(&CShardedBroker::RunShard,
+                this, i);
+        }
+    }
+    catch (DWORD)
+    {
+        Stop();
+        throw;
+    }
+}
+
+
+CShardedBroker::~CShardedBroker(void)
+{
+    Stop();
+}
+
+
+// Stop the threads that were started, then close the sessions of every
+// shard.
+void CShardedBroker::Stop(void)
+{
+    if (!m_pShards)
+    {
+        return;
+    }
+
+    m_fStopping.store(true, std::memory_order_release);
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        if (m_pShards[i].hAlert)
+        {
+            SetEvent(m_pShards[i].hAlert);
+        }
+    }
+
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        SHARD &shard = m_pShards[i];
+        if (shard.thread.joinable())
+        {
+            shard.thread.join();
+        }
+        shard.pBroker.reset();
+        if (shard.hAlert)
+        {
+            CloseHandle(shard.hAlert);
+            shard.hAlert = NULL;
+        }
+    }
+}
+
+
+unsigned int CShardedBroker::Poll(void)
+{
+    return m_pBroker ? m_pBroker->Poll() : 0;
+}
+
+
+void CShardedBroker::Wait(DWORD dwMilliseconds, HANDLE hAlert)
+{
+    if (m_pBroker)
+    {
+        m_pBroker->Wait(dwMilliseconds, hAlert);
+        return;
+    }
+
+    m_dwIdleWait.store(dwMilliseconds, std::memory_order_relaxed);
+    if (hAlert)
+    {
+        WaitForSingleObject(hAlert, dwMilliseconds);
+    }
+    else
+    {
+        Sleep(dwMilliseconds);
+    }
+}
+
+
+void CShardedBroker::SetAccepting(bool fAccepting)
+{
+    if (m_pBroker)
+    {
+        m_pBroker->SetAccepting(fAccepting);
+        return;
+    }
+
+    m_fAccepting.store(fAccepting, std::memory_order_release);
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        SetEvent(m_pShards[i].hAlert);
+    }
+}
+
+
+void CShardedBroker::SetRateLimits(uint32_t cMessages, uint32_t cbBytes)
+{
+    if (m_pBroker)
+    {
+        m_pBroker->SetRateLimits(cMessages, cbBytes);
+        return;
+    }
+
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        m_pShards[i].pBroker->SetRateLimits(cMessages, cbBytes);
+    }
+}
+
+
+void CShardedBroker::SetPluginHost(CPluginHost *pPlugins)
+{
+    if (m_pBroker)
+    {
+        m_pBroker->SetPluginHost(pPlugins);
+        return;
+    }
+
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        m_pShards[i].pBroker->SetPluginHost(pPlugins);
+    }
+}
+
+
+void CShardedBroker::SetPaused(bool fPaused)
+{
+    if (m_pBroker)
+    {
+        return;
+    }
+
+    m_fPaused.store(fPaused, std::memory_order_release);
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        SetEvent(m_pShards[i].hAlert);
+    }
+}
+
+
+bool CShardedBroker::IsDrained(void)
+{
+    if (m_pBroker)
+    {
+        return m_pBroker->IsDrained();
+    }
+
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        if (!m_pShards[i].fDrained.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+unsigned int CShardedBroker::GetActiveCount(void) const
+{
+    return m_pHeader->cActiveSessions.load(std::memory_order_relaxed);
+}
+
+
+unsigned long long CShardedBroker::GetRequestCount(void) const
+{
+    if (m_pBroker)
+    {
+        return m_pBroker->GetRequestCount();
+    }
+
+    unsigned long long cRequests = 0;
+    for (uint32_t i = 0; i < m_cShards; i++)
+    {
+        if (m_pShards[i].pBroker)
+        {
+            cRequests += m_pShards[i].pBroker->GetRequestCount();
+        }
+    }
+    return cRequests;
+}
+
+
+//
+//   FUNCTION: GetShardAffinity(uint32_t, uint32_t)
+//
+//   PURPOSE: Pick the core a shard thread is pinned to: the iShard-th of
+//   the processors the process may run on. Threads are only pinned while
+//   each shard gets a core of its own, and not at all when the process
+//   spans several processor groups, for which GetProcessAffinityMask
+//   reports no mask.
+//
+//   RETURN VALUE: The affinity mask of the core, or 0 to leave the thread
+//   to the scheduler.
+//
+static DWORD_PTR GetShardAffinity(uint32_t iShard, uint32_t cShards)
+{
+    DWORD_PTR processMask;
+    DWORD_PTR systemMask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask,
+        &systemMask) || processMask == 0)
+    {
+        return 0;
+    }
+
+    uint32_t cCores = 0;
+    for (DWORD_PTR mask = processMask; mask != 0; mask &= mask - 1)
+    {
+        cCores++;
+    }
+    if (cShards > cCores)
+    {
+        return 0;
+    }
+
+    DWORD_PTR mask = processMask;
+    for (uint32_t i = 0; i < iShard; i++)
+    {
+        mask &= mask - 1;
+    }
+    return mask & (~mask + 1);
+}
+
+
+//
+//   FUNCTION: CShardedBroker::RunShard(uint32_t)
+//
+//   PURPOSE: The loop of a shard thread. The thread is pinned to a core of
+//   its own while there are enough of them (see GetShardAffinity), so the
+//   sessions of the shard and the state of its broker stay in the caches
+//   of that core. It polls its broker, which answers the requests inline,
+//   until the shard runs out of work, and then waits on the doorbell of
+//   the shard.
+//
+void CShardedBroker::RunShard(uint32_t iShard)
+{
+    SHARD &shard = m_pShards[iShard];
+
+    DWORD_PTR affinity = GetShardAffinity(iShard, m_cShards);
+    if (affinity != 0)
+    {
+        SetThreadAffinityMask(GetCurrentThread(), affinity);
+    }
+
+    while (!m_fStopping.load(std::memory_order_acquire))
+    {
+        if (m_fPaused.load(std::memory_order_acquire))
+        {
+            WaitForSingleObject(shard.hAlert, INFINITE);
+            continue;
+        }
+
+        shard.pBroker->SetAccepting(
+            m_fAccepting.load(std::memory_order_acquire));
+
+        if (shard.pBroker->Poll() != 0)
+        {
+            shard.fDrained.store(false, std::memory_order_release);
+            continue;
+        }
+
+        shard.fDrained.store(shard.pBroker->IsDrained(),
+            std::memory_order_release);
+        shard.pBroker->Wait(m_dwIdleWait.load(std::memory_order_relaxed),
+            shard.hAlert);
+    }
+}
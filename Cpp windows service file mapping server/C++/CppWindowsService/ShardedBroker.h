@@ -0,0 +1,123 @@
+/****************************** Module Header ******************************\
+* Module Name:  ShardedBroker.h
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Declares CShardedBroker, which serves a section whose sessions are split
+* into shards (see IpcChannel.h). Every shard has a thread of its own,
+* pinned to a core, that runs the Poll and Wait loop of a CSessionBroker
+* over the sessions of the shard and answers their requests inline. The
+* shards share no lock, no queue and no counter that is written on the
+* path of a request, so the throughput grows with the number of shards
+* until the cores run out.
+* 
+* The service thread keeps the loop it runs for a single broker: for a
+* sharded section Poll dispatches nothing and Wait only waits for hAlert,
+* while the shard threads follow the accepting and paused states the
+* service sets. A section of a single shard is served as before, by one
+* CSessionBroker that the owner polls and that dispatches to the thread
+* pool.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "SessionBroker.h"
+
+// Interval, in milliseconds, at which an idle shard polls its sessions
+// until the owner of the broker first waits.
+#define SHARD_DEFAULT_IDLE_WAIT 100
+
+
+class CShardedBroker
+{
+public:
+
+    // Create a broker per shard and start the shard threads. Throws the
+    // Win32 error code on failure.
+    CShardedBroker(IPC_SECTION_HEADER *pHeader,
+        LPSECURITY_ATTRIBUTES pSecurityAttributes,
+        IPC_STATS_HEADER *pStats = NULL);
+
+    // Stop the shard threads and close every session.
+    ~CShardedBroker(void);
+
+    // Accept, reap and dispatch the sessions of an unsharded section.
+    // Returns the number of sessions dispatched; always 0 for a sharded
+    // section, whose shards poll themselves.
+    unsigned int Poll(void);
+
+    // Block until a client rings the doorbell of an unsharded section,
+    // hAlert (optional) is signaled or the timeout elapses. The shards of
+    // a sharded section wait at most as long when they are idle.
+    void Wait(DWORD dwMilliseconds, HANDLE hAlert = NULL);
+
+    // Whether the shards accept new sessions (see CSessionBroker).
+    void SetAccepting(bool fAccepting);
+
+    // Limit the rate of requests and request bytes of every session (see
+    // CSessionBroker::SetRateLimits).
+    void SetRateLimits(uint32_t cMessages, uint32_t cbBytes);
+
+    // Let the plugin of a host answer the requests of every shard (see
+    // CSessionBroker::SetPluginHost).
+    void SetPluginHost(CPluginHost *pPlugins);
+
+    // Whether the shards serve requests. Paused shards leave the requests
+    // queued in the rings. An unsharded section is only polled by its
+    // owner, which stops polling instead.
+    void SetPaused(bool fPaused);
+
+    // Whether every shard has answered every request it can.
+    bool IsDrained(void);
+
+    uint32_t GetShardCount(void) const { return m_cShards; }
+
+    // Number of sessions in the ACTIVE state.
+    unsigned int GetActiveCount(void) const;
+
+    // Total number of requests answered by all shards.
+    unsigned long long GetRequestCount(void) const;
+
+private:
+
+    CShardedBroker(const CShardedBroker &);
+    CShardedBroker &operator=(const CShardedBroker &);
+
+    struct SHARD
+    {
+        std::unique_ptr<CSessionBroker> pBroker;
+        HANDLE hAlert;                  // Wakes the thread of the shard
+        std::thread thread;
+
+        // Published by the thread of the shard whenever it runs out of
+        // work, for IsDrained.
+        std::atomic<bool> fDrained;
+    };
+
+    void RunShard(uint32_t iShard);
+    void Stop(void);
+
+    IPC_SECTION_HEADER *m_pHeader;
+    uint32_t m_cShards;
+
+    // The broker of an unsharded section, polled by the owner.
+    std::unique_ptr<CSessionBroker> m_pBroker;
+
+    std::unique_ptr<SHARD[]> m_pShards;
+    std::atomic<bool> m_fStopping;
+    std::atomic<bool> m_fAccepting;
+    std::atomic<bool> m_fPaused;
+    std::atomic<DWORD> m_dwIdleWait;
+};
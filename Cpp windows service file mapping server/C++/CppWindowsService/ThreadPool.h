@@ -3,8 +3,14 @@
 * Project:      CppWindowsService
 * Copyright (c) Microsoft Corporation.
 * 
-* The class was designed by Kenny Kerr. It provides the ability to queue 
-* simple member functions of a class to the Windows thread pool.
+* The class was originally designed by Kenny Kerr as a thin wrapper that
+* queued simple member functions of a class to the Windows thread pool. It
+* is now a portable work-stealing pool built on std::thread. Each worker
+* owns a bounded deque of tasks; a worker pops its own deque from the back
+* (LIFO, cache friendly) and, when it runs dry, steals from the front of
+* the other workers' deques (FIFO). Tasks are stored in place with a small
+* buffer, so queuing a typical lambda or member function does not touch
+* the heap.
 * 
 * Using the thread pool is simple and feels natural in C++. 
 * 
@@ -23,6 +29,11 @@
 *     }
 * };
 * 
+* Arbitrary callables and futures are supported too:
+* 
+*     CThreadPool::Default().Post([this] { HandleRequest(); });
+*     std::future<int> f = CThreadPool::Default().Submit([] { return 42; });
+* 
 * Kenny Kerr spends most of his time designing and building distributed 
 * applications for the Microsoft Windows platform. He also has a particular 
 * passion for C++ and security programming. Reach Kenny at 
@@ -40,41 +51,514 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 
 class CThreadPool
 {
 public:
 
-    template <typename T>
-    static void QueueUserWorkItem(void (T::*function)(void), 
-        T *object, ULONG flags = WT_EXECUTELONGFUNCTION)
+    // Queuing flags. ExecuteLongFunction has the same value and meaning as
+    // WT_EXECUTELONGFUNCTION: the callback runs for a long time (typically
+    // the main loop of a service), so it gets a dedicated thread instead of
+    // occupying one of the pool workers forever.
+    enum
+    {
+        ExecuteDefault      = 0x00000000,
+        ExecuteLongFunction = 0x00000010
+    };
+
+    // Number of tasks each worker deque can hold before Post runs the task
+    // on the calling thread instead (the pool never blocks the caller).
+    static const size_t QueueCapacity = 1024;
+
+    // Create a pool with cThreads workers. Zero means one worker per
+    // hardware thread.
+    explicit CThreadPool(unsigned int cThreads = 0)
+        : m_fStopping(false), m_cPending(0), m_cSleeping(0), m_iNext(0)
+    {
+        if (cThreads == 0)
+        {
+            cThreads = std::thread::hardware_concurrency();
+            if (cThreads == 0)
+            {
+                cThreads = 1;
+            }
+        }
+
+        m_queues.reserve(cThreads);
+        for (unsigned int i = 0; i < cThreads; i++)
+        {
+            m_queues.push_back(std::unique_ptr<CWorkQueue>(new CWorkQueue));
+        }
+
+        m_threads.reserve(cThreads);
+        for (unsigned int i = 0; i < cThreads; i++)
+        {
+            m_threads.push_back(std::thread(&CThreadPool::WorkerProc, this, i));
+        }
+    }
+
+    // Drain the queued tasks and join the workers.
+    ~CThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fStopping = true;
+        }
+        m_cvWork.notify_all();
+
+        for (size_t i = 0; i < m_threads.size(); i++)
+        {
+            m_threads[i].join();
+        }
+    }
+
+    // The process-wide pool that the services share.
+    static CThreadPool &Default()
     {
-        typedef std::pair<void (T::*)(), T *> CallbackType;
-        std::auto_ptr<CallbackType> p(new CallbackType(function, object));
+        static CThreadPool pool;
+        return pool;
+    }
 
-        if (::QueueUserWorkItem(ThreadProc<T>, p.get(), flags))
+    // Queue a member function of an object. This keeps the signature of the
+    // original Windows thread pool wrapper. By default the function is
+    // treated as a long-running one and gets its own thread.
+    template <typename T>
+    static void QueueUserWorkItem(void (T::*function)(void),
+        T *object, unsigned long flags = ExecuteLongFunction)
+    {
+        if (flags & ExecuteLongFunction)
         {
-            // The ThreadProc now has the responsibility of deleting the pair.
-            p.release();
+            std::thread(function, object).detach();
         }
         else
         {
-            throw GetLastError();
+            Default().Post(CMemberCall<T>(function, object));
         }
     }
 
+    // Queue a callable that takes no arguments and whose result is ignored.
+    // Callables that fit into the task buffer are queued without any heap
+    // allocation. The callable must not throw; use Submit to observe
+    // exceptions.
+    template <typename F>
+    void Post(F function)
+    {
+        CTask task(std::move(function));
+        if (!Enqueue(task))
+        {
+            // Every deque is full. Run the task here rather than block.
+            task();
+        }
+    }
+
+    // Queue a callable and return a future for its result. The future's
+    // shared state is the only allocation made for the call.
+    template <typename F>
+    auto Submit(F function) -> std::future<decltype(function())>
+    {
+        typedef decltype(function()) ResultType;
+
+        std::packaged_task<ResultType()> task(std::move(function));
+        std::future<ResultType> result = task.get_future();
+        Post(std::move(task));
+        return result;
+    }
+
+    // The number of worker threads.
+    unsigned int GetThreadCount() const
+    {
+        return static_cast<unsigned int>(m_threads.size());
+    }
+
+    // The number of tasks queued but not yet started.
+    size_t GetPendingCount() const
+    {
+        return m_cPending.load(std::memory_order_relaxed);
+    }
+
 private:
 
+    CThreadPool(const CThreadPool &);
+    CThreadPool &operator=(const CThreadPool &);
+
+    // Adapts a member function pointer to a callable.
     template <typename T>
-    static DWORD WINAPI ThreadProc(PVOID context)
+    class CMemberCall
     {
-        typedef std::pair<void (T::*)(), T *> CallbackType;
+    public:
+        CMemberCall(void (T::*function)(void), T *object)
+            : m_function(function), m_object(object)
+        {
+        }
 
-        std::auto_ptr<CallbackType> p(static_cast<CallbackType *>(context));
+        void operator()()
+        {
+            (m_object->*m_function)();
+        }
 
-        (p->second->*p->first)();
-        return 0;
+    private:
+        void (T::*m_function)(void);
+        T *m_object;
+    };
+
+    // A move-only, type-erased task with small buffer storage. Callables
+    // larger than the buffer fall back to a single heap allocation.
+    class CTask
+    {
+    public:
+
+        static const size_t BufferSize = 64;
+
+        CTask() : m_pOps(NULL)
+        {
+        }
+
+        template <typename F>
+        explicit CTask(F function)
+        {
+            typedef typename std::decay<F>::type FunctionType;
+            Construct<FunctionType>(std::move(function),
+                std::integral_constant<bool, FitsInline<FunctionType>::value>());
+        }
+
+        CTask(CTask &&other) : m_pOps(NULL)
+        {
+            MoveFrom(other);
+        }
+
+        CTask &operator=(CTask &&other)
+        {
+            if (this != &other)
+            {
+                Reset();
+                MoveFrom(other);
+            }
+            return *this;
+        }
+
+        ~CTask()
+        {
+            Reset();
+        }
+
+        void operator()()
+        {
+            m_pOps->pfnInvoke(&m_buffer);
+        }
+
+        bool IsEmpty() const
+        {
+            return m_pOps == NULL;
+        }
+
+        void Reset()
+        {
+            if (m_pOps)
+            {
+                m_pOps->pfnDestroy(&m_buffer);
+                m_pOps = NULL;
+            }
+        }
+
+    private:
+
+        CTask(const CTask &);
+        CTask &operator=(const CTask &);
+
+        struct TaskOps
+        {
+            void (*pfnInvoke)(void *pBuffer);
+            void (*pfnMove)(void *pDest, void *pSource);
+            void (*pfnDestroy)(void *pBuffer);
+        };
+
+        template <typename F>
+        struct FitsInline
+        {
+            static const bool value = sizeof(F) <= BufferSize &&
+                std::alignment_of<F>::value <=
+                std::alignment_of<std::max_align_t>::value;
+        };
+
+        // The callable lives in the buffer.
+        template <typename F>
+        struct InlineOps
+        {
+            static void Invoke(void *pBuffer)
+            {
+                (*static_cast<F *>(pBuffer))();
+            }
+            static void Move(void *pDest, void *pSource)
+            {
+                new (pDest) F(std::move(*static_cast<F *>(pSource)));
+                static_cast<F *>(pSource)->~F();
+            }
+            static void Destroy(void *pBuffer)
+            {
+                static_cast<F *>(pBuffer)->~F();
+            }
+            static const TaskOps *Get()
+            {
+                static const TaskOps ops = { Invoke, Move, Destroy };
+                return &ops;
+            }
+        };
+
+        // The buffer holds a pointer to a heap copy of the callable.
+        template <typename F>
+        struct HeapOps
+        {
+            static void Invoke(void *pBuffer)
+            {
+                (**static_cast<F **>(pBuffer))();
+            }
+            static void Move(void *pDest, void *pSource)
+            {
+                *static_cast<F **>(pDest) = *static_cast<F **>(pSource);
+            }
+            static void Destroy(void *pBuffer)
+            {
+                delete *static_cast<F **>(pBuffer);
+            }
+            static const TaskOps *Get()
+            {
+                static const TaskOps ops = { Invoke, Move, Destroy };
+                return &ops;
+            }
+        };
+
+        template <typename F>
+        void Construct(F &&function, std::true_type)
+        {
+            new (&m_buffer) F(std::move(function));
+            m_pOps = InlineOps<F>::Get();
+        }
+
+        template <typename F>
+        void Construct(F &&function, std::false_type)
+        {
+            *reinterpret_cast<F **>(&m_buffer) = new F(std::move(function));
+            m_pOps = HeapOps<F>::Get();
+        }
+
+        void MoveFrom(CTask &other)
+        {
+            if (other.m_pOps)
+            {
+                other.m_pOps->pfnMove(&m_buffer, &other.m_buffer);
+                m_pOps = other.m_pOps;
+                other.m_pOps = NULL;
+            }
+        }
+
+        const TaskOps *m_pOps;
+        typename std::aligned_storage<BufferSize,
+            std::alignment_of<std::max_align_t>::value>::type m_buffer;
+    };
+
+    // A bounded double-ended queue of tasks owned by one worker. The owner
+    // pushes and pops at the back; other workers steal from the front. A
+    // short spin lock guards the indices, which are only held for the
+    // duration of a task move.
+    class CWorkQueue
+    {
+    public:
+
+        CWorkQueue() : m_front(0), m_back(0)
+        {
+            m_lock.clear();
+        }
+
+        bool PushBack(CTask &task)
+        {
+            CSpinLock lock(m_lock);
+            if (m_back - m_front == QueueCapacity)
+            {
+                return false;
+            }
+            m_tasks[m_back % QueueCapacity] = std::move(task);
+            m_back++;
+            return true;
+        }
+
+        bool PopBack(CTask &task)
+        {
+            CSpinLock lock(m_lock);
+            if (m_back == m_front)
+            {
+                return false;
+            }
+            m_back--;
+            task = std::move(m_tasks[m_back % QueueCapacity]);
+            return true;
+        }
+
+        bool StealFront(CTask &task)
+        {
+            CSpinLock lock(m_lock);
+            if (m_back == m_front)
+            {
+                return false;
+            }
+            task = std::move(m_tasks[m_front % QueueCapacity]);
+            m_front++;
+            return true;
+        }
+
+    private:
+
+        class CSpinLock
+        {
+        public:
+            explicit CSpinLock(std::atomic_flag &flag) : m_flag(flag)
+            {
+                while (m_flag.test_and_set(std::memory_order_acquire))
+                {
+                    std::this_thread::yield();
+                }
+            }
+            ~CSpinLock()
+            {
+                m_flag.clear(std::memory_order_release);
+            }
+        private:
+            CSpinLock &operator=(const CSpinLock &);
+            std::atomic_flag &m_flag;
+        };
+
+        std::atomic_flag m_lock;
+        size_t m_front;
+        size_t m_back;
+        CTask m_tasks[QueueCapacity];
+    };
+
+    // Identifies the pool and worker that the current thread belongs to.
+    struct WorkerIdentity
+    {
+        const CThreadPool *pPool;
+        int iWorker;
+    };
+
+    static WorkerIdentity &CurrentIdentity()
+    {
+        static thread_local WorkerIdentity identity = { NULL, -1 };
+        return identity;
     }
+
+    // The index of the worker running on the current thread, or -1 when
+    // the current thread does not belong to this pool.
+    int CurrentWorker() const
+    {
+        const WorkerIdentity &identity = CurrentIdentity();
+        return (identity.pPool == this) ? identity.iWorker : -1;
+    }
+
+    bool Enqueue(CTask &task)
+    {
+        size_t cQueues = m_queues.size();
+
+        // A worker queues onto its own deque first; other threads spread
+        // their work round-robin.
+        int iWorker = CurrentWorker();
+        size_t iStart = (iWorker >= 0) ? static_cast<size_t>(iWorker) :
+            m_iNext.fetch_add(1, std::memory_order_relaxed);
+
+        // Count the task before it becomes visible, so that the pending
+        // count never underflows when a worker takes it straight away.
+        // Together with the sequentially consistent check in WorkerProc
+        // this also guarantees a sleeping worker is never missed.
+        m_cPending.fetch_add(1);
+
+        for (size_t i = 0; i < cQueues; i++)
+        {
+            if (m_queues[(iStart + i) % cQueues]->PushBack(task))
+            {
+                if (m_cSleeping.load() > 0)
+                {
+                    std::lock_guard<std::mutex> lock(m_mutex);
+                    m_cvWork.notify_one();
+                }
+                return true;
+            }
+        }
+
+        m_cPending.fetch_sub(1);
+        return false;
+    }
+
+    bool Dequeue(size_t iWorker, CTask &task)
+    {
+        if (m_queues[iWorker]->PopBack(task))
+        {
+            return true;
+        }
+
+        size_t cQueues = m_queues.size();
+        for (size_t i = 1; i < cQueues; i++)
+        {
+            if (m_queues[(iWorker + i) % cQueues]->StealFront(task))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WorkerProc(unsigned int iWorker)
+    {
+        WorkerIdentity &identity = CurrentIdentity();
+        identity.pPool = this;
+        identity.iWorker = static_cast<int>(iWorker);
+
+        CTask task;
+        for (;;)
+        {
+            if (Dequeue(iWorker, task))
+            {
+                m_cPending.fetch_sub(1, std::memory_order_relaxed);
+                task();
+                task.Reset();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cSleeping.fetch_add(1);
+            while (m_cPending.load() == 0 && !m_fStopping)
+            {
+                m_cvWork.wait(lock);
+            }
+            m_cSleeping.fetch_sub(1);
+
+            if (m_fStopping && m_cPending.load() == 0)
+            {
+                break;
+            }
+        }
+
+        identity.pPool = NULL;
+        identity.iWorker = -1;
+    }
+
+    std::vector<std::unique_ptr<CWorkQueue> > m_queues;
+    std::vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cvWork;
+    bool m_fStopping;
+
+    std::atomic<size_t> m_cPending;
+    std::atomic<size_t> m_cSleeping;
+    std::atomic<size_t> m_iNext;
 };
\ No newline at end of file
@@ -0,0 +1,366 @@
+/****************************** Module Header ******************************\
+* Module Name:  TimerWheel.cpp
+* Project:      CppWindowsService
+* Copyright (c) Microsoft Corporation.
+* 
+* Implements the hierarchical timing wheel.
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include "TimerWheel.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#pragma endregion
+
+
+// iSlot of the timers taken out of the wheel to be fired.
+#define TIMER_SLOT_FIRING       UINT32_MAX
+
+
+// Index of the lowest set bit of a non-zero word.
+static inline uint32_t LowestBit(uint64_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return index;
+#else
+    return (uint32_t)__builtin_ctzll(bits);
+#endif
+}
+
+
+// Make an empty circular list, or move the timers of one list to the end
+// of another.
+static inline void InitializeList(TIMER_ENTRY *pHead)
+{
+    pHead->pNext = pHead;
+    pHead->pPrev = pHead;
+}
+
+static inline void AppendList(TIMER_ENTRY *pHead, TIMER_ENTRY *pSource)
+{
+    if (pSource->pNext == pSource)
+    {
+        return;
+    }
+    pSource->pNext->pPrev = pHead->pPrev;
+    pHead->pPrev->pNext = pSource->pNext;
+    pSource->pPrev->pNext = pHead;
+    pHead->pPrev = pSource->pPrev;
+    InitializeList(pSource);
+}
+
+
+CTimerWheel::CTimerWheel(uint64_t now)
+: m_tickLength(IpcTimestampFrequency() * TIMER_WHEEL_RESOLUTION / 1000000),
+  m_current(0),
+  m_cTimers(0)
+{
+    if (m_tickLength == 0)
+    {
+        m_tickLength = 1;
+    }
+    m_current = now / m_tickLength;
+
+    for (uint32_t iLevel = 0; iLevel < TIMER_WHEEL_LEVELS; iLevel++)
+    {
+        for (uint32_t iSlot = 0; iSlot < SlotCount; iSlot++)
+        {
+            InitializeList(&m_slots[iLevel][iSlot]);
+        }
+    }
+    memset(m_occupied, 0, sizeof(m_occupied));
+}
+
+
+void CTimerWheel::Initialize(TIMER_ENTRY *pTimer, PTIMER_CALLBACK pfnCallback,
+                             PVOID pContext)
+{
+    pTimer->pNext = NULL;
+    pTimer->pPrev = NULL;
+    pTimer->Expiry = 0;
+    pTimer->iSlot = 0;
+    pTimer->fPending = false;
+    pTimer->pfnCallback = pfnCallback;
+    pTimer->pContext = pContext;
+}
+
+
+void CTimerWheel::Schedule(TIMER_ENTRY *pTimer, uint64_t deadline)
+{
+    if (pTimer->fPending)
+    {
+        Unlink(pTimer);
+        m_cTimers--;
+    }
+
+    // Round up, so that the timer never fires before its deadline.
+    pTimer->Expiry = (deadline <= UINT64_MAX - m_tickLength) ?
+        (deadline + m_tickLength - 1) / m_tickLength : UINT64_MAX / m_tickLength;
+    pTimer->fPending = true;
+    m_cTimers++;
+    Link(pTimer);
+}
+
+
+bool CTimerWheel::Cancel(TIMER_ENTRY *pTimer)
+{
+    if (!pTimer->fPending)
+    {
+        return false;
+    }
+    Unlink(pTimer);
+    pTimer->fPending = false;
+    m_cTimers--;
+    return true;
+}
+
+
+//
+//   FUNCTION: CTimerWheel::Advance(uint64_t)
+//
+//   PURPOSE: Process the ticks up to now. Runs of empty slots are skipped
+//   with the bitmap of the lowest level, so a loop that slept for a long
+//   time catches up in a few steps. The timers of a slot are taken out of
+//   the wheel before the clock moves on and their callbacks run, so that a
+//   callback that cancels one of them, or schedules a timer one revolution
+//   ahead, does not disturb the slot.
+//
+size_t CTimerWheel::Advance(uint64_t now)
+{
+    uint64_t target = now / m_tickLength;
+    size_t cFired = 0;
+
+    while (m_current <= target)
+    {
+        uint32_t iSlot = (uint32_t)m_current & SlotMask;
+        if (!IsOccupied(0, iSlot))
+        {
+            // Move to the next occupied slot of this revolution, or to the
+            // start of the next one, where the levels above cascade.
+            int iNext = FindOccupied(0, iSlot);
+            uint64_t next = m_current - iSlot +
+                ((iNext >= 0) ? (uint64_t)iNext : SlotCount);
+            if (next > target)
+            {
+                m_current = target + 1;
+                if (((uint32_t)m_current & SlotMask) == 0)
+                {
+                    Cascade(1);
+                }
+                break;
+            }
+            m_current = next;
+            if (iNext < 0)
+            {
+                Cascade(1);
+            }
+            continue;
+        }
+
+        TIMER_ENTRY firing;
+        InitializeList(&firing);
+        AppendList(&firing, &m_slots[0][iSlot]);
+        m_occupied[0][iSlot / 64] &= ~(1ULL << (iSlot % 64));
+        for (TIMER_ENTRY *p = firing.pNext; p != &firing; p = p->pNext)
+        {
+            p->iSlot = TIMER_SLOT_FIRING;
+        }
+
+        m_current++;
+        if (((uint32_t)m_current & SlotMask) == 0)
+        {
+            Cascade(1);
+        }
+
+        while (firing.pNext != &firing)
+        {
+            Fire(firing.pNext);
+            cFired++;
+        }
+    }
+
+    return cFired;
+}
+
+
+size_t CTimerWheel::ExpireAll(void)
+{
+    TIMER_ENTRY firing;
+    InitializeList(&firing);
+
+    for (uint32_t iLevel = 0; iLevel < TIMER_WHEEL_LEVELS; iLevel++)
+    {
+        for (uint32_t iSlot = 0; iSlot < SlotCount; iSlot++)
+        {
+            AppendList(&firing, &m_slots[iLevel][iSlot]);
+        }
+    }
+    memset(m_occupied, 0, sizeof(m_occupied));
+    for (TIMER_ENTRY *p = firing.pNext; p != &firing; p = p->pNext)
+    {
+        p->iSlot = TIMER_SLOT_FIRING;
+    }
+
+    size_t cFired = 0;
+    while (firing.pNext != &firing)
+    {
+        Fire(firing.pNext);
+        cFired++;
+    }
+    return cFired;
+}
+
+
+// The timers of the lowest level beyond the current slot fire within this
+// revolution; anything else fires at the next revolution at the earliest.
+uint64_t CTimerWheel::GetNextExpiry(void) const
+{
+    if (m_cTimers == 0)
+    {
+        return TIMER_WHEEL_NEVER;
+    }
+
+    uint32_t iSlot = (uint32_t)m_current & SlotMask;
+    int iNext = FindOccupied(0, iSlot);
+    uint64_t tick = m_current - iSlot +
+        ((iNext >= 0) ? (uint64_t)iNext : SlotCount);
+    return tick * m_tickLength;
+}
+
+
+//
+//   FUNCTION: CTimerWheel::Link(TIMER_ENTRY *)
+//
+//   PURPOSE: Put a pending timer into the slot of the lowest level that
+//   reaches its expiry. A timer beyond the reach of the wheel waits in the
+//   last slot of the top level and is placed again when it cascades.
+//
+void CTimerWheel::Link(TIMER_ENTRY *pTimer)
+{
+    uint64_t expiry = (pTimer->Expiry < m_current) ? m_current : pTimer->Expiry;
+    uint64_t delta = expiry - m_current;
+
+    uint32_t iLevel = 0;
+    while (iLevel < TIMER_WHEEL_LEVELS - 1 &&
+        delta >= (1ULL << (SlotBits * (iLevel + 1))))
+    {
+        iLevel++;
+    }
+    if (delta >= (1ULL << (SlotBits * TIMER_WHEEL_LEVELS)))
+    {
+        expiry = m_current + (1ULL << (SlotBits * TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    uint32_t iSlot = (uint32_t)(expiry >> (SlotBits * iLevel)) & SlotMask;
+    TIMER_ENTRY *pHead = &m_slots[iLevel][iSlot];
+    pTimer->pNext = pHead;
+    pTimer->pPrev = pHead->pPrev;
+    pHead->pPrev->pNext = pTimer;
+    pHead->pPrev = pTimer;
+    pTimer->iSlot = iLevel * SlotCount + iSlot;
+    m_occupied[iLevel][iSlot / 64] |= 1ULL << (iSlot % 64);
+}
+
+
+void CTimerWheel::Unlink(TIMER_ENTRY *pTimer)
+{
+    pTimer->pPrev->pNext = pTimer->pNext;
+    pTimer->pNext->pPrev = pTimer->pPrev;
+
+    if (pTimer->iSlot != TIMER_SLOT_FIRING)
+    {
+        uint32_t iLevel = pTimer->iSlot / SlotCount;
+        uint32_t iSlot = pTimer->iSlot % SlotCount;
+        TIMER_ENTRY *pHead = &m_slots[iLevel][iSlot];
+        if (pHead->pNext == pHead)
+        {
+            m_occupied[iLevel][iSlot / 64] &= ~(1ULL << (iSlot % 64));
+        }
+    }
+}
+
+
+//
+//   FUNCTION: CTimerWheel::Cascade(uint32_t)
+//
+//   PURPOSE: The clock has just reached the start of a slot of the given
+//   level: move its timers down into the levels below. When that slot is
+//   the first of its level, the level above has reached a slot too.
+//
+void CTimerWheel::Cascade(uint32_t iLevel)
+{
+    if (iLevel >= TIMER_WHEEL_LEVELS)
+    {
+        return;
+    }
+
+    uint32_t iSlot = (uint32_t)(m_current >> (SlotBits * iLevel)) & SlotMask;
+    if (iSlot == 0)
+    {
+        Cascade(iLevel + 1);
+    }
+    if (!IsOccupied(iLevel, iSlot))
+    {
+        return;
+    }
+
+    TIMER_ENTRY moving;
+    InitializeList(&moving);
+    AppendList(&moving, &m_slots[iLevel][iSlot]);
+    m_occupied[iLevel][iSlot / 64] &= ~(1ULL << (iSlot % 64));
+
+    while (moving.pNext != &moving)
+    {
+        TIMER_ENTRY *pTimer = moving.pNext;
+        moving.pNext = pTimer->pNext;
+        pTimer->pNext->pPrev = &moving;
+        Link(pTimer);
+    }
+}
+
+
+bool CTimerWheel::IsOccupied(uint32_t iLevel, uint32_t iSlot) const
+{
+    return (m_occupied[iLevel][iSlot / 64] & (1ULL << (iSlot % 64))) != 0;
+}
+
+
+// The first occupied slot of the level at or after iFirst, without
+// wrapping around; -1 if there is none.
+int CTimerWheel::FindOccupied(uint32_t iLevel, uint32_t iFirst) const
+{
+    uint32_t iWord = iFirst / 64;
+    uint64_t bits = m_occupied[iLevel][iWord] & (~0ULL << (iFirst % 64));
+    for (;;)
+    {
+        if (bits)
+        {
+            return (int)(iWord * 64 + LowestBit(bits));
+        }
+        if (++iWord == SlotCount / 64)
+        {
+            return -1;
+        }
+        bits = m_occupied[iLevel][iWord];
+    }
+}
+
+
+void CTimerWheel::Fire(TIMER_ENTRY *pTimer)
+{
+    Unlink(pTimer);
+    pTimer->fPending = false;
+    m_cTimers--;
+    pTimer->pfnCallback(pTimer, pTimer->pContext);
+}
@@ -0,0 +1,258 @@
+/****************************** Module Header ******************************\
+* Module Name:  IpcStat.cpp
+* Project:      IpcStat
+* Copyright (c) Microsoft Corporation.
+* 
+* ipcstat samples the statistics section published by the server service
+* (or, with -client, by the client service) and prints the message and
+* byte rates, queue depths, flow-control credits, backpressure events,
+* drops and latency percentiles, one line per interval. The section is
+* mapped read-only: sampling never sends a message to the service and adds
+* no load to it, whatever the interval.
+* 
+*     ipcstat [-client] [-sessions] [interval_ms [count]]
+* 
+* This source is subject to the Microsoft Public License.
+* See http://www.microsoft.com/en-us/openness/resources/licenses.aspx#MPL.
+* All other rights reserved.
+* 
+* THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+* EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+* WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+\***************************************************************************/
+
+#pragma region Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "IpcStats.h"
+#pragma endregion
+
+
+// Default sampling interval, in milliseconds.
+#define DEFAULT_INTERVAL    1000
+
+// Number of samples between two repetitions of the column headings.
+#define HEADING_INTERVAL    20
+
+
+//
+//   FUNCTION: Delta(uint64_t, uint64_t)
+//
+//   PURPOSE: Difference between two samples of a counter. The counters are
+//   not read as one snapshot, so a session that closes between two reads
+//   can make a total appear to go back for one sample; report 0 then.
+//
+static uint64_t Delta(uint64_t current, uint64_t previous)
+{
+    return (current > previous) ? current - previous : 0;
+}
+
+
+//
+//   FUNCTION: Percentile(const uint64_t *, const uint64_t *, double)
+//
+//   PURPOSE: Upper bound, in microseconds, of the histogram bucket that
+//   holds the given percentile of the latencies recorded between two
+//   samples. Returns 0 when nothing was recorded.
+//
+static uint64_t Percentile(const uint64_t *current, const uint64_t *previous,
+                           double fraction)
+{
+    uint64_t cTotal = 0;
+    for (unsigned int i = 0; i < IPC_LATENCY_BUCKETS; i++)
+    {
+        cTotal += Delta(current[i], previous[i]);
+    }
+    if (cTotal == 0)
+    {
+        return 0;
+    }
+
+    uint64_t cRank = (uint64_t)(fraction * cTotal);
+    uint64_t cSeen = 0;
+    for (unsigned int i = 0; i < IPC_LATENCY_BUCKETS; i++)
+    {
+        cSeen += Delta(current[i], previous[i]);
+        if (cSeen > cRank)
+        {
+            return IpcLatencyBucketLimit(i);
+        }
+    }
+    return IpcLatencyBucketLimit(IPC_LATENCY_BUCKETS - 1);
+}
+
+
+static void PrintHeadings(void)
+{
+    wprintf(L"%8s %10s %10s %10s %10s %7s %7s %7s %8s %8s %8s %8s\n",
+        L"sessions", L"msg/s in", L"msg/s out", L"KB/s in", L"KB/s out",
+        L"in-q", L"out-q", L"credits", L"bp/s", L"drops", L"p50(us)",
+        L"p99(us)");
+}
+
+
+static void PrintSessions(const IPC_STATS_HEADER *pStats)
+{
+    for (uint32_t i = 0; i < pStats->cSessions; i++)
+    {
+        const IPC_SESSION_STATS *pSession = IpcGetSessionStats(pStats, i);
+        if (!pSession->fActive.load(std::memory_order_relaxed))
+        {
+            continue;
+        }
+
+        const IPC_STATS_COUNTERS &counters = pSession->Counters;
+        wprintf(L"  session %3u pid %6u in %10llu out %10llu "
+            L"in-q %4llu out-q %4llu credits %4llu bp %llu drops %llu\n",
+            i, pSession->ClientPid.load(std::memory_order_relaxed),
+            (unsigned long long)counters.cMessagesIn.load(std::memory_order_relaxed),
+            (unsigned long long)counters.cMessagesOut.load(std::memory_order_relaxed),
+            (unsigned long long)counters.InDepth.load(std::memory_order_relaxed),
+            (unsigned long long)counters.OutDepth.load(std::memory_order_relaxed),
+            (unsigned long long)counters.Credits.load(std::memory_order_relaxed),
+            (unsigned long long)counters.cBackpressure.load(std::memory_order_relaxed),
+            (unsigned long long)counters.cDropped.load(std::memory_order_relaxed));
+    }
+}
+
+
+//
+//  FUNCTION: wmain(int, wchar_t *[])
+//
+//  PURPOSE: entrypoint for the application.
+//
+//  PARAMETERS:
+//    argc - number of command line arguments
+//    argv - array of command line arguments
+//
+//  RETURN VALUE:
+//    0 on success, 1 if the statistics section cannot be opened.
+//
+int wmain(int argc, wchar_t *argv[])
+{
+    PCWSTR pszName = IPC_STATS_NAME;
+    BOOL fSessions = FALSE;
+    DWORD dwInterval = DEFAULT_INTERVAL;
+    unsigned long cSamples = 0;     // 0 = until interrupted
+    int iPositional = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (*argv[i] == L'-' || *argv[i] == L'/')
+        {
+            if (_wcsicmp(L"client", argv[i] + 1) == 0)
+            {
+                pszName = IPC_CLIENT_STATS_NAME;
+            }
+            else if (_wcsicmp(L"sessions", argv[i] + 1) == 0)
+            {
+                fSessions = TRUE;
+            }
+            else
+            {
+                wprintf(L"Usage: ipcstat [-client] [-sessions] "
+                    L"[interval_ms [count]]\n");
+                return 1;
+            }
+        }
+        else if (iPositional++ == 0)
+        {
+            dwInterval = wcstoul(argv[i], NULL, 10);
+            if (dwInterval == 0)
+            {
+                dwInterval = DEFAULT_INTERVAL;
+            }
+        }
+        else
+        {
+            cSamples = wcstoul(argv[i], NULL, 10);
+        }
+    }
+
+    HANDLE hMapFile = OpenFileMapping(FILE_MAP_READ, FALSE, pszName);
+    if (hMapFile == NULL)
+    {
+        wprintf(L"OpenFileMapping(%s) failed w/err 0x%08lx\n", pszName,
+            GetLastError());
+        return 1;
+    }
+
+    // Map the whole section read-only.
+    PVOID pView = MapViewOfFile(hMapFile, FILE_MAP_READ, 0, 0, 0);
+    if (pView == NULL)
+    {
+        wprintf(L"MapViewOfFile failed w/err 0x%08lx\n", GetLastError());
+        CloseHandle(hMapFile);
+        return 1;
+    }
+
+    MEMORY_BASIC_INFORMATION info;
+    SIZE_T cbView = 0;
+    if (VirtualQuery(pView, &info, sizeof(info)) != 0)
+    {
+        cbView = info.RegionSize;
+    }
+    if (!IpcValidateStats(pView, cbView))
+    {
+        wprintf(L"%s is not a statistics section of a known version\n",
+            pszName);
+        UnmapViewOfFile(pView);
+        CloseHandle(hMapFile);
+        return 1;
+    }
+
+    const IPC_STATS_HEADER *pStats = (const IPC_STATS_HEADER *)pView;
+    wprintf(L"%s: process %u, %u session slots\n", pszName,
+        pStats->ProcessId, pStats->cSessions);
+
+    IPC_STATS_SNAPSHOT previous, current;
+    IpcSnapshotStats(pStats, &previous);
+    ULONGLONG ullPrevious = GetTickCount64();
+
+    for (unsigned long iSample = 0; cSamples == 0 || iSample < cSamples;
+        iSample++)
+    {
+        ::Sleep(dwInterval);
+
+        IpcSnapshotStats(pStats, &current);
+        ULONGLONG ullNow = GetTickCount64();
+        double seconds = (ullNow - ullPrevious) / 1000.0;
+        if (seconds <= 0)
+        {
+            seconds = dwInterval / 1000.0;
+        }
+
+        if (iSample % HEADING_INTERVAL == 0 || fSessions)
+        {
+            PrintHeadings();
+        }
+
+        wprintf(L"%8u %10.0f %10.0f %10.1f %10.1f %7llu %7llu %7llu %8.0f "
+            L"%8llu %8llu %8llu\n",
+            current.cActiveSessions,
+            Delta(current.cMessagesIn, previous.cMessagesIn) / seconds,
+            Delta(current.cMessagesOut, previous.cMessagesOut) / seconds,
+            Delta(current.cBytesIn, previous.cBytesIn) / seconds / 1024,
+            Delta(current.cBytesOut, previous.cBytesOut) / seconds / 1024,
+            (unsigned long long)current.InDepth,
+            (unsigned long long)current.OutDepth,
+            (unsigned long long)current.Credits,
+            Delta(current.cBackpressure, previous.cBackpressure) / seconds,
+            (unsigned long long)Delta(current.cDropped, previous.cDropped),
+            (unsigned long long)Percentile(current.Latency, previous.Latency, 0.50),
+            (unsigned long long)Percentile(current.Latency, previous.Latency, 0.99));
+
+        if (fSessions)
+        {
+            PrintSessions(pStats);
+        }
+
+        previous = current;
+        ullPrevious = ullNow;
+    }
+
+    UnmapViewOfFile(pView);
+    CloseHandle(hMapFile);
+    return 0;
+}
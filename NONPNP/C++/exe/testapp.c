@@ -20,6 +20,12 @@ Abstract:
     directory, and reads the same file and matches the content.
     If -l option is specified, it does the write and read operation in a loop
     until the app is terminated by pressing ^C.
+    If -o option is specified, it writes blocks at different offsets of the
+    file, reads them back in another order and matches each of them, to
+    check that the driver honours the byte offset of every request.
+    If -t option is specified, it measures the read & write throughput of
+    one thread and then of the given number of threads, each with its own
+    handle and file, to check that the driver serves handles in parallel.
 
     Make sure you have the \SystemRoot\Temp directory exists before you run the test.
 
@@ -73,6 +79,16 @@ DoFileReadWrite(
     HANDLE HDevice
     );
 
+BOOLEAN
+DoOffsetReadWrite(
+    HANDLE HDevice
+    );
+
+BOOLEAN
+DoThreadedReadWrite(
+    ULONG ThreadCount
+    );
+
 VOID
 DoIoctls(
     HANDLE hDevice
@@ -82,8 +98,24 @@ DoIoctls(
 //
 #define MAX_VERSION_SIZE 6
 
+//
+// Blocks written by DoOffsetReadWrite, and the size of each of them.
+//
+#define OFFSET_TEST_BLOCKS      16
+#define OFFSET_TEST_BLOCK_SIZE  4096
+
+//
+// Most threads DoThreadedReadWrite runs, and the write & read pairs each
+// thread issues. WaitForMultipleObjects waits for at most
+// MAXIMUM_WAIT_OBJECTS threads.
+//
+#define THREAD_TEST_MAX_THREADS MAXIMUM_WAIT_OBJECTS
+#define THREAD_TEST_REQUESTS    2048
+
 CHAR G_coInstallerVersion[MAX_VERSION_SIZE] = {0};
 BOOLEAN  G_fLoop = FALSE;
+BOOLEAN  G_fVerifyOffsets = FALSE;
+ULONG    G_threadCount = 0;
 BOOL G_versionSpecified = FALSE;
 
 
@@ -96,11 +128,13 @@ __pragma(warning(disable: 4127)) while(constant); __pragma(warning(default: 4127
 
 
 #define USAGE  \
-"Usage: nonpnpapp <-V version> <-l> \n" \
+"Usage: nonpnpapp <-V version> <-l> <-o> <-t threads> \n" \
        " -V version  {if no version is specified the version specified in the build environment will be used.}\n" \
        "    The version is the version of the KMDF coinstaller to use \n"  \
        "    The format of version  is MMmmm where MM -- major #, mmm - serial# \n" \
-       " -l  { option to continuously read & write to the file} \n"
+       " -l  { option to continuously read & write to the file} \n" \
+       " -o  { option to verify reads & writes at different offsets of the file} \n" \
+       " -t threads  { option to measure the throughput of that many threads, each with its own handle} \n"
 
 BOOL
 ValidateCoinstallerVersion(
@@ -181,6 +215,23 @@ Return Value:
             case 'L':
                 G_fLoop = TRUE;
                 break;
+            case 'o':
+            case 'O':
+                G_fVerifyOffsets = TRUE;
+                break;
+            case 't':
+            case 'T':
+                if (i+1 < argc) {
+                    i++;
+                    G_threadCount = strtoul(argv[i], NULL, 10);
+                }
+                if (G_threadCount == 0 ||
+                    G_threadCount > THREAD_TEST_MAX_THREADS) {
+                    printf("The number of threads must be between 1 and %d\n",
+                           THREAD_TEST_MAX_THREADS);
+                    error = ERROR_INVALID_PARAMETER;
+                }
+                break;
             default:
                 printf(USAGE);
                 error = ERROR_INVALID_PARAMETER;
@@ -233,6 +284,8 @@ main(
     //
     // Parse command line args
     //   -l     -- loop option
+    //   -o     -- offset verify option
+    //   -t     -- multi-threaded throughput option
     //
     if ( argc > 1 ) {// give usage if invoked with no parms
         error = Parse(argc, argv);
@@ -343,6 +396,18 @@ main(
 		}
 		printf("Read from kernel driver: %s\n", pKSObj);
 #endif
+    if (G_fVerifyOffsets) {
+        if (DoOffsetReadWrite(hDevice)) {
+            printf("Offset read & write test passed\n");
+        } else {
+            printf("Offset read & write test failed\n");
+        }
+    }
+    if (G_threadCount) {
+        if (!DoThreadedReadWrite(G_threadCount)) {
+            printf("Multi-threaded read & write test failed\n");
+        }
+    }
 		printf("input 'q' to unload the kernel driver & terminate process\r\n");
 //  DoIoctls(hDevice);
     do {
@@ -553,6 +618,7 @@ DoFileReadWrite(
     PUCHAR writeBuf = NULL;
     BOOLEAN ret;
     ULONG   bytesWritten, bytesRead;
+    OVERLAPPED overlapped;
 
     //
     // Seed the random-number generator with current time so that
@@ -593,14 +659,17 @@ DoFileReadWrite(
 
     //
     // Tell the driver to write the buffer content to the file from the
-    // begining of the file.
+    // begining of the file. The driver uses the offset of the request, and
+    // without an OVERLAPPED structure that would be the current position of
+    // the handle, which every read and write moves forward.
     //
+    ZeroMemory(&overlapped, sizeof(overlapped));
 
     if (!WriteFile(HDevice,
                   writeBuf,
                   bufLength,
                   &bytesWritten,
-                  NULL)) {
+                  &overlapped)) {
 
         printf("ReadFile failed with error 0x%x\n", GetLastError());
 
@@ -624,11 +693,13 @@ DoFileReadWrite(
     //
     // Tell the driver to read the file from the begining.
     //
+    ZeroMemory(&overlapped, sizeof(overlapped));
+
     if (!ReadFile(HDevice,
                   readBuf,
                   bufLength,
                   &bytesRead,
-                  NULL)) {
+                  &overlapped)) {
 
         printf("Error: ReadFile failed with error 0x%x\n", GetLastError());
 
@@ -670,4 +741,419 @@ End:
 
 }
 
+BOOLEAN
+DoOffsetReadWrite(
+    HANDLE HDevice
+    )
+/*++
+Routine Description:
+
+    Writes OFFSET_TEST_BLOCKS blocks, each filled with its own pattern, at
+    the offsets of the file they belong to, in a shuffled order. Then reads
+    every block back at its offset in another order, and reads the whole
+    range in one request, and matches what was read against the patterns.
+    A driver that ignores the offset of the request puts every block at the
+    beginning of the file and fails the test.
+
+    The handle is not opened for overlapped I/O, so every call still
+    completes before it returns; the OVERLAPPED structure only carries the
+    offset.
+
+Arguments:
+
+    HDevice - handle of the device opened by main()
+
+Return Value:
+
+    TRUE if every block read matches the one written at its offset
+
+--*/
+{
+    ULONG order[OFFSET_TEST_BLOCKS];
+    ULONG index, block, swap;
+    ULONG bufLength = OFFSET_TEST_BLOCKS * OFFSET_TEST_BLOCK_SIZE;
+    PUCHAR readBuf = NULL;
+    PUCHAR writeBuf = NULL;
+    BOOLEAN ret;
+    ULONG   bytesWritten, bytesRead;
+    OVERLAPPED overlapped;
+
+    srand( (unsigned)time( NULL ) );
+
+    writeBuf = HeapAlloc(GetProcessHeap(), 0, bufLength);
+    readBuf = HeapAlloc(GetProcessHeap(), 0, bufLength);
+    if(!writeBuf || !readBuf) {
+        ret = FALSE;
+        goto End;
+    }
+
+    //
+    // Fill each block with random bytes, and start it with its number so
+    // that a block read at the wrong offset shows which one it was.
+    //
+    for (index = 0; index < bufLength; index++) {
+        writeBuf[index] = (UCHAR) rand() % UCHAR_MAX;
+    }
+    for (block = 0; block < OFFSET_TEST_BLOCKS; block++) {
+        writeBuf[block * OFFSET_TEST_BLOCK_SIZE] = (UCHAR) block;
+        order[block] = block;
+    }
+
+    //
+    // Write the blocks in a shuffled order.
+    //
+    for (index = OFFSET_TEST_BLOCKS - 1; index > 0; index--) {
+        block = rand() % (index + 1);
+        swap = order[index];
+        order[index] = order[block];
+        order[block] = swap;
+    }
+
+    printf("Write %d blocks of %d bytes at their offsets\n",
+           OFFSET_TEST_BLOCKS, OFFSET_TEST_BLOCK_SIZE);
+
+    for (index = 0; index < OFFSET_TEST_BLOCKS; index++) {
+        block = order[index];
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.Offset = block * OFFSET_TEST_BLOCK_SIZE;
+
+        if (!WriteFile(HDevice,
+                       writeBuf + block * OFFSET_TEST_BLOCK_SIZE,
+                       OFFSET_TEST_BLOCK_SIZE,
+                       &bytesWritten,
+                       &overlapped) ||
+            bytesWritten != OFFSET_TEST_BLOCK_SIZE) {
+
+            printf("Error: WriteFile of block %d failed with error 0x%x\n",
+                   block, GetLastError());
+            ret = FALSE;
+            goto End;
+        }
+    }
+
+    //
+    // Read them back in the reverse order, each at its own offset.
+    //
+    printf("Read them back in reverse order\n");
+
+    for (index = OFFSET_TEST_BLOCKS; index > 0; index--) {
+        block = order[index - 1];
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.Offset = block * OFFSET_TEST_BLOCK_SIZE;
+        ZeroMemory(readBuf, OFFSET_TEST_BLOCK_SIZE);
+
+        if (!ReadFile(HDevice,
+                      readBuf,
+                      OFFSET_TEST_BLOCK_SIZE,
+                      &bytesRead,
+                      &overlapped)) {
+
+            printf("Error: ReadFile of block %d failed with error 0x%x\n",
+                   block, GetLastError());
+            ret = FALSE;
+            goto End;
+        }
+
+        if (bytesRead != OFFSET_TEST_BLOCK_SIZE ||
+            memcmp(readBuf,
+                   writeBuf + block * OFFSET_TEST_BLOCK_SIZE,
+                   OFFSET_TEST_BLOCK_SIZE) != 0) {
+
+            printf("Error: block %d read %d bytes, starting with block %d\n",
+                   block, bytesRead, readBuf[0]);
+            ret = FALSE;
+            goto End;
+        }
+    }
+
+    //
+    // Finally read the whole range at once; the blocks must follow each
+    // other in the file in the order of their offsets.
+    //
+    printf("Read %d bytes from the beginning of the file\n", bufLength);
+
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    ZeroMemory(readBuf, bufLength);
+
+    if (!ReadFile(HDevice,
+                  readBuf,
+                  bufLength,
+                  &bytesRead,
+                  &overlapped)) {
+
+        printf("Error: ReadFile failed with error 0x%x\n", GetLastError());
+        ret = FALSE;
+        goto End;
+    }
+
+    if (bytesRead != bufLength || memcmp(readBuf, writeBuf, bufLength) != 0) {
+        printf("Error: ReadBuf and WriteBuf contents are not the same\n");
+        ret = FALSE;
+        goto End;
+    }
+
+    ret = TRUE;
+
+End:
+
+    if(readBuf){
+        HeapFree (GetProcessHeap(), 0, readBuf);
+    }
+
+    if(writeBuf){
+        HeapFree (GetProcessHeap(), 0, writeBuf);
+    }
+
+    return ret;
+}
+
+//
+// State of one thread of DoThreadedReadWrite.
+//
+typedef struct _THREAD_TEST_CONTEXT {
+
+    HANDLE  Device;         // Opened on a file of its own
+    HANDLE  StartEvent;     // Set when all the threads may begin
+    ULONG   Index;
+    BOOLEAN Ok;
+    UCHAR   WriteBuf[OFFSET_TEST_BLOCK_SIZE];
+    UCHAR   ReadBuf[OFFSET_TEST_BLOCK_SIZE];
+
+} THREAD_TEST_CONTEXT, *PTHREAD_TEST_CONTEXT;
+
+
+DWORD WINAPI
+ThreadedReadWriteThread(
+    LPVOID Parameter
+    )
+/*++
+Routine Description:
+
+    Issues THREAD_TEST_REQUESTS writes of a block, each followed by a read
+    of the same block, cycling through OFFSET_TEST_BLOCKS offsets of the
+    file of the thread, and matches every block read.
+
+--*/
+{
+    PTHREAD_TEST_CONTEXT context = (PTHREAD_TEST_CONTEXT) Parameter;
+    OVERLAPPED overlapped;
+    ULONG   request, bytesWritten, bytesRead;
+
+    WaitForSingleObject(context->StartEvent, INFINITE);
+
+    for (request = 0; request < THREAD_TEST_REQUESTS; request++) {
+
+        //
+        // Stamp the block so that a read of another thread's block, or of
+        // an older one, does not match.
+        //
+        context->WriteBuf[0] = (UCHAR) context->Index;
+        CopyMemory(&context->WriteBuf[1], &request, sizeof(request));
+
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.Offset = (request % OFFSET_TEST_BLOCKS) * OFFSET_TEST_BLOCK_SIZE;
+
+        if (!WriteFile(context->Device,
+                       context->WriteBuf,
+                       OFFSET_TEST_BLOCK_SIZE,
+                       &bytesWritten,
+                       &overlapped)) {
+
+            printf("Error: thread %d WriteFile failed with error 0x%x\n",
+                   context->Index, GetLastError());
+            context->Ok = FALSE;
+            return 0;
+        }
+
+        if (!ReadFile(context->Device,
+                      context->ReadBuf,
+                      OFFSET_TEST_BLOCK_SIZE,
+                      &bytesRead,
+                      &overlapped)) {
+
+            printf("Error: thread %d ReadFile failed with error 0x%x\n",
+                   context->Index, GetLastError());
+            context->Ok = FALSE;
+            return 0;
+        }
+
+        if (bytesRead != bytesWritten ||
+            memcmp(context->ReadBuf, context->WriteBuf, bytesRead) != 0) {
+
+            printf("Error: thread %d read back another block\n",
+                   context->Index);
+            context->Ok = FALSE;
+            return 0;
+        }
+    }
+
+    context->Ok = TRUE;
+    return 0;
+}
+
+
+BOOLEAN
+RunThreadedReadWrite(
+    ULONG ThreadCount,
+    double *MegabytesPerSecond
+    )
+/*++
+Routine Description:
+
+    Opens a handle per thread, each on a file of its own, starts
+    ThreadCount threads at once and times them until the last one is done.
+
+Arguments:
+
+    ThreadCount - threads to run, at most THREAD_TEST_MAX_THREADS
+
+    MegabytesPerSecond - receives the bytes written and read by all the
+                         threads per second
+
+Return Value:
+
+    TRUE if every thread matched every block it read
+
+--*/
+{
+    PTHREAD_TEST_CONTEXT contexts = NULL;
+    HANDLE  threads[THREAD_TEST_MAX_THREADS];
+    HANDLE  startEvent = NULL;
+    CHAR    deviceName[MAX_PATH];
+    LARGE_INTEGER frequency, start, end;
+    ULONG   index, started = 0;
+    BOOLEAN ret = FALSE;
+
+    contexts = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+                         ThreadCount * sizeof(THREAD_TEST_CONTEXT));
+    startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!contexts || !startEvent) {
+        goto End;
+    }
+
+    for (index = 0; index < ThreadCount; index++) {
+        contexts[index].Device = INVALID_HANDLE_VALUE;
+    }
+
+    for (index = 0; index < ThreadCount; index++) {
+
+        if (FAILED( StringCchPrintf(deviceName, MAX_PATH,
+                                    DEVICE_NAME_FORMAT, index) )) {
+            goto End;
+        }
+
+        contexts[index].Device = CreateFile(deviceName,
+                                            GENERIC_READ | GENERIC_WRITE,
+                                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                            NULL,
+                                            CREATE_ALWAYS,
+                                            FILE_ATTRIBUTE_NORMAL,
+                                            NULL);
+        if (contexts[index].Device == INVALID_HANDLE_VALUE) {
+            printf("Error: CreateFile of %s failed with error 0x%x\n",
+                   deviceName, GetLastError());
+            goto End;
+        }
+
+        contexts[index].StartEvent = startEvent;
+        contexts[index].Index = index;
+        memset(contexts[index].WriteBuf, (UCHAR) index, OFFSET_TEST_BLOCK_SIZE);
+    }
+
+    for (started = 0; started < ThreadCount; started++) {
+        threads[started] = CreateThread(NULL, 0, ThreadedReadWriteThread,
+                                        &contexts[started], 0, NULL);
+        if (threads[started] == NULL) {
+            printf("Error: CreateThread failed with error 0x%x\n",
+                   GetLastError());
+            break;
+        }
+    }
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    SetEvent(startEvent);
+
+    if (started != 0) {
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    }
+
+    QueryPerformanceCounter(&end);
+
+    for (index = 0; index < started; index++) {
+        CloseHandle(threads[index]);
+    }
+    if (started != ThreadCount) {
+        goto End;
+    }
+
+    ret = TRUE;
+    for (index = 0; index < ThreadCount; index++) {
+        if (!contexts[index].Ok) {
+            ret = FALSE;
+        }
+    }
+
+    *MegabytesPerSecond =
+        (double) ThreadCount * THREAD_TEST_REQUESTS * 2 * OFFSET_TEST_BLOCK_SIZE /
+        (1024.0 * 1024.0) /
+        ((double) (end.QuadPart - start.QuadPart) / frequency.QuadPart);
+
+End:
+
+    if (contexts) {
+        for (index = 0; index < ThreadCount; index++) {
+            if (contexts[index].Device != INVALID_HANDLE_VALUE) {
+                CloseHandle(contexts[index].Device);
+            }
+        }
+        HeapFree(GetProcessHeap(), 0, contexts);
+    }
+
+    if (startEvent) {
+        CloseHandle(startEvent);
+    }
+
+    return ret;
+}
+
+
+BOOLEAN
+DoThreadedReadWrite(
+    ULONG ThreadCount
+    )
+/*++
+Routine Description:
+
+    Measures the throughput of one thread, and then of ThreadCount
+    threads, each writing and reading its own file through its own handle.
+    The driver keeps the file of every handle in the file object context
+    and dispatches requests in parallel, so the throughput should grow
+    with the threads until the disk or the processors are busy.
+
+--*/
+{
+    double single = 0, multiple = 0;
+
+    printf("Write & read %d blocks of %d bytes with 1 thread\n",
+           THREAD_TEST_REQUESTS, OFFSET_TEST_BLOCK_SIZE);
+
+    if (!RunThreadedReadWrite(1, &single)) {
+        return FALSE;
+    }
+
+    printf("Write & read %d blocks of %d bytes with each of %d threads\n",
+           THREAD_TEST_REQUESTS, OFFSET_TEST_BLOCK_SIZE, ThreadCount);
+
+    if (!RunThreadedReadWrite(ThreadCount, &multiple)) {
+        return FALSE;
+    }
+
+    printf("1 thread: %.1f MB/s, %d threads: %.1f MB/s (%.2fx)\n",
+           single, ThreadCount, multiple,
+           single > 0 ? multiple / single : 0);
+
+    return TRUE;
+}
+
 
@@ -209,10 +209,11 @@ Return Value:
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT,
                    "NonPnpDeviceAdd DeviceInit %p\n", DeviceInit);
     //
-    // Set exclusive to TRUE so that no more than one app can talk to the
-    // control device at any time.
+    // Set exclusive to FALSE so that any number of apps can talk to the
+    // control device at the same time. Each handle has its own file and
+    // counters in its FILE_CONTEXT, so the handles do not share any state.
     //
-    WdfDeviceInitSetExclusive(DeviceInit, TRUE);
+    WdfDeviceInitSetExclusive(DeviceInit, FALSE);
 
     WdfDeviceInitSetIoType(DeviceInit, WdfDeviceIoBuffered);
 
@@ -246,9 +247,14 @@ Return Value:
                         WDF_NO_EVENT_CALLBACK // not interested in Cleanup
                         );
 
+    //
+    // Specify the size of the per handle context.
+    //
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, FILE_CONTEXT);
+
     WdfDeviceInitSetFileObjectConfig(DeviceInit,
                                        &fileConfig,
-                                       WDF_NO_OBJECT_ATTRIBUTES);
+                                       &attributes);
 
     //
     // In order to support METHOD_NEITHER Device controls, or
@@ -293,10 +299,12 @@ Return Value:
     //
     // Configure a default queue so that requests that are not
     // configure-fowarded using WdfDeviceConfigureRequestDispatching to goto
-    // other queues get dispatched here.
+    // other queues get dispatched here. The queue is parallel: a request
+    // does not wait for the ones before it to complete, so the requests
+    // of different handles, which use different files, run side by side.
     //
     WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&ioQueueConfig,
-                                    WdfIoQueueDispatchSequential);
+                                    WdfIoQueueDispatchParallel);
 
     ioQueueConfig.EvtIoRead = FileEvtIoRead;
     ioQueueConfig.EvtIoWrite = FileEvtIoWrite;
@@ -430,15 +438,16 @@ Return Value:
     OBJECT_ATTRIBUTES           fileAttributes;
     IO_STATUS_BLOCK             ioStatus;
     PCONTROL_DEVICE_EXTENSION   devExt;
+    PFILE_CONTEXT               fileCtx;
     NTSTATUS                    status;
     USHORT                      length = 0;
+    LONG                        openHandles;
 
 
-    UNREFERENCED_PARAMETER( FileObject );
-
     PAGED_CODE ();
 
     devExt = ControlGetData(Device);
+    fileCtx = FileGetContext(FileObject);
 
     //
     // Assume the directory is a temp directory under %windir%
@@ -493,14 +502,18 @@ Return Value:
                                 NULL // SecurityDescriptor
                                 );
 
+    //
+    // Share the file for writing too, so that two handles opened with the
+    // same name can both use it.
+    //
     status = ZwCreateFile (
-                    &devExt->FileHandle,
+                    &fileCtx->FileHandle,
                     SYNCHRONIZE | GENERIC_WRITE | GENERIC_READ,
                     &fileAttributes,
                     &ioStatus,
                     NULL,// alloc size = none
                     FILE_ATTRIBUTE_NORMAL,
-                    FILE_SHARE_READ,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE,
                     FILE_OPEN_IF,
                     FILE_SYNCHRONOUS_IO_NONALERT |FILE_NON_DIRECTORY_FILE,
                     NULL,// eabuffer
@@ -511,7 +524,12 @@ Return Value:
 
         TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
                        "ZwCreateFile failed with status %!STATUS!", status);
-        devExt->FileHandle = NULL;
+        fileCtx->FileHandle = NULL;
+    } else {
+        openHandles = InterlockedIncrement(&devExt->OpenHandles);
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT,
+                       "Opened File Handle %p, %d handles open",
+                       fileCtx->FileHandle, openHandles);
     }
 
 End:
@@ -552,6 +570,8 @@ Return Value:
 --*/
 {
     PCONTROL_DEVICE_EXTENSION devExt;
+    PFILE_CONTEXT fileCtx;
+    LONG openHandles;
 
     PAGED_CODE ();
 
@@ -559,11 +579,20 @@ Return Value:
     TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "NonPnpEvtFileClose\n");
 
     devExt = ControlGetData(WdfFileObjectGetDevice(FileObject));
+    fileCtx = FileGetContext(FileObject);
 
-    if(devExt->FileHandle) {
+    if(fileCtx->FileHandle) {
         TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT,
-                       "Closing File Handle %p", devExt->FileHandle);
-        ZwClose(devExt->FileHandle);
+                       "Closing File Handle %p: %I64d reads (%I64d bytes), "
+                       "%I64d writes (%I64d bytes)",
+                       fileCtx->FileHandle,
+                       fileCtx->ReadRequests, fileCtx->BytesRead,
+                       fileCtx->WriteRequests, fileCtx->BytesWritten);
+        ZwClose(fileCtx->FileHandle);
+        fileCtx->FileHandle = NULL;
+        openHandles = InterlockedDecrement(&devExt->OpenHandles);
+        TraceEvents(TRACE_LEVEL_VERBOSE, DBG_INIT, "%d handles open",
+                       openHandles);
     }
 
     return;
@@ -581,7 +610,8 @@ FileEvtIoRead(
 Routine Description:
 
     This event is called when the framework receives IRP_MJ_READ requests.
-    We will just read the file.
+    We read the file at the byte offset of the request, so that requests
+    for different parts of the file need no seek in between.
 
 Arguments:
 
@@ -601,8 +631,9 @@ Return Value:
     NTSTATUS                   status = STATUS_SUCCESS;
     PVOID                       outBuf;
     IO_STATUS_BLOCK             ioStatus;
-    PCONTROL_DEVICE_EXTENSION   devExt;
-    FILE_POSITION_INFORMATION   position;
+    PFILE_CONTEXT               fileCtx;
+    WDF_REQUEST_PARAMETERS      params;
+    LARGE_INTEGER               byteOffset;
     ULONG_PTR                   bytesRead = 0;
     size_t  bufLength;
 
@@ -622,41 +653,52 @@ Return Value:
 
     }
 
-    devExt = ControlGetData(WdfIoQueueGetDevice(Queue));
+    //
+    // The I/O manager fills in the offset of the request: the one the
+    // application passed in its OVERLAPPED structure, or else the current
+    // position of its handle. Pass it straight to ZwReadFile instead of
+    // moving the position of our own handle first, which cost a second
+    // system call per request.
+    //
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+    byteOffset.QuadPart = params.Parameters.Read.DeviceOffset;
+    if (byteOffset.QuadPart < 0) {
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
+
+    fileCtx = FileGetContext(WdfRequestGetFileObject(Request));
 
-    if(devExt->FileHandle) {
+    if(fileCtx->FileHandle) {
 
-        //
-        // Set the file position to the beginning of the file.
-        //
-        position.CurrentByteOffset.QuadPart = 0;
-        status = ZwSetInformationFile(devExt->FileHandle,
-                             &ioStatus,
-                             &position,
-                             sizeof(FILE_POSITION_INFORMATION),
-                             FilePositionInformation);
-        if (NT_SUCCESS(status)) {
-
-            status = ZwReadFile (devExt->FileHandle,
-                                NULL,//   Event,
-                                NULL,// PIO_APC_ROUTINE  ApcRoutine
-                                NULL,// PVOID  ApcContext
-                                &ioStatus,
-                                outBuf,
-                                (ULONG)Length,
-                                0, // ByteOffset
-                                NULL // Key
-                                );
+        status = ZwReadFile (fileCtx->FileHandle,
+                            NULL,//   Event,
+                            NULL,// PIO_APC_ROUTINE  ApcRoutine
+                            NULL,// PVOID  ApcContext
+                            &ioStatus,
+                            outBuf,
+                            (ULONG)Length,
+                            &byteOffset,
+                            NULL // Key
+                            );
 
-            if (!NT_SUCCESS(status)) {
+        if (!NT_SUCCESS(status)) {
 
-                TraceEvents(TRACE_LEVEL_ERROR, DBG_RW,
-                               "ZwReadFile failed with status 0x%x",
-                               status);
-            }
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_RW,
+                           "ZwReadFile failed with status 0x%x",
+                           status);
+        } else {
 
+            //
+            // The I/O status block is only filled in when the call
+            // succeeds; on failure it is left as it was.
+            //
             status = ioStatus.Status;
             bytesRead = ioStatus.Information;
+
+            InterlockedIncrement64(&fileCtx->ReadRequests);
+            InterlockedExchangeAdd64(&fileCtx->BytesRead, (LONG64)bytesRead);
         }
     }
 
@@ -677,6 +719,7 @@ FileEvtIoWrite(
 Routine Description:
 
     This event is called when the framework receives IRP_MJ_WRITE requests.
+    We write the file at the byte offset of the request.
 
 Arguments:
 
@@ -696,8 +739,9 @@ Return Value:
     NTSTATUS                   status = STATUS_SUCCESS;
     PVOID                       inBuf;
     IO_STATUS_BLOCK             ioStatus;
-    PCONTROL_DEVICE_EXTENSION   devExt;
-    FILE_POSITION_INFORMATION   position;
+    PFILE_CONTEXT               fileCtx;
+    WDF_REQUEST_PARAMETERS      params;
+    LARGE_INTEGER               byteOffset;
     ULONG_PTR                   bytesWritten = 0;
     size_t      bufLength;
 
@@ -717,42 +761,48 @@ Return Value:
 
     }
 
-    devExt = ControlGetData(WdfIoQueueGetDevice(Queue));
+    //
+    // Write at the offset of the request, as FileEvtIoRead reads.
+    //
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+    byteOffset.QuadPart = params.Parameters.Write.DeviceOffset;
+    if (byteOffset.QuadPart < 0) {
+        WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+        return;
+    }
 
-    if(devExt->FileHandle) {
+    fileCtx = FileGetContext(WdfRequestGetFileObject(Request));
 
-        //
-        // Set the file position to the beginning of the file.
-        //
-        position.CurrentByteOffset.QuadPart = 0;
-
-        status = ZwSetInformationFile(devExt->FileHandle,
-                             &ioStatus,
-                             &position,
-                             sizeof(FILE_POSITION_INFORMATION),
-                             FilePositionInformation);
-        if (NT_SUCCESS(status))
-        {
-
-            status = ZwWriteFile(devExt->FileHandle,
-                                NULL,//   Event,
-                                NULL,// PIO_APC_ROUTINE  ApcRoutine
-                                NULL,// PVOID  ApcContext
-                                &ioStatus,
-                                inBuf,
-                                (ULONG)Length,
-                                0, // ByteOffset
-                                NULL // Key
-                                );
-            if (!NT_SUCCESS(status))
-            {
-                TraceEvents(TRACE_LEVEL_ERROR, DBG_RW,
-                               "ZwWriteFile failed with status 0x%x",
-                               status);
-            }
+    if(fileCtx->FileHandle) {
 
+        status = ZwWriteFile(fileCtx->FileHandle,
+                            NULL,//   Event,
+                            NULL,// PIO_APC_ROUTINE  ApcRoutine
+                            NULL,// PVOID  ApcContext
+                            &ioStatus,
+                            inBuf,
+                            (ULONG)Length,
+                            &byteOffset,
+                            NULL // Key
+                            );
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR, DBG_RW,
+                           "ZwWriteFile failed with status 0x%x",
+                           status);
+        }
+        else
+        {
+            //
+            // As in FileEvtIoRead, take the I/O status block only when the
+            // call succeeds.
+            //
             status = ioStatus.Status;
             bytesWritten =  ioStatus.Information;
+
+            InterlockedIncrement64(&fileCtx->WriteRequests);
+            InterlockedExchangeAdd64(&fileCtx->BytesWritten, (LONG64)bytesWritten);
         }
     }
 
@@ -1233,8 +1283,8 @@ Routine Description:
     If you register for a normal shutdown notification, all of these are
     available to you.
 
-    This function implementation does nothing, but if you had any outstanding
-    file handles open, this is where you would close them.
+    The file handles of the applications are closed in NonPnpEvtFileClose;
+    this function only reports those still open.
 
 Arguments:
     Device - The device which registered the notification during init
@@ -1245,7 +1295,13 @@ Return Value:
   --*/
 
 {
-    UNREFERENCED_PARAMETER(Device);
+    LONG openHandles = ControlGetData(Device)->OpenHandles;
+
+    if (openHandles != 0) {
+        TraceEvents(TRACE_LEVEL_WARNING, DBG_INIT,
+                       "Shutting down with %d file handles open\n",
+                       openHandles);
+    }
     return;
 }
 
@@ -31,13 +31,32 @@ Environment:
 
 typedef struct _CONTROL_DEVICE_EXTENSION {
 
-    HANDLE   FileHandle; // Store your control data here
+    LONG     OpenHandles; // Handles with a file open, for the traces
 
 } CONTROL_DEVICE_EXTENSION, *PCONTROL_DEVICE_EXTENSION;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_DEVICE_EXTENSION,
                                         ControlGetData)
 
+//
+// Every handle an application opens on the device gets its own file object
+// context, with the file the handle reads and writes and the counters of
+// its requests that succeeded. The queue dispatches requests in parallel, so requests of
+// the same handle can run at the same time and the counters are updated
+// with interlocked operations.
+//
+typedef struct _FILE_CONTEXT {
+
+    HANDLE   FileHandle;
+    LONG64   ReadRequests;
+    LONG64   WriteRequests;
+    LONG64   BytesRead;
+    LONG64   BytesWritten;
+
+} FILE_CONTEXT, *PFILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_CONTEXT, FileGetContext)
+
 //
 // Following request context is used only for the method-neither ioctl case.
 //
@@ -51,3 +51,10 @@ Environment:
 
 #define DRIVER_NAME       "NONPNP"
 #define DEVICE_NAME       "\\\\.\\NONPNP\\nonpnpsamp.log"
+
+//
+// Every handle reads and writes the file in \SystemRoot\Temp named after
+// the path it opened, so handles opened with different names do not share
+// a file. The multi-threaded test of the app opens one per thread.
+//
+#define DEVICE_NAME_FORMAT "\\\\.\\NONPNP\\nonpnpsamp%u.log"